@@ -0,0 +1,318 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <sstream>
+
+#include <unistd.h>
+
+#include <docopt.h>
+#include <nlohmann/json.hpp>
+
+#include "debug.h"
+#include "fixture.h"
+#include "kernelcache.h"
+#include "kext.h"
+#include "lzfse.h"
+#include "lzss.h"
+#include "thread_pool.h"
+
+using namespace kcmod;
+
+namespace fs = std::filesystem;
+using json = nlohmann::json;
+using Duration = std::chrono::steady_clock::duration;
+
+static const char k_usage[] =
+    R"(kcmod-bench.
+
+    Times every stage of replacing a fileset of a synthetic kernelcache and of
+    compressing the result, and compares the throughput against a baseline.
+
+    Usage:
+      kcmod-bench --baseline=<file> [--update-baseline] [--threshold=<percent>] [--iterations=<n>] [--compression-threads=<list>] [--compression-iterations=<n>] [--skip-compression] [--fixture-dir=<dir>] [--filesets=<n>] [--segment-size=<kb>] [--symbols=<n>] [--fixup-density=<fraction>] [--kext-references=<n>] [--kext-pointers=<n>] [--kext-binds=<n>] [--kext-hooks=<n>] [--seed=<n>]
+
+    Options:
+      --baseline <file>             Stage throughput recorded by --update-baseline, recorded if missing
+      --update-baseline             Record the measured throughput as the new baseline
+      --threshold <percent>         Throughput loss of a stage that fails the run [default: 10]
+      --iterations <n>              Replace runs, the median of every stage is compared [default: 9]
+      --compression-threads <list>  Comma separated thread counts LZFSE and LZSS encoding is timed with [default: 1,2,4,8,16,32]
+      --compression-iterations <n>  Encode runs per codec and thread count [default: 3]
+      --skip-compression            Only time replacing the fileset
+      --fixture-dir <dir>           Directory the fixture is generated in, a temporary one by default
+      --filesets <n>                Filesets of the kernelcache
+      --segment-size <kb>           Size of the code and data segments of every fileset
+      --symbols <n>                 Function symbols of every fileset
+      --fixup-density <fraction>    Fraction of fileset pointer slots holding a chained rebase
+      --kext-references <n>         ADRP and ADD/LDR pairs of the kext
+      --kext-pointers <n>           Rebased pointers of the kext
+      --kext-binds <n>              Binds of the kext
+      --kext-hooks <n>              Kernel functions hooked by the kext
+      --seed <n>                    Seed of the fixture contents
+)";
+
+// Stages shorter than this are compared as if they took this long, below it
+// timer resolution and scheduling noise dominate
+static constexpr Duration k_noise_floor = std::chrono::microseconds{100};
+
+static FixtureOptions fixture_options(std::map<std::string, docopt::value> &args) {
+    FixtureOptions options;
+    auto override = [&](const char *name, auto &field) {
+        if (args[name]) {
+            field = std::stoull(args[name].asString());
+        }
+    };
+    override("--filesets", options.filesets);
+    override("--symbols", options.symbols);
+    override("--kext-references", options.kext_references);
+    override("--kext-pointers", options.kext_pointers);
+    override("--kext-binds", options.kext_binds);
+    override("--kext-hooks", options.kext_hooks);
+    override("--seed", options.seed);
+    if (args["--segment-size"]) {
+        options.segment_size = std::stoull(args["--segment-size"].asString()) * 1024;
+    }
+    if (args["--fixup-density"]) {
+        options.fixup_density = std::stod(args["--fixup-density"].asString());
+    }
+    return options;
+}
+
+static json to_json(const FixtureOptions &options) {
+    return {
+        {"filesets", options.filesets},
+        {"segment_size", options.segment_size},
+        {"symbols", options.symbols},
+        {"fixup_density", options.fixup_density},
+        {"kext_text_size", options.kext_text_size},
+        {"kext_references", options.kext_references},
+        {"kext_pointers", options.kext_pointers},
+        {"kext_binds", options.kext_binds},
+        {"kext_hooks", options.kext_hooks},
+        {"seed", options.seed},
+    };
+}
+
+static std::vector<char> read_file(const fs::path &path) {
+    std::ifstream file{path, std::ios::binary};
+    return {std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{}};
+}
+
+// Durations of every stage over all iterations, in the order the stages ran
+class StageTimes {
+public:
+    void add(std::string_view stage, Duration duration) {
+        auto it = std::ranges::find(stages_, stage, &Stage::name);
+        if (it == stages_.end()) {
+            it = stages_.insert(stages_.end(), Stage{std::string{stage}, {}});
+        }
+        it->durations.push_back(duration);
+    }
+
+    template <class F>
+    void time(std::string_view stage, F &&fn) {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        add(stage, std::chrono::steady_clock::now() - start);
+    }
+
+    // Median duration of every stage
+    std::vector<std::pair<std::string, Duration>> medians() {
+        std::vector<std::pair<std::string, Duration>> result;
+        for (auto &stage: stages_) {
+            auto middle = stage.durations.begin() + stage.durations.size() / 2;
+            std::ranges::nth_element(stage.durations, middle);
+            result.emplace_back(stage.name, *middle);
+        }
+        return result;
+    }
+
+private:
+    struct Stage {
+        std::string name;
+        std::vector<Duration> durations;
+    };
+    std::vector<Stage> stages_;
+};
+
+static std::vector<size_t> parse_thread_counts(const std::string &list) {
+    std::vector<size_t> result;
+    std::istringstream stream{list};
+    for (std::string count; std::getline(stream, count, ',');) {
+        result.push_back(std::stoull(count));
+        kcmod_verify(result.back() > 0);
+    }
+    return result;
+}
+
+using Encoder = std::function<std::vector<char>(std::span<const char>, ThreadPool &)>;
+using Decoder = std::function<std::vector<char>(std::span<const char>)>;
+
+// Times encoding data on pools of every thread count and decoding the
+// result. Chunks are compressed independently, so every stream is decoded and
+// compared against data to catch broken stitching.
+static void time_compression(StageTimes &times, std::string_view codec, std::span<const char> data,
+                             const std::vector<size_t> &thread_counts, size_t iterations, const Encoder &encode,
+                             const Decoder &decode) {
+    for (size_t thread_count: thread_counts) {
+        ThreadPool pool{thread_count};
+        auto stage = fmt::format("{} encode {} thread{}", codec, thread_count, thread_count == 1 ? "" : "s");
+        for (size_t i = 0; i < iterations; ++i) {
+            std::vector<char> encoded;
+            times.time(stage, [&] { encoded = encode(data, pool); });
+            std::vector<char> decoded;
+            times.time(fmt::format("{} decode", codec), [&] { decoded = decode(encoded); });
+            if (!std::ranges::equal(decoded, data)) {
+                throw FatalError{"{} stream encoded on {} threads does not decode to its input", codec, thread_count};
+            }
+        }
+    }
+}
+
+static double mib_per_second(size_t bytes, Duration duration) {
+    double seconds = std::chrono::duration<double>{std::max(duration, k_noise_floor)}.count();
+    return static_cast<double>(bytes) / (1024 * 1024) / seconds;
+}
+
+static int run_benchmark(std::map<std::string, docopt::value> &args) {
+    FixtureOptions options = fixture_options(args);
+    fs::path baseline_path = args["--baseline"].asString();
+    bool update_baseline = args["--update-baseline"].asBool();
+    double threshold = std::stod(args["--threshold"].asString()) / 100;
+    size_t iterations = std::stoul(args["--iterations"].asString());
+    kcmod_verify(iterations > 0);
+
+    json baseline;
+    if (!update_baseline && !fs::exists(baseline_path)) {
+        // The first run on a host records the baseline later runs compare against
+        fmt::print("Baseline {} not found, recording it\n", baseline_path.string());
+        update_baseline = true;
+    }
+    if (!update_baseline) {
+        std::ifstream baseline_file{baseline_path};
+        baseline = json::parse(baseline_file);
+        if (baseline.at("fixture") != to_json(options)) {
+            throw FatalError{"Baseline {} was recorded with a different fixture", baseline_path.string()};
+        }
+    }
+
+    bool temporary_fixture = !args["--fixture-dir"];
+    fs::path fixture_dir = temporary_fixture ? fs::temp_directory_path() / fmt::format("kcmod-bench.{}", getpid())
+                                             : fs::path{args["--fixture-dir"].asString()};
+    Fixture fixture = generate_fixture(options, fixture_dir);
+    std::vector<char> pristine = read_file(fixture.kernelcache);
+    fmt::print("Fixture: {:.1f} MiB kernelcache with {} filesets at {}\n",
+               static_cast<double>(pristine.size()) / (1024 * 1024), options.filesets, fixture_dir.string());
+
+    StageTimes times;
+    ThreadPool worker_pool;
+    std::vector<char> data(pristine.size());
+    for (size_t i = 0; i < iterations; ++i) {
+        std::ranges::copy(pristine, data.begin());
+        std::optional<KernelExtension> kext;
+        times.time("parse kext", [&] { kext.emplace(fixture.kext); });
+
+        KernelCache kernelcache{data};
+        kernelcache.set_thread_pool(&worker_pool);
+        kernelcache.set_step_observer([&](std::string_view step, Duration duration) { times.add(step, duration); });
+        SymbolRegistry registry;
+        times.time("index symbols", [&] { registry = kernelcache.construct_symbol_registry(*kext, std::nullopt); });
+        times.time("replace fileset", [&] { kernelcache.replace_fileset(fixture.victim, *kext, registry); });
+
+        // Instruction fixups again without the pool, showing what it gains
+        std::ranges::copy(pristine, data.begin());
+        KernelCache serial{data};
+        serial.set_step_observer([&](std::string_view step, Duration duration) {
+            if (step == "split segment fixups") {
+                times.add("split seg fixups serial", duration);
+            }
+        });
+        serial.replace_fileset(fixture.victim, *kext, registry);
+    }
+    if (temporary_fixture) {
+        fs::remove_all(fixture_dir);
+    }
+
+    if (!args["--skip-compression"].asBool()) {
+        auto thread_counts = parse_thread_counts(args["--compression-threads"].asString());
+        size_t compression_iterations = std::stoul(args["--compression-iterations"].asString());
+        kcmod_verify(compression_iterations > 0);
+        time_compression(
+            times, "lzfse", data, thread_counts, compression_iterations,
+            [](std::span<const char> input, ThreadPool &pool) { return lzfse_encode(input, pool); },
+            [](std::span<const char> encoded) {
+                std::vector<char> result(lzfse_decoded_size(encoded));
+                lzfse_decode(encoded, result);
+                return result;
+            });
+        time_compression(
+            times, "lzss", data, thread_counts, compression_iterations,
+            [](std::span<const char> input, ThreadPool &pool) { return lzss_encode(input, pool); },
+            [](std::span<const char> encoded) {
+                std::vector<char> result(lzss_decoded_size(encoded));
+                lzss_decode(encoded, result);
+                return result;
+            });
+    }
+
+    json stages = json::object();
+    size_t regressions = 0;
+    fmt::print("{:<24}{:>12}{:>12}{:>12}{:>10}\n", "stage", "median us", "MiB/s", "baseline", "change");
+    for (const auto &[stage, duration]: times.medians()) {
+        double throughput = mib_per_second(pristine.size(), duration);
+        stages[stage] = throughput;
+        auto line = fmt::format("{:<24}{:>12}{:>12.1f}", stage,
+                                std::chrono::duration_cast<std::chrono::microseconds>(duration).count(), throughput);
+        if (!update_baseline && baseline.at("stages").contains(stage)) {
+            double expected = baseline["stages"][stage].get<double>();
+            double change = throughput / expected - 1;
+            bool regressed = change < -threshold;
+            regressions += regressed;
+            line += fmt::format("{:>12.1f}{:>+9.1f}%{}", expected, change * 100, regressed ? "  REGRESSION" : "");
+        }
+        fmt::print("{}\n", line);
+    }
+
+    if (update_baseline) {
+        std::ofstream baseline_file{baseline_path, std::ios::trunc};
+        baseline_file << json{{"fixture", to_json(options)}, {"stages", stages}}.dump(4) << "\n";
+        fmt::print("Baseline written to {}\n", baseline_path.string());
+        return 0;
+    }
+    if (regressions > 0) {
+        fmt::print(stderr, "{} stages lost more than {:.0f}% throughput\n", regressions, threshold * 100);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, const char *argv[]) {
+    std::map<std::string, docopt::value> args = docopt::docopt(k_usage, {argv + 1, argv + argc});
+    try {
+        return run_benchmark(args);
+    } catch (const std::exception &e) {
+        fmt::print(stderr, "{}\n", e.what());
+        return 1;
+    }
+}
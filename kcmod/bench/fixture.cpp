@@ -0,0 +1,843 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <random>
+#include <string_view>
+
+#include <fmt/format.h>
+#include <mach-o/fixup-chains.h>
+#include <mach-o/loader.h>
+#include <mach-o/nlist.h>
+
+#ifdef __APPLE__
+#include <Kernel/mach/kmod.h>
+#else
+#include <mach/kmod.h>
+#endif
+
+#include "aarch64.h"
+#include "common.h"
+#include "debug.h"
+#include "fixture.h"
+#include "fixup_chain.h"
+#include "memio.h"
+#include "split_seg.h"
+
+
+using namespace kcmod;
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr uint64_t k_page_size = 16384;
+constexpr uint64_t k_vm_base = 0xfffffe0007004000;
+// Fileset ids are padded so that the kext bundle id fits in place
+constexpr size_t k_entry_id_size = 64;
+constexpr uint32_t k_platform_ios = 2;
+constexpr uint32_t k_os_version = 0x100000;
+constexpr uint32_t k_text_flags = S_ATTR_PURE_INSTRUCTIONS | S_ATTR_SOME_INSTRUCTIONS;
+
+constexpr const char *k_kernel_id = "com.apple.kernel";
+constexpr const char *k_victim_id = "com.kcmod.fixture.victim";
+constexpr const char *k_kext_id = "com.kcmod.fixture.kext";
+constexpr const char *k_kext_name = "KCModFixture";
+// Filesets after com.apple.kernel the kext depends on
+constexpr size_t k_kext_dependencies = 3;
+
+constexpr uint32_t k_stp_fp_lr = 0xa9bf7bfd; // stp x29, x30, [sp, #-16]!
+constexpr uint32_t k_ldp_fp_lr = 0xa8c17bfd; // ldp x29, x30, [sp], #16
+constexpr uint32_t k_bti_c = 0xd503245f;
+constexpr uint32_t k_adrp_x0 = 0x90000000;
+constexpr uint32_t k_adrp_x16 = 0x90000010;
+constexpr uint32_t k_add_x0 = 0x91000000;     // add x0, x0, #0
+constexpr uint32_t k_ldr_x0 = 0xf9400000;     // ldr x0, [x0]
+constexpr uint32_t k_nop = 0xd503201f;
+constexpr uint32_t k_ret = 0xd65f03c0;
+constexpr uint32_t k_brk = 0xd4200020;
+
+// Section numbers of the kext, in load command order
+constexpr uint64_t k_kext_text_section = 2;
+constexpr uint64_t k_kext_const_section = 3;
+constexpr uint64_t k_kext_data_section = 4;
+
+uint64_t align(uint64_t value, uint64_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+template <class T>
+void append(std::string &out, const T &value) {
+    out.append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+std::span<const char> bytes(const std::string &value) {
+    return {value.data(), value.size()};
+}
+
+void append_uleb128(std::string &out, uint64_t value) {
+    do {
+        uint8_t byte = value & 0x7f;
+        value >>= 7;
+        out.push_back(static_cast<char>(value != 0 ? byte | 0x80 : byte));
+    } while (value != 0);
+}
+
+// Deterministic for a seed on every standard library, unlike the
+// distributions of <random>
+class Random {
+public:
+    explicit Random(uint64_t seed) : engine_{seed} {}
+
+    uint64_t below(uint64_t bound) { return engine_() % bound; }
+    bool chance() { return (engine_() & 1) != 0; }
+
+    std::array<uint8_t, 16> uuid() {
+        std::array<uint8_t, 16> result;
+        for (auto &byte: result) {
+            byte = static_cast<uint8_t>(engine_());
+        }
+        return result;
+    }
+
+private:
+    std::mt19937_64 engine_;
+};
+
+struct Section {
+    const char *name;
+    // Relative to the segment
+    uint64_t offset;
+    uint64_t size;
+    uint32_t flags = 0;
+};
+
+struct Segment {
+    const char *name;
+    uint64_t fileoff;
+    uint64_t vmaddr;
+    uint64_t size;
+    vm_prot_t prot;
+    std::vector<Section> sections;
+};
+
+// Load commands of one Mach-O header, every command padded to 8 bytes
+class LoadCommands {
+public:
+    template <class T>
+    void add(T command, std::string_view payload = {}) {
+        command.cmdsize = align(sizeof(T) + payload.size(), 8);
+        append(data_, command);
+        data_.append(payload);
+        data_.resize(align(data_.size(), 8));
+        ncmds_++;
+    }
+
+    void add_segment(const Segment &segment) {
+        segment_command_64 command{};
+        command.cmd = LC_SEGMENT_64;
+        strncpy(command.segname, segment.name, sizeof(command.segname));
+        command.vmaddr = segment.vmaddr;
+        command.vmsize = segment.size;
+        command.fileoff = segment.fileoff;
+        command.filesize = segment.size;
+        command.maxprot = segment.prot;
+        command.initprot = segment.prot;
+        command.nsects = segment.sections.size();
+        std::string sections;
+        for (const Section &section: segment.sections) {
+            section_64 entry{};
+            strncpy(entry.sectname, section.name, sizeof(entry.sectname));
+            strncpy(entry.segname, segment.name, sizeof(entry.segname));
+            entry.addr = segment.vmaddr + section.offset;
+            entry.size = section.size;
+            entry.offset = segment.fileoff + section.offset;
+            entry.align = 3;
+            entry.flags = section.flags;
+            append(sections, entry);
+        }
+        add(command, sections);
+    }
+
+    void add_linkedit_data(uint32_t cmd, uint64_t dataoff, uint64_t datasize) {
+        linkedit_data_command command{};
+        command.cmd = cmd;
+        command.dataoff = dataoff;
+        command.datasize = datasize;
+        add(command);
+    }
+
+    void add_identity(Random &random) {
+        uuid_command uuid{};
+        uuid.cmd = LC_UUID;
+        auto bytes = random.uuid();
+        memcpy(uuid.uuid, bytes.data(), sizeof(uuid.uuid));
+        add(uuid);
+
+        build_version_command version{};
+        version.cmd = LC_BUILD_VERSION;
+        version.platform = k_platform_ios;
+        version.minos = k_os_version;
+        version.sdk = k_os_version;
+        add(version);
+    }
+
+    void add_symtab(uint64_t symoff, uint64_t nsyms, uint64_t stroff, uint64_t strsize) {
+        symtab_command symtab{};
+        symtab.cmd = LC_SYMTAB;
+        symtab.symoff = symoff;
+        symtab.nsyms = nsyms;
+        symtab.stroff = stroff;
+        symtab.strsize = strsize;
+        add(symtab);
+
+        dysymtab_command dysymtab{};
+        dysymtab.cmd = LC_DYSYMTAB;
+        dysymtab.nextdefsym = nsyms;
+        add(dysymtab);
+    }
+
+    size_t size() const { return sizeof(mach_header_64) + data_.size(); }
+
+    void write(std::span<char> data, uint64_t offset, uint32_t filetype, uint32_t flags) const {
+        mach_header_64 header{};
+        header.magic = MH_MAGIC_64;
+        header.cputype = CPU_TYPE_ARM64;
+        header.cpusubtype = CPU_SUBTYPE_ARM64E;
+        header.filetype = filetype;
+        header.ncmds = ncmds_;
+        header.sizeofcmds = data_.size();
+        header.flags = flags;
+        SpanWriter writer{data, offset};
+        writer.write(header);
+        writer.write(bytes(data_));
+    }
+
+private:
+    std::string data_;
+    uint32_t ncmds_ = 0;
+};
+
+void write_instr(std::span<char> data, uint64_t fileoff, uint32_t instr) {
+    SpanWriter{data, fileoff}.put(instr);
+}
+
+void fill_instrs(std::span<char> data, uint64_t fileoff, uint64_t size, uint32_t instr) {
+    for (uint64_t offset = 0; offset + sizeof(instr) <= size; offset += sizeof(instr)) {
+        write_instr(data, fileoff + offset, instr);
+    }
+}
+
+DyldFixupPointer rebase_pointer(uint64_t target, bool auth, uint16_t diversity) {
+    DyldFixupPointer pointer{};
+    if (auth) {
+        dyld_chained_ptr_arm64e_auth_rebase rebase{};
+        rebase.target = target;
+        rebase.diversity = diversity;
+        rebase.addrDiv = 1;
+        rebase.auth = 1;
+        pointer.ptr_auth_rebase = rebase;
+    } else {
+        dyld_chained_ptr_arm64e_rebase rebase{};
+        rebase.target = target;
+        pointer.ptr_rebase = rebase;
+    }
+    return pointer;
+}
+
+DyldFixupPointer bind_pointer(uint64_t ordinal, bool auth, uint16_t diversity) {
+    DyldFixupPointer pointer{};
+    if (auth) {
+        dyld_chained_ptr_arm64e_auth_bind bind{};
+        bind.ordinal = ordinal;
+        bind.diversity = diversity;
+        bind.addrDiv = 1;
+        bind.bind = 1;
+        bind.auth = 1;
+        pointer.ptr_auth_bind = bind;
+    } else {
+        dyld_chained_ptr_arm64e_bind bind{};
+        bind.ordinal = ordinal;
+        bind.bind = 1;
+        pointer.ptr_bind = bind;
+    }
+    return pointer;
+}
+
+// Fixups of one segment, written with one chain per page
+class SegmentFixups {
+public:
+    SegmentFixups(uint64_t fileoff, uint64_t size)
+        : fileoff_{fileoff}, page_starts_(align(size, k_page_size) / k_page_size, DYLD_CHAINED_PTR_START_NONE) {
+        kcmod_verify(page_starts_.size() <= UINT16_MAX);
+    }
+
+    // Fixups must be added in ascending order
+    void add(std::span<char> data, uint64_t fileoff, DyldFixupPointer pointer) {
+        uint64_t page_idx = (fileoff - fileoff_) / k_page_size;
+        if (page_starts_[page_idx] == DYLD_CHAINED_PTR_START_NONE) {
+            page_starts_[page_idx] = (fileoff - fileoff_) % k_page_size;
+        } else {
+            kcmod_verify(fileoff > last_ && (fileoff - last_) / 4 < (1 << 11));
+            SpanWriter{data, last_}.peek<DyldFixupPointer>()->next = (fileoff - last_) / 4;
+        }
+        pointer.next = 0;
+        SpanWriter{data, fileoff}.put(pointer);
+        last_ = fileoff;
+    }
+
+    // dyld_chained_starts_in_segment
+    std::string encode() const {
+        dyld_chained_starts_in_segment starts{};
+        starts.size = offsetof(dyld_chained_starts_in_segment, page_start) + page_starts_.size() * sizeof(uint16_t);
+        starts.page_size = k_page_size;
+        starts.pointer_format = DYLD_CHAINED_PTR_64_KERNEL_CACHE;
+        starts.segment_offset = fileoff_;
+        starts.page_count = page_starts_.size();
+        std::string out;
+        append(out, starts);
+        out.resize(offsetof(dyld_chained_starts_in_segment, page_start));
+        for (uint16_t page_start: page_starts_) {
+            append(out, page_start);
+        }
+        return out;
+    }
+
+private:
+    uint64_t fileoff_;
+    uint64_t last_ = 0;
+    std::vector<uint16_t> page_starts_;
+};
+
+// LC_DYLD_CHAINED_FIXUPS payload. fixups holds the segment index of every
+// segment with fixups.
+std::string encode_chained_fixups(size_t segment_count, const std::map<size_t, const SegmentFixups *> &fixups,
+                                  const std::vector<std::string> &imports) {
+    std::string starts;
+    std::vector<uint32_t> seg_info_offsets(segment_count);
+    size_t starts_header_size = align(sizeof(uint32_t) * (1 + segment_count), 8);
+    for (const auto &[index, segment]: fixups) {
+        seg_info_offsets[index] = starts_header_size + starts.size();
+        starts += segment->encode();
+        starts.resize(align(starts.size(), 8));
+    }
+
+    std::string import_table;
+    std::string symbols{"\0", 1};
+    for (const auto &name: imports) {
+        dyld_chained_import import{};
+        import.lib_ordinal = 1;
+        import.name_offset = symbols.size();
+        append(import_table, import);
+        symbols.append(name);
+        symbols.push_back('\0');
+    }
+
+    dyld_chained_fixups_header header{};
+    header.starts_offset = align(sizeof(header), 8);
+    header.imports_offset = header.starts_offset + starts_header_size + starts.size();
+    header.symbols_offset = header.imports_offset + import_table.size();
+    header.imports_count = imports.size();
+    header.imports_format = DYLD_CHAINED_IMPORT;
+
+    std::string out;
+    append(out, header);
+    out.resize(header.starts_offset);
+    append(out, static_cast<uint32_t>(segment_count));
+    for (uint32_t offset: seg_info_offsets) {
+        append(out, offset);
+    }
+    out.resize(header.starts_offset + starts_header_size);
+    out += starts;
+    out += import_table;
+    out += symbols;
+    return out;
+}
+
+std::string fileset_id(size_t index, size_t count) {
+    if (index == 0) {
+        return k_kernel_id;
+    } else if (index + 1 == count) {
+        return k_victim_id;
+    }
+    return fmt::format("com.kcmod.fixture.fileset{}", index);
+}
+
+std::string function_name(size_t fileset, size_t index) {
+    if (fileset == 0) {
+        return fmt::format("_kernel_fn{}", index);
+    }
+    return fmt::format("_fileset{}_fn{}", fileset, index);
+}
+
+size_t dependency_count(const FixtureOptions &options) {
+    return std::min(k_kext_dependencies, options.filesets - 2);
+}
+
+void write_file(const fs::path &path, std::span<const char> data) {
+    std::ofstream file{path, std::ios::binary | std::ios::trunc};
+    file.write(data.data(), data.size());
+    if (!file) {
+        throw FatalError{"Failed to write {}", path.string()};
+    }
+}
+
+std::vector<char> build_kernelcache(const FixtureOptions &options, Random &random) {
+    const size_t count = options.filesets;
+    const uint64_t segment_size = align(options.segment_size, k_page_size);
+    const uint64_t function_size = segment_size / options.symbols / 4 * 4;
+    if (function_size < 4 * sizeof(uint32_t)) {
+        throw FatalError{"{} symbols do not fit in {} byte segments", options.symbols, segment_size};
+    }
+    // Hooks branch from com.apple.kernel to the victim, which must be in reach
+    if (count * segment_size >= aarch64::Branch::k_max_imm) {
+        throw FatalError{"{} filesets of {} byte segments are out of branch range", count, segment_size};
+    }
+
+    // Segments in the order of an arm64e kernelcache, every fileset has a
+    // slice of each
+    const uint64_t header_size = align(
+        sizeof(mach_header_64) + 6 * sizeof(segment_command_64) + sizeof(linkedit_data_command) +
+            count * align(sizeof(fileset_entry_command) + k_entry_id_size, 8),
+        k_page_size);
+    const uint64_t text_off = 0;
+    const uint64_t text_size = header_size + count * k_page_size;
+    const uint64_t data_const_off = text_off + text_size;
+    const uint64_t text_exec_off = data_const_off + count * segment_size;
+    const uint64_t prelink_off = text_exec_off + count * segment_size;
+
+    auto fileset_text = [&](size_t i) { return header_size + i * k_page_size; };
+    auto fileset_data_const = [&](size_t i) { return data_const_off + i * segment_size; };
+    auto fileset_text_exec = [&](size_t i) { return text_exec_off + i * segment_size; };
+
+    std::string prelink_info =
+        R"(<?xml version="1.0" encoding="UTF-8"?>)"
+        R"(<!DOCTYPE plist PUBLIC "-//Apple//DTD PLIST 1.0//EN" "http://www.apple.com/DTDs/PropertyList-1.0.dtd">)"
+        R"(<plist version="1.0"><dict><key>_PrelinkInfoDictionary</key><array>)";
+    for (size_t i = 0; i < count; ++i) {
+        prelink_info += fmt::format(
+            "<dict><key>CFBundleIdentifier</key><string>{}</string>"
+            "<key>CFBundleVersion</key>{}"
+            "<key>_PrelinkBundlePath</key><string>/System/Library/Extensions/Fixture{}.kext</string>"
+            "<key>_PrelinkExecutableLoadAddr</key><integer size=\"64\">{:#x}</integer></dict>",
+            fileset_id(i, count), i == 0 ? R"(<string ID="0">1.0.0</string>)" : R"(<string IDREF="0"/>)", i,
+            k_vm_base + fileset_text(i));
+    }
+    prelink_info += "</array></dict></plist>";
+    const uint64_t prelink_size = align(prelink_info.size() + 64 * 1024, k_page_size);
+    const uint64_t data_off = prelink_off + prelink_size;
+    const uint64_t linkedit_off = data_off + count * segment_size;
+    auto fileset_data = [&](size_t i) { return data_off + i * segment_size; };
+
+    // __LINKEDIT holds the symbols of all filesets followed by the chained
+    // fixups of the kernelcache
+    std::string symbols;
+    std::string strings{"\0", 1};
+    for (size_t i = 0; i < count; ++i) {
+        for (size_t j = 0; j < options.symbols; ++j) {
+            nlist_64 nlist{};
+            nlist.n_un.n_strx = strings.size();
+            nlist.n_type = N_SECT | N_EXT;
+            nlist.n_sect = 3;
+            nlist.n_value = k_vm_base + fileset_text_exec(i) + j * function_size;
+            append(symbols, nlist);
+            strings += function_name(i, j);
+            strings.push_back('\0');
+        }
+    }
+    strings.resize(align(strings.size(), 8));
+    const uint64_t symoff = linkedit_off;
+    const uint64_t stroff = symoff + symbols.size();
+    const uint64_t fixups_off = stroff + strings.size();
+
+    SegmentFixups data_const_fixups{data_const_off, count * segment_size};
+    SegmentFixups data_fixups{data_off, count * segment_size};
+    std::vector<char> kernelcache(fixups_off);
+
+    for (size_t i = 0; i < count; ++i) {
+        // Functions of every shape bind_hooks copies into a super function
+        fill_instrs(kernelcache, fileset_text_exec(i), segment_size, k_nop);
+        for (size_t j = 0; j < options.symbols; ++j) {
+            uint64_t fn = fileset_text_exec(i) + j * function_size;
+            uint64_t body = fn;
+            if (j % 3 == 1) {
+                write_instr(kernelcache, body, k_bti_c);
+                body += 4;
+            } else if (j % 3 == 2) {
+                write_instr(kernelcache, body, k_adrp_x16);
+                body += 4;
+            }
+            write_instr(kernelcache, body, k_stp_fp_lr);
+            write_instr(kernelcache, fn + function_size - 8, k_ldp_fp_lr);
+            write_instr(kernelcache, fn + function_size - 4, k_ret);
+        }
+
+        // Pointers to functions of the fileset at the requested density
+        if (options.fixup_density <= 0) {
+            continue;
+        }
+        uint64_t max_gap = std::clamp<uint64_t>(std::llround(2 / options.fixup_density) - 1, 1, 1023);
+        for (auto [segment_off, fixups]: {std::pair{fileset_data_const(i), &data_const_fixups},
+                                          std::pair{fileset_data(i), &data_fixups}}) {
+            for (uint64_t offset = random.below(max_gap) * 8; offset < segment_size;
+                 offset += (1 + random.below(max_gap)) * 8) {
+                uint64_t target = fileset_text_exec(i) + random.below(options.symbols) * function_size;
+                fixups->add(kernelcache, segment_off + offset,
+                            rebase_pointer(target, random.chance(), static_cast<uint16_t>(random.below(1 << 16))));
+            }
+        }
+    }
+
+    std::string chained_fixups = encode_chained_fixups(6, {{1, &data_const_fixups}, {4, &data_fixups}}, {});
+    const uint64_t linkedit_size = align(fixups_off + chained_fixups.size() - linkedit_off, k_page_size);
+    kernelcache.resize(linkedit_off + linkedit_size);
+    SpanWriter linkedit{kernelcache, linkedit_off};
+    linkedit.write(bytes(symbols));
+    linkedit.write(bytes(strings));
+    linkedit.write(bytes(chained_fixups));
+    SpanWriter{kernelcache, prelink_off}.put(bytes(prelink_info));
+
+    for (size_t i = 0; i < count; ++i) {
+        std::string id = fileset_id(i, count);
+        uint64_t cstring_offset = 0x1000;
+        SpanWriter{kernelcache, fileset_text(i) + cstring_offset}.put(std::span{id.c_str(), id.size() + 1});
+
+        auto segment = [&](const char *name, uint64_t fileoff, uint64_t size, vm_prot_t prot, std::vector<Section> sections) {
+            return Segment{name, fileoff, k_vm_base + fileoff, size, prot, std::move(sections)};
+        };
+        LoadCommands commands;
+        commands.add_segment(segment("__TEXT", fileset_text(i), k_page_size, VM_PROT_READ,
+                                     {{"__cstring", cstring_offset, id.size() + 1}}));
+        commands.add_segment(segment("__DATA_CONST", fileset_data_const(i), segment_size, VM_PROT_READ,
+                                     {{"__const", 0, segment_size}}));
+        commands.add_segment(segment("__TEXT_EXEC", fileset_text_exec(i), segment_size, VM_PROT_READ | VM_PROT_EXECUTE,
+                                     {{"__text", 0, segment_size, k_text_flags}}));
+        commands.add_segment(segment("__DATA", fileset_data(i), segment_size, VM_PROT_READ | VM_PROT_WRITE,
+                                     {{"__data", 0, segment_size}}));
+        commands.add_segment(segment("__LINKEDIT", linkedit_off, linkedit_size, VM_PROT_READ, {}));
+        commands.add_symtab(symoff + i * options.symbols * sizeof(nlist_64), options.symbols, stroff, strings.size());
+        commands.add_identity(random);
+        kcmod_verify(commands.size() < cstring_offset);
+        commands.write(kernelcache, fileset_text(i), i == 0 ? MH_EXECUTE : MH_KEXT_BUNDLE, MH_DYLIB_IN_CACHE);
+    }
+
+    LoadCommands commands;
+    for (const Segment &segment: {
+             Segment{"__TEXT", text_off, k_vm_base + text_off, text_size, VM_PROT_READ},
+             Segment{"__DATA_CONST", data_const_off, k_vm_base + data_const_off, count * segment_size, VM_PROT_READ},
+             Segment{"__TEXT_EXEC", text_exec_off, k_vm_base + text_exec_off, count * segment_size,
+                     VM_PROT_READ | VM_PROT_EXECUTE},
+             Segment{"__PRELINK_INFO", prelink_off, k_vm_base + prelink_off, prelink_size, VM_PROT_READ},
+             Segment{"__DATA", data_off, k_vm_base + data_off, count * segment_size, VM_PROT_READ | VM_PROT_WRITE},
+             Segment{"__LINKEDIT", linkedit_off, k_vm_base + linkedit_off, linkedit_size, VM_PROT_READ},
+         }) {
+        commands.add_segment(segment);
+    }
+    commands.add_linkedit_data(LC_DYLD_CHAINED_FIXUPS, fixups_off, chained_fixups.size());
+    for (size_t i = 0; i < count; ++i) {
+        std::string id = fileset_id(i, count);
+        kcmod_verify(id.size() < k_entry_id_size);
+        fileset_entry_command entry{};
+        entry.cmd = LC_FILESET_ENTRY;
+        entry.vmaddr = k_vm_base + fileset_text(i);
+        entry.fileoff = fileset_text(i);
+        entry.entry_id.offset = sizeof(entry);
+        id.resize(k_entry_id_size);
+        commands.add(entry, id);
+    }
+    kcmod_verify(commands.size() <= header_size);
+    commands.write(kernelcache, 0, MH_FILESET, 0);
+    return kernelcache;
+}
+
+// DYLD_CACHE_ADJ_V2 split segment info, keyed by from and to section, to
+// section offset and kind
+class SplitSegWriter {
+public:
+    void add(uint64_t from_section, uint64_t from_offset, uint64_t to_section, uint64_t to_offset,
+             DyldCacheAdjV2Kind kind) {
+        sections_[{from_section, to_section}][to_offset][static_cast<uint64_t>(kind)].push_back(from_offset);
+    }
+
+    std::string encode() {
+        std::string out;
+        out.push_back(static_cast<char>(DYLD_CACHE_ADJ_V2_FORMAT));
+        append_uleb128(out, sections_.size());
+        for (auto &[sections, to_offsets]: sections_) {
+            append_uleb128(out, sections.first);
+            append_uleb128(out, sections.second);
+            append_uleb128(out, to_offsets.size());
+            uint64_t last_to_offset = 0;
+            for (auto &[to_offset, kinds]: to_offsets) {
+                append_uleb128(out, to_offset - last_to_offset);
+                last_to_offset = to_offset;
+                append_uleb128(out, kinds.size());
+                for (auto &[kind, from_offsets]: kinds) {
+                    std::ranges::sort(from_offsets);
+                    append_uleb128(out, kind);
+                    append_uleb128(out, from_offsets.size());
+                    uint64_t last_from_offset = 0;
+                    for (uint64_t from_offset: from_offsets) {
+                        append_uleb128(out, from_offset - last_from_offset);
+                        last_from_offset = from_offset;
+                    }
+                }
+            }
+        }
+        out.resize(align(out.size(), 8));
+        return out;
+    }
+
+private:
+    std::map<std::pair<uint64_t, uint64_t>, std::map<uint64_t, std::map<uint64_t, std::vector<uint64_t>>>> sections_;
+};
+
+std::vector<char> build_kext(const FixtureOptions &options, Random &random) {
+    // Linked at zero, file offsets are addresses
+    const uint64_t text_exec_size = align(options.kext_text_size, k_page_size);
+    const uint64_t text_exec_off = k_page_size;
+    const uint64_t data_const_off = text_exec_off + text_exec_size;
+    const uint64_t data_off = data_const_off + k_page_size;
+    const uint64_t linkedit_off = data_off + k_page_size;
+    const uint64_t cstring_offset = 0x1000;
+
+    constexpr uint64_t k_hook_size = 8 * sizeof(uint32_t);
+    constexpr uint64_t k_reference_size = 2 * sizeof(uint32_t);
+    const uint64_t references_off = text_exec_off + options.kext_hooks * k_hook_size;
+    if (references_off + options.kext_references * k_reference_size + sizeof(uint32_t) > data_const_off) {
+        throw FatalError{"{} hooks and {} references do not fit in {} bytes of kext code", options.kext_hooks,
+                         options.kext_references, text_exec_size};
+    }
+    if (options.kext_hooks > options.symbols) {
+        throw FatalError{"Hooking {} of {} kernel functions", options.kext_hooks, options.symbols};
+    }
+    // kmod_info starts __DATA, the remaining slots of both data pages hold
+    // the pointers
+    const uint64_t kmod_info_size = align(sizeof(kmod_info), 8);
+    const uint64_t slots = (2 * k_page_size - kmod_info_size) / sizeof(uint64_t);
+    if (options.kext_pointers + options.kext_binds > slots) {
+        throw FatalError{"{} pointers and {} binds do not fit in the kext data pages", options.kext_pointers,
+                         options.kext_binds};
+    }
+
+    std::vector<char> kext(linkedit_off);
+    SplitSegWriter split_seg;
+    std::string symbols;
+    std::string strings{"\0", 1};
+    auto add_symbol = [&](const std::string &name, uint8_t section, uint64_t vmaddr) {
+        nlist_64 nlist{};
+        nlist.n_un.n_strx = strings.size();
+        nlist.n_type = N_SECT | N_EXT;
+        nlist.n_sect = section;
+        nlist.n_value = vmaddr;
+        append(symbols, nlist);
+        strings += name;
+        strings.push_back('\0');
+    };
+
+    // Every hook has an override calling the super function, which is left
+    // as brk instructions for bind_hooks to fill in
+    fill_instrs(kext, text_exec_off, text_exec_size, k_nop);
+    const uint64_t hook_stride = options.symbols / std::max<size_t>(options.kext_hooks, 1);
+    for (size_t i = 0; i < options.kext_hooks; ++i) {
+        uint64_t override_fn = text_exec_off + i * k_hook_size;
+        uint64_t super_fn = override_fn + k_hook_size / 2;
+        write_instr(kext, override_fn, k_stp_fp_lr);
+        write_instr(kext, override_fn + 4, aarch64::Branch{static_cast<int64_t>(super_fn - override_fn - 4), true}.encode());
+        write_instr(kext, override_fn + 8, k_ldp_fp_lr);
+        write_instr(kext, override_fn + 12, k_ret);
+        fill_instrs(kext, super_fn, k_hook_size / 2, k_brk);
+        split_seg.add(k_kext_text_section, override_fn + 4 - text_exec_off, k_kext_text_section,
+                      super_fn - text_exec_off, DyldCacheAdjV2Kind::Arm64Br26);
+
+        std::string fn_name = function_name(0, i * hook_stride).substr(1);
+        add_symbol(fmt::format("___kcmod_hook_override_{}", fn_name), k_kext_text_section, override_fn);
+        add_symbol(fmt::format("___kcmod_hook_super_{}", fn_name), k_kext_text_section, super_fn);
+    }
+
+    // ADRP with ADD or LDR of a data address
+    for (size_t i = 0; i < options.kext_references; ++i) {
+        uint64_t pc = references_off + i * k_reference_size;
+        bool to_const = random.chance();
+        uint64_t to_section = to_const ? k_kext_const_section : k_kext_data_section;
+        uint64_t to_offset = random.below(k_page_size / 8) * 8;
+        uint64_t to_addr = (to_const ? data_const_off : data_off) + to_offset;
+        aarch64::Adrp adrp{k_adrp_x0};
+        adrp.set_imm(static_cast<int64_t>((to_addr & ~4095ULL) - (pc & ~4095ULL)));
+        write_instr(kext, pc, adrp.encode());
+        if (random.chance()) {
+            aarch64::AddImm add{k_add_x0};
+            add.set_imm(to_addr & 0xfff);
+            write_instr(kext, pc + 4, add.encode());
+        } else {
+            aarch64::LdrImmediate ldr{k_ldr_x0};
+            ldr.set_imm(to_addr & 0xfff);
+            write_instr(kext, pc + 4, ldr.encode());
+        }
+        split_seg.add(k_kext_text_section, pc - text_exec_off, to_section, to_offset, DyldCacheAdjV2Kind::Arm64Adrp);
+        split_seg.add(k_kext_text_section, pc + 4 - text_exec_off, to_section, to_offset, DyldCacheAdjV2Kind::Arm64Off12);
+    }
+    write_instr(kext, references_off + options.kext_references * k_reference_size, k_ret);
+
+    // Binds of dependency symbols
+    std::vector<std::string> imports;
+    std::map<std::string, uint64_t> import_ordinals;
+    auto bind_ordinal = [&]() {
+        size_t fileset = random.below(dependency_count(options) + 1);
+        std::string name = function_name(fileset, random.below(options.symbols));
+        auto [it, inserted] = import_ordinals.try_emplace(name, imports.size());
+        if (inserted) {
+            imports.push_back(name);
+        }
+        return it->second;
+    };
+
+    // Each data page holds rebased pointers to kext functions followed by
+    // binds, add_fixup can not insert before the first fixup of a page
+    kmod_info info{};
+    info.info_version = 1;
+    strncpy(info.name, k_kext_id, sizeof(info.name) - 1);
+    strncpy(info.version, "1.0.0", sizeof(info.version) - 1);
+    SpanWriter{kext, data_off}.put(info);
+    SegmentFixups data_const_fixups{data_const_off, k_page_size};
+    SegmentFixups data_fixups{data_off, k_page_size};
+    struct DataPage {
+        uint64_t section_off;
+        uint64_t first_slot;
+        uint64_t section;
+        SegmentFixups *fixups;
+        size_t pointers;
+        size_t binds;
+    };
+    size_t const_pointers = std::min(options.kext_pointers, k_page_size / 8);
+    size_t const_binds = std::min(options.kext_binds, k_page_size / 8 - const_pointers);
+    for (const DataPage &page: {
+             DataPage{data_const_off, data_const_off, k_kext_const_section, &data_const_fixups, const_pointers, const_binds},
+             DataPage{data_off, data_off + kmod_info_size, k_kext_data_section, &data_fixups,
+                      options.kext_pointers - const_pointers, options.kext_binds - const_binds},
+         }) {
+        for (size_t i = 0; i < page.pointers; ++i) {
+            uint64_t fileoff = page.first_slot + i * sizeof(uint64_t);
+            uint64_t target = references_off + random.below(options.kext_references + 1) * k_reference_size;
+            page.fixups->add(kext, fileoff, rebase_pointer(target, random.chance(), static_cast<uint16_t>(random.below(1 << 16))));
+            split_seg.add(page.section, fileoff - page.section_off, k_kext_text_section, target - text_exec_off,
+                          DyldCacheAdjV2Kind::Pointer64);
+        }
+        for (size_t i = 0; i < page.binds; ++i) {
+            uint64_t fileoff = page.first_slot + (page.pointers + i) * sizeof(uint64_t);
+            page.fixups->add(kext, fileoff, bind_pointer(bind_ordinal(), random.chance(), static_cast<uint16_t>(random.below(1 << 16))));
+        }
+    }
+    add_symbol("_kmod_info", k_kext_data_section, data_off);
+    SpanWriter{kext, cstring_offset}.put(std::span{k_kext_name, strlen(k_kext_name) + 1});
+
+    std::string chained_fixups = encode_chained_fixups(5, {{2, &data_const_fixups}, {3, &data_fixups}}, imports);
+    chained_fixups.resize(align(chained_fixups.size(), 8));
+    std::string split_seg_info = split_seg.encode();
+    strings.resize(align(strings.size(), 8));
+    const uint64_t fixups_off = linkedit_off;
+    const uint64_t split_seg_off = fixups_off + chained_fixups.size();
+    const uint64_t symoff = split_seg_off + split_seg_info.size();
+    const uint64_t stroff = symoff + symbols.size();
+    const uint64_t linkedit_size = stroff + strings.size() - linkedit_off;
+    kext.resize(linkedit_off + linkedit_size);
+    SpanWriter linkedit{kext, linkedit_off};
+    for (const std::string *blob: {&chained_fixups, &split_seg_info, &symbols, &strings}) {
+        linkedit.write(bytes(*blob));
+    }
+
+    LoadCommands commands;
+    commands.add_segment(Segment{"__TEXT", 0, 0, k_page_size, VM_PROT_READ,
+                                 {{"__cstring", cstring_offset, strlen(k_kext_name) + 1}}});
+    commands.add_segment(Segment{"__TEXT_EXEC", text_exec_off, text_exec_off, text_exec_size,
+                                 VM_PROT_READ | VM_PROT_EXECUTE, {{"__text", 0, text_exec_size, k_text_flags}}});
+    commands.add_segment(Segment{"__DATA_CONST", data_const_off, data_const_off, k_page_size, VM_PROT_READ,
+                                 {{"__const", 0, k_page_size}}});
+    commands.add_segment(Segment{"__DATA", data_off, data_off, k_page_size, VM_PROT_READ | VM_PROT_WRITE,
+                                 {{"__data", 0, k_page_size}}});
+    commands.add_segment(Segment{"__LINKEDIT", linkedit_off, linkedit_off, linkedit_size, VM_PROT_READ, {}});
+    commands.add_symtab(symoff, symbols.size() / sizeof(nlist_64), stroff, strings.size());
+    commands.add_identity(random);
+    commands.add_linkedit_data(LC_DYLD_CHAINED_FIXUPS, fixups_off, chained_fixups.size());
+    commands.add_linkedit_data(LC_SEGMENT_SPLIT_INFO, split_seg_off, split_seg_info.size());
+    kcmod_verify(commands.size() < cstring_offset);
+    commands.write(kext, 0, MH_KEXT_BUNDLE, 0);
+    return kext;
+}
+
+std::string kext_info_plist(const FixtureOptions &options) {
+    std::string libraries = "<key>com.apple.kpi.libkern</key><string>21.0</string>";
+    for (size_t i = 1; i <= dependency_count(options); ++i) {
+        libraries += fmt::format("<key>{}</key><string>1.0.0</string>", fileset_id(i, options.filesets));
+    }
+    return fmt::format(
+        R"(<?xml version="1.0" encoding="UTF-8"?>
+<!DOCTYPE plist PUBLIC "-//Apple//DTD PLIST 1.0//EN" "http://www.apple.com/DTDs/PropertyList-1.0.dtd">
+<plist version="1.0">
+<dict>
+	<key>CFBundleExecutable</key>
+	<string>{0}</string>
+	<key>CFBundleIdentifier</key>
+	<string>{1}</string>
+	<key>CFBundleName</key>
+	<string>{0}</string>
+	<key>CFBundlePackageType</key>
+	<string>KEXT</string>
+	<key>CFBundleVersion</key>
+	<string>1.0.0</string>
+	<key>OSBundleLibraries</key>
+	<dict>{2}</dict>
+</dict>
+</plist>
+)",
+        k_kext_name, k_kext_id, libraries);
+}
+
+}// namespace
+
+
+Fixture kcmod::generate_fixture(const FixtureOptions &options, const fs::path &directory) {
+    if (options.filesets < 2) {
+        throw FatalError{"Fixture needs at least com.apple.kernel and the victim fileset"};
+    }
+    if (options.symbols == 0) {
+        throw FatalError{"Fixture filesets need at least one symbol"};
+    }
+    Random random{options.seed};
+
+    Fixture fixture{
+        .kernelcache = directory / "kernelcache",
+        .kext = directory / fmt::format("{}.kext", k_kext_name),
+        .victim = k_victim_id,
+    };
+    fs::create_directories(directory);
+    write_file(fixture.kernelcache, build_kernelcache(options, random));
+
+    fs::path contents = fixture.kext / "Contents";
+    fs::create_directories(contents / "MacOS");
+    write_file(contents / "MacOS" / k_kext_name, build_kext(options, random));
+    std::string info_plist = kext_info_plist(options);
+    write_file(contents / "Info.plist", bytes(info_plist));
+    return fixture;
+}
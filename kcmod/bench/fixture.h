@@ -0,0 +1,66 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+
+namespace kcmod {
+
+// Shape of a synthetic kernelcache and of the kext replacing one of its
+// filesets. Segment sizes are rounded up to 16 KiB pages.
+struct FixtureOptions {
+    // Filesets including com.apple.kernel and the victim
+    size_t filesets = 256;
+    // Size of __TEXT_EXEC, __DATA_CONST and __DATA of every fileset
+    uint64_t segment_size = 128 * 1024;
+    // Function symbols exported by every fileset
+    size_t symbols = 512;
+    // Fraction of the pointer slots of fileset data segments holding a
+    // chained rebase
+    double fixup_density = 0.25;
+
+    // Size of the kext __TEXT_EXEC, __DATA_CONST and __DATA are a page each
+    uint64_t kext_text_size = 128 * 1024;
+    // ADRP and ADD/LDR pairs referring to kext data
+    size_t kext_references = 4096;
+    // Rebased pointers to kext functions and binds to dependency symbols
+    size_t kext_pointers = 1024;
+    size_t kext_binds = 512;
+    // Functions of com.apple.kernel hooked by the kext
+    size_t kext_hooks = 16;
+
+    uint64_t seed = 1;
+};
+
+struct Fixture {
+    std::filesystem::path kernelcache;
+    std::filesystem::path kext;
+    std::string victim;
+};
+
+// Writes an uncompressed MH_FILESET kernelcache and a kext bundle that
+// replaces its victim fileset into directory. The kext carries split segment
+// info for all of its references, binds symbols of its dependency filesets and
+// hooks functions of com.apple.kernel.
+Fixture generate_fixture(const FixtureOptions &options, const std::filesystem::path &directory);
+
+}// namespace kcmod
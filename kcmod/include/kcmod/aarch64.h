@@ -394,4 +394,9 @@ static inline bool is_bti_instr(uint32_t instr) {
     return (instr & 0xffffff3f) == 0xd503241f;
 }
 
+// ADD (immediate), the check AddImm does without throwing
+static inline bool is_add_imm_instr(uint32_t instr) {
+    return (instr & 0x7f800000) == 0x11000000;
+}
+
 }// namespace kcmod::aarch64
\ No newline at end of file
@@ -0,0 +1,86 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <array>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "macho.h"
+
+namespace kcmod {
+
+struct AddressLocation {
+    // Id of the fileset containing the address, empty when the address is
+    // only covered by a top level segment of the kernelcache
+    std::string_view fileset;
+    const segment_command_64* segment;
+    // nullptr when the address is not within any section of segment
+    const section_64* section;
+    uint64_t vmaddr;
+    uint64_t fileoff;
+};
+
+// Sorted ranges of the segments and sections of a Mach-O binary and, for a
+// kernelcache, of every fileset in it. Lookups resolve to the innermost range
+// in O(log n) instead of scanning load commands.
+//
+// Ranges shared by several filesets (like their common __LINKEDIT) resolve to
+// the enclosing top level segment. The index points into data and must be
+// rebuilt after load commands are edited.
+class AddressIndex {
+public:
+    explicit AddressIndex(std::span<const char> data, uint64_t offset = 0);
+
+    std::optional<AddressLocation> find_vmaddr(uint64_t vmaddr) const;
+    std::optional<AddressLocation> find_fileoff(uint64_t fileoff) const;
+
+private:
+    struct Range {
+        uint64_t begin;
+        uint64_t end;
+        uint32_t fileset;
+        const segment_command_64* segment;
+        const section_64* section;
+    };
+
+    enum Level {
+        TOP_SEGMENT,
+        SEGMENT,
+        SECTION,
+        LEVEL_COUNT,
+    };
+    using Ranges = std::array<std::vector<Range>, LEVEL_COUNT>;
+
+    void index_binary(std::span<const char> data, uint64_t offset, uint32_t fileset);
+    static void finish(std::vector<Range>& ranges);
+    static const Range* find(const Ranges& ranges, uint64_t address);
+    AddressLocation location(const Range& range) const;
+
+    std::vector<std::string> fileset_ids_;
+    Ranges by_vmaddr_;
+    Ranges by_fileoff_;
+};
+
+}// namespace kcmod
@@ -0,0 +1,71 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace kcmod {
+
+enum DerTag : uint8_t {
+    DER_INTEGER = 0x02,
+    DER_OCTET_STRING = 0x04,
+    DER_IA5_STRING = 0x16,
+    DER_SEQUENCE = 0x30,
+};
+
+struct DerElement {
+    uint8_t tag;
+    // Contents octets, without the identifier and length
+    std::span<const char> content;
+};
+
+// Reader for the definite length DER subset used by IMG4 containers
+class DerReader {
+public:
+    explicit DerReader(std::span<const char> data)
+        : data_{data}, cursor_{0} {}
+
+    bool empty() const { return cursor_ == data_.size(); }
+
+    DerElement read();
+    DerElement read(DerTag tag);
+
+    uint64_t read_integer();
+    std::string read_string();
+
+private:
+    std::span<const char> data_;
+    size_t cursor_;
+};
+
+// Identifier and length octets of an element with content_size bytes of
+// contents
+std::vector<char> der_header(DerTag tag, uint64_t content_size);
+
+void der_append(std::vector<char> &out, DerTag tag, std::span<const char> content);
+void der_append_integer(std::vector<char> &out, uint64_t value);
+void der_append_string(std::vector<char> &out, std::string_view value);
+
+}// namespace kcmod
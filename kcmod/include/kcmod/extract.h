@@ -0,0 +1,46 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <exception>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace kcmod {
+
+struct ExtractResult {
+    std::string fileset_id;
+    std::filesystem::path output;
+    // Null when the fileset was written
+    std::exception_ptr error;
+};
+
+// Writes filesets of the kernelcache at path to output_dir as standalone
+// Mach-O files named after their ids, all filesets when fileset_ids is empty.
+// Chained rebases are resolved into plain pointers, segments are laid out
+// from file offset 0 and __LINKEDIT only keeps the fileset's own symbol table
+// and linkedit data. Filesets are written in parallel on jobs threads.
+std::vector<ExtractResult> extract_filesets(const std::filesystem::path &kernelcache,
+                                            const std::vector<std::string> &fileset_ids,
+                                            const std::filesystem::path &output_dir, size_t jobs);
+
+}// namespace kcmod
@@ -40,6 +40,11 @@ union DyldFixupPointer {
     dyld_chained_ptr_arm64e_auth_bind ptr_auth_bind;
 };
 
+struct DyldFixupAddition {
+    uint64_t fileoff;
+    DyldFixupPointer pointer;
+};
+
 struct DyldChainedImport {
     dyld_chained_import import;
     std::string symbol_name;
@@ -52,6 +57,9 @@ public:
 
     void remove_fixups(uint64_t fileoff, uint64_t size);
     void add_fixup(uint64_t fileoff, DyldFixupPointer pointer);
+    // Adds all fixups at once, every affected page chain is walked and
+    // relinked a single time
+    void add_fixups(std::vector<DyldFixupAddition> fixups);
     std::vector<DyldFixupPointer*> read_fixups();
     std::vector<DyldChainedImport> read_chained_imports();
 
@@ -66,4 +74,8 @@ private:
     MachOBinary<char> binary_;
 };
 
+// Chain starts of every segment with fixups, read without an editor from the
+// LC_DYLD_CHAINED_FIXUPS of a binary that is only read
+std::vector<const dyld_chained_starts_in_segment *> read_chained_starts(MachOBinary<const char> binary);
+
 }// namespace kcmod
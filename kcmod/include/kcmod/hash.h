@@ -0,0 +1,48 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <string>
+
+#include "thread_pool.h"
+
+namespace kcmod {
+
+// XXH64 (https://github.com/Cyan4973/xxHash) content hash
+uint64_t xxh64(std::span<const char> data, uint64_t seed = 0);
+
+// Hashes fixed size chunks of data concurrently and combines the chunk hashes.
+// The result depends on chunk_size and is not the XXH64 of data.
+uint64_t parallel_xxh64(std::span<const char> data, ThreadPool &pool,
+                        size_t chunk_size = 16 * 1024 * 1024, uint64_t seed = 0);
+
+// Adler-32 checksum, as stored in the header of LZSS compressed kernelcaches
+uint32_t adler32(std::span<const char> data, uint32_t adler = 1);
+
+// Adler-32 of the concatenation of two buffers, from their checksums and the
+// size of the second one
+uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, size_t size2);
+
+std::string to_hex(uint64_t value);
+
+}// namespace kcmod
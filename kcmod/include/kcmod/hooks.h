@@ -30,11 +30,18 @@ struct KCModHook {
     Symbol hook_fn;
 };
 
+// Rebased pointers to fn_name are retargeted to redirect_fn
+struct KCModRedirect {
+    std::string fn_name;
+    Symbol redirect_fn;
+};
+
 class KCModHookReader {
 private:
     static constexpr const char* k_hook_prefix = "___kcmod_hook_";
     static constexpr const char* k_hook_super_prefix = "super_";
     static constexpr const char* k_hook_override_prefix = "override_";
+    static constexpr const char* k_redirect_prefix = "___kcmod_redirect_";
 
     struct HookEntry {
         const nlist_64* fn_super;
@@ -44,6 +51,7 @@ private:
 public:
     KCModHookReader(std::span<const char> data, uint64_t offset);
     std::vector<KCModHook> read_hooks();
+    std::vector<KCModRedirect> read_redirects();
 
 private:
     Symbol process_hook_symbol(const nlist_64& nlist);
@@ -0,0 +1,53 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <ostream>
+#include <span>
+#include <string>
+
+namespace kcmod {
+
+// Compression algorithm recorded in the IM4P compression info
+enum class Im4pCompression : uint64_t {
+    LZFSE = 1,
+};
+
+struct Im4p {
+    // Four character payload type, "krnl" for kernelcaches
+    std::string type;
+    std::string description;
+    std::span<const char> payload;
+    std::optional<Im4pCompression> compression;
+    std::optional<uint64_t> decoded_size;
+};
+
+bool is_im4p(std::span<const char> data);
+
+// Parses an IM4P, or the IM4P payload of an IMG4 container
+Im4p parse_im4p(std::span<const char> data);
+
+// Writes im4p as DER. The payload is streamed to out without being copied.
+void write_im4p(std::ostream &out, const Im4p &im4p);
+
+}// namespace kcmod
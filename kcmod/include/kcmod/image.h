@@ -0,0 +1,150 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <filesystem>
+#include <mutex>
+#include <ostream>
+#include <optional>
+#include <set>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <mio/mmap.hpp>
+
+#include "im4p.h"
+#include "thread_pool.h"
+
+namespace kcmod {
+
+enum class KernelCacheEncoding {
+    NONE,
+    LZSS,
+    LZFSE,
+};
+
+enum class OutputFormat {
+    MACHO,
+    IM4P,
+};
+
+// Parses "macho" or "im4p"
+OutputFormat parse_output_format(const std::string &name);
+
+// How a kernelcache file encodes the Mach-O, outputs in IM4P format are
+// encoded the same way
+struct KernelCacheContainer {
+    KernelCacheEncoding encoding = KernelCacheEncoding::NONE;
+    // Empty when the kernelcache is not IM4P wrapped
+    std::string im4p_type;
+    std::string im4p_description;
+};
+
+// A kernelcache as shipped: a plain Mach-O, or LZSS or LZFSE compressed and
+// optionally wrapped in an IM4P. path may name an entry of a zip archive such
+// as an ipsw, written "archive.zip:entry", which is inflated into memory. The
+// decoded kernelcache is produced on a background thread so the load commands
+// are usable while the rest of the payload is still being decoded.
+class KernelCacheImage {
+public:
+    explicit KernelCacheImage(const std::filesystem::path &path);
+    ~KernelCacheImage();
+
+    KernelCacheEncoding encoding() const { return encoding_; }
+    // IM4P wrapping the kernelcache. Its payload refers to the input and is
+    // valid for the lifetime of the image.
+    const std::optional<Im4p> &im4p() const { return im4p_; }
+    KernelCacheContainer container() const;
+    // Size of the decoded kernelcache
+    size_t size() const { return size_; }
+
+    // Starts decoding into output, which must be size() bytes and stay valid
+    // until the image is destroyed
+    void start(std::span<char> output);
+    // Starts decoding into a shared mapping of the file at path, which is
+    // resized to size(). With low_memory the input is read sequentially and
+    // decoded pages are dropped from memory soon after they are written, so
+    // the resident size does not grow with the kernelcache. path must not be
+    // the input, which is read while the output is written.
+    void start(const std::filesystem::path &path, bool low_memory = false);
+    // The decoded kernelcache. Only the prefix passed to wait() is valid
+    // before finish() returns.
+    std::span<char> data() const { return output_; }
+    // Blocks until the first size bytes of the output are decoded. Errors of
+    // the decoder are rethrown here.
+    void wait(size_t size);
+    // Blocks until the whole output is decoded
+    void finish() { wait(size_); }
+
+    // Blocks until the load commands are decoded and returns the ids of all
+    // filesets in the kernelcache
+    std::set<std::string> wait_for_fileset_ids();
+
+private:
+    void decode(std::span<char> output);
+    void set_progress(size_t decoded);
+
+private:
+    mio::mmap_source input_;
+    // Path of the mapped input, empty for archive entries
+    std::filesystem::path input_path_;
+    // Inflated contents of an archive entry input
+    std::vector<char> archive_entry_;
+    KernelCacheEncoding encoding_;
+    std::optional<Im4p> im4p_;
+    std::span<const char> encoded_;
+    size_t size_;
+
+    mio::mmap_sink output_file_;
+    std::span<char> output_;
+    std::thread decoder_;
+    std::atomic<bool> cancelled_ = false;
+    std::mutex mutex_;
+    std::condition_variable progress_cv_;
+    size_t decoded_ = 0;
+    std::exception_ptr error_;
+    bool low_memory_ = false;
+    // End of the output released in low memory mode, used by the decoder only
+    size_t released_ = 0;
+};
+
+// Returns true if the kernelcache at path is compressed, IM4P wrapped or an
+// archive entry
+bool is_encoded_kernelcache(const std::filesystem::path &path);
+
+// Reads and decodes the kernelcache at path into memory
+std::vector<char> read_kernelcache(const std::filesystem::path &path,
+                                   KernelCacheContainer *container = nullptr);
+
+// Writes the kernelcache in data to out. In IM4P format it is compressed on
+// pool with the encoding of container and wrapped with its IM4P type and
+// description. Plain Mach-O inputs are LZFSE compressed as "krnl".
+void write_kernelcache(std::ostream &out, std::span<const char> data, OutputFormat format,
+                       const KernelCacheContainer &container, ThreadPool &pool);
+void write_kernelcache(const std::filesystem::path &path, std::span<const char> data, OutputFormat format,
+                       const KernelCacheContainer &container, ThreadPool &pool);
+
+}// namespace kcmod
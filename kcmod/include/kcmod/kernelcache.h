@@ -20,34 +20,110 @@
 
 #pragma once
 
+#include <chrono>
+#include <functional>
+#include <map>
 #include <optional>
+#include <set>
 #include <span>
+#include <string_view>
 
 #include <mach-o/loader.h>
 
 #include "kext.h"
 #include "plist.h"
+#include "pointer_index.h"
+#include "profile.h"
 #include "symidx.h"
+#include "thread_pool.h"
 
 
 namespace kcmod {
 
+// Range of a segment of the kernelcache a kext segment is copied into instead
+// of the segment of the same name of the victim fileset
+struct SegmentPlacement {
+    std::string fileset;
+    std::string segment;
+    uint64_t offset = 0;
+    uint64_t size = 0;
+};
+
+// Placements by kext segment name. Filesets other than the victim holding
+// kext segments (donors) are removed from the kernelcache.
+using KextPlacement = std::map<std::string, SegmentPlacement>;
+
 class KernelCache {
 public:
+    // Receives the name and duration of every step of copy_fileset and
+    // link_fileset
+    using StepObserver = std::function<void(std::string_view, std::chrono::steady_clock::duration)>;
+
     KernelCache(std::span<char> data) : data_{data} {}
+    void set_step_observer(StepObserver observer) { step_observer_ = std::move(observer); }
+    // Applies the instruction fixups of large kexts on pool instead of the
+    // calling thread, which waits for them and must not be a worker of pool
+    void set_thread_pool(ThreadPool* pool) { thread_pool_ = pool; }
+
     void replace_fileset(const std::string& fileset, const KernelExtension &binary,
                          const std::optional<std::filesystem::path>& symbols);
+    void replace_fileset(const std::string& fileset, const KernelExtension &binary,
+                         const SymbolRegistry& registry, const KextPlacement& placement = {});
+
+    // The two halves of replace_fileset. copy_fileset overwrites the victim
+    // fileset (and the placed ranges of donors) with the kext and needs no
+    // symbols, it only writes inside them and __PRELINK_INFO so dependency
+    // filesets can be indexed meanwhile. link_fileset renames the fileset,
+    // removes donors and binds the kext.
+    void copy_fileset(const std::string& fileset, const KernelExtension& kext, const KextPlacement& placement = {});
+    void link_fileset(const std::string& fileset, const KernelExtension& kext, const SymbolRegistry& registry,
+                      const KextPlacement& placement = {});
+
+    // Links kext again into a kernelcache in which previous has replaced a
+    // fileset. The segment layout of both kexts must be identical. Only the
+    // given segments are copied and fixed up again, pristine is the
+    // kernelcache before previous was linked.
+    void relink_segments(const KernelExtension& previous, const KernelExtension& kext,
+                         const std::set<std::string>& segments, const SymbolRegistry& registry,
+                         std::span<const char> pristine);
+
+    SymbolRegistry construct_symbol_registry(const KernelExtension& kext, const std::optional<std::filesystem::path>& symbols);
+
+    // Retargets the rebased pointers to every function redirected by the
+    // linked kext to its replacement in the kext, keeping the auth key and
+    // diversity of each pointer. Pointers inside the kext are left alone.
+    void redirect_pointers(const KernelExtension& kext, const SymbolRegistry& registry, const PointerIndex& index);
 
 private:
+    template <class F>
+    void run_step(std::string_view name, F &&fn) {
+        ProfileScope scope{name};
+        if (!step_observer_) {
+            fn();
+            return;
+        }
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        step_observer_(name, std::chrono::steady_clock::now() - start);
+    }
+
+    static std::set<std::string> kext_segments(const KernelExtension& kext);
+    static std::set<std::string> donor_filesets(const std::string& fileset, const KextPlacement& placement);
     void replace_fileset_id(const std::string& from, const std::string& to);
-    void replace_segment(const std::string& fileset, const KernelExtension& kext, const std::string& segment_name);
-    void replace_text_segment(const std::string& fileset, const KernelExtension& kext);
-    void apply_split_segment_fixups(const std::string& fileset, const KernelExtension& kext);
+    void remove_fileset_entry(const std::string& fileset);
+    // Segment the kext segment segment_name is copied into
+    segment_command_64 destination_segment(const std::string& fileset, const std::string& segment_name,
+                                           const KextPlacement& placement);
+    void replace_segment(const std::string& fileset, const KernelExtension& kext, const std::string& segment_name,
+                         const KextPlacement& placement = {});
+    void replace_text_segment(const std::string& fileset, const KernelExtension& kext,
+                              const KextPlacement& placement = {});
+    void apply_split_segment_fixups(const std::string& fileset, const KernelExtension& kext,
+                                    const std::set<std::string>& from_segments);
+    void setup_kmod_info(const KernelExtension& kext);
 
-    void remove_prelink_info(const std::string& fileset);
-    void insert_prelink_info(CFDictionaryRef info);
-    void write_prelink_info(CFPropertyListRef plist);
-    PropertyList read_prelink_info();
+    void replace_prelink_info(const std::string& fileset, const KernelExtension& kext,
+                              const std::set<std::string>& removed = {});
 
     fileset_entry_command* read_fileset(const std::string& fileset);
     std::vector<segment_command_64*> read_fs_segments(const std::string& fileset);
@@ -55,15 +131,18 @@ private:
     std::vector<section_64*> read_fs_sections(const std::string& fileset, const std::string& segment);
     segment_command_64* read_prelink_info_segment();
 
-    std::vector<std::string> read_kext_deps(const KernelExtension& kext);
-    SymbolRegistry construct_symbol_registry(const KernelExtension& kext, const std::optional<std::filesystem::path>& symbols);
-
-    void insert_kext_prelink_info(const KernelExtension& kext);
-    void bind_kext_symbols(const KernelExtension& kext, const std::optional<std::filesystem::path>& symbols);
-    void bind_hooks(const KernelExtension& kext, const std::optional<std::filesystem::path>& symbols);
+    // Info of the kext copied into fileset, which may not be renamed yet
+    PropertyList kext_prelink_info(const std::string& fileset, const KernelExtension& kext);
+    void bind_kext_symbols(const KernelExtension& kext, const SymbolRegistry& registry,
+                           const std::set<std::string>& segments);
+    void bind_hooks(const KernelExtension& kext, const SymbolRegistry& registry);
+    // File offsets of the pointers to vmaddr outside the segments of fileset
+    std::vector<uint64_t> external_pointers(const std::string& fileset, const PointerIndex& index, uint64_t vmaddr);
 
 private:
     std::span<char> data_;
+    StepObserver step_observer_;
+    ThreadPool* thread_pool_ = nullptr;
 };
 
 }// namespace kcmod
\ No newline at end of file
@@ -25,15 +25,37 @@
 #include <mach-o/loader.h>
 #include <mio/mmap.hpp>
 
+#include "fixup_chain.h"
+#include "hooks.h"
 #include "macho.h"
 #include "plist.h"
+#include "split_seg.h"
 
 namespace kcmod {
 
+struct KextBind {
+    uint64_t fileoff;
+    DyldFixupPointer pointer;
+    std::string symbol_name;
+};
+
+// KernelExtension decodes everything required for linking (Info.plist, split
+// segment info, chained binds, hooks and redirects) once during construction. After that
+// the object is immutable and can be shared between threads linking the same
+// kext into different kernelcaches.
+//
+// When path points to a precompiled kext object (see kextobj.h) the decoded
+// state is loaded from the object instead.
 class KernelExtension {
 public:
     KernelExtension(const std::filesystem::path &path);
 
+    // Key identifying the content of the kext binary and Info.plist at path
+    static std::string content_key(const std::filesystem::path &path);
+    // Key identifying the bundle name and executable path of the kext at path,
+    // which are linked into __PRELINK_INFO along with its content
+    static std::string bundle_key(const std::filesystem::path &path);
+
     const std::string &bundle_id() const { return bundle_id_; }
     MachOBinary<const char> binary() const { return MachOBinary{binary_data_, 0}; }
     std::span<const char> binary_data() const { return binary_data_; }
@@ -51,11 +73,22 @@ public:
     }
 
     PropertyList read_info_plist() const;
+    std::span<const char> info_plist_data() const { return info_plist_data_; }
+
+    const std::vector<std::string> &dependencies() const { return dependencies_; }
+    const SplitSegInfo &split_seg_info() const { return split_seg_info_; }
+    const std::vector<KextBind> &binds() const { return binds_; }
+    const std::vector<KCModHook> &hooks() const { return hooks_; }
+    const std::vector<KCModRedirect> &redirects() const { return redirects_; }
 
     const std::filesystem::path& path() const { return path_; }
     const std::filesystem::path& binary_path() const { return binary_path_; }
     const std::filesystem::path& info_path() const { return info_path_; }
 
+private:
+    void parse_kext();
+    void load_object(const std::filesystem::path &path);
+
 private:
     std::filesystem::path path_;
     std::filesystem::path binary_path_;
@@ -63,6 +96,13 @@ private:
     std::string bundle_id_;
     mio::mmap_source binary_mmap_;
     std::span<const char> binary_data_;
+    std::vector<char> info_plist_data_;
+
+    std::vector<std::string> dependencies_;
+    SplitSegInfo split_seg_info_;
+    std::vector<KextBind> binds_;
+    std::vector<KCModHook> hooks_;
+    std::vector<KCModRedirect> redirects_;
 };
 
 }// namespace kcmod
\ No newline at end of file
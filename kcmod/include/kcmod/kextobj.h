@@ -0,0 +1,100 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <filesystem>
+
+#include "kext.h"
+
+namespace kcmod {
+
+// Precompiled kext object (.kcmodobj)
+//
+// Stores everything KernelExtension decodes from a kext so that later runs can
+// mmap the object and link without parsing the Mach-O or Info.plist. Layout:
+//
+//     KextObjectHeader
+//     binary            kext Mach-O, __LINKEDIT included so the symbol table
+//                       stays readable
+//     info_plist        raw Info.plist
+//     strings           NUL terminated strings referenced by offset
+//     dependencies      uint32_t string offsets
+//     split_seg_info    LC_SEGMENT_SPLIT_INFO data, decoded when linking
+//     binds             KextObjectBind
+//     hooks             KextObjectHook
+//     redirects         KextObjectRedirect
+//
+// Objects are only valid for the kcmod build that produced them.
+
+constexpr const char *k_kext_object_extension = ".kcmodobj";
+constexpr char k_kext_object_magic[8] = {'K', 'C', 'M', 'O', 'D', 'O', 'B', 'J'};
+constexpr uint32_t k_kext_object_version = 4;
+
+struct KextObjectRange {
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct KextObjectHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t bundle_id;
+    uint32_t path;
+    uint32_t binary_path;
+    uint32_t info_path;
+    uint32_t reserved;
+    KextObjectRange binary;
+    KextObjectRange info_plist;
+    KextObjectRange strings;
+    KextObjectRange dependencies;
+    KextObjectRange split_seg_info;
+    KextObjectRange binds;
+    KextObjectRange hooks;
+    KextObjectRange redirects;
+};
+
+struct KextObjectBind {
+    uint64_t fileoff;
+    DyldFixupPointer pointer;
+    uint32_t symbol_name;
+    uint32_t reserved;
+};
+
+struct KextObjectHook {
+    uint32_t fn_name;
+    uint32_t reserved;
+    Symbol super_fn;
+    Symbol hook_fn;
+};
+
+struct KextObjectRedirect {
+    uint32_t fn_name;
+    uint32_t reserved;
+    Symbol redirect_fn;
+};
+
+void write_kext_object(const KernelExtension &kext, const std::filesystem::path &output);
+
+// Path of the object for the kext at kext_path inside cache_dir
+std::filesystem::path kext_object_cache_path(const std::filesystem::path &cache_dir,
+                                             const std::filesystem::path &kext_path);
+
+}// namespace kcmod
@@ -20,9 +20,61 @@
 
 #pragma once
 
+#include <atomic>
+#include <string_view>
+#include <utility>
+
+#include <fmt/format.h>
+
+// Messages below this level are compiled out, see KCMOD_MIN_LOG_LEVEL in CMakeLists.txt
+#ifndef KCMOD_MIN_LOG_LEVEL
+#define KCMOD_MIN_LOG_LEVEL DEBUG
+#endif
+
 namespace kcmod {
 
-#define kcmod_log_debug(format, ...) fmt::print("[DEBUG] " format "\n", ##__VA_ARGS__)
-#define kcmod_log_warn(format, ...) fmt::print("[WARN] " format "\n", ##__VA_ARGS__)
+enum class LogLevel {
+    TRACE,
+    DEBUG,
+    INFO,
+    WARN,
+};
+
+// Messages are queued on a buffer of the logging thread and written to stderr
+// by a background thread. Messages of one thread keep their order, messages of
+// different threads may be interleaved in any order.
+class Logger {
+public:
+    static bool enabled(LogLevel level) { return level >= level_.load(std::memory_order_relaxed); }
+    static void set_level(LogLevel level) { level_.store(level, std::memory_order_relaxed); }
+
+    template <typename... T>
+    static void log(LogLevel level, fmt::format_string<T...> format, T &&...args) {
+        fmt::memory_buffer message;
+        fmt::format_to(std::back_inserter(message), format, std::forward<T>(args)...);
+        write(level, {message.data(), message.size()});
+    }
+
+    static void write(LogLevel level, std::string_view message);
+    // Blocks until every message queued so far is written
+    static void flush();
+
+private:
+    static std::atomic<LogLevel> level_;
+};
+
+#define kcmod_log(level, format, ...)                                              \
+    do {                                                                           \
+        if constexpr ((level) >= kcmod::LogLevel::KCMOD_MIN_LOG_LEVEL) {           \
+            if (kcmod::Logger::enabled(level)) {                                   \
+                kcmod::Logger::log(level, format, ##__VA_ARGS__);                  \
+            }                                                                      \
+        }                                                                          \
+    } while (0)
+
+#define kcmod_log_trace(format, ...) kcmod_log(kcmod::LogLevel::TRACE, format, ##__VA_ARGS__)
+#define kcmod_log_debug(format, ...) kcmod_log(kcmod::LogLevel::DEBUG, format, ##__VA_ARGS__)
+#define kcmod_log_info(format, ...) kcmod_log(kcmod::LogLevel::INFO, format, ##__VA_ARGS__)
+#define kcmod_log_warn(format, ...) kcmod_log(kcmod::LogLevel::WARN, format, ##__VA_ARGS__)
 
 }// namespace kcmod
@@ -0,0 +1,60 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <span>
+#include <vector>
+
+#include "thread_pool.h"
+
+namespace kcmod {
+
+// LZFSE block magics
+constexpr uint32_t k_lzfse_end_of_stream_magic = 0x24787662;// bvx$
+constexpr uint32_t k_lzfse_uncompressed_block_magic = 0x2d787662;// bvx-
+constexpr uint32_t k_lzfse_compressed_v1_block_magic = 0x31787662;// bvx1
+constexpr uint32_t k_lzfse_compressed_v2_block_magic = 0x32787662;// bvx2
+constexpr uint32_t k_lzfse_compressed_lzvn_block_magic = 0x6e787662;// bvxn
+
+bool is_lzfse(std::span<const char> data);
+
+// Size of the data encoded in an LZFSE stream, computed from its block headers
+size_t lzfse_decoded_size(std::span<const char> data);
+
+// Decodes the LZFSE stream in data into output, which must be
+// lzfse_decoded_size(data) bytes. progress is called after every block with
+// the number of bytes of output that are final.
+void lzfse_decode(std::span<const char> data, std::span<char> output,
+                  const std::function<void(size_t)> &progress = {});
+
+// Encodes data as an LZFSE stream of compressed v2 blocks. data is split
+// into chunk_size pieces which are compressed concurrently on pool, matches
+// never cross a chunk boundary.
+std::vector<char> lzfse_encode(std::span<const char> data, ThreadPool &pool, size_t chunk_size = 1024 * 1024);
+
+// Decodes a raw LZVN stream, as found in bvxn blocks, into output starting at
+// offset. Matches may reference output before offset. Returns the offset
+// after the last decoded byte.
+size_t lzvn_decode(std::span<const char> data, std::span<char> output, size_t offset = 0);
+
+}// namespace kcmod
@@ -0,0 +1,59 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <span>
+#include <vector>
+
+#include "thread_pool.h"
+
+namespace kcmod {
+
+// Header of an LZSS compressed kernelcache. Integers are big endian.
+struct LzssHeader {
+    char signature[4];// "comp"
+    char compression_type[4];// "lzss"
+    uint32_t checksum;// adler32 of the decoded data
+    uint32_t decoded_size;
+    uint32_t encoded_size;
+    char padding[0x16c];
+};
+
+static_assert(sizeof(LzssHeader) == 0x180);
+
+bool is_lzss(std::span<const char> data);
+
+size_t lzss_decoded_size(std::span<const char> data);
+
+// Decodes the LZSS stream in data into output, which must be
+// lzss_decoded_size(data) bytes. progress is called periodically with the
+// number of bytes of output that are final.
+void lzss_decode(std::span<const char> data, std::span<char> output,
+                 const std::function<void(size_t)> &progress = {});
+
+// Encodes data as an LZSS compressed kernelcache including its header. data
+// is split into chunk_size pieces whose matches are searched concurrently on
+// pool, the matches are then joined into a single stream.
+std::vector<char> lzss_encode(std::span<const char> data, ThreadPool &pool, size_t chunk_size = 1024 * 1024);
+
+}// namespace kcmod
@@ -0,0 +1,60 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace kcmod {
+
+struct Match {
+    size_t length;
+    size_t distance;
+};
+
+// Hash chain match finder for the LZ encoders. Positions must be inserted in
+// increasing order, every position of data is expected to be visited.
+class MatchFinder {
+public:
+    MatchFinder(std::span<const char> data, size_t window, size_t min_length, size_t max_length,
+                size_t max_chain = 16);
+
+    // Returns the longest match for the bytes at pos within the window, or a
+    // zero length match, and inserts pos
+    Match find(size_t pos);
+    // Inserts pos without searching
+    void insert(size_t pos);
+
+private:
+    uint32_t hash(size_t pos) const;
+
+private:
+    std::span<const char> data_;
+    size_t window_;
+    size_t min_length_;
+    size_t max_length_;
+    size_t max_chain_;
+    std::vector<int32_t> head_;
+    std::vector<int32_t> prev_;
+};
+
+}// namespace kcmod
@@ -22,11 +22,41 @@
 
 #include <fmt/format.h>
 #include <span>
+#include <stdexcept>
 
 #include "debug.h"
 
 namespace kcmod {
 
+// Decodes the ULEB128 value at offset in data and advances offset past it.
+// One and two byte values, nearly all deltas in linkedit streams, are decoded
+// without branching on each byte.
+inline uint64_t decode_uleb128(std::span<const char> data, uint64_t &offset) {
+    if (offset + 2 <= data.size()) {
+        auto b0 = static_cast<uint8_t>(data[offset]);
+        auto b1 = static_cast<uint8_t>(data[offset + 1]);
+        uint64_t more = b0 >> 7;
+        if ((more & (b1 >> 7)) == 0) {
+            offset += 1 + more;
+            return (b0 & 0x7f) | ((static_cast<uint64_t>(b1 & 0x7f) << 7) & (0 - more));
+        }
+    }
+    uint64_t result = 0;
+    int bit = 0;
+    while (true) {
+        kcmod_decode_verify(offset < data.size());
+        auto byte = static_cast<uint8_t>(data[offset++]);
+        uint64_t slice = byte & 0x7f;
+        kcmod_decode_verify(bit < 64);
+        kcmod_decode_verify(slice << bit >> bit == slice);
+        result |= (slice << bit);
+        bit += 7;
+        if ((byte & 0x80) == 0) {
+            return result;
+        }
+    }
+}
+
 template <class CharType>
 class SpanReader {
 private:
@@ -75,19 +105,7 @@ public:
     }
 
     uint64_t read_uleb128() {
-        uint64_t result = 0;
-        int bit = 0;
-        while (true) {
-            uint8_t byte = *read<uint8_t>();
-            uint64_t slice = byte & 0x7f;
-            kcmod_verify(bit < 64);
-            kcmod_verify(slice << bit >> bit == slice);
-            result |= (slice << bit);
-            bit += 7;
-            if ((byte & 0x80) == 0) {
-                return result;
-            }
-        }
+        return decode_uleb128(data_, cursor_);
     }
 
     void seek(size_t by) {
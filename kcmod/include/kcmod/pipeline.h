@@ -0,0 +1,69 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace kcmod {
+
+// A graph of named stages. Each stage runs on a thread pool as soon as every
+// stage it depends on has finished, so independent stages overlap. Stages
+// depending on a failed stage are skipped.
+class Pipeline {
+public:
+    using Stage = size_t;
+    using Clock = std::chrono::steady_clock;
+
+    struct StageTrace {
+        std::string name;
+        // Relative to the start of run(), empty if the stage was skipped
+        std::optional<Clock::duration> start;
+        std::optional<Clock::duration> end;
+    };
+
+    // Adds a stage running fn after all dependencies, which must have been
+    // added before
+    Stage add(std::string name, std::vector<Stage> dependencies, std::function<void()> fn);
+
+    // Runs all stages and blocks until none is running anymore. The first
+    // error thrown by a stage is rethrown.
+    void run();
+
+    const std::vector<StageTrace> &trace() const { return trace_; }
+    // Timeline of the last run, one line per stage
+    std::string format_trace() const;
+
+private:
+    struct StageInfo {
+        std::function<void()> fn;
+        std::vector<Stage> dependencies;
+        std::vector<Stage> dependents;
+    };
+
+    std::vector<StageInfo> stages_;
+    std::vector<StageTrace> trace_;
+};
+
+}// namespace kcmod
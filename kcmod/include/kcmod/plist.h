@@ -21,20 +21,167 @@
 #pragma once
 
 #include <filesystem>
-
-#include <CoreFoundation/CFPropertyList.h>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
 
 namespace kcmod {
 
+// Bump allocator, everything allocated from an arena is released together
+class Arena {
+public:
+    explicit Arena(size_t block_size = 64 * 1024) : block_size_{block_size} {}
+    Arena(Arena &&) = default;
+    Arena &operator=(Arena &&) = default;
+
+    void *allocate(size_t size, size_t alignment);
+    std::string_view copy(std::string_view value);
+
+    template <class T>
+    T *create() {
+        static_assert(std::is_trivially_destructible_v<T>);
+        return new (allocate(sizeof(T), alignof(T))) T{};
+    }
+
+private:
+    size_t block_size_;
+    std::vector<std::unique_ptr<char[]>> blocks_;
+    char *next_ = nullptr;
+    size_t available_ = 0;
+};
+
+struct PlistNode {
+    enum class Type : uint8_t {
+        DICT,
+        ARRAY,
+        STRING,
+        INTEGER,
+        REAL,
+        BOOLEAN,
+        DATA,
+        DATE,
+    };
+
+    struct Iterator {
+        PlistNode *node;
+        PlistNode *operator*() const { return node; }
+        Iterator &operator++() {
+            node = node->next;
+            return *this;
+        }
+        bool operator==(const Iterator &) const = default;
+    };
+
+    struct Children {
+        PlistNode *first;
+        Iterator begin() const { return {first}; }
+        Iterator end() const { return {nullptr}; }
+    };
+
+    Type type;
+    // Decoded string value, or the text of integer, real, date and data elements
+    std::string_view text;
+    bool boolean;
+    // Key of a dictionary value
+    std::string_view key;
+
+    PlistNode *parent;
+    PlistNode *first;
+    PlistNode *last;
+    PlistNode *prev;
+    PlistNode *next;
+    size_t count;
+
+    // IOKit style ID and IDREF attributes, ref is the node an IDREF refers to
+    std::string_view id;
+    PlistNode *ref;
+
+    // Source of a parsed node: the whole element, the text between the
+    // previous sibling (or the parent's opening tag) and the element, which
+    // includes the <key> of dictionary values, and for containers the opening
+    // tag and the text from the last child up to the closing tag
+    std::string_view source;
+    std::string_view prefix;
+    std::string_view open;
+    std::string_view close;
+    // Node or one of its descendants changed since it was parsed
+    bool dirty;
+    // A descendant carries an ID or IDREF attribute
+    bool has_ids;
+
+    const PlistNode *resolve() const { return ref ? ref : this; }
+    bool is_dict() const { return type == Type::DICT; }
+    bool is_array() const { return type == Type::ARRAY; }
+
+    Children children() const { return {resolve()->first}; }
+    size_t size() const { return resolve()->count; }
+    // Value for key in a dictionary, nullptr if it is not present
+    PlistNode *find(std::string_view key) const;
+    std::string_view string() const;
+    uint64_t integer() const;
+};
+
+// Property list DOM. Nodes are allocated from an arena owned by the property
+// list and parsed strings point into a private copy of the source document.
+// Serializing a property list writes the unchanged parts of a parsed document
+// byte for byte, including ID and IDREF attributes.
 class PropertyList {
 public:
-    PropertyList(const std::filesystem::path& path);
-    PropertyList(const std::span<const char> data);
-    CFPropertyListRef plist() { return plist_; };
-    ~PropertyList();
+    PropertyList();
+    explicit PropertyList(const std::filesystem::path &path);
+    explicit PropertyList(std::span<const char> data);
+    PropertyList(PropertyList &&) = default;
+    PropertyList &operator=(PropertyList &&) = default;
+
+    PlistNode *root() const { return root_; }
+    void set_root(PlistNode *root);
+
+    PlistNode *new_dict();
+    PlistNode *new_array();
+    PlistNode *new_string(std::string_view value);
+    PlistNode *new_integer(uint64_t value);
+    PlistNode *new_boolean(bool value);
+    PlistNode *new_data(std::span<const uint8_t> value);
+    // Deep copy of a node from another property list, IDREFs are resolved
+    PlistNode *copy(const PlistNode *node);
+
+    // Sets key in dict to value, replacing an existing value in place
+    void set(PlistNode *dict, std::string_view key, PlistNode *value);
+    void append(PlistNode *array, PlistNode *value);
+    void remove(PlistNode *node);
+
+    std::string serialize() const;
+    // Serializes node as an XML element without indentation
+    std::string serialize(const PlistNode *node) const;
+
+private:
+    PlistNode *new_node(PlistNode::Type type);
+    void mark_dirty(PlistNode *node);
+
+    friend class PlistParser;
+    friend class PlistWriter;
 
 private:
-    CFPropertyListRef plist_;
+    Arena arena_;
+    std::unique_ptr<char[]> source_;
+    // Text around the root element of a parsed document
+    std::string_view header_;
+    std::string_view trailer_;
+    PlistNode *root_ = nullptr;
+    std::unordered_map<std::string_view, PlistNode *> ids_;
+    // Generated elements are indented when the document is
+    bool pretty_ = true;
 };
 
-}// namespace kcmod
\ No newline at end of file
+// Value of the text of an integer element, decimal or hexadecimal
+uint64_t parse_plist_integer(std::string_view text);
+// Escapes the characters of text which can not appear in XML text
+std::string escape_xml(std::string_view text);
+// Decodes the character and entity references in XML text
+std::string unescape_xml(std::string_view text);
+
+}// namespace kcmod
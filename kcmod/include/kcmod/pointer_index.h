@@ -0,0 +1,55 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <span>
+#include <vector>
+
+#include "fixup_chain.h"
+
+namespace kcmod {
+
+// Rebased pointers of a kernelcache by the address they point at, built in
+// one pass over all chained fixups with the pages walked in parallel. Finding
+// every pointer to a function otherwise means walking every chain.
+//
+// Binds are skipped, kernelcaches resolve all of them at build time. The
+// index holds file offsets only and must be rebuilt after chains are edited.
+class PointerIndex {
+public:
+    explicit PointerIndex(std::span<const char> kernelcache);
+
+    // File offsets of the pointers to vmaddr, ascending
+    std::vector<uint64_t> find(uint64_t vmaddr) const;
+    size_t size() const { return entries_.size(); }
+
+private:
+    struct Entry {
+        uint64_t target;
+        uint64_t fileoff;
+
+        auto operator<=>(const Entry&) const = default;
+    };
+
+    std::vector<Entry> entries_;
+};
+
+}// namespace kcmod
@@ -0,0 +1,100 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <map>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "plist.h"
+
+namespace kcmod {
+
+// Edits the _PrelinkInfoDictionary array of a __PRELINK_INFO segment without
+// building a property list of it. The XML is tokenized once to find the byte
+// range of every info dictionary and of every ID definition and IDREF, and
+// commit() writes the unchanged parts as slices of the original document
+// around the edits.
+//
+// Appended info dictionaries are written without whitespace and share
+// repeated values through ID and IDREF attributes, like kxld and
+// OSSerialize do. Strings, numbers and data already defined in the document
+// are referenced when the reference is shorter than the value, and values
+// repeated within the appended dictionaries are defined once.
+class PrelinkInfoEditor {
+public:
+    explicit PrelinkInfoEditor(std::span<char> segment);
+
+    void remove(const std::string &bundle_id);
+    void append(const PlistNode *info);
+    // Writes the edited document to the segment, zeroing only the part of the
+    // previous document beyond its end, and returns the number of bytes left
+    // in the segment. The editor can not be used afterwards.
+    size_t commit();
+
+private:
+    struct Range {
+        size_t begin;
+        size_t end;
+    };
+
+    struct IdRef {
+        Range range;
+        std::string_view id;
+    };
+
+    struct InfoDict {
+        Range range;
+        std::string bundle_id;
+        bool removed = false;
+    };
+
+    struct Splice {
+        Range range;
+        std::string replacement;
+    };
+
+    void scan();
+    void define(std::string_view id, Range range);
+    std::string_view element_name(Range range) const;
+    std::string_view element_text(Range range) const;
+    std::string materialize(std::string_view id);
+
+private:
+    std::span<char> segment_;
+    std::string_view xml_;
+    std::vector<InfoDict> info_dicts_;
+    // Offset of the closing tag of _PrelinkInfoDictionary
+    size_t array_end_ = 0;
+    std::map<std::string_view, Range> definitions_;
+    std::vector<IdRef> refs_;
+    // Scalar value (see scalar_key) to its first definition
+    std::unordered_map<std::string, std::pair<std::string_view, Range>> values_;
+    uint64_t next_id_ = 0;
+    std::vector<PropertyList> appended_;
+    std::map<std::string_view, bool> materialized_;
+    bool committed_ = false;
+};
+
+}// namespace kcmod
@@ -0,0 +1,131 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace kcmod {
+
+enum class ProfileCounter {
+    BYTES_COPIED,
+    FIXUPS_ADDED,
+    FIXUPS_REMOVED,
+    SYMBOLS_INDEXED,
+    PLIST_BYTES_PARSED,
+    PLIST_BYTES_SERIALIZED,
+    MINOR_PAGE_FAULTS,
+    MAJOR_PAGE_FAULTS,
+};
+
+constexpr size_t k_profile_counter_count = static_cast<size_t>(ProfileCounter::MAJOR_PAGE_FAULTS) + 1;
+
+// Records scoped timings and counters of the whole process while it exists.
+// Instrumented code reaches it through Profiler::active(), when no profiler
+// exists every scope and counter costs a single relaxed load.
+class Profiler {
+public:
+    using Clock = std::chrono::steady_clock;
+    using Counters = std::array<uint64_t, k_profile_counter_count>;
+
+    Profiler();
+    ~Profiler();
+
+    Profiler(const Profiler &) = delete;
+    Profiler &operator=(const Profiler &) = delete;
+
+    static Profiler *active() { return active_.load(std::memory_order_relaxed); }
+
+    void add(ProfileCounter counter, uint64_t value) {
+        counters_[static_cast<size_t>(counter)].fetch_add(value, std::memory_order_relaxed);
+    }
+
+    // Totals of all counters so far, including the page faults of the process
+    Counters counters() const;
+
+    // Records a scope that ran on the calling thread. The counters are the
+    // totals at its start, they change with work done by other threads too.
+    void record(std::string name, Clock::time_point begin, const Counters &begin_counters);
+
+    // Writes a Chrome trace event file, loadable in Perfetto or chrome://tracing
+    void write_trace(const std::filesystem::path &path) const;
+    // Counter totals and elapsed time on one line
+    std::string format_summary() const;
+
+private:
+    struct Event {
+        std::string name;
+        uint32_t thread;
+        Clock::time_point begin;
+        Clock::time_point end;
+        Counters begin_counters;
+        Counters end_counters;
+    };
+
+    static std::atomic<Profiler *> active_;
+
+    Clock::time_point start_;
+    Counters start_faults_;
+    std::array<std::atomic<uint64_t>, k_profile_counter_count> counters_{};
+    mutable std::mutex mutex_;
+    std::vector<Event> events_;
+};
+
+// Times the enclosing scope, the name is only copied when profiling is on
+class ProfileScope {
+public:
+    explicit ProfileScope(std::string_view name) : profiler_{Profiler::active()} {
+        if (profiler_) {
+            name_ = name;
+            begin_counters_ = profiler_->counters();
+            begin_ = Profiler::Clock::now();
+        }
+    }
+
+    ~ProfileScope() {
+        if (profiler_) {
+            profiler_->record(std::move(name_), begin_, begin_counters_);
+        }
+    }
+
+    ProfileScope(const ProfileScope &) = delete;
+    ProfileScope &operator=(const ProfileScope &) = delete;
+
+private:
+    Profiler *profiler_;
+    std::string name_;
+    Profiler::Clock::time_point begin_;
+    Profiler::Counters begin_counters_;
+};
+
+inline void profile_count(ProfileCounter counter, uint64_t value) {
+    if (Profiler *profiler = Profiler::active()) {
+        profiler->add(counter, value);
+    }
+}
+
+}// namespace kcmod
@@ -0,0 +1,71 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <exception>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "image.h"
+#include "kext.h"
+
+namespace kcmod {
+
+struct ReplaceOptions {
+    std::string fileset_id;
+    // Replace the best fitting fileset of every target instead of fileset_id,
+    // see select_victim
+    bool auto_victim = false;
+    // Place kext segments too large for the victim into other filesets, see
+    // place_segments
+    bool scatter = false;
+    std::filesystem::path kext;
+    std::optional<std::filesystem::path> symbols;
+    std::optional<std::filesystem::path> kext_cache;
+    std::optional<std::filesystem::path> result_cache;
+    OutputFormat output_format = OutputFormat::MACHO;
+    size_t jobs = 1;
+    // Print the timeline of the pipeline stages of every target
+    bool trace = false;
+    // Edit the output in place with bounded memory, see KernelCacheImage::start
+    bool low_memory = false;
+};
+
+struct ReplaceTarget {
+    std::filesystem::path input;
+    std::filesystem::path output;
+};
+
+// Loads the kext at kext_path. When cache_dir is given the precompiled kext
+// object in it is used, or created if it does not exist yet.
+KernelExtension load_kext(const std::filesystem::path &kext_path,
+                          const std::optional<std::filesystem::path> &cache_dir);
+
+// Replaces options.fileset_id, or the victim picked for each target with
+// options.auto_victim, with options.kext in every target. The kext is
+// decoded at most once and targets are linked concurrently. Returns the error
+// for each target, or nullptr when it succeeded.
+std::vector<std::exception_ptr> replace_kernelcaches(const ReplaceOptions &options,
+                                                     const std::vector<ReplaceTarget> &targets);
+
+}// namespace kcmod
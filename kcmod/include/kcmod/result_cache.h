@@ -0,0 +1,68 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "thread_pool.h"
+
+namespace kcmod {
+
+// Opt-in cache of replace results keyed by the content of every input.
+//
+// An entry stores the output as a patch against the input kernelcache, so a
+// hit costs hashing the inputs plus one copy of the input kernelcache.
+class ResultCache {
+public:
+    explicit ResultCache(const std::filesystem::path &dir);
+
+    class KeyBuilder {
+    public:
+        explicit KeyBuilder(ThreadPool &pool) : pool_{pool} {}
+        KeyBuilder &add_file(const std::filesystem::path &path);
+        KeyBuilder &add_string(const std::string &value);
+        std::string finish() const;
+
+    private:
+        ThreadPool &pool_;
+        std::vector<uint64_t> hashes_;
+    };
+
+    KeyBuilder key_builder() { return KeyBuilder{pool_}; }
+
+    // Writes the cached output for key to output. Returns false on a miss,
+    // a corrupt entry is removed and counts as one without touching output.
+    bool restore(const std::string &key, const std::filesystem::path &input, const std::filesystem::path &output);
+
+    // Stores output (produced from input) under key
+    void store(const std::string &key, const std::filesystem::path &input, const std::filesystem::path &output);
+
+private:
+    std::filesystem::path entry_path(const std::string &key) const;
+
+private:
+    std::filesystem::path dir_;
+    ThreadPool pool_;
+};
+
+}// namespace kcmod
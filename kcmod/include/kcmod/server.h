@@ -0,0 +1,110 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <atomic>
+#include <filesystem>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+#include "image.h"
+#include "kext.h"
+#include "symidx.h"
+#include "thread_pool.h"
+
+namespace kcmod {
+
+// A kernelcache kept in memory by the daemon together with the symbol
+// registries built from it
+class LoadedKernelCache {
+public:
+    LoadedKernelCache(const std::filesystem::path &path, std::filesystem::file_time_type mtime);
+
+    const std::filesystem::path &path() const { return path_; }
+    std::filesystem::file_time_type mtime() const { return mtime_; }
+    std::span<const char> data();
+    // Encoding of the file, valid after data() was called
+    const KernelCacheContainer &container() const { return container_; }
+
+    // Registry used to link kext, shared between requests with the same
+    // dependencies and symbols file
+    std::shared_ptr<const SymbolRegistry> kext_registry(const KernelExtension &kext,
+                                                        const std::optional<std::filesystem::path> &symbols);
+    // Registry of every fileset in the kernelcache
+    std::shared_ptr<const SymbolRegistry> full_registry();
+
+    size_t memory_size() const { return memory_size_; }
+
+private:
+    std::filesystem::path path_;
+    std::filesystem::file_time_type mtime_;
+    std::once_flag load_flag_;
+    std::vector<char> data_;
+    KernelCacheContainer container_;
+    std::mutex registries_mutex_;
+    std::map<std::string, std::shared_ptr<const SymbolRegistry>> registries_;
+    std::atomic<size_t> memory_size_ = 0;
+};
+
+// Least recently used kernelcaches, bounded by their memory usage. Entries
+// evicted while a request still uses them are freed once it completes.
+class KernelCacheStore {
+public:
+    explicit KernelCacheStore(size_t memory_limit) : memory_limit_{memory_limit} {}
+
+    std::shared_ptr<LoadedKernelCache> load(const std::filesystem::path &path);
+    // Compression and instruction fixup tasks of all connections
+    ThreadPool &worker_pool() { return worker_pool_; }
+
+private:
+    void evict();
+
+private:
+    size_t memory_limit_;
+    std::mutex mutex_;
+    std::list<std::shared_ptr<LoadedKernelCache>> entries_;
+    ThreadPool worker_pool_;
+};
+
+struct ServerOptions {
+    std::filesystem::path socket;
+    size_t memory_limit;
+};
+
+// Handles a request of the form {"command": "replace" | "lookup" | "verify", ...}
+// and returns {"ok": true, ...} or {"ok": false, "error": <message>}
+nlohmann::json handle_request(KernelCacheStore &store, const nlohmann::json &request);
+
+// Serves newline delimited JSON requests on a Unix domain socket, every
+// connection is handled on its own thread. Never returns.
+[[noreturn]] void serve(const ServerOptions &options);
+
+// Sends request to the daemon listening on socket and returns its response
+nlohmann::json send_request(const std::filesystem::path &socket, const nlohmann::json &request);
+
+}// namespace kcmod
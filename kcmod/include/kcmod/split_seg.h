@@ -20,7 +20,11 @@
 
 #pragma once
 
+#include <iterator>
 #include <span>
+#include <vector>
+
+#include "memio.h"
 
 namespace kcmod {
 
@@ -51,6 +55,118 @@ struct DyldCacheAdjV2Entry {
     DyldCacheAdjV2Kind kind;
 };
 
-std::vector<DyldCacheAdjV2Entry> parse_split_seg_info(std::span<const char> data);
+// Ascending from section offsets of a run, decoded from their ULEB128 deltas
+// while iterating
+class SplitSegOffsets {
+public:
+    class Iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = uint64_t;
+        using difference_type = std::ptrdiff_t;
+
+        Iterator() = default;
+        Iterator(std::span<const char> data, uint64_t position, uint64_t remaining)
+            : data_{data}, position_{position}, remaining_{remaining} {
+            if (remaining_ > 0) {
+                value_ = decode_uleb128(data_, position_);
+            }
+        }
+
+        uint64_t operator*() const { return value_; }
+        Iterator &operator++() {
+            if (--remaining_ > 0) {
+                value_ += decode_uleb128(data_, position_);
+            }
+            return *this;
+        }
+        void operator++(int) { ++*this; }
+        bool operator==(std::default_sentinel_t) const { return remaining_ == 0; }
+
+    private:
+        std::span<const char> data_;
+        uint64_t position_ = 0;
+        uint64_t remaining_ = 0;
+        uint64_t value_ = 0;
+    };
+
+    SplitSegOffsets() = default;
+    SplitSegOffsets(std::span<const char> data, uint64_t position, uint64_t count)
+        : data_{data}, position_{position}, count_{count} {}
+
+    Iterator begin() const { return {data_, position_, count_}; }
+    std::default_sentinel_t end() const { return {}; }
+    uint64_t size() const { return count_; }
+
+private:
+    std::span<const char> data_;
+    uint64_t position_ = 0;
+    uint64_t count_ = 0;
+};
+
+// Adjustments sharing the from and to section, the target offset and the kind
+struct SplitSegRun {
+    uint64_t from_section_idx;
+    uint64_t to_section_idx;
+    uint64_t to_section_offset;
+    DyldCacheAdjV2Kind kind;
+    SplitSegOffsets from_section_offsets;
+};
+
+// DYLD_CACHE_ADJ_V2 split segment info, decoded lazily. Iterating yields the
+// runs in stream order, which groups them by from and to section, so all
+// adjustments of a run are applied sequentially within one section.
+class SplitSegInfo {
+public:
+    class Iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = SplitSegRun;
+        using difference_type = std::ptrdiff_t;
+
+        Iterator() = default;
+        Iterator(std::span<const char> data, uint64_t position, uint64_t section_count);
+
+        const SplitSegRun &operator*() const { return run_; }
+        const SplitSegRun *operator->() const { return &run_; }
+        Iterator &operator++() {
+            advance();
+            return *this;
+        }
+        void operator++(int) { advance(); }
+        bool operator==(std::default_sentinel_t) const { return done_; }
+
+    private:
+        void advance();
+
+    private:
+        std::span<const char> data_;
+        uint64_t position_ = 0;
+        uint64_t sections_left_ = 0;
+        uint64_t to_offsets_left_ = 0;
+        uint64_t kinds_left_ = 0;
+        SplitSegRun run_{};
+        bool done_ = true;
+    };
+
+    SplitSegInfo() = default;
+    // encoded is the data of LC_SEGMENT_SPLIT_INFO, starting with the format
+    explicit SplitSegInfo(std::span<const char> encoded);
+    // Split segment info of the Mach-O binary in data
+    static SplitSegInfo read(std::span<const char> data);
+
+    std::span<const char> encoded() const { return encoded_; }
+
+    Iterator begin() const;
+    std::default_sentinel_t end() const { return {}; }
+
+    // Every adjustment as a separate entry
+    std::vector<DyldCacheAdjV2Entry> entries() const;
+
+private:
+    std::span<const char> encoded_;
+    uint64_t runs_offset_ = 0;
+    uint64_t section_count_ = 0;
+};
 
 }// namespace kcmod
@@ -0,0 +1,105 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <mio/mmap.hpp>
+
+#include "kext.h"
+
+namespace kcmod {
+
+struct SymbolLocation {
+    std::string_view fileset;
+    // Symbol name, generated as sub_<address> for function starts without a
+    // symbol and <segment>,<section> for addresses before the first symbol of
+    // a section
+    std::string_view symbol;
+    uint64_t offset;
+};
+
+// Sorted address to symbol index of a kernelcache.
+//
+// Covers the nlist symbols and LC_FUNCTION_STARTS of every fileset and of
+// kexts replaced into the kernelcache by kcmod, whose filesets carry no
+// symbols of their own. Addresses are unslid kernelcache addresses. The index
+// can be written to a file and mapped again without the kernelcache:
+//
+//     SymbolIndexHeader
+//     key               NUL terminated key of the indexed inputs
+//     addresses         sorted uint64_t symbol addresses
+//     entries           name and fileset string offsets of each address
+//     strings           NUL terminated names referenced by offset
+class SymbolicationIndex {
+public:
+    SymbolicationIndex(std::span<const char> kernelcache, const std::vector<const KernelExtension *> &kexts,
+                       std::string key);
+    explicit SymbolicationIndex(const std::filesystem::path &path);
+
+    SymbolicationIndex(SymbolicationIndex &&) = default;
+    SymbolicationIndex &operator=(SymbolicationIndex &&) = default;
+
+    void save(const std::filesystem::path &path) const;
+
+    std::optional<SymbolLocation> resolve(uint64_t vmaddr) const;
+    const std::string &key() const { return key_; }
+    size_t size() const { return addresses_.size(); }
+
+private:
+    struct Entry {
+        uint32_t name;
+        uint32_t fileset;
+    };
+
+private:
+    std::string key_;
+    mio::mmap_source mapping_;
+    std::vector<uint64_t> address_storage_;
+    std::vector<Entry> entry_storage_;
+    std::vector<char> string_storage_;
+    std::span<const uint64_t> addresses_;
+    std::span<const Entry> entries_;
+    std::span<const char> strings_;
+};
+
+struct SymbolicateOptions {
+    std::filesystem::path kernelcache;
+    // Kexts kcmod replaced filesets of the kernelcache with
+    std::vector<std::filesystem::path> kexts;
+    // Index file to load, rebuilt when missing or built from other inputs
+    std::optional<std::filesystem::path> index;
+    // KASLR slide, taken from "Kernel slide:" lines of the input when unset
+    std::optional<uint64_t> slide;
+    // Read from stdin when empty
+    std::vector<std::filesystem::path> inputs;
+};
+
+// Copies inputs to stdout with the symbol of every resolved 0x prefixed
+// address appended after it, like 0xfffffff0071b5c1c (com.apple.kernel`_panic + 0x1c)
+void symbolicate(const SymbolicateOptions &options);
+
+}// namespace kcmod
@@ -55,6 +55,7 @@ public:
     void add_override(const std::string& name, uint64_t address);
     const std::vector<Symbol>* find_registered_symbols(const std::string& name) const;
     Symbol find_bind_symbol(const std::string& name) const;
+    size_t memory_size() const;
 
 private:
     std::map<std::string, std::vector<Symbol>> symbols_;
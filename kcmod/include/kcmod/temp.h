@@ -21,6 +21,7 @@
 #pragma once
 
 #include <filesystem>
+#include <string_view>
 
 namespace kcmod {
 
@@ -28,6 +29,10 @@ class TemporaryFile {
 public:
     TemporaryFile();
     TemporaryFile(const std::filesystem::path &path);
+    // Empty file with a unique name starting with prefix in directory, for
+    // output that is renamed into place once written. A renamed file is not
+    // removed.
+    TemporaryFile(const std::filesystem::path &directory, std::string_view prefix);
     ~TemporaryFile();
 
     const std::filesystem::path& path() const { return path_; }
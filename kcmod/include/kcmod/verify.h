@@ -0,0 +1,39 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <span>
+#include <string>
+#include <vector>
+
+namespace kcmod {
+
+// Checks the structure of a kernelcache and returns a description of every
+// problem found, an empty result means the kernelcache is well formed. The
+// checks run in parallel:
+//  - every fixup chain stays in its page, rebases target kernelcache segments
+//    and no bind is left
+//  - branches and ADRPs of instruction sections point into the kernelcache
+//  - the segments and sections of every fileset lie in the top level segments
+//  - __PRELINK_INFO parses and matches the LC_FILESET_ENTRY list
+std::vector<std::string> verify_kernelcache(std::span<const char> data);
+
+}// namespace kcmod
@@ -0,0 +1,68 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <span>
+#include <string>
+#include <vector>
+
+#include "kernelcache.h"
+#include "kext.h"
+
+namespace kcmod {
+
+// How a kext fits into a fileset replaced by it
+struct VictimFit {
+    std::string fileset_id;
+    // Why the fileset can not be replaced by the kext, empty when it fits
+    std::string rejection;
+    // Bytes of the replaced segments left unused by the kext
+    uint64_t slack = 0;
+    // Bytes missing from the segments too small for the kext
+    uint64_t shortfall = 0;
+
+    bool fits() const { return rejection.empty(); }
+};
+
+// Checks every fileset of kernelcache as victim for kext, with the same size
+// limits replace enforces, from the load commands only. Filesets the kernel
+// needs to boot, the dependencies of the kext and filesets other prelinked
+// filesets list in OSBundleLibraries are never picked. Fitting
+// filesets come first, the one leaving the least space unused first, followed
+// by the ones missing the fewest bytes. With scatter only __TEXT has to fit,
+// the other segments are placed by place_segments.
+std::vector<VictimFit> rank_victims(std::span<const char> kernelcache, const KernelExtension &kext,
+                                    bool scatter = false);
+
+// Best fitting victim for kext. Throws a FatalError listing why the filesets
+// closest to fitting were rejected when none fits.
+std::string select_victim(std::span<const char> kernelcache, const KernelExtension &kext, bool scatter = false);
+
+// Places __TEXT_EXEC, __DATA_CONST and __DATA of kext for replacing victim.
+// Empty when all of them fit the victim. Otherwise the segments of the victim
+// and of the filesets that could be victims themselves are packed best fit
+// decreasing, preferring filesets already holding a kext segment, so as few
+// filesets as possible are dropped. __DATA_CONST may be placed in __DATA.
+// Throws a FatalError when a segment fits nowhere.
+KextPlacement place_segments(std::span<const char> kernelcache, const KernelExtension &kext,
+                             const std::string &victim);
+
+}// namespace kcmod
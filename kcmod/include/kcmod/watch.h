@@ -0,0 +1,47 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <chrono>
+#include <filesystem>
+#include <optional>
+#include <string>
+
+namespace kcmod {
+
+struct WatchOptions {
+    std::string fileset_id;
+    std::filesystem::path kernelcache;
+    std::filesystem::path kext;
+    std::filesystem::path output;
+    std::optional<std::filesystem::path> symbols;
+    std::chrono::milliseconds interval{50};
+};
+
+// Links kext into kernelcache and keeps the result up to date as the kext is
+// rebuilt. The kernelcache, its symbol index and the output mapping stay in
+// memory. When a rebuilt kext has the same segment layout only the segments
+// whose content, split segment entries, binds or hooks changed are linked
+// again, otherwise the output is restored from the kernelcache and linked
+// from scratch. Never returns.
+[[noreturn]] void watch_kext(const WatchOptions &options);
+
+}// namespace kcmod
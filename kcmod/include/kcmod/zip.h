@@ -0,0 +1,94 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+#include <mio/mmap.hpp>
+
+#include "thread_pool.h"
+
+namespace kcmod {
+
+// An entry of an archive, written as "archive.zip:entry"
+struct ArchivePath {
+    std::filesystem::path archive;
+    std::string entry;
+};
+
+// Splits path into an archive and an entry name when it is not an existing
+// file itself and the part before the last ':' is one
+std::optional<ArchivePath> parse_archive_path(const std::filesystem::path &path);
+
+struct ZipEntry {
+    std::string name;
+    uint16_t version_made_by;
+    uint16_t version_needed;
+    uint16_t flags;
+    uint16_t method;
+    uint16_t time;
+    uint16_t date;
+    uint32_t crc32;
+    uint64_t compressed_size;
+    uint64_t uncompressed_size;
+    uint16_t internal_attributes;
+    uint32_t external_attributes;
+    uint64_t local_header_offset;
+    // Extra fields other than the zip64 extended information
+    std::vector<char> extra;
+    std::span<const char> comment;
+};
+
+// Zip archive, including zip64, mapped read only. Entries are either stored
+// or deflated.
+class ZipArchive {
+public:
+    explicit ZipArchive(const std::filesystem::path &path);
+
+    const std::vector<ZipEntry> &entries() const { return entries_; }
+    const ZipEntry &find(const std::string &name) const;
+
+    // Inflates entry and verifies its CRC
+    std::vector<char> read(const ZipEntry &entry) const;
+
+    // Writes a copy of the archive to path in which the entry name holds
+    // data. The new entry is deflated in chunks on pool, the other entries are
+    // copied byte for byte without being recompressed.
+    void write_replacing(const std::filesystem::path &path, const std::string &name, std::span<const char> data,
+                         ThreadPool &pool) const;
+
+private:
+    // Compressed data of entry, following its local header
+    std::span<const char> entry_data(const ZipEntry &entry) const;
+
+private:
+    mio::mmap_source file_;
+    std::vector<ZipEntry> entries_;
+    uint64_t directory_offset_;
+    std::span<const char> comment_;
+};
+
+}// namespace kcmod
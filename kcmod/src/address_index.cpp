@@ -0,0 +1,145 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+
+#include "address_index.h"
+
+using namespace kcmod;
+
+namespace {
+
+bool is_zerofill(const section_64* section) {
+    uint32_t type = section->flags & SECTION_TYPE;
+    return type == S_ZEROFILL || type == S_GB_ZEROFILL || type == S_THREAD_LOCAL_ZEROFILL;
+}
+
+}// namespace
+
+AddressIndex::AddressIndex(std::span<const char> data, uint64_t offset) {
+    fileset_ids_.emplace_back();
+    MachOBinary binary {data, offset};
+    auto filesets = binary.read_filesets();
+    if (filesets.empty()) {
+        index_binary(data, offset, 0);
+    } else {
+        for (const auto* segment: binary.read_segments()) {
+            by_vmaddr_[TOP_SEGMENT].push_back({segment->vmaddr, segment->vmaddr + segment->vmsize, 0, segment, nullptr});
+            by_fileoff_[TOP_SEGMENT].push_back({segment->fileoff, segment->fileoff + segment->filesize, 0, segment, nullptr});
+        }
+        for (const auto& [fileset_id, fileset]: filesets) {
+            fileset_ids_.push_back(fileset_id);
+            index_binary(data, fileset->fileoff, fileset_ids_.size() - 1);
+        }
+    }
+    for (size_t level = 0; level < LEVEL_COUNT; ++level) {
+        finish(by_vmaddr_[level]);
+        finish(by_fileoff_[level]);
+    }
+}
+
+void AddressIndex::index_binary(std::span<const char> data, uint64_t offset, uint32_t fileset) {
+    MachOBinary binary {data, offset};
+    for (const auto* segment: binary.read_segments()) {
+        by_vmaddr_[SEGMENT].push_back({segment->vmaddr, segment->vmaddr + segment->vmsize, fileset, segment, nullptr});
+        by_fileoff_[SEGMENT].push_back({segment->fileoff, segment->fileoff + segment->filesize, fileset, segment, nullptr});
+        const auto* sections = reinterpret_cast<const section_64*>(segment + 1);
+        for (size_t i = 0; i < segment->nsects; ++i) {
+            const section_64* section = &sections[i];
+            by_vmaddr_[SECTION].push_back({section->addr, section->addr + section->size, fileset, segment, section});
+            if (!is_zerofill(section)) {
+                by_fileoff_[SECTION].push_back({section->offset, section->offset + section->size, fileset, segment, section});
+            }
+        }
+    }
+}
+
+void AddressIndex::finish(std::vector<Range>& ranges) {
+    std::erase_if(ranges, [](const Range& range) { return range.begin >= range.end; });
+    std::sort(ranges.begin(), ranges.end(), [](const Range& a, const Range& b) {
+        return a.begin < b.begin;
+    });
+
+    // An address covered by more than one range of a level is ambiguous, drop
+    // all of them so that lookups fall back to the enclosing level
+    std::vector<bool> overlapping(ranges.size());
+    size_t furthest = 0;
+    for (size_t i = 1; i < ranges.size(); ++i) {
+        if (ranges[i].begin < ranges[furthest].end) {
+            overlapping[i] = true;
+            overlapping[furthest] = true;
+        }
+        if (ranges[i].end > ranges[furthest].end) {
+            furthest = i;
+        }
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        if (!overlapping[i]) {
+            ranges[kept++] = ranges[i];
+        }
+    }
+    ranges.resize(kept);
+}
+
+const AddressIndex::Range* AddressIndex::find(const Ranges& ranges, uint64_t address) {
+    for (int level = LEVEL_COUNT - 1; level >= 0; --level) {
+        const auto& level_ranges = ranges[level];
+        auto it = std::upper_bound(level_ranges.begin(), level_ranges.end(), address, [](uint64_t address, const Range& range) {
+            return address < range.begin;
+        });
+        if (it != level_ranges.begin() && address < std::prev(it)->end) {
+            return &*std::prev(it);
+        }
+    }
+    return nullptr;
+}
+
+AddressLocation AddressIndex::location(const Range& range) const {
+    return AddressLocation {
+        .fileset = fileset_ids_[range.fileset],
+        .segment = range.segment,
+        .section = range.section,
+        .vmaddr = 0,
+        .fileoff = 0,
+    };
+}
+
+std::optional<AddressLocation> AddressIndex::find_vmaddr(uint64_t vmaddr) const {
+    const Range* range = find(by_vmaddr_, vmaddr);
+    if (range == nullptr) {
+        return std::nullopt;
+    }
+    AddressLocation result = location(*range);
+    result.vmaddr = vmaddr;
+    result.fileoff = range->segment->fileoff + (vmaddr - range->segment->vmaddr);
+    return result;
+}
+
+std::optional<AddressLocation> AddressIndex::find_fileoff(uint64_t fileoff) const {
+    const Range* range = find(by_fileoff_, fileoff);
+    if (range == nullptr) {
+        return std::nullopt;
+    }
+    AddressLocation result = location(*range);
+    result.vmaddr = range->segment->vmaddr + (fileoff - range->segment->fileoff);
+    result.fileoff = fileoff;
+    return result;
+}
@@ -0,0 +1,133 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <bit>
+#include <tuple>
+
+#include "debug.h"
+#include "der.h"
+
+
+using namespace kcmod;
+
+namespace {
+
+// Decodes the identifier and length octets at data. Returns the tag, the size
+// of the header and the size of the contents.
+std::tuple<uint8_t, size_t, uint64_t> read_header(std::span<const char> data) {
+    kcmod_decode_verify(data.size() >= 2);
+    auto tag = static_cast<uint8_t>(data[0]);
+    // High tag numbers do not occur in IMG4
+    kcmod_decode_verify((tag & 0x1f) != 0x1f);
+    auto length = static_cast<uint8_t>(data[1]);
+    if ((length & 0x80) == 0) {
+        return {tag, 2, length};
+    }
+    size_t count = length & 0x7f;
+    // Indefinite lengths are not allowed in DER
+    kcmod_decode_verify(count != 0 && count <= sizeof(uint64_t));
+    kcmod_decode_verify(data.size() >= 2 + count);
+    uint64_t size = 0;
+    for (size_t i = 0; i < count; ++i) {
+        size = (size << 8) | static_cast<uint8_t>(data[2 + i]);
+    }
+    return {tag, 2 + count, size};
+}
+
+}// namespace
+
+
+DerElement DerReader::read() {
+    auto [tag, header_size, size] = read_header(data_.subspan(cursor_));
+    kcmod_decode_verify(size <= data_.size() - cursor_ - header_size);
+    DerElement element{tag, data_.subspan(cursor_ + header_size, size)};
+    cursor_ += header_size + size;
+    return element;
+}
+
+DerElement DerReader::read(DerTag tag) {
+    auto element = read();
+    if (element.tag != tag) {
+        throw DecodeError{"expected DER tag {:#x}, found {:#x}", static_cast<uint8_t>(tag), element.tag};
+    }
+    return element;
+}
+
+uint64_t DerReader::read_integer() {
+    auto content = read(DER_INTEGER).content;
+    kcmod_decode_verify(!content.empty());
+    // Negative integers do not occur in IMG4
+    kcmod_decode_verify((content[0] & 0x80) == 0);
+    if (content.size() > sizeof(uint64_t)) {
+        kcmod_decode_verify(content.size() == sizeof(uint64_t) + 1 && content[0] == 0);
+        content = content.subspan(1);
+    }
+    uint64_t value = 0;
+    for (char c: content) {
+        value = (value << 8) | static_cast<uint8_t>(c);
+    }
+    return value;
+}
+
+std::string DerReader::read_string() {
+    auto content = read(DER_IA5_STRING).content;
+    return {content.begin(), content.end()};
+}
+
+std::vector<char> kcmod::der_header(DerTag tag, uint64_t content_size) {
+    std::vector<char> header{static_cast<char>(tag)};
+    if (content_size < 0x80) {
+        header.push_back(static_cast<char>(content_size));
+        return header;
+    }
+    size_t count = (std::bit_width(content_size) + 7) / 8;
+    header.push_back(static_cast<char>(0x80 | count));
+    for (size_t i = count; i > 0; --i) {
+        header.push_back(static_cast<char>(content_size >> (8 * (i - 1))));
+    }
+    return header;
+}
+
+void kcmod::der_append(std::vector<char> &out, DerTag tag, std::span<const char> content) {
+    auto header = der_header(tag, content.size());
+    out.insert(out.end(), header.begin(), header.end());
+    out.insert(out.end(), content.begin(), content.end());
+}
+
+void kcmod::der_append_integer(std::vector<char> &out, uint64_t value) {
+    // Minimal big endian two's complement, with a leading zero when the top
+    // bit is set
+    std::vector<char> content;
+    for (int shift = 56; shift >= 0; shift -= 8) {
+        auto byte = static_cast<uint8_t>(value >> shift);
+        if (content.empty() && byte == 0 && shift != 0) {
+            continue;
+        }
+        if (content.empty() && (byte & 0x80)) {
+            content.push_back(0);
+        }
+        content.push_back(static_cast<char>(byte));
+    }
+    der_append(out, DER_INTEGER, content);
+}
+
+void kcmod::der_append_string(std::vector<char> &out, std::string_view value) {
+    der_append(out, DER_IA5_STRING, value);
+}
@@ -0,0 +1,325 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <future>
+
+#include <mio/mmap.hpp>
+
+#include "debug.h"
+#include "extract.h"
+#include "fixup_chain.h"
+#include "image.h"
+#include "macho.h"
+#include "thread_pool.h"
+
+
+using namespace kcmod;
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr uint64_t k_segment_alignment = 16384;
+
+uint64_t align(uint64_t value, uint64_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+struct ResolvedPointer {
+    uint64_t fileoff;
+    uint64_t value;
+};
+
+// Plain values of every rebase in the kernelcache, sorted by file offset.
+// Every segment's chains are walked on their own task.
+std::vector<ResolvedPointer> resolve_rebases(std::span<const char> data, ThreadPool &pool) {
+    MachOBinary<const char> kc{data};
+    uint64_t vm_base = kc.vm_base();
+    std::vector<std::future<std::vector<ResolvedPointer>>> futures;
+    for (const auto *starts: read_chained_starts(kc)) {
+        futures.push_back(pool.submit([data, vm_base, starts] {
+            std::vector<ResolvedPointer> pointers;
+            for (uint64_t page_idx = 0; page_idx < starts->page_count; ++page_idx) {
+                if (starts->page_start[page_idx] == DYLD_CHAINED_PTR_START_NONE) {
+                    continue;
+                }
+                SpanReader reader{data, starts->segment_offset + page_idx * starts->page_size +
+                                            starts->page_start[page_idx]};
+                while (true) {
+                    const auto *pointer = reader.peek<DyldFixupPointer>();
+                    if (pointer->bind) {
+                        throw DecodeError{"Bind at {:#x} in kernelcache", reader.cursor()};
+                    }
+                    uint64_t target = pointer->auth ? pointer->ptr_auth_rebase.target : pointer->ptr_rebase.target;
+                    pointers.push_back(ResolvedPointer{reader.cursor(), vm_base + target});
+                    if (pointer->next == 0) {
+                        break;
+                    }
+                    reader.seek(pointer->next * 4);
+                }
+            }
+            return pointers;
+        }));
+    }
+    std::vector<ResolvedPointer> result;
+    for (auto &future: futures) {
+        std::vector<ResolvedPointer> pointers = future.get();
+        result.insert(result.end(), pointers.begin(), pointers.end());
+    }
+    std::ranges::sort(result, {}, &ResolvedPointer::fileoff);
+    return result;
+}
+
+// Linkedit data kept in the standalone file, other linkedit data commands
+// describe the kernelcache and are dropped
+bool keeps_linkedit_data(uint32_t cmd) {
+    switch (cmd) {
+        case LC_FUNCTION_STARTS:
+        case LC_DATA_IN_CODE:
+        case LC_SEGMENT_SPLIT_INFO:
+        case LC_DYLD_EXPORTS_TRIE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Range of the kernelcache copied to an offset of the output
+struct Copy {
+    uint64_t from;
+    uint64_t size;
+    uint64_t to;
+};
+
+// Writes one fileset. The output is sized up front and mapped, every byte is
+// copied once from the kernelcache and pointers and load commands are
+// rewritten in the mapping.
+void extract_fileset(std::span<const char> data, const fileset_entry_command *fileset,
+                     const std::vector<ResolvedPointer> &rebases, const fs::path &output) {
+    MachOBinary<const char> binary{data, fileset->fileoff};
+    const auto *header = reinterpret_cast<const mach_header_64 *>(data.data() + fileset->fileoff);
+
+    // File offsets of the segments in the output, by load command offset
+    std::map<uint64_t, uint64_t> segment_offsets;
+    std::vector<Copy> copies;
+    uint64_t output_size = 0;
+    const segment_command_64 *linkedit = nullptr;
+    for (const auto *segment: binary.read_segments()) {
+        if (std::string{segment->segname} == "__LINKEDIT") {
+            linkedit = segment;
+            continue;
+        }
+        kcmod_decode_verify(segment->fileoff <= data.size() && segment->filesize <= data.size() - segment->fileoff);
+        uint64_t fileoff = segment->filesize == 0 ? 0 : output_size;
+        segment_offsets[reinterpret_cast<const char *>(segment) - data.data()] = fileoff;
+        if (segment->filesize > 0) {
+            copies.push_back(Copy{segment->fileoff, segment->filesize, fileoff});
+            output_size = align(output_size + segment->filesize, k_segment_alignment);
+        }
+    }
+    kcmod_decode_verify(!copies.empty() && copies.front().from == fileset->fileoff);
+
+    // __LINKEDIT holds the symbol table followed by the kept linkedit data
+    uint64_t linkedit_offset = output_size;
+    std::map<uint64_t, uint64_t> linkedit_offsets;
+    auto add_linkedit = [&](uint64_t from, uint64_t size) {
+        kcmod_decode_verify(from <= data.size() && size <= data.size() - from);
+        linkedit_offsets[from] = output_size;
+        copies.push_back(Copy{from, size, output_size});
+        output_size = align(output_size + size, sizeof(uint64_t));
+    };
+    const auto *symtab = binary.read_command<symtab_command>(LC_SYMTAB);
+    if (symtab != nullptr && symtab->nsyms > 0) {
+        add_linkedit(symtab->symoff, symtab->nsyms * sizeof(nlist_64));
+        add_linkedit(symtab->stroff, symtab->strsize);
+    }
+    SpanReader reader{data, fileset->fileoff + sizeof(mach_header_64)};
+    for (uint32_t i = 0; i < header->ncmds; ++i) {
+        const auto *cmd = reader.peek<load_command>();
+        if (keeps_linkedit_data(cmd->cmd)) {
+            const auto *linkedit_data = reader.peek<linkedit_data_command>();
+            add_linkedit(linkedit_data->dataoff, linkedit_data->datasize);
+        }
+        reader.seek(cmd->cmdsize);
+    }
+    uint64_t linkedit_size = output_size - linkedit_offset;
+
+    {
+        std::ofstream file{output, std::ios::binary | std::ios::trunc};
+        if (!file) {
+            throw FatalError{"Failed to create {}", output.string()};
+        }
+    }
+    fs::resize_file(output, output_size);
+    mio::mmap_sink mapping{output.string()};
+    std::span<char> out{mapping.data(), mapping.size()};
+    for (const auto &copy: copies) {
+        memcpy(out.data() + copy.to, data.data() + copy.from, copy.size);
+    }
+
+    // Rebases become the pointers they resolve to
+    for (const auto &copy: copies) {
+        if (copy.to >= linkedit_offset) {
+            break;
+        }
+        auto it = std::ranges::lower_bound(rebases, copy.from, {}, &ResolvedPointer::fileoff);
+        for (; it != rebases.end() && it->fileoff < copy.from + copy.size; ++it) {
+            SpanWriter{out, copy.to + (it->fileoff - copy.from)}.put(it->value);
+        }
+    }
+
+    // Load commands are rewritten in place, dropped ones are removed and the
+    // space they took is zeroed
+    auto *out_header = reinterpret_cast<mach_header_64 *>(out.data());
+    out_header->flags &= ~MH_DYLIB_IN_CACHE;
+    uint64_t read_cursor = sizeof(mach_header_64);
+    uint64_t write_cursor = sizeof(mach_header_64);
+    uint32_t ncmds = 0;
+    for (uint32_t i = 0; i < header->ncmds; ++i) {
+        uint64_t source = fileset->fileoff + read_cursor;
+        uint32_t cmdsize = reinterpret_cast<const load_command *>(data.data() + source)->cmdsize;
+        read_cursor += cmdsize;
+        auto *cmd = reinterpret_cast<load_command *>(out.data() + write_cursor);
+        memcpy(cmd, data.data() + source, cmdsize);
+        switch (cmd->cmd) {
+            case LC_SEGMENT_64: {
+                auto *segment = reinterpret_cast<segment_command_64 *>(cmd);
+                uint64_t fileoff;
+                if (std::string{segment->segname} == "__LINKEDIT") {
+                    fileoff = linkedit_offset;
+                    segment->filesize = linkedit_size;
+                    segment->vmsize = align(linkedit_size, k_segment_alignment);
+                } else {
+                    fileoff = segment_offsets.at(source);
+                }
+                auto *sections = reinterpret_cast<section_64 *>(segment + 1);
+                for (uint32_t j = 0; j < segment->nsects; ++j) {
+                    if (sections[j].offset != 0) {
+                        sections[j].offset = fileoff + (sections[j].offset - segment->fileoff);
+                    }
+                    sections[j].reloff = 0;
+                    sections[j].nreloc = 0;
+                }
+                segment->fileoff = fileoff;
+                break;
+            }
+            case LC_SYMTAB: {
+                auto *out_symtab = reinterpret_cast<symtab_command *>(cmd);
+                if (out_symtab->nsyms > 0) {
+                    out_symtab->symoff = linkedit_offsets.at(out_symtab->symoff);
+                    out_symtab->stroff = linkedit_offsets.at(out_symtab->stroff);
+                } else {
+                    out_symtab->symoff = 0;
+                    out_symtab->stroff = 0;
+                    out_symtab->strsize = 0;
+                }
+                break;
+            }
+            case LC_DYSYMTAB: {
+                // Only the symbol ranges apply, the tables are not copied
+                auto *dysymtab = reinterpret_cast<dysymtab_command *>(cmd);
+                dysymtab->tocoff = dysymtab->ntoc = 0;
+                dysymtab->modtaboff = dysymtab->nmodtab = 0;
+                dysymtab->extrefsymoff = dysymtab->nextrefsyms = 0;
+                dysymtab->indirectsymoff = dysymtab->nindirectsyms = 0;
+                dysymtab->extreloff = dysymtab->nextrel = 0;
+                dysymtab->locreloff = dysymtab->nlocrel = 0;
+                break;
+            }
+            case LC_DYLD_CHAINED_FIXUPS:
+            case LC_CODE_SIGNATURE:
+                continue;
+            default:
+                if (keeps_linkedit_data(cmd->cmd)) {
+                    auto *linkedit_data = reinterpret_cast<linkedit_data_command *>(cmd);
+                    linkedit_data->dataoff = linkedit_offsets.at(linkedit_data->dataoff);
+                }
+                break;
+        }
+        write_cursor += cmdsize;
+        ncmds++;
+    }
+    memset(out.data() + write_cursor, 0, read_cursor - write_cursor);
+    out_header->ncmds = ncmds;
+    out_header->sizeofcmds = write_cursor - sizeof(mach_header_64);
+
+    std::error_code error;
+    mapping.sync(error);
+    if (error) {
+        throw FatalError{"Failed to write {}: {}", output.string(), error.message()};
+    }
+}
+
+}// namespace
+
+
+std::vector<ExtractResult> kcmod::extract_filesets(const fs::path &kernelcache,
+                                                   const std::vector<std::string> &fileset_ids,
+                                                   const fs::path &output_dir, size_t jobs) {
+    // Plain kernelcaches are mapped, encoded ones decoded into memory
+    mio::mmap_source mapping;
+    std::vector<char> decoded;
+    std::span<const char> data;
+    if (is_encoded_kernelcache(kernelcache)) {
+        decoded = read_kernelcache(kernelcache);
+        data = decoded;
+    } else {
+        mapping = mio::mmap_source{kernelcache.string()};
+        data = {mapping.data(), mapping.size()};
+    }
+
+    MachOBinary<const char> kc{data};
+    auto filesets = kc.read_filesets();
+    std::vector<std::string> ids = fileset_ids;
+    if (ids.empty()) {
+        for (const auto &[id, fileset]: filesets) {
+            ids.push_back(id);
+        }
+    }
+    for (const auto &id: ids) {
+        if (!filesets.contains(id)) {
+            throw FatalError{"Fileset {} not present in kernelcache", id};
+        }
+    }
+
+    ThreadPool pool{jobs};
+    std::vector<ResolvedPointer> rebases = resolve_rebases(data, pool);
+    std::vector<ExtractResult> results;
+    std::vector<std::future<void>> futures;
+    for (const auto &id: ids) {
+        results.push_back(ExtractResult{.fileset_id = id, .output = output_dir / id});
+    }
+    for (auto &result: results) {
+        futures.push_back(pool.submit([&, fileset = filesets.at(result.fileset_id)] {
+            extract_fileset(data, fileset, rebases, result.output);
+        }));
+    }
+    for (size_t i = 0; i < futures.size(); ++i) {
+        try {
+            futures[i].get();
+        } catch (...) {
+            results[i].error = std::current_exception();
+        }
+    }
+    return results;
+}
@@ -18,14 +18,31 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <algorithm>
+
 #include <mach-o/fixup-chains.h>
 
 #include "fixup_chain.h"
 #include "log.h"
+#include "profile.h"
 
 
 using namespace kcmod;
 
+namespace {
+
+size_t chain_length(std::span<char> data, uint64_t chain_start) {
+    SpanReader reader{data, chain_start};
+    size_t length = 1;
+    for (auto *pointer = reader.peek<DyldFixupPointer>(); pointer->next != 0; pointer = reader.peek<DyldFixupPointer>()) {
+        reader.seek(pointer->next * 4);
+        length++;
+    }
+    return length;
+}
+
+}// namespace
+
 
 dyld_chained_fixups_header *DyldFixupChainEditor::read_header() {
     const auto *cmd = binary_.read_command<linkedit_data_command>(LC_DYLD_CHAINED_FIXUPS);
@@ -131,9 +148,15 @@ void DyldFixupChainEditor::remove_fixups(uint64_t fileoff, uint64_t size) {
         kcmod_verify(
             fixup_segment->pointer_format == DYLD_CHAINED_PTR_64_KERNEL_CACHE ||
             fixup_segment->pointer_format == DYLD_CHAINED_PTR_ARM64E_KERNEL);
+        if (fixup_segment->page_start[page_idx] == DYLD_CHAINED_PTR_START_NONE) {
+            continue;
+        }
         uint64_t page_start = fixup_segment->segment_offset + page_idx * fixup_segment->page_size + fixup_segment->page_start[page_idx];
         uint64_t page_end = fixup_segment->segment_offset + (page_idx + 1) * fixup_segment->page_size;
         if (page_start >= fileoff && page_end <= end) {
+            if (Profiler::active()) {
+                removed += chain_length(binary_.data(), page_start);
+            }
             fixup_segment->page_start[page_idx] = DYLD_CHAINED_PTR_START_NONE;
             continue;
         }
@@ -142,8 +165,11 @@ void DyldFixupChainEditor::remove_fixups(uint64_t fileoff, uint64_t size) {
         while (true) {
             auto *pointer = reader.peek<DyldFixupPointer>();
             if (reader.cursor() >= fileoff && reader.cursor() < end) {
+                // Removing the last pointer ends the chain at the one before
                 if (prev != nullptr) {
-                    prev->next += pointer->next;
+                    prev->next = pointer->next == 0 ? 0 : prev->next + pointer->next;
+                } else if (pointer->next == 0) {
+                    fixup_segment->page_start[page_idx] = DYLD_CHAINED_PTR_START_NONE;
                 } else {
                     fixup_segment->page_start[page_idx] += pointer->next * 4;
                 }
@@ -158,9 +184,12 @@ void DyldFixupChainEditor::remove_fixups(uint64_t fileoff, uint64_t size) {
         }
     }
     kcmod_log_debug("removed {} fixups", removed);
+    profile_count(ProfileCounter::FIXUPS_REMOVED, removed);
 }
 
 void DyldFixupChainEditor::add_fixup(uint64_t fileoff, DyldFixupPointer pointer) {
+    kcmod_log_trace("add fixup at {:#x}", fileoff);
+    profile_count(ProfileCounter::FIXUPS_ADDED, 1);
     uint64_t page_idx = 0;
     dyld_chained_starts_in_segment *segment = find_fixup_segment(fileoff, &page_idx);
     kcmod_verify(segment != nullptr);
@@ -190,6 +219,68 @@ void DyldFixupChainEditor::add_fixup(uint64_t fileoff, DyldFixupPointer pointer)
     kcmod_not_reachable();
 }
 
+void DyldFixupChainEditor::add_fixups(std::vector<DyldFixupAddition> fixups) {
+    profile_count(ProfileCounter::FIXUPS_ADDED, fixups.size());
+    std::ranges::sort(fixups, {}, &DyldFixupAddition::fileoff);
+    std::vector<dyld_chained_starts_in_segment *> seg_starts = read_starts_in_segment();
+    std::span<char> data = binary_.data();
+    // Chain offsets of one page, with the index of the added fixup or -1 for
+    // an existing one
+    std::vector<std::pair<uint64_t, ptrdiff_t>> chain;
+    size_t first = 0;
+    while (first < fixups.size()) {
+        uint64_t fileoff = fixups[first].fileoff;
+        dyld_chained_starts_in_segment *segment = nullptr;
+        uint64_t page_idx = 0;
+        for (auto *start: seg_starts) {
+            if (fileoff >= start->segment_offset && (fileoff - start->segment_offset) / start->page_size < start->page_count) {
+                segment = start;
+                page_idx = (fileoff - start->segment_offset) / start->page_size;
+                break;
+            }
+        }
+        kcmod_verify(segment != nullptr);
+        uint64_t page_begin = segment->segment_offset + page_idx * segment->page_size;
+        uint64_t page_end = page_begin + segment->page_size;
+
+        chain.clear();
+        size_t last = first;
+        for (; last < fixups.size() && fixups[last].fileoff < page_end; ++last) {
+            kcmod_log_trace("add fixup at {:#x}", fixups[last].fileoff);
+            chain.emplace_back(fixups[last].fileoff, static_cast<ptrdiff_t>(last));
+        }
+        if (segment->page_start[page_idx] != DYLD_CHAINED_PTR_START_NONE) {
+            SpanReader reader{data, page_begin + segment->page_start[page_idx]};
+            while (true) {
+                chain.emplace_back(reader.cursor(), -1);
+                auto *pointer = reader.peek<DyldFixupPointer>();
+                if (pointer->next == 0) {
+                    break;
+                }
+                reader.seek(pointer->next * 4);
+            }
+        }
+        std::ranges::sort(chain);
+
+        for (size_t i = 0; i < chain.size(); ++i) {
+            auto [offset, added] = chain[i];
+            SpanWriter writer{data, offset};
+            auto *pointer = writer.peek<DyldFixupPointer>();
+            if (added >= 0) {
+                *pointer = fixups[added].pointer;
+            }
+            pointer->next = 0;
+            if (i + 1 < chain.size()) {
+                uint64_t stride = chain[i + 1].first - offset;
+                kcmod_verify(stride > 0 && stride % 4 == 0 && stride / 4 < (1 << 11));
+                pointer->next = stride / 4;
+            }
+        }
+        segment->page_start[page_idx] = chain.front().first - page_begin;
+        first = last;
+    }
+}
+
 std::vector<DyldFixupPointer *> DyldFixupChainEditor::read_fixups() {
     std::vector<DyldFixupPointer *> result;
     std::vector<dyld_chained_starts_in_segment *> seg_starts = read_starts_in_segment();
@@ -232,3 +323,31 @@ std::vector<DyldChainedImport> DyldFixupChainEditor::read_chained_imports() {
     }
     return result;
 }
+
+std::vector<const dyld_chained_starts_in_segment *> kcmod::read_chained_starts(MachOBinary<const char> binary) {
+    const auto *cmd = binary.read_command<linkedit_data_command>(LC_DYLD_CHAINED_FIXUPS);
+    kcmod_decode_verify(cmd != nullptr);
+    SpanReader reader{binary.data(), cmd->dataoff};
+    const auto *header = reader.peek<dyld_chained_fixups_header>();
+    reader.seek(header->starts_offset);
+    uint64_t starts_in_image = reader.cursor();
+    const auto *image = reader.peek<dyld_chained_starts_in_image>();
+    reader.peek_data(offsetof(dyld_chained_starts_in_image, seg_info_offset) +
+                     sizeof(image->seg_info_offset[0]) * image->seg_count);
+
+    std::vector<const dyld_chained_starts_in_segment *> result;
+    for (uint32_t i = 0; i < image->seg_count; ++i) {
+        if (image->seg_info_offset[i] == 0) {
+            continue;
+        }
+        SpanReader starts_reader{binary.data(), starts_in_image + image->seg_info_offset[i]};
+        const auto *starts = starts_reader.peek<dyld_chained_starts_in_segment>();
+        kcmod_decode_verify(starts->pointer_format == DYLD_CHAINED_PTR_64_KERNEL_CACHE ||
+                            starts->pointer_format == DYLD_CHAINED_PTR_ARM64E_KERNEL);
+        kcmod_decode_verify(starts->page_size > 0);
+        starts_reader.peek_data(offsetof(dyld_chained_starts_in_segment, page_start) +
+                                sizeof(starts->page_start[0]) * starts->page_count);
+        result.push_back(starts);
+    }
+    return result;
+}
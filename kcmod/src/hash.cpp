@@ -0,0 +1,172 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include "hash.h"
+
+
+using namespace kcmod;
+
+namespace {
+
+constexpr uint64_t k_prime_1 = 0x9E3779B185EBCA87ULL;
+constexpr uint64_t k_prime_2 = 0xC2B2AE3D27D4EB4FULL;
+constexpr uint64_t k_prime_3 = 0x165667B19E3779F9ULL;
+constexpr uint64_t k_prime_4 = 0x85EBCA77C2B2AE63ULL;
+constexpr uint64_t k_prime_5 = 0x27D4EB2F165667C5ULL;
+
+inline uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+inline uint64_t read64(const char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint32_t read32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint64_t round(uint64_t acc, uint64_t input) {
+    acc += input * k_prime_2;
+    acc = rotl(acc, 31);
+    return acc * k_prime_1;
+}
+
+inline uint64_t merge_round(uint64_t acc, uint64_t val) {
+    acc ^= round(0, val);
+    return acc * k_prime_1 + k_prime_4;
+}
+
+}// namespace
+
+
+uint64_t kcmod::xxh64(std::span<const char> data, uint64_t seed) {
+    const char *p = data.data();
+    const char *end = p + data.size();
+    uint64_t h;
+
+    if (data.size() >= 32) {
+        uint64_t v1 = seed + k_prime_1 + k_prime_2;
+        uint64_t v2 = seed + k_prime_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - k_prime_1;
+        const char *limit = end - 32;
+        do {
+            v1 = round(v1, read64(p));
+            v2 = round(v2, read64(p + 8));
+            v3 = round(v3, read64(p + 16));
+            v4 = round(v4, read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = merge_round(h, v1);
+        h = merge_round(h, v2);
+        h = merge_round(h, v3);
+        h = merge_round(h, v4);
+    } else {
+        h = seed + k_prime_5;
+    }
+
+    h += data.size();
+
+    while (p + 8 <= end) {
+        h ^= round(0, read64(p));
+        h = rotl(h, 27) * k_prime_1 + k_prime_4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        h ^= static_cast<uint64_t>(read32(p)) * k_prime_1;
+        h = rotl(h, 23) * k_prime_2 + k_prime_3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= static_cast<uint8_t>(*p) * k_prime_5;
+        h = rotl(h, 11) * k_prime_1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= k_prime_2;
+    h ^= h >> 29;
+    h *= k_prime_3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t kcmod::parallel_xxh64(std::span<const char> data, ThreadPool &pool, size_t chunk_size, uint64_t seed) {
+    size_t chunk_count = (data.size() + chunk_size - 1) / chunk_size;
+    if (chunk_count <= 1) {
+        return xxh64(data, seed);
+    }
+    std::vector<std::future<uint64_t>> futures;
+    for (size_t i = 0; i < chunk_count; ++i) {
+        std::span<const char> chunk = data.subspan(i * chunk_size, std::min(chunk_size, data.size() - i * chunk_size));
+        futures.push_back(pool.submit([chunk, seed] { return xxh64(chunk, seed); }));
+    }
+    std::vector<uint64_t> hashes;
+    for (auto &future: futures) {
+        hashes.push_back(future.get());
+    }
+    hashes.push_back(data.size());
+    return xxh64({reinterpret_cast<const char *>(hashes.data()), hashes.size() * sizeof(uint64_t)}, seed);
+}
+
+uint32_t kcmod::adler32(std::span<const char> data, uint32_t adler) {
+    constexpr uint32_t k_base = 65521;
+    // Largest n such that 255 * n * (n + 1) / 2 + (n + 1) * (k_base - 1) fits in 32 bits
+    constexpr size_t k_block_size = 5552;
+    uint32_t a = adler & 0xffff;
+    uint32_t b = adler >> 16;
+    while (!data.empty()) {
+        size_t size = std::min(data.size(), k_block_size);
+        for (char c: data.first(size)) {
+            a += static_cast<uint8_t>(c);
+            b += a;
+        }
+        a %= k_base;
+        b %= k_base;
+        data = data.subspan(size);
+    }
+    return (b << 16) | a;
+}
+
+uint32_t kcmod::adler32_combine(uint32_t adler1, uint32_t adler2, size_t size2) {
+    constexpr uint32_t k_base = 65521;
+    uint32_t remainder = size2 % k_base;
+    uint32_t a1 = adler1 & 0xffff;
+    uint32_t b1 = adler1 >> 16;
+    uint32_t a = (a1 + (adler2 & 0xffff) + k_base - 1) % k_base;
+    uint32_t b = static_cast<uint32_t>((uint64_t{remainder} * a1 + b1 + (adler2 >> 16) + k_base - remainder) % k_base);
+    return (b << 16) | a;
+}
+
+std::string kcmod::to_hex(uint64_t value) {
+    return fmt::format("{:016x}", value);
+}
@@ -84,6 +84,26 @@ std::vector<KCModHook> KCModHookReader::read_hooks() {
     return result;
 }
 
+std::vector<KCModRedirect> KCModHookReader::read_redirects() {
+    MachOBinary binary{data_, offset_};
+    std::vector<KCModRedirect> result;
+    for (const auto &[name, symbol]: binary.read_symbols()) {
+        if ((symbol->n_type & N_TYPE) != N_SECT) {
+            continue;
+        }
+        if (!name.starts_with(k_redirect_prefix)) {
+            continue;
+        }
+        std::string fn_name = name.substr(strlen(k_redirect_prefix) - 1);
+        kcmod_decode_verify(fn_name.size() > 1);
+        result.emplace_back(KCModRedirect{
+            .fn_name = fn_name,
+            .redirect_fn = process_hook_symbol(*symbol),
+        });
+    }
+    return result;
+}
+
 Symbol KCModHookReader::process_hook_symbol(const nlist_64 &entry) {
     Symbol symbol{entry};
     kcmod_decode_verify(symbol.type == Symbol::SECT);
@@ -0,0 +1,107 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "der.h"
+#include "debug.h"
+#include "im4p.h"
+
+
+using namespace kcmod;
+
+namespace {
+
+// Parses the IM4P elements following the "IM4P" magic
+Im4p parse_im4p_elements(DerReader &reader) {
+    Im4p im4p;
+    im4p.type = reader.read_string();
+    im4p.description = reader.read_string();
+    im4p.payload = reader.read(DER_OCTET_STRING).content;
+    // Optional SEQUENCE { INTEGER algorithm, INTEGER decoded size }. Other
+    // optional elements like PAYP properties are not used.
+    while (!reader.empty()) {
+        auto element = reader.read();
+        if (element.tag != DER_SEQUENCE) {
+            continue;
+        }
+        DerReader info{element.content};
+        im4p.compression = static_cast<Im4pCompression>(info.read_integer());
+        im4p.decoded_size = info.read_integer();
+        if (*im4p.compression != Im4pCompression::LZFSE) {
+            throw DecodeError{"unsupported IM4P compression {}", static_cast<uint64_t>(*im4p.compression)};
+        }
+    }
+    return im4p;
+}
+
+std::string read_magic(std::span<const char> data) {
+    DerReader reader{DerReader{data}.read(DER_SEQUENCE).content};
+    return reader.read_string();
+}
+
+}// namespace
+
+
+bool kcmod::is_im4p(std::span<const char> data) {
+    if (data.empty() || static_cast<uint8_t>(data[0]) != DER_SEQUENCE) {
+        return false;
+    }
+    try {
+        auto magic = read_magic(data);
+        return magic == "IM4P" || magic == "IMG4";
+    } catch (const DecodeError &) {
+        return false;
+    }
+}
+
+Im4p kcmod::parse_im4p(std::span<const char> data) {
+    DerReader reader{DerReader{data}.read(DER_SEQUENCE).content};
+    auto magic = reader.read_string();
+    if (magic == "IMG4") {
+        // SEQUENCE { "IMG4", IM4P, [0] IM4M, [1] IM4R }
+        reader = DerReader{reader.read(DER_SEQUENCE).content};
+        magic = reader.read_string();
+    }
+    if (magic != "IM4P") {
+        throw DecodeError{"expected IM4P, found {}", magic};
+    }
+    return parse_im4p_elements(reader);
+}
+
+void kcmod::write_im4p(std::ostream &out, const Im4p &im4p) {
+    std::vector<char> head;
+    der_append_string(head, "IM4P");
+    der_append_string(head, im4p.type);
+    der_append_string(head, im4p.description);
+    auto payload_header = der_header(DER_OCTET_STRING, im4p.payload.size());
+    head.insert(head.end(), payload_header.begin(), payload_header.end());
+    std::vector<char> tail;
+    if (im4p.compression) {
+        std::vector<char> info;
+        der_append_integer(info, static_cast<uint64_t>(*im4p.compression));
+        der_append_integer(info, im4p.decoded_size.value());
+        der_append(tail, DER_SEQUENCE, info);
+    }
+
+    auto header = der_header(DER_SEQUENCE, head.size() + im4p.payload.size() + tail.size());
+    out.write(header.data(), static_cast<std::streamsize>(header.size()));
+    out.write(head.data(), static_cast<std::streamsize>(head.size()));
+    out.write(im4p.payload.data(), static_cast<std::streamsize>(im4p.payload.size()));
+    out.write(tail.data(), static_cast<std::streamsize>(tail.size()));
+}
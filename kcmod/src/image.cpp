@@ -0,0 +1,262 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <cstring>
+#include <fstream>
+
+#include "debug.h"
+#include "image.h"
+#include "lzfse.h"
+#include "lzss.h"
+#include "macho.h"
+#include "memory.h"
+#include "version.h"
+#include "zip.h"
+
+
+using namespace kcmod;
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Plain kernelcaches are copied in chunks so that waiters can proceed before
+// the whole file is read
+constexpr size_t k_copy_chunk_size = 4 * 1024 * 1024;
+
+// In low memory mode decoded pages further than k_release_lag behind the
+// decoder, which never refers back more than a few hundred KiB, are released
+// every k_release_interval bytes
+constexpr size_t k_release_lag = 4 * 1024 * 1024;
+constexpr size_t k_release_interval = 16 * 1024 * 1024;
+
+// Thrown from the progress callback to stop the decoder when the image is
+// destroyed before decoding finished
+struct DecodeCancelled {};
+
+}// namespace
+
+
+OutputFormat kcmod::parse_output_format(const std::string &name) {
+    if (name == "macho") {
+        return OutputFormat::MACHO;
+    }
+    if (name == "im4p") {
+        return OutputFormat::IM4P;
+    }
+    throw FatalError{"Unknown output format {}", name};
+}
+
+KernelCacheImage::KernelCacheImage(const fs::path &path) {
+    std::span<const char> data;
+    if (auto archive_path = parse_archive_path(path)) {
+        ZipArchive archive{archive_path->archive};
+        archive_entry_ = archive.read(archive.find(archive_path->entry));
+        data = archive_entry_;
+    } else {
+        input_ = mio::mmap_source{path.string()};
+        input_path_ = path;
+        data = {input_.data(), input_.size()};
+    }
+    if (is_im4p(data)) {
+        im4p_ = parse_im4p(data);
+        data = im4p_->payload;
+    }
+    encoded_ = data;
+    if (is_lzss(data)) {
+        encoding_ = KernelCacheEncoding::LZSS;
+        size_ = lzss_decoded_size(data);
+    } else if (is_lzfse(data)) {
+        encoding_ = KernelCacheEncoding::LZFSE;
+        size_ = lzfse_decoded_size(data);
+        if (im4p_ && im4p_->decoded_size) {
+            kcmod_decode_verify(*im4p_->decoded_size == size_);
+        }
+    } else {
+        encoding_ = KernelCacheEncoding::NONE;
+        size_ = data.size();
+    }
+}
+
+KernelCacheImage::~KernelCacheImage() {
+    cancelled_ = true;
+    if (decoder_.joinable()) {
+        decoder_.join();
+    }
+}
+
+KernelCacheContainer KernelCacheImage::container() const {
+    KernelCacheContainer container{.encoding = encoding_};
+    if (im4p_) {
+        container.im4p_type = im4p_->type;
+        container.im4p_description = im4p_->description;
+    }
+    return container;
+}
+
+void KernelCacheImage::start(std::span<char> output) {
+    kcmod_verify(output.size() == size_);
+    kcmod_verify(!decoder_.joinable());
+    output_ = output;
+    decoder_ = std::thread{[this, output] {
+        try {
+            decode(output);
+        } catch (...) {
+            std::lock_guard lock{mutex_};
+            error_ = std::current_exception();
+        }
+        progress_cv_.notify_all();
+    }};
+}
+
+void KernelCacheImage::start(const fs::path &path, bool low_memory) {
+    // Truncating the mapped input would destroy it while it is decoded
+    if (!input_path_.empty() && fs::exists(path) && fs::equivalent(path, input_path_)) {
+        throw FatalError{"Output {} is the input kernelcache", path.string()};
+    }
+    low_memory_ = low_memory;
+    if (low_memory_ && input_.is_mapped()) {
+        advise_sequential(encoded_);
+    }
+    {
+        std::ofstream file{path, std::ios::binary | std::ios::trunc};
+        kcmod_verify(file.good());
+    }
+    fs::resize_file(path, size_);
+    output_file_ = mio::mmap_sink{path.string()};
+    start(std::span<char>{output_file_.data(), output_file_.size()});
+}
+
+void KernelCacheImage::decode(std::span<char> output) {
+    auto progress = [this](size_t decoded) { set_progress(decoded); };
+    switch (encoding_) {
+        case KernelCacheEncoding::NONE:
+            for (size_t offset = 0; offset < size_; offset += k_copy_chunk_size) {
+                size_t size = std::min(k_copy_chunk_size, size_ - offset);
+                memcpy(output.data() + offset, encoded_.data() + offset, size);
+                set_progress(offset + size);
+            }
+            break;
+        case KernelCacheEncoding::LZSS:
+            lzss_decode(encoded_, output, progress);
+            break;
+        case KernelCacheEncoding::LZFSE:
+            lzfse_decode(encoded_, output, progress);
+            break;
+    }
+}
+
+void KernelCacheImage::set_progress(size_t decoded) {
+    if (cancelled_) {
+        throw DecodeCancelled{};
+    }
+    {
+        std::lock_guard lock{mutex_};
+        decoded_ = decoded;
+    }
+    progress_cv_.notify_all();
+
+    size_t release_end = decoded > k_release_lag ? decoded - k_release_lag : 0;
+    if (low_memory_ && release_end >= released_ + k_release_interval) {
+        release_pages(output_.subspan(released_, release_end - released_));
+        if (encoding_ == KernelCacheEncoding::NONE && input_.is_mapped()) {
+            release_pages(encoded_.subspan(released_, release_end - released_));
+        }
+        released_ = release_end;
+    }
+}
+
+void KernelCacheImage::wait(size_t size) {
+    kcmod_verify(decoder_.joinable() && size <= size_);
+    std::unique_lock lock{mutex_};
+    progress_cv_.wait(lock, [&] { return decoded_ >= size || error_; });
+    if (error_) {
+        std::rethrow_exception(error_);
+    }
+}
+
+std::set<std::string> KernelCacheImage::wait_for_fileset_ids() {
+    kcmod_decode_verify(size_ >= sizeof(mach_header_64));
+    wait(sizeof(mach_header_64));
+    const auto *header = reinterpret_cast<const mach_header_64 *>(output_.data());
+    kcmod_decode_verify(header->magic == MH_MAGIC_64 && header->filetype == MH_FILESET);
+    size_t commands_end = sizeof(mach_header_64) + header->sizeofcmds;
+    kcmod_decode_verify(commands_end <= size_);
+    wait(commands_end);
+
+    std::set<std::string> result;
+    std::span<const char> commands{output_.data(), commands_end};
+    for (const auto &[fileset_id, _]: MachOBinary{commands}.read_filesets()) {
+        result.insert(fileset_id);
+    }
+    return result;
+}
+
+bool kcmod::is_encoded_kernelcache(const fs::path &path) {
+    if (parse_archive_path(path)) {
+        return true;
+    }
+    mio::mmap_source input{path.string()};
+    std::span<const char> data{input.data(), input.size()};
+    return is_im4p(data) || is_lzss(data) || is_lzfse(data);
+}
+
+std::vector<char> kcmod::read_kernelcache(const fs::path &path, KernelCacheContainer *container) {
+    KernelCacheImage image{path};
+    if (container) {
+        *container = image.container();
+    }
+    std::vector<char> data(image.size());
+    image.start(data);
+    image.finish();
+    return data;
+}
+
+void kcmod::write_kernelcache(std::ostream &out, std::span<const char> data, OutputFormat format,
+                              const KernelCacheContainer &container, ThreadPool &pool) {
+    if (format == OutputFormat::MACHO) {
+        out.write(data.data(), static_cast<std::streamsize>(data.size()));
+        return;
+    }
+
+    Im4p im4p{
+        .type = container.im4p_type.empty() ? "krnl" : container.im4p_type,
+        .description = container.im4p_type.empty() ? fmt::format("kcmod-{}", k_kcmod_version)
+                                                   : container.im4p_description,
+    };
+    std::vector<char> payload;
+    if (container.encoding == KernelCacheEncoding::LZSS) {
+        payload = lzss_encode(data, pool);
+    } else {
+        payload = lzfse_encode(data, pool);
+        im4p.compression = Im4pCompression::LZFSE;
+        im4p.decoded_size = data.size();
+    }
+    im4p.payload = payload;
+    write_im4p(out, im4p);
+}
+
+void kcmod::write_kernelcache(const fs::path &path, std::span<const char> data, OutputFormat format,
+                              const KernelCacheContainer &container, ThreadPool &pool) {
+    std::ofstream file{path, std::ios::binary | std::ios::trunc};
+    kcmod_verify(file.good());
+    write_kernelcache(file, data, format, container, pool);
+    kcmod_verify(file.good());
+}
@@ -18,25 +18,31 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <cstring>
 #include <fstream>
 #include <filesystem>
 #include <set>
 
-#include <CoreFoundation/CFNumber.h>
+#ifdef __APPLE__
 #include <Kernel/mach/kmod.h>
+#else
+#include <mach/kmod.h>
+#endif
 
 #include <nlohmann/json.hpp>
 
 #include "common.h"
 #include "aarch64.h"
-#include "core_foundation.h"
+#include "address_index.h"
 #include "fixup_chain.h"
 #include "hooks.h"
 #include "kernelcache.h"
 #include "log.h"
 #include "macho.h"
+#include "prelink.h"
 #include "split_seg.h"
 #include "symidx.h"
+#include "thread_pool.h"
 
 
 using namespace kcmod;
@@ -44,80 +50,256 @@ using namespace kcmod;
 namespace fs = std::filesystem;
 using json = nlohmann::json;
 
+namespace {
+
+// Instruction fixups retargeted by one task. Below two chunks, or without a
+// thread pool, they are retargeted on the calling thread.
+constexpr size_t k_instruction_fixup_chunk = 4096;
+
+// ADRP, ADD/LDR immediate or branch instruction at fileoff of the kernelcache
+// to be retargeted to to_addr
+struct InstructionFixup {
+    uint64_t fileoff;
+    uint64_t from_addr;
+    uint64_t to_addr;
+    DyldCacheAdjV2Kind kind;
+};
+
+// Returns raw, an instruction of kind at from_addr, referring to to_addr
+// instead. Throws BadInstruction if raw is no instruction of kind or to_addr
+// is out of its range.
+uint32_t retarget_instruction(uint32_t raw, DyldCacheAdjV2Kind kind, uint64_t from_addr, uint64_t to_addr) {
+    switch (kind) {
+        case DyldCacheAdjV2Kind::Arm64Adrp: {
+            aarch64::Adrp instr{raw};
+            instr.set_imm((to_addr & ~4095ULL) - (from_addr & ~4095ULL));
+            return instr.encode();
+        }
+        case DyldCacheAdjV2Kind::Arm64Br26: {
+            aarch64::Branch instr{raw};
+            instr.set_imm(static_cast<int64_t>(to_addr - from_addr));
+            return instr.encode();
+        }
+        case DyldCacheAdjV2Kind::Arm64Off12: {
+            if (aarch64::is_add_imm_instr(raw)) {
+                aarch64::AddImm instr{raw};
+                instr.set_imm(to_addr & 0xfffULL);
+                return instr.encode();
+            }
+            aarch64::LdrImmediate instr{raw};
+            instr.set_imm(to_addr & 0xfffULL);
+            return instr.encode();
+        }
+        default:
+            kcmod_not_reachable();
+    }
+}
+
+// Writes the retargeted instruction of every fixup to staged without
+// touching data, so that a bad instruction leaves the kernelcache unchanged
+void retarget_instructions(std::span<const char> data, std::span<const InstructionFixup> fixups,
+                           std::span<uint32_t> staged) {
+    for (size_t i = 0; i < fixups.size(); ++i) {
+        const auto& fixup = fixups[i];
+        uint32_t raw;
+        memcpy(&raw, data.data() + fixup.fileoff, sizeof(raw));
+        try {
+            staged[i] = retarget_instruction(raw, fixup.kind, fixup.from_addr, fixup.to_addr);
+        } catch (const aarch64::BadInstruction& e) {
+            throw FatalError{"cannot retarget instruction {:#010x} at {:#x} to {:#x}: {}", raw, fixup.from_addr,
+                             fixup.to_addr, e.what()};
+        }
+    }
+}
+
+}// namespace
+
 
 void KernelCache::replace_fileset(const std::string& fileset, const KernelExtension &kext, const std::optional<fs::path>& symbols) {
+    replace_fileset(fileset, kext, construct_symbol_registry(kext, symbols));
+}
+
+void KernelCache::replace_fileset(const std::string& fileset, const KernelExtension &kext, const SymbolRegistry& registry,
+                                  const KextPlacement& placement) {
+    copy_fileset(fileset, kext, placement);
+    link_fileset(fileset, kext, registry, placement);
+}
+
+void KernelCache::copy_fileset(const std::string& fileset, const KernelExtension &kext,
+                               const KextPlacement& placement) {
     // Verify kext segments
+    std::set<std::string> kext_segment_names = kext_segments(kext);
+    std::set<std::string> donors = donor_filesets(fileset, placement);
+
+    // Remove dyld chained fixups in victim and donor filesets
+    run_step("remove fixups", [&] {
+        DyldFixupChainEditor fixup_editor {MachOBinary<char>{data_}};
+        std::set<std::string> cleared = donors;
+        cleared.insert(fileset);
+        for (const auto& fileset_id: cleared) {
+            for (const auto* segment: read_fs_segments(fileset_id)) {
+                std::string segname {segment->segname};
+                if (segname == "__DATA_CONST" || segname == "__DATA") {
+                    fixup_editor.remove_fixups(segment->fileoff, segment->filesize);
+                }
+            }
+        }
+    });
+
+    // Copy segments from kext to victim fileset
+    run_step("copy segments", [&] {
+        if (kext.read_segment("__TEXT_EXEC")) {
+            replace_segment(fileset, kext, "__TEXT_EXEC", placement);
+        }
+        if (kext.read_segment("__DATA_CONST")) {
+            replace_segment(fileset, kext, "__DATA_CONST", placement);
+        }
+        if (kext.read_segment("__DATA")) {
+            replace_segment(fileset, kext, "__DATA", placement);
+        }
+        if (kext.read_segment("__TEXT")) {
+            replace_text_segment(fileset, kext, placement);
+        } else {
+            throw FatalError("Kext missing __TEXT segment");
+        }
+    });
+
+    // Apply split segment info
+    run_step("split segment fixups", [&] { apply_split_segment_fixups(fileset, kext, kext_segment_names); });
+
+    // Replace victim fileset prelink info with kext prelink info
+    run_step("prelink info", [&] { replace_prelink_info(fileset, kext, donors); });
+}
+
+void KernelCache::link_fileset(const std::string& fileset, const KernelExtension &kext, const SymbolRegistry& registry,
+                               const KextPlacement& placement) {
+    // Replace fileset id
+    run_step("fileset id", [&] { replace_fileset_id(fileset, kext.bundle_id()); });
+
+    // Drop donor filesets, their segments now hold the kext
+    run_step("remove donors", [&] {
+        for (const auto& donor: donor_filesets(fileset, placement)) {
+            remove_fileset_entry(donor);
+        }
+    });
+
+    // setup kmod info
+    run_step("kmod info", [&] { setup_kmod_info(kext); });
+
+    // Link kext
+    run_step("bind symbols", [&] { bind_kext_symbols(kext, registry, kext_segments(kext)); });
+
+    // Setup hooks
+    run_step("bind hooks", [&] { bind_hooks(kext, registry); });
+
+    // Redirect pointers, the index is only built when the kext asks for it
+    if (!kext.redirects().empty()) {
+        run_step("redirect pointers", [&] { redirect_pointers(kext, registry, PointerIndex{data_}); });
+    }
+}
+
+std::set<std::string> KernelCache::kext_segments(const KernelExtension& kext) {
     const std::set<std::string> k_expected_segments = {
         "__TEXT", "__TEXT_EXEC", "__DATA_CONST", "__DATA", "__LINKEDIT"
     };
+    std::set<std::string> kext_segment_names;
     for (const auto& segment: kext.read_segments()) {
         if (k_expected_segments.find(segment->segname) == k_expected_segments.end()) {
             throw FatalError("Unexpected segment: {}", std::string(segment->segname));
         }
+        kext_segment_names.insert(segment->segname);
+    }
+    return kext_segment_names;
+}
+
+std::set<std::string> KernelCache::donor_filesets(const std::string& fileset, const KextPlacement& placement) {
+    std::set<std::string> donors;
+    for (const auto& [segname, target]: placement) {
+        if (target.fileset != fileset) {
+            donors.insert(target.fileset);
+        }
+    }
+    return donors;
+}
+
+void KernelCache::relink_segments(const KernelExtension& previous, const KernelExtension& kext,
+                                  const std::set<std::string>& segments, const SymbolRegistry& registry,
+                                  std::span<const char> pristine) {
+    const std::string& fileset = kext.bundle_id();
+    kcmod_verify(previous.bundle_id() == fileset);
+    kcmod_verify(pristine.size() == data_.size());
+
+    // __TEXT holds the header, load commands and LC_UUID which change with
+    // every build, it is small enough to always copy
+    replace_text_segment(fileset, kext);
+    const auto* previous_uuid = previous.binary().read_uuid();
+    const auto* uuid = kext.binary().read_uuid();
+    if (previous_uuid == nullptr || uuid == nullptr ||
+        memcmp(previous_uuid->uuid, uuid->uuid, sizeof(uuid->uuid)) != 0) {
+        replace_prelink_info(fileset, kext);
     }
 
-    // Remove dyld chained fixups in victim fileset
     {
         DyldFixupChainEditor fixup_editor {MachOBinary<char>{data_}};
         for (const auto* segment: read_fs_segments(fileset)) {
             std::string segname {segment->segname};
+            if (!segments.contains(segname)) {
+                continue;
+            }
             if (segname == "__DATA_CONST" || segname == "__DATA") {
                 fixup_editor.remove_fixups(segment->fileoff, segment->filesize);
             }
+            replace_segment(fileset, kext, segname);
         }
     }
-
-    // Copy segments from kext to victim fileset
-    if (kext.read_segment("__TEXT_EXEC")) {
-        replace_segment(fileset, kext, "__TEXT_EXEC");
-    }
-    if (kext.read_segment("__DATA_CONST")) {
-        replace_segment(fileset, kext, "__DATA_CONST");
-    }
-    if (kext.read_segment("__DATA")) {
-        replace_segment(fileset, kext, "__DATA");
-    }
-    if (kext.read_segment("__TEXT")) {
-        replace_text_segment(fileset, kext);
-    } else {
-        throw FatalError("Kext missing __TEXT segment");
-    }
-
-    // Apply split segment info
-    apply_split_segment_fixups(fileset, kext);
-
-    // Remove victim fileset prelink info
-    remove_prelink_info(fileset);
-
-    // Replace fileset id
-    replace_fileset_id(fileset, kext.bundle_id());
-
-    // Insert kext prelink info
-    insert_kext_prelink_info(kext);
-
-    // setup kmod info
-    {
-        std::map<std::string, const segment_command_64*> fileset_segments;
-        for (const auto* segment: read_fs_segments(kext.bundle_id())) {
-            fileset_segments[segment->segname] = segment;
+    apply_split_segment_fixups(fileset, kext, segments);
+    if (segments.contains("__DATA")) {
+        setup_kmod_info(kext);
+    }
+    bind_kext_symbols(kext, registry, segments);
+
+    if (segments.contains("__TEXT_EXEC")) {
+        // Hooked functions start with a branch into the previous kext, restore
+        // their original instructions before hooking them again
+        AddressIndex kc_index {data_};
+        for (const auto& hook: previous.hooks()) {
+            Symbol fn_symbol = registry.find_bind_symbol(hook.fn_name);
+            auto fn_location = kc_index.find_vmaddr(fn_symbol.vmaddr);
+            kcmod_decode_verify(fn_location.has_value());
+            uint64_t fileoff = fn_location->fileoff;
+            SpanWriter writer {data_, fileoff};
+            writer.write(SpanReader{pristine, fileoff}.read_data(2 * sizeof(uint32_t)));
+        }
+        bind_hooks(kext, registry);
+
+        // Redirected pointers hold addresses in the previous kext. The ones
+        // found in pristine are restored before redirecting them again.
+        if (!previous.redirects().empty() || !kext.redirects().empty()) {
+            PointerIndex pristine_index {pristine};
+            for (const auto& redirect: previous.redirects()) {
+                Symbol fn_symbol = registry.find_bind_symbol(redirect.fn_name);
+                for (uint64_t fileoff: external_pointers(fileset, pristine_index, fn_symbol.vmaddr)) {
+                    SpanWriter writer {data_, fileoff};
+                    writer.write(SpanReader{pristine, fileoff}.read_data(sizeof(DyldFixupPointer)));
+                }
+            }
+            redirect_pointers(kext, registry, pristine_index);
         }
-        SpanReader reader{data_, fileset_segments["__DATA"]->fileoff};
-        auto* info = reader.read<kmod_info>();
-        info->address = fileset_segments["__TEXT"]->vmaddr;
-        info->size = fileset_segments["__TEXT"]->vmsize;
     }
-
-    // Link kext
-    bind_kext_symbols(kext, symbols);
-
-    // Setup hooks
-    bind_hooks(kext, symbols);
 }
 
-void KernelCache::bind_hooks(const KernelExtension &kext, const std::optional<std::filesystem::path>& symbols_json) {
-    KCModHookReader reader {kext.binary_data(), 0};
-    SymbolRegistry registry = construct_symbol_registry(kext, symbols_json);
+void KernelCache::setup_kmod_info(const KernelExtension& kext) {
+    std::map<std::string, const segment_command_64*> fileset_segments;
+    for (const auto* segment: read_fs_segments(kext.bundle_id())) {
+        fileset_segments[segment->segname] = segment;
+    }
+    SpanReader reader{data_, fileset_segments["__DATA"]->fileoff};
+    auto* info = reader.read<kmod_info>();
+    info->address = fileset_segments["__TEXT"]->vmaddr;
+    info->size = fileset_segments["__TEXT"]->vmsize;
+}
 
+void KernelCache::bind_hooks(const KernelExtension &kext, const SymbolRegistry& registry) {
     std::map<std::string, const segment_command_64*> kext_segments;
     for (const auto& segment: kext.read_segments()) {
         kext_segments[segment->segname] = segment;
@@ -131,19 +313,18 @@ void KernelCache::bind_hooks(const KernelExtension &kext, const std::optional<st
     const auto* kext_text_exec = kext_segments["__TEXT_EXEC"];
     const auto* fileset_text_exec = fileset_segments["__TEXT_EXEC"];
 
-    for (const auto& hook: reader.read_hooks()) {
+    AddressIndex kc_index {data_};
+    for (const auto& hook: kext.hooks()) {
         Symbol fn_symbol = registry.find_bind_symbol(hook.fn_name);
-        MachOBinary kc_binary {data_, 0};
-        const auto* fn_segment = kc_binary.find_segment_with_va(fn_symbol.vmaddr);
-        kcmod_decode_verify(fn_segment != nullptr);
-        uint64_t fn_segment_offset = fn_symbol.vmaddr - fn_segment->vmaddr;
+        auto fn_location = kc_index.find_vmaddr(fn_symbol.vmaddr);
+        kcmod_decode_verify(fn_location.has_value());
         uint64_t hook_fn_segment_offset = hook.hook_fn.vmaddr - kext_text_exec->vmaddr;
         uint64_t super_fn_segment_offset = hook.super_fn.vmaddr - kext_text_exec->vmaddr;
         uint64_t hook_fn_kc_vmaddr = fileset_text_exec->vmaddr + hook_fn_segment_offset;
         uint64_t super_fn_kc_vmaddr = fileset_text_exec->vmaddr + super_fn_segment_offset;
 
         int64_t fn_offset = hook_fn_kc_vmaddr - fn_symbol.vmaddr;
-        SpanWriter fn_writer{data_, fn_segment->fileoff + fn_segment_offset};
+        SpanWriter fn_writer{data_, fn_location->fileoff};
         if (aarch64::is_bti_instr(*fn_writer.peek<uint32_t>())) {
             fn_writer.seek(4);
             fn_offset -= 4;
@@ -163,27 +344,66 @@ void KernelCache::bind_hooks(const KernelExtension &kext, const std::optional<st
             kcmod_verify(*super_fn_writer.peek<uint32_t>() == 0xd4200020); // brk instruction
             super_fn_writer.write(instr);
         }
+        kcmod_log_debug("hooked {} at {:#x} with {:#x}", hook.fn_name, fn_symbol.vmaddr, hook_fn_kc_vmaddr);
     }
 }
 
-std::vector<std::string> KernelCache::read_kext_deps(const KernelExtension &kext) {
-    PropertyList plist = kext.read_info_plist();
-    cf::Dictionary dict {static_cast<CFDictionaryRef>(plist.plist())};
-    std::vector<std::string> entries = dict.read_dict("OSBundleLibraries").keys();
-    std::set<std::string> deps;
-    for (const auto& entry: entries) {
-        if (entry.starts_with("com.apple.kpi.")) {
-            deps.insert("com.apple.kernel");
-        } else {
-            deps.insert(entry);
+void KernelCache::redirect_pointers(const KernelExtension& kext, const SymbolRegistry& registry,
+                                    const PointerIndex& index) {
+    const auto* kext_text_exec = kext.read_segment("__TEXT_EXEC");
+    const auto* fileset_text_exec = read_fs_segment(kext.bundle_id(), "__TEXT_EXEC");
+    kcmod_verify(kext_text_exec != nullptr && fileset_text_exec != nullptr);
+    uint64_t vm_base = MachOBinary{data_}.vm_base();
+
+    for (const auto& redirect: kext.redirects()) {
+        Symbol fn_symbol = registry.find_bind_symbol(redirect.fn_name);
+        uint64_t redirect_fn_kc_vmaddr =
+            fileset_text_exec->vmaddr + (redirect.redirect_fn.vmaddr - kext_text_exec->vmaddr);
+        kcmod_verify(redirect_fn_kc_vmaddr >= vm_base);
+        uint64_t target = redirect_fn_kc_vmaddr - vm_base;
+
+        std::vector<uint64_t> fileoffs = external_pointers(kext.bundle_id(), index, fn_symbol.vmaddr);
+        if (fileoffs.empty()) {
+            kcmod_log_warn("no pointers to {} at {:#x} to redirect", redirect.fn_name, fn_symbol.vmaddr);
+        }
+        for (uint64_t fileoff: fileoffs) {
+            // Only the target changes, the chain, key and diversity are kept
+            auto* pointer = SpanReader{data_, fileoff}.peek<DyldFixupPointer>();
+            kcmod_verify(!pointer->bind);
+            if (pointer->auth) {
+                pointer->ptr_auth_rebase.target = target;
+                kcmod_verify(pointer->ptr_auth_rebase.target == target);
+            } else {
+                pointer->ptr_rebase.target = target;
+                kcmod_verify(pointer->ptr_rebase.target == target);
+            }
+        }
+        kcmod_log_debug("redirected {} pointers to {} at {:#x} to {:#x}", fileoffs.size(), redirect.fn_name,
+                        fn_symbol.vmaddr, redirect_fn_kc_vmaddr);
+    }
+}
+
+std::vector<uint64_t> KernelCache::external_pointers(const std::string& fileset, const PointerIndex& index,
+                                                     uint64_t vmaddr) {
+    std::vector<std::pair<uint64_t, uint64_t>> fileset_ranges;
+    for (const auto* segment: read_fs_segments(fileset)) {
+        // __LINKEDIT is shared by all filesets and holds no pointers
+        if (std::string{segment->segname} != "__LINKEDIT") {
+            fileset_ranges.emplace_back(segment->fileoff, segment->fileoff + segment->filesize);
         }
     }
-    return std::vector<std::string>{deps.begin(), deps.end()};
+    std::vector<uint64_t> result = index.find(vmaddr);
+    std::erase_if(result, [&](uint64_t fileoff) {
+        return std::ranges::any_of(fileset_ranges, [&](const auto& range) {
+            return fileoff >= range.first && fileoff < range.second;
+        });
+    });
+    return result;
 }
 
 SymbolRegistry KernelCache::construct_symbol_registry(const KernelExtension& kext, const std::optional<std::filesystem::path>& symbols_json) {
     SymbolRegistry registry;
-    std::vector<std::string> kext_deps = read_kext_deps(kext);
+    const std::vector<std::string>& kext_deps = kext.dependencies();
     for (const auto& fileset_id: kext_deps) {
         const auto* fileset = read_fileset(fileset_id);
         if (!fileset) {
@@ -221,30 +441,24 @@ SymbolRegistry KernelCache::construct_symbol_registry(const KernelExtension& kex
     return registry;
 }
 
-void KernelCache::bind_kext_symbols(const KernelExtension &kext, const std::optional<std::filesystem::path>& symbols_json) {
+void KernelCache::bind_kext_symbols(const KernelExtension &kext, const SymbolRegistry& registry,
+                                    const std::set<std::string>& segments) {
     std::map<std::string, segment_command_64*> fileset_segments;
     for (const auto* segment: read_fs_segments(kext.bundle_id())) {
         fileset_segments[segment->segname] = const_cast<segment_command_64*>(segment);
     }
     uint64_t vm_base = MachOBinary{data_}.vm_base();
-    SymbolRegistry registry = construct_symbol_registry(kext, symbols_json);
     DyldFixupChainEditor kc_dyld_editor{MachOBinary{data_}};
-    DyldFixupChainEditor kext_dyld_reader {MachOBinary{
-        // TODO: cleanup
-        std::span<char>{(char*)kext.binary_data().data(), kext.binary_data().size()}
-    }};
-    MachOBinary kext_binary = kext.binary();
-    std::vector<DyldChainedImport> imports = kext_dyld_reader.read_chained_imports();
-    std::vector<DyldFixupPointer*> fixups = kext_dyld_reader.read_fixups();
-    for (const auto& v: fixups) {
-        if (!v->bind) {
-            // TODO: verify target is in kc??
+    AddressIndex kext_index {kext.binary_data()};
+    for (const auto& bind: kext.binds()) {
+        const DyldFixupPointer* v = &bind.pointer;
+        uint64_t ptr_kext_fileoff = bind.fileoff;
+        auto kext_location = kext_index.find_fileoff(ptr_kext_fileoff);
+        kcmod_decode_verify(kext_location.has_value());
+        const segment_command_64* kext_segment = kext_location->segment;
+        if (!segments.contains(kext_segment->segname)) {
             continue;
         }
-
-        uint64_t ptr_kext_fileoff = kext_binary.fileoff_from_pointer(
-            reinterpret_cast<const char*>(v));
-        const segment_command_64* kext_segment = kext_binary.find_segment_with_fileoff(ptr_kext_fileoff);
         const segment_command_64* fileset_segment = fileset_segments[kext_segment->segname];
         kcmod_verify(ptr_kext_fileoff >= kext_segment->fileoff);
         uint64_t ptr_segment_offset = ptr_kext_fileoff - kext_segment->fileoff;
@@ -253,16 +467,13 @@ void KernelCache::bind_kext_symbols(const KernelExtension &kext, const std::opti
         DyldFixupPointer* kc_ptr = kc_reader.peek<DyldFixupPointer>();
         kcmod_verify(kc_ptr->raw == v->raw);
 
-        uint64_t ordinal = v->auth ? v->ptr_auth_bind.ordinal : v->ptr_bind.ordinal;
         uint64_t addend = v->auth ? 0 : v->ptr_bind.addend;
         kcmod_verify(addend == 0);
-        std::vector<Symbol> symbols;
-        kcmod_decode_verify(ordinal < imports.size());
-        std::string name = imports[ordinal].symbol_name;
-        const auto symbol = registry.find_bind_symbol(name);
+        const auto symbol = registry.find_bind_symbol(bind.symbol_name);
         uint64_t target = symbol.vmaddr;
         kcmod_verify(target >= vm_base);
         uint64_t offset = target - vm_base;
+        kcmod_log_trace("bind {} at {:#x} to {:#x}", bind.symbol_name, kc_reader.cursor(), target);
 
         DyldFixupPointer kc_fixup;
         if (v->auth) {
@@ -288,138 +499,71 @@ void KernelCache::bind_kext_symbols(const KernelExtension &kext, const std::opti
     }
 }
 
-void KernelCache::insert_kext_prelink_info(const KernelExtension &kext) {
+PropertyList KernelCache::kext_prelink_info(const std::string &fileset, const KernelExtension &kext) {
     std::map<std::string, const segment_command_64*> fileset_segments;
-    for (const auto* segment: read_fs_segments(kext.bundle_id())) {
+    for (const auto* segment: read_fs_segments(fileset)) {
         fileset_segments[segment->segname] = segment;
     }
 
-    PropertyList plist = kext.read_info_plist();
-    CFMutableDictionaryRef info_dict = const_cast<CFMutableDictionaryRef>(
-        static_cast<CFDictionaryRef>(plist.plist()));
+    PropertyList info = kext.read_info_plist();
+    PlistNode* info_dict = info.root();
     // OSBundleUUID
     {
         const auto* kext_uuid = kext.binary().read_uuid();
-        CFDataRef cf_kext_uuid = CFDataCreate(kCFAllocatorDefault, kext_uuid->uuid, sizeof(kext_uuid->uuid));
-        CFDictionarySetValue(
-            info_dict,
-            CFSTR("OSBundleUUID"),
-            cf_kext_uuid);
-        CFRelease(cf_kext_uuid);
+        info.set(info_dict, "OSBundleUUID", info.new_data(kext_uuid->uuid));
     }
     // _InfoPlistDigest??
 
     // _PrelinkBundlePath
     {
         std::string kext_name = fs::path{"/System/Library/Extensions"} / kext.path().filename();
-        CFStringRef cf_kext_name = CFStringCreateWithCString(kCFAllocatorDefault, kext_name.c_str(), kCFStringEncodingUTF8);
-        CFDictionarySetValue(
-            info_dict,
-            CFSTR("_PrelinkBundlePath"),
-            cf_kext_name);
-        CFRelease(cf_kext_name);
+        info.set(info_dict, "_PrelinkBundlePath", info.new_string(kext_name));
     }
 
     // _PrelinkExecutableLoadAddr
     // _PrelinkExecutableSourceAddr
     {
-        CFNumberRef cf_load_addr = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt64Type, &fileset_segments["__TEXT"]->vmaddr);
-        CFDictionarySetValue(
-            info_dict,
-            CFSTR("_PrelinkExecutableLoadAddr"),
-            cf_load_addr
-        );
-        CFDictionarySetValue(
-            info_dict,
-            CFSTR("_PrelinkExecutableSourceAddr"),
-            cf_load_addr
-        );
-        CFRelease(cf_load_addr);
+        uint64_t load_addr = fileset_segments["__TEXT"]->vmaddr;
+        info.set(info_dict, "_PrelinkExecutableLoadAddr", info.new_integer(load_addr));
+        info.set(info_dict, "_PrelinkExecutableSourceAddr", info.new_integer(load_addr));
     }
 
     // _PrelinkExecutableRelativePath
     {
         std::string executable_path = relative(kext.binary_path(), kext.path());
-        CFStringRef cf_relative_path = CFStringCreateWithCString(kCFAllocatorDefault, executable_path.c_str(), kCFStringEncodingUTF8);
-        CFDictionarySetValue(
-            info_dict,
-            CFSTR("_PrelinkExecutableRelativePath"),
-            cf_relative_path
-        );
-        CFRelease(cf_relative_path);
+        info.set(info_dict, "_PrelinkExecutableRelativePath", info.new_string(executable_path));
     }
 
     // _PrelinkExecutableSize
     {
-        uint64_t size = fileset_segments["__TEXT"]->filesize;
-        CFNumberRef cf_exec_size = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt64Type, &size);
-        CFDictionarySetValue(
-            info_dict,
-            CFSTR("_PrelinkExecutableSize"),
-            cf_exec_size
-        );
-        CFRelease(cf_exec_size);
+        info.set(info_dict, "_PrelinkExecutableSize", info.new_integer(fileset_segments["__TEXT"]->filesize));
     }
 
     // _PrelinkKmodInfo
     {
-        CFNumberRef cf_addr = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt64Type, &fileset_segments["__DATA"]->vmaddr);
-        CFDictionarySetValue(
-            info_dict,
-            CFSTR("_PrelinkKmodInfo"),
-            cf_addr);
-        CFRelease(cf_addr);
-    }
-    insert_prelink_info(info_dict);
-}
-
-void KernelCache::remove_prelink_info(const std::string &fileset) {
-    PropertyList plist = read_prelink_info();
-    CFMutableDictionaryRef plist_dict = const_cast<CFMutableDictionaryRef>(static_cast<CFDictionaryRef>(plist.plist()));
-    CFArrayRef info_dicts = static_cast<CFArrayRef>(CFDictionaryGetValue(plist_dict, CFSTR("_PrelinkInfoDictionary")));
-    for (size_t i=0; i < CFArrayGetCount(info_dicts); ++i) {
-        CFDictionaryRef current_info_dict = static_cast<CFDictionaryRef>(CFArrayGetValueAtIndex(info_dicts, i));
-        CFStringRef cf_bundle_id = static_cast<CFStringRef>(CFDictionaryGetValue(current_info_dict, CFSTR("CFBundleIdentifier")));
-        kcmod_verify(cf_bundle_id != nullptr);
-        std::string bundle_id{CFStringGetCStringPtr(cf_bundle_id, kCFStringEncodingUTF8)};
-        if (bundle_id == fileset) {
-            CFArrayRemoveValueAtIndex(const_cast<CFMutableArrayRef>(info_dicts), i);
-            write_prelink_info(plist_dict);
-            return;
-        }
-    }
-    throw FatalError{"Fileset {} not found in prelink info", fileset};
-}
-
-void KernelCache::insert_prelink_info(CFDictionaryRef info) {
-    PropertyList plist = read_prelink_info();
-    CFMutableDictionaryRef plist_dict = const_cast<CFMutableDictionaryRef>(static_cast<CFDictionaryRef>(plist.plist()));
-    CFArrayRef info_dicts = static_cast<CFArrayRef>(CFDictionaryGetValue(plist_dict, CFSTR("_PrelinkInfoDictionary")));
-    CFArrayAppendValue(const_cast<CFMutableArrayRef>(info_dicts), info);
-    write_prelink_info(plist_dict);
-}
-
-void KernelCache::write_prelink_info(CFPropertyListRef plist) {
-    const auto* segment = read_prelink_info_segment();
-    SpanReader reader{data_, segment->fileoff};
-    CFDataRef data = CFPropertyListCreateXMLData(kCFAllocatorDefault, plist);
-    kcmod_verify(data != nullptr);
-    kcmod_verify(0 < CFDataGetLength(data) <= segment->filesize);
-    SpanWriter writer{reader.read_data(segment->filesize), 0};
-    writer.put_zero(segment->filesize);
-    writer.write(std::span<const char>{(const char*)CFDataGetBytePtr(data), (size_t)CFDataGetLength(data)});
-    CFRelease(data);
+        info.set(info_dict, "_PrelinkKmodInfo", info.new_integer(fileset_segments["__DATA"]->vmaddr));
+    }
+    return info;
 }
 
-PropertyList KernelCache::read_prelink_info() {
+void KernelCache::replace_prelink_info(const std::string &fileset, const KernelExtension &kext,
+                                       const std::set<std::string>& removed) {
     const auto* segment = read_prelink_info_segment();
     SpanReader reader{data_, segment->fileoff};
-    return PropertyList{reader.read_data(segment->filesize)};
+    PrelinkInfoEditor editor{reader.read_data(segment->filesize)};
+    editor.remove(fileset);
+    for (const auto& fileset_id: removed) {
+        editor.remove(fileset_id);
+    }
+    PropertyList info = kext_prelink_info(fileset, kext);
+    editor.append(info.root());
+    size_t headroom = editor.commit();
+    kcmod_log_debug("__PRELINK_INFO has {} of {} bytes free", headroom, segment->filesize);
 }
 
-void KernelCache::apply_split_segment_fixups(const std::string &fileset, const KernelExtension &kext) {
+void KernelCache::apply_split_segment_fixups(const std::string &fileset, const KernelExtension &kext,
+                                             const std::set<std::string>& from_segments) {
     uint64_t kc_vm_base = MachOBinary{data_, 0}.vm_base();
-    std::vector<DyldCacheAdjV2Entry> entries = parse_split_seg_info(kext.binary_data());
     std::vector<const section_64*> kext_sections;
     std::vector<const section_64*> fileset_sections;
     for (const auto* segment: kext.read_segments()) {
@@ -431,71 +575,80 @@ void KernelCache::apply_split_segment_fixups(const std::string &fileset, const K
         }
     }
     kcmod_verify(kext_sections.size() == fileset_sections.size());
-    for (const auto& entry: entries) {
-        kcmod_decode_verify(entry.from_section_idx >= 1);
-        kcmod_decode_verify(entry.from_section_idx <= kext_sections.size());
-        kcmod_decode_verify(entry.to_section_idx >= 1);
-        kcmod_decode_verify(entry.to_section_idx <= kext_sections.size());
-        const auto* kext_from_section = kext_sections[entry.from_section_idx - 1];
-        const auto* kext_to_section = kext_sections[entry.to_section_idx - 1];
-        const auto* fileset_from_section = fileset_sections[entry.from_section_idx - 1];
-        const auto* fileset_to_section = fileset_sections[entry.to_section_idx - 1];
+
+    // Validate all runs up front. Instruction fixups are retargeted after
+    // the walk, pointer rebases are collected for one commit.
+    std::vector<InstructionFixup> instruction_fixups;
+    std::vector<DyldFixupAddition> rebases;
+    auto add_instruction_fixups = [&](const SplitSegRun& run, const section_64* section, uint64_t to_addr) {
+        for (uint64_t from_offset: run.from_section_offsets) {
+            kcmod_decode_verify(from_offset + sizeof(uint32_t) <= section->size);
+            instruction_fixups.push_back(InstructionFixup{
+                .fileoff = section->offset + from_offset,
+                .from_addr = section->addr + from_offset,
+                .to_addr = to_addr,
+                .kind = run.kind,
+            });
+        }
+    };
+    for (const SplitSegRun& run: kext.split_seg_info()) {
+        kcmod_decode_verify(run.from_section_idx >= 1);
+        kcmod_decode_verify(run.from_section_idx <= kext_sections.size());
+        kcmod_decode_verify(run.to_section_idx >= 1);
+        kcmod_decode_verify(run.to_section_idx <= kext_sections.size());
+        const auto* kext_from_section = kext_sections[run.from_section_idx - 1];
+        const auto* kext_to_section = kext_sections[run.to_section_idx - 1];
+        const auto* fileset_from_section = fileset_sections[run.from_section_idx - 1];
+        const auto* fileset_to_section = fileset_sections[run.to_section_idx - 1];
         std::string from_segment_name {kext_from_section->segname};
         std::string to_segment_name {kext_to_section->segname};
-        switch (entry.kind) {
-            case DyldCacheAdjV2Kind::Arm64Adrp: {
-                SpanReader instr_reader {data_, fileset_from_section->offset};
-                instr_reader.seek(entry.from_section_offset);
-                uint64_t to_addr = (fileset_to_section->addr + entry.to_section_offset) & ~4095ULL;
-                uint64_t from_addr = (fileset_from_section->addr + entry.from_section_offset) & ~4095ULL;
-                auto* instr_raw = instr_reader.read<uint32_t>();
-                aarch64::Adrp instr{*instr_raw};
-                instr.set_imm(to_addr - from_addr);
-                *instr_raw = instr.encode();
+        if (!from_segments.contains(from_segment_name)) {
+            continue;
+        }
+        kcmod_decode_verify(fileset_from_section->offset + fileset_from_section->size <= data_.size());
+        uint64_t to_addr = fileset_to_section->addr + run.to_section_offset;
+        kcmod_log_trace("split segment run kind {} from section {} to {:#x}, {} references",
+                        static_cast<int>(run.kind), run.from_section_idx, to_addr, run.from_section_offsets.size());
+        switch (run.kind) {
+            case DyldCacheAdjV2Kind::Arm64Adrp:
+            case DyldCacheAdjV2Kind::Arm64Off12: {
+                add_instruction_fixups(run, fileset_from_section, to_addr);
                 break;
             }
-            case DyldCacheAdjV2Kind::Arm64Off12: {
-                SpanReader instr_reader {data_, fileset_from_section->offset};
-                instr_reader.seek(entry.from_section_offset);
-                uint64_t to_addr = fileset_to_section->addr + entry.to_section_offset;
-                uint64_t offset = to_addr & 0xfffLL;
-                auto* instr_raw = instr_reader.read<uint32_t>();
-                
-                if (auto instr = aarch64::parse_instr<aarch64::AddImm>(*instr_raw)) {
-                    instr->set_imm(offset);
-                    *instr_raw = instr->encode();
-                    break;
+            case DyldCacheAdjV2Kind::Pointer64:
+            case DyldCacheAdjV2Kind::ThreadedPointer64: {
+                for (uint64_t from_offset: run.from_section_offsets) {
+                    kcmod_decode_verify(from_offset + sizeof(DyldFixupPointer) <= fileset_from_section->size);
+                    uint64_t fileoff = fileset_from_section->offset + from_offset;
+                    auto dyld_ptr = *SpanReader{data_, fileoff}.peek<DyldFixupPointer>();
+                    kcmod_verify(!dyld_ptr.bind);
+                    if (dyld_ptr.auth) {
+                        dyld_ptr.ptr_auth_rebase.target = to_addr - kc_vm_base;
+                    } else {
+                        dyld_ptr.ptr_rebase.target = to_addr - kc_vm_base;
+                    }
+                    rebases.push_back(DyldFixupAddition{fileoff, dyld_ptr});
                 }
-
-                if (auto instr = aarch64::parse_instr<aarch64::LdrImmediate>(*instr_raw)) {
-                    instr->set_imm(offset);
-                    *instr_raw = instr->encode();
+                break;
+            }
+            case DyldCacheAdjV2Kind::Arm64Br26: {
+                if (from_segment_name == to_segment_name) {
+                    // Segments are copied whole, relative branches stay valid
                     break;
                 }
-
-                kcmod_todo();
-            }
-            case DyldCacheAdjV2Kind::Pointer64:
-            case DyldCacheAdjV2Kind::ThreadedPointer64: {
-                SpanReader reader {data_, fileset_from_section->offset};
-                reader.seek(entry.from_section_offset);
-                auto dyld_ptr = *reader.peek<DyldFixupPointer>();
-                kcmod_verify(!dyld_ptr.bind);
-                uint64_t target = fileset_to_section->addr + entry.to_section_offset;
-                if (dyld_ptr.auth) {
-                    dyld_ptr.ptr_auth_rebase.target = target - kc_vm_base;
-                } else {
-                    dyld_ptr.ptr_rebase.target = target - kc_vm_base;
+                // Segments placed apart may be out of branch range
+                for (uint64_t from_offset: run.from_section_offsets) {
+                    int64_t delta = to_addr - (fileset_from_section->addr + from_offset);
+                    if (static_cast<uint64_t>(std::abs(delta)) >= aarch64::Branch::k_max_imm) {
+                        throw FatalError{"branch from {} to {} at {:#x} out of range after placement",
+                                         from_segment_name, to_segment_name, fileset_from_section->addr + from_offset};
+                    }
                 }
-                dyld_ptr.next = 0;
-                DyldFixupChainEditor editor{MachOBinary{data_, 0}};
-                editor.add_fixup(reader.cursor(), dyld_ptr);
+                add_instruction_fixups(run, fileset_from_section, to_addr);
                 break;
             }
-            case DyldCacheAdjV2Kind::Arm64Br26:
             case DyldCacheAdjV2Kind::ArmBr24: {
                 if (from_segment_name == to_segment_name) {
-                    // TODO: optimizations
                     break;
                 }
                 kcmod_todo();
@@ -512,6 +665,40 @@ void KernelCache::apply_split_segment_fixups(const std::string &fileset, const K
                 kcmod_not_reachable();
         }
     }
+
+    // Instructions are retargeted in chunks into a staging buffer and only
+    // written once all of them succeeded
+    std::span<const InstructionFixup> fixups{instruction_fixups};
+    std::vector<uint32_t> staged(fixups.size());
+    if (!thread_pool_ || fixups.size() < 2 * k_instruction_fixup_chunk) {
+        retarget_instructions(data_, fixups, staged);
+    } else {
+        std::vector<std::future<void>> futures;
+        for (size_t begin = 0; begin < fixups.size(); begin += k_instruction_fixup_chunk) {
+            size_t size = std::min(k_instruction_fixup_chunk, fixups.size() - begin);
+            futures.push_back(thread_pool_->submit([this, fixups, &staged, begin, size] {
+                retarget_instructions(data_, fixups.subspan(begin, size), std::span{staged}.subspan(begin, size));
+            }));
+        }
+        // Every task refers to staged, wait for all of them before rethrowing
+        std::exception_ptr error;
+        for (auto& future: futures) {
+            try {
+                future.get();
+            } catch (...) {
+                error = error ? error : std::current_exception();
+            }
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+    for (size_t i = 0; i < fixups.size(); ++i) {
+        memcpy(data_.data() + fixups[i].fileoff, &staged[i], sizeof(uint32_t));
+    }
+
+    DyldFixupChainEditor fixup_editor{MachOBinary{data_, 0}};
+    fixup_editor.add_fixups(std::move(rebases));
 }
 
 void KernelCache::replace_fileset_id(const std::string &from, const std::string &to) {
@@ -526,28 +713,68 @@ void KernelCache::replace_fileset_id(const std::string &from, const std::string
     writer.write_zero(max_id_len - to.size() + 1);
 }
 
+void KernelCache::remove_fileset_entry(const std::string& fileset) {
+    auto* entry = read_fileset(fileset);
+    kcmod_verify(entry != nullptr);
+    SpanReader reader{data_, 0};
+    auto* header = reader.read<mach_header_64>();
+    char* cmds_end = data_.data() + sizeof(mach_header_64) + header->sizeofcmds;
+    char* entry_end = reinterpret_cast<char*>(entry) + entry->cmdsize;
+    kcmod_decode_verify(entry_end <= cmds_end);
+    uint32_t cmdsize = entry->cmdsize;
+    memmove(entry, entry_end, cmds_end - entry_end);
+    memset(cmds_end - cmdsize, 0, cmdsize);
+    header->ncmds -= 1;
+    header->sizeofcmds -= cmdsize;
+}
+
+segment_command_64 KernelCache::destination_segment(const std::string& fileset, const std::string& segment_name,
+                                                    const KextPlacement& placement) {
+    auto it = placement.find(segment_name);
+    if (it == placement.end()) {
+        const auto* segment = read_fs_segment(fileset, segment_name);
+        kcmod_verify(segment != nullptr);
+        return *segment;
+    }
+    const SegmentPlacement& target = it->second;
+    const auto* segment = read_fs_segment(target.fileset, target.segment);
+    kcmod_verify(segment != nullptr);
+    kcmod_verify(target.offset + target.size <= segment->filesize);
+    segment_command_64 result = *segment;
+    result.vmaddr += target.offset;
+    result.fileoff += target.offset;
+    result.vmsize = target.size;
+    result.filesize = target.size;
+    return result;
+}
+
 void KernelCache::replace_segment(const std::string &fileset_id, const KernelExtension &kext,
-                                  const std::string &segment_name) {
-    const auto* victim_segment = read_fs_segment(fileset_id, segment_name);
-    kcmod_verify(victim_segment->filesize <= victim_segment->vmsize);
-    uint64_t available_size = victim_segment->filesize;
+                                  const std::string &segment_name, const KextPlacement& placement) {
+    segment_command_64 victim_segment = destination_segment(fileset_id, segment_name, placement);
+    kcmod_verify(victim_segment.filesize <= victim_segment.vmsize);
+    uint64_t available_size = victim_segment.filesize;
     const auto* replacement_segment = kext.read_segment(segment_name);
     size_t replacement_data_size = kext.binary().read_used_segment_size(segment_name);
     if (replacement_data_size > available_size) {
         throw FatalError{"replacement kext segment {} is too large", segment_name};
     }
-    SpanWriter writer{data_, victim_segment->fileoff};
+    SpanWriter writer{data_, victim_segment.fileoff};
     SpanReader reader{kext.binary_data(), replacement_segment->fileoff};
     writer.write(reader.read_data(replacement_data_size));
     writer.write_zero(available_size - replacement_data_size);
+    profile_count(ProfileCounter::BYTES_COPIED, replacement_data_size);
 }
 
-void KernelCache::replace_text_segment(const std::string &fileset_id, const KernelExtension &kext) {
+void KernelCache::replace_text_segment(const std::string &fileset_id, const KernelExtension &kext,
+                                       const KextPlacement& placement) {
     const auto* fileset = read_fileset(fileset_id);
 
     std::map<std::string, segment_command_64> current_segments;
     for (const auto& segment : read_fs_segments(fileset_id)) {
-        current_segments[segment->segname] = *segment;
+        current_segments[segment->segname] = destination_segment(fileset_id, segment->segname, placement);
+    }
+    for (const auto& [segname, target]: placement) {
+        current_segments[segname] = destination_segment(fileset_id, segname, placement);
     }
 
     const segment_command_64* src_text_cmd = kext.read_segment("__TEXT");
@@ -595,6 +822,7 @@ void KernelCache::replace_text_segment(const std::string &fileset_id, const Kern
         size_t wrote_bytes = writer.cursor() - dst_text_cmd->fileoff;
         kcmod_verify(wrote_bytes < dst_text_cmd->filesize);
         writer.write_zero(dst_text_cmd->filesize - wrote_bytes);
+        profile_count(ProfileCounter::BYTES_COPIED, wrote_bytes);
     }
 
     // Fixup header
@@ -654,6 +882,7 @@ void KernelCache::replace_text_segment(const std::string &fileset_id, const Kern
         SpanWriter writer{text_section, section->offset - src_text_cmd->fileoff};
         SpanReader reader{kext.binary_data(), section->offset};
         writer.write(reader.read_data(section->size));
+        profile_count(ProfileCounter::BYTES_COPIED, section->size);
     }
 }
 
@@ -18,33 +18,107 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <fstream>
+#include <set>
 #include <span>
 
+#include "hash.h"
 #include "kext.h"
+#include "kextobj.h"
 #include "plist.h"
 
 using namespace kcmod;
 
 namespace fs = std::filesystem;
 
-KernelExtension::KernelExtension(const std::filesystem::path &path): path_{path} {
+namespace {
+
+std::pair<fs::path, fs::path> resolve_kext_paths(const fs::path &path) {
     bool is_macos_kext = path.extension() == ".kext";
     std::string kext_name = path.stem().string();
-    binary_path_ = is_macos_kext ? path / "Contents" / "MacOS" / kext_name : path / kext_name;
-    info_path_ = is_macos_kext ? path / "Contents" / "Info.plist" : path / "Info.plist";
-    if (!fs::exists(binary_path_)) {
-        throw DecodeError{"Mach-O binary not found at path {}", binary_path_.string()};
+    fs::path binary_path = is_macos_kext ? path / "Contents" / "MacOS" / kext_name : path / kext_name;
+    fs::path info_path = is_macos_kext ? path / "Contents" / "Info.plist" : path / "Info.plist";
+    if (!fs::exists(binary_path)) {
+        throw DecodeError{"Mach-O binary not found at path {}", binary_path.string()};
+    }
+    if (!fs::exists(info_path)) {
+        throw DecodeError{"Info.plist not found at path {}", info_path.string()};
     }
-    if (!fs::exists(info_path_)) {
-        throw DecodeError{"Info.plist not found at path {}", info_path_.string()};
+    return {binary_path, info_path};
+}
+
+}// namespace
+
+KernelExtension::KernelExtension(const std::filesystem::path &path): path_{path} {
+    if (path.extension() == k_kext_object_extension) {
+        load_object(path);
+    } else {
+        std::tie(binary_path_, info_path_) = resolve_kext_paths(path);
+        parse_kext();
     }
+}
+
+std::string KernelExtension::content_key(const std::filesystem::path &path) {
+    auto [binary_path, info_path] = resolve_kext_paths(path);
+    mio::mmap_source binary{binary_path.string()};
+    mio::mmap_source info{info_path.string()};
+    return to_hex(xxh64(std::span{binary.data(), binary.size()})) +
+           to_hex(xxh64(std::span{info.data(), info.size()}));
+}
+
+std::string KernelExtension::bundle_key(const std::filesystem::path &path) {
+    auto [binary_path, info_path] = resolve_kext_paths(path);
+    return fmt::format("{}:{}", path.filename().string(), fs::relative(binary_path, path).string());
+}
+
+void KernelExtension::parse_kext() {
     binary_mmap_ = mio::mmap_source{binary_path_.string()};
     binary_data_ = std::span{binary_mmap_.data(), binary_mmap_.size()};
-    PropertyList plist{info_path_};
-    CFStringRef bundle_id = static_cast<CFStringRef>(CFDictionaryGetValue(static_cast<CFDictionaryRef>(plist.plist()), CFSTR("CFBundleIdentifier")));
-    bundle_id_ = CFStringGetCStringPtr(bundle_id, kCFStringEncodingUTF8);
+    {
+        std::ifstream info_file{info_path_, std::ios::binary};
+        info_plist_data_.assign(std::istreambuf_iterator<char>{info_file}, std::istreambuf_iterator<char>{});
+    }
+
+    PropertyList plist = read_info_plist();
+    const PlistNode *bundle_id = plist.root()->find("CFBundleIdentifier");
+    if (!bundle_id) {
+        throw DecodeError{"CFBundleIdentifier not found in {}", info_path_.string()};
+    }
+    bundle_id_ = bundle_id->string();
+    if (const PlistNode *libraries = plist.root()->find("OSBundleLibraries")) {
+        std::set<std::string> deps;
+        for (const PlistNode *entry: libraries->children()) {
+            if (entry->key.starts_with("com.apple.kpi.")) {
+                deps.insert("com.apple.kernel");
+            } else {
+                deps.insert(std::string{entry->key});
+            }
+        }
+        dependencies_ = std::vector<std::string>{deps.begin(), deps.end()};
+    }
+
+    split_seg_info_ = SplitSegInfo::read(binary_data_);
+    hooks_ = KCModHookReader{binary_data_, 0}.read_hooks();
+    redirects_ = KCModHookReader{binary_data_, 0}.read_redirects();
+
+    DyldFixupChainEditor dyld_reader{MachOBinary{
+        // TODO: cleanup
+        std::span<char>{const_cast<char *>(binary_data_.data()), binary_data_.size()}}};
+    std::vector<DyldChainedImport> imports = dyld_reader.read_chained_imports();
+    for (const auto *pointer: dyld_reader.read_fixups()) {
+        if (!pointer->bind) {
+            continue;
+        }
+        uint64_t ordinal = pointer->auth ? pointer->ptr_auth_bind.ordinal : pointer->ptr_bind.ordinal;
+        kcmod_decode_verify(ordinal < imports.size());
+        binds_.push_back(KextBind{
+            .fileoff = static_cast<uint64_t>(reinterpret_cast<const char *>(pointer) - binary_data_.data()),
+            .pointer = *pointer,
+            .symbol_name = imports[ordinal].symbol_name,
+        });
+    }
 }
 
 PropertyList KernelExtension::read_info_plist() const {
-    return PropertyList{info_path_};
+    return PropertyList{std::span<const char>{info_plist_data_}};
 }
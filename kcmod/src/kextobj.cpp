@@ -0,0 +1,216 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <fstream>
+
+#include "debug.h"
+#include "hash.h"
+#include "kextobj.h"
+#include "temp.h"
+
+
+using namespace kcmod;
+
+namespace fs = std::filesystem;
+
+namespace {
+
+class KextObjectBuilder {
+public:
+    uint32_t add_string(const std::string &value) {
+        uint32_t offset = strings_.size();
+        strings_.insert(strings_.end(), value.begin(), value.end());
+        strings_.push_back('\0');
+        return offset;
+    }
+
+    KextObjectRange add_section(std::span<const char> data) {
+        align(16);
+        KextObjectRange range{.offset = buffer_.size(), .size = data.size()};
+        buffer_.insert(buffer_.end(), data.begin(), data.end());
+        return range;
+    }
+
+    template <class T>
+    KextObjectRange add_array(std::span<const T> values) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        return add_section({reinterpret_cast<const char *>(values.data()), values.size_bytes()});
+    }
+
+    std::vector<char> finish(KextObjectHeader header) {
+        header.strings = add_section(strings_);
+        memcpy(buffer_.data(), &header, sizeof(header));
+        return std::move(buffer_);
+    }
+
+private:
+    void align(size_t alignment) {
+        buffer_.resize((buffer_.size() + alignment - 1) / alignment * alignment);
+    }
+
+private:
+    std::vector<char> buffer_ = std::vector<char>(sizeof(KextObjectHeader));
+    std::vector<char> strings_;
+};
+
+template <class T>
+std::span<const T> read_array(std::span<const char> data, const KextObjectRange &range) {
+    kcmod_decode_verify(range.size % sizeof(T) == 0);
+    SpanReader reader{data, range.offset};
+    auto bytes = reader.read_data(range.size);
+    kcmod_decode_verify(reinterpret_cast<uintptr_t>(bytes.data()) % alignof(T) == 0);
+    return {reinterpret_cast<const T *>(bytes.data()), range.size / sizeof(T)};
+}
+
+}// namespace
+
+
+void kcmod::write_kext_object(const KernelExtension &kext, const fs::path &output) {
+    KextObjectBuilder builder;
+    KextObjectHeader header{};
+    memcpy(header.magic, k_kext_object_magic, sizeof(header.magic));
+    header.version = k_kext_object_version;
+    header.bundle_id = builder.add_string(kext.bundle_id());
+    header.path = builder.add_string(kext.path().string());
+    header.binary_path = builder.add_string(kext.binary_path().string());
+    header.info_path = builder.add_string(kext.info_path().string());
+
+    // LC_SYMTAB and the other linkedit commands point into __LINKEDIT
+    header.binary = builder.add_section(kext.binary_data());
+
+    header.info_plist = builder.add_section(kext.info_plist_data());
+
+    std::vector<uint32_t> dependencies;
+    for (const auto &dependency: kext.dependencies()) {
+        dependencies.push_back(builder.add_string(dependency));
+    }
+    header.dependencies = builder.add_array(std::span<const uint32_t>{dependencies});
+
+    header.split_seg_info = builder.add_section(kext.split_seg_info().encoded());
+
+    std::vector<KextObjectBind> binds;
+    for (const auto &bind: kext.binds()) {
+        binds.push_back(KextObjectBind{
+            .fileoff = bind.fileoff,
+            .pointer = bind.pointer,
+            .symbol_name = builder.add_string(bind.symbol_name),
+        });
+    }
+    header.binds = builder.add_array(std::span<const KextObjectBind>{binds});
+
+    std::vector<KextObjectHook> hooks;
+    for (const auto &hook: kext.hooks()) {
+        hooks.push_back(KextObjectHook{
+            .fn_name = builder.add_string(hook.fn_name),
+            .super_fn = hook.super_fn,
+            .hook_fn = hook.hook_fn,
+        });
+    }
+    header.hooks = builder.add_array(std::span<const KextObjectHook>{hooks});
+
+    std::vector<KextObjectRedirect> redirects;
+    for (const auto &redirect: kext.redirects()) {
+        redirects.push_back(KextObjectRedirect{
+            .fn_name = builder.add_string(redirect.fn_name),
+            .redirect_fn = redirect.redirect_fn,
+        });
+    }
+    header.redirects = builder.add_array(std::span<const KextObjectRedirect>{redirects});
+
+    std::vector<char> object = builder.finish(header);
+
+    // Write to a temporary file next to output and rename so that concurrent
+    // runs sharing a cache directory never observe a partial object
+    TemporaryFile temp{output.parent_path(), fmt::format(".{}.", output.filename().string())};
+    {
+        std::ofstream file{temp.path(), std::ios::binary | std::ios::trunc};
+        file.write(object.data(), object.size());
+        kcmod_verify(file.good());
+    }
+    fs::rename(temp.path(), output);
+}
+
+fs::path kcmod::kext_object_cache_path(const fs::path &cache_dir, const fs::path &kext_path) {
+    // Objects store the bundle paths, a copy of the kext in a bundle of
+    // another name gets its own object. Objects of other versions left in the
+    // cache are not picked up.
+    return cache_dir / fmt::format("{}{}.v{}{}", KernelExtension::content_key(kext_path),
+                                   to_hex(xxh64(KernelExtension::bundle_key(kext_path))), k_kext_object_version,
+                                   k_kext_object_extension);
+}
+
+void KernelExtension::load_object(const fs::path &path) {
+    binary_mmap_ = mio::mmap_source{path.string()};
+    std::span<const char> data{binary_mmap_.data(), binary_mmap_.size()};
+
+    SpanReader reader{data, 0};
+    const auto *header = reader.read<KextObjectHeader>();
+    if (memcmp(header->magic, k_kext_object_magic, sizeof(header->magic)) != 0) {
+        throw DecodeError{"{} is not a kext object", path.string()};
+    }
+    if (header->version != k_kext_object_version) {
+        throw DecodeError{"Unsupported kext object version {} in {}", header->version, path.string()};
+    }
+
+    std::span<const char> strings = read_array<char>(data, header->strings);
+    auto read_string = [&](uint32_t offset) {
+        return SpanReader{strings, offset}.read_string();
+    };
+
+    bundle_id_ = read_string(header->bundle_id);
+    path_ = read_string(header->path);
+    binary_path_ = read_string(header->binary_path);
+    info_path_ = read_string(header->info_path);
+    binary_data_ = read_array<char>(data, header->binary);
+    // Validate the stored Mach-O header, later accesses go through binary()
+    [[maybe_unused]] MachOBinary binary{binary_data_, 0};
+
+    std::span<const char> info_plist = read_array<char>(data, header->info_plist);
+    info_plist_data_.assign(info_plist.begin(), info_plist.end());
+
+    for (uint32_t dependency: read_array<uint32_t>(data, header->dependencies)) {
+        dependencies_.push_back(read_string(dependency));
+    }
+
+    split_seg_info_ = SplitSegInfo{read_array<char>(data, header->split_seg_info)};
+
+    for (const auto &bind: read_array<KextObjectBind>(data, header->binds)) {
+        binds_.push_back(KextBind{
+            .fileoff = bind.fileoff,
+            .pointer = bind.pointer,
+            .symbol_name = read_string(bind.symbol_name),
+        });
+    }
+
+    for (const auto &hook: read_array<KextObjectHook>(data, header->hooks)) {
+        hooks_.push_back(KCModHook{
+            .fn_name = read_string(hook.fn_name),
+            .super_fn = hook.super_fn,
+            .hook_fn = hook.hook_fn,
+        });
+    }
+
+    for (const auto &redirect: read_array<KextObjectRedirect>(data, header->redirects)) {
+        redirects_.push_back(KCModRedirect{
+            .fn_name = read_string(redirect.fn_name),
+            .redirect_fn = redirect.redirect_fn,
+        });
+    }
+}
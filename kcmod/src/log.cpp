@@ -0,0 +1,212 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "log.h"
+
+
+using namespace kcmod;
+
+namespace {
+
+constexpr size_t k_buffer_size = 64 * 1024;
+constexpr auto k_flush_interval = std::chrono::milliseconds{20};
+
+std::string_view level_prefix(LogLevel level) {
+    switch (level) {
+        case LogLevel::TRACE:
+            return "[TRACE] ";
+        case LogLevel::DEBUG:
+            return "[DEBUG] ";
+        case LogLevel::INFO:
+            return "[INFO] ";
+        case LogLevel::WARN:
+            return "[WARN] ";
+    }
+    return "";
+}
+
+// Ring of message lines with a single producer, the thread owning it, and a
+// single consumer, whichever thread holds the drain lock of the LogWriter.
+// Positions only grow, the index into the ring is the position modulo its size.
+class LogBuffer {
+public:
+    static_assert((k_buffer_size & (k_buffer_size - 1)) == 0);
+
+    // Queues prefix and message as one line, false if there is not enough room
+    bool push(std::string_view prefix, std::string_view message) {
+        size_t size = prefix.size() + message.size() + 1;
+        size_t head = head_.load(std::memory_order_relaxed);
+        size_t tail = tail_.load(std::memory_order_acquire);
+        if (k_buffer_size - (head - tail) < size) {
+            return false;
+        }
+        copy_in(head, prefix);
+        copy_in(head + prefix.size(), message);
+        copy_in(head + size - 1, "\n");
+        head_.store(head + size, std::memory_order_release);
+        return true;
+    }
+
+    // Appends all queued lines to out
+    void drain(std::string &out) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        size_t head = head_.load(std::memory_order_acquire);
+        while (tail < head) {
+            size_t index = tail & (k_buffer_size - 1);
+            size_t size = std::min(head - tail, k_buffer_size - index);
+            out.append(data_.get() + index, size);
+            tail += size;
+        }
+        tail_.store(tail, std::memory_order_release);
+    }
+
+    bool empty() const {
+        return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+    }
+
+    // Set when the owning thread exits, the buffer is dropped once drained
+    std::atomic<bool> closed{false};
+
+private:
+    void copy_in(size_t position, std::string_view text) {
+        size_t index = position & (k_buffer_size - 1);
+        size_t first = std::min(text.size(), k_buffer_size - index);
+        memcpy(data_.get() + index, text.data(), first);
+        memcpy(data_.get(), text.data() + first, text.size() - first);
+    }
+
+    std::unique_ptr<char[]> data_ = std::make_unique<char[]>(k_buffer_size);
+    std::atomic<size_t> head_{0};
+    std::atomic<size_t> tail_{0};
+};
+
+// Writes the buffers of all threads to stderr every k_flush_interval, when a
+// buffer runs full and at exit
+class LogWriter {
+public:
+    static LogWriter &instance() {
+        static LogWriter writer;
+        return writer;
+    }
+
+    ~LogWriter() {
+        {
+            std::lock_guard lock{mutex_};
+            stopping_ = true;
+        }
+        cv_.notify_one();
+        thread_.join();
+        drain();
+    }
+
+    std::shared_ptr<LogBuffer> add_buffer() {
+        auto buffer = std::make_shared<LogBuffer>();
+        std::lock_guard lock{mutex_};
+        buffers_.push_back(buffer);
+        return buffer;
+    }
+
+    void wake() {
+        cv_.notify_one();
+    }
+
+    // Writes every queued line on the calling thread
+    void drain() {
+        std::lock_guard drain_lock{drain_mutex_};
+        std::vector<std::shared_ptr<LogBuffer>> buffers;
+        {
+            std::lock_guard lock{mutex_};
+            // A closed buffer is never pushed to again, once drained it can go
+            std::erase_if(buffers_, [](const auto &buffer) { return buffer->closed && buffer->empty(); });
+            buffers = buffers_;
+        }
+        output_.clear();
+        for (const auto &buffer: buffers) {
+            buffer->drain(output_);
+        }
+        if (!output_.empty()) {
+            fwrite(output_.data(), 1, output_.size(), stderr);
+            fflush(stderr);
+        }
+    }
+
+private:
+    LogWriter() : thread_{[this] { run(); }} {}
+
+    void run() {
+        std::unique_lock lock{mutex_};
+        while (!stopping_) {
+            cv_.wait_for(lock, k_flush_interval);
+            lock.unlock();
+            drain();
+            lock.lock();
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stopping_ = false;
+    std::vector<std::shared_ptr<LogBuffer>> buffers_;
+    std::mutex drain_mutex_;
+    std::string output_;
+    // Declared last so it starts after the state it uses is initialized
+    std::thread thread_;
+};
+
+struct ThreadBuffer {
+    std::shared_ptr<LogBuffer> buffer = LogWriter::instance().add_buffer();
+
+    ~ThreadBuffer() {
+        buffer->closed = true;
+    }
+};
+
+}// namespace
+
+
+std::atomic<LogLevel> Logger::level_{LogLevel::INFO};
+
+void Logger::write(LogLevel level, std::string_view message) {
+    std::string_view prefix = level_prefix(level);
+    if (prefix.size() + message.size() + 1 > k_buffer_size) {
+        // Written directly after the queued lines of this thread
+        flush();
+        fmt::print(stderr, "{}{}\n", prefix, message);
+        return;
+    }
+    thread_local ThreadBuffer thread_buffer;
+    while (!thread_buffer.buffer->push(prefix, message)) {
+        LogWriter::instance().wake();
+        std::this_thread::yield();
+    }
+}
+
+void Logger::flush() {
+    LogWriter::instance().drain();
+}
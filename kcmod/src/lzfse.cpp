@@ -0,0 +1,940 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Decoder for the LZFSE format as written by Apple's reference encoder
+// (https://github.com/lzfse/lzfse)
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstring>
+#include <vector>
+
+#include "debug.h"
+#include "lzfse.h"
+#include "match_finder.h"
+
+
+using namespace kcmod;
+
+namespace {
+
+constexpr size_t k_l_symbols = 20;
+constexpr size_t k_m_symbols = 20;
+constexpr size_t k_d_symbols = 64;
+constexpr size_t k_literal_symbols = 256;
+
+constexpr uint32_t k_l_states = 64;
+constexpr uint32_t k_m_states = 64;
+constexpr uint32_t k_d_states = 256;
+constexpr uint32_t k_literal_states = 1024;
+
+constexpr size_t k_max_literals = 4 * 10000 + 64;
+
+// Limits of the encoder, a block holds at most k_literals_per_block literals
+// and k_matches_per_block matches
+constexpr size_t k_literals_per_block = 4 * 10000;
+constexpr size_t k_matches_per_block = 10000;
+constexpr uint32_t k_max_l_value = 315;
+constexpr uint32_t k_max_m_value = 2359;
+constexpr uint32_t k_max_d_value = 262139;
+constexpr size_t k_min_match = 4;
+
+constexpr std::array<uint8_t, k_l_symbols> k_l_extra_bits = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 3, 5, 8};
+constexpr std::array<uint8_t, k_m_symbols> k_m_extra_bits = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 3, 5, 8, 11};
+constexpr std::array<uint8_t, k_d_symbols> k_d_extra_bits = {
+    0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+    4, 4, 4, 4, 5, 5, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7,
+    8, 8, 8, 8, 9, 9, 9, 9, 10, 10, 10, 10, 11, 11, 11, 11,
+    12, 12, 12, 12, 13, 13, 13, 13, 14, 14, 14, 14, 15, 15, 15, 15};
+
+// Symbols cover consecutive value ranges, each starting where the previous
+// symbol's extra bits end
+template <size_t N>
+constexpr std::array<uint32_t, N> base_values(const std::array<uint8_t, N> &extra_bits) {
+    std::array<uint32_t, N> base{};
+    for (size_t i = 1; i < N; ++i) {
+        base[i] = base[i - 1] + (1u << extra_bits[i - 1]);
+    }
+    return base;
+}
+
+constexpr auto k_l_base_values = base_values(k_l_extra_bits);
+constexpr auto k_m_base_values = base_values(k_m_extra_bits);
+constexpr auto k_d_base_values = base_values(k_d_extra_bits);
+
+static_assert(k_d_base_values.back() == 229372);
+
+struct BlockHeader {
+    uint32_t n_raw_bytes;
+    uint32_t n_literals;
+    uint32_t n_matches;
+    uint32_t n_literal_payload_bytes;
+    uint32_t n_lmd_payload_bytes;
+    int32_t literal_bits;
+    std::array<uint16_t, 4> literal_state;
+    int32_t lmd_bits;
+    uint16_t l_state;
+    uint16_t m_state;
+    uint16_t d_state;
+    std::array<uint16_t, k_l_symbols> l_freq;
+    std::array<uint16_t, k_m_symbols> m_freq;
+    std::array<uint16_t, k_d_symbols> d_freq;
+    std::array<uint16_t, k_literal_symbols> literal_freq;
+};
+
+constexpr size_t k_v1_header_size = 772;
+constexpr size_t k_v2_fixed_header_size = 32;
+
+template <class T>
+T load(const char *p) {
+    T value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+uint32_t get_field(uint64_t value, int offset, int bits) {
+    return static_cast<uint32_t>((value >> offset) & ((uint64_t{1} << bits) - 1));
+}
+
+// Reads the header of the FSE compressed block at data. Returns the header
+// and the size of the encoded header.
+std::pair<BlockHeader, size_t> read_v1_header(std::span<const char> data) {
+    kcmod_decode_verify(data.size() >= k_v1_header_size);
+    const char *p = data.data();
+    BlockHeader header{};
+    header.n_raw_bytes = load<uint32_t>(p + 4);
+    header.n_literals = load<uint32_t>(p + 12);
+    header.n_matches = load<uint32_t>(p + 16);
+    header.n_literal_payload_bytes = load<uint32_t>(p + 20);
+    header.n_lmd_payload_bytes = load<uint32_t>(p + 24);
+    header.literal_bits = load<int32_t>(p + 28);
+    for (size_t i = 0; i < 4; ++i) {
+        header.literal_state[i] = load<uint16_t>(p + 32 + 2 * i);
+    }
+    header.lmd_bits = load<int32_t>(p + 40);
+    header.l_state = load<uint16_t>(p + 44);
+    header.m_state = load<uint16_t>(p + 46);
+    header.d_state = load<uint16_t>(p + 48);
+    memcpy(header.l_freq.data(), p + 50, sizeof(header.l_freq));
+    memcpy(header.m_freq.data(), p + 90, sizeof(header.m_freq));
+    memcpy(header.d_freq.data(), p + 130, sizeof(header.d_freq));
+    memcpy(header.literal_freq.data(), p + 258, sizeof(header.literal_freq));
+    return {header, k_v1_header_size};
+}
+
+// Decodes one entry of the variable length frequency table of v2 headers.
+// Returns the frequency and the number of bits consumed.
+std::pair<uint16_t, int> read_v2_freq(uint32_t bits) {
+    static constexpr int8_t k_nbits[32] = {
+        2, 3, 2, 5, 2, 3, 2, 8, 2, 3, 2, 5, 2, 3, 2, 14,
+        2, 3, 2, 5, 2, 3, 2, 8, 2, 3, 2, 5, 2, 3, 2, 14};
+    static constexpr int8_t k_values[32] = {
+        0, 2, 1, 4, 0, 3, 1, -1, 0, 2, 1, 5, 0, 3, 1, -1,
+        0, 2, 1, 6, 0, 3, 1, -1, 0, 2, 1, 7, 0, 3, 1, -1};
+    uint32_t b = bits & 31;
+    int n = k_nbits[b];
+    if (n == 8) {
+        return {static_cast<uint16_t>(8 + ((bits >> 4) & 0xf)), n};
+    }
+    if (n == 14) {
+        return {static_cast<uint16_t>(24 + ((bits >> 4) & 0x3ff)), n};
+    }
+    return {static_cast<uint16_t>(k_values[b]), n};
+}
+
+std::pair<BlockHeader, size_t> read_v2_header(std::span<const char> data) {
+    kcmod_decode_verify(data.size() >= k_v2_fixed_header_size);
+    const char *p = data.data();
+    auto v0 = load<uint64_t>(p + 8);
+    auto v1 = load<uint64_t>(p + 16);
+    auto v2 = load<uint64_t>(p + 24);
+    BlockHeader header{};
+    header.n_raw_bytes = load<uint32_t>(p + 4);
+    header.n_literals = get_field(v0, 0, 20);
+    header.n_literal_payload_bytes = get_field(v0, 20, 20);
+    header.n_matches = get_field(v0, 40, 20);
+    header.literal_bits = static_cast<int32_t>(get_field(v0, 60, 3)) - 7;
+    for (size_t i = 0; i < 4; ++i) {
+        header.literal_state[i] = get_field(v1, 10 * static_cast<int>(i), 10);
+    }
+    header.n_lmd_payload_bytes = get_field(v1, 40, 20);
+    header.lmd_bits = static_cast<int32_t>(get_field(v1, 60, 3)) - 7;
+    header.l_state = get_field(v2, 32, 10);
+    header.m_state = get_field(v2, 42, 10);
+    header.d_state = get_field(v2, 52, 10);
+
+    size_t header_size = get_field(v2, 0, 32);
+    kcmod_decode_verify(header_size >= k_v2_fixed_header_size && header_size <= data.size());
+    // An empty frequency table leaves all frequencies zero
+    std::span<const char> src = data.subspan(k_v2_fixed_header_size, header_size - k_v2_fixed_header_size);
+    if (!src.empty()) {
+        uint16_t *tables[] = {header.l_freq.data(), header.m_freq.data(), header.d_freq.data(),
+                              header.literal_freq.data()};
+        size_t sizes[] = {k_l_symbols, k_m_symbols, k_d_symbols, k_literal_symbols};
+        uint32_t accum = 0;
+        int accum_nbits = 0;
+        size_t in = 0;
+        for (size_t t = 0; t < 4; ++t) {
+            for (size_t i = 0; i < sizes[t]; ++i) {
+                while (in < src.size() && accum_nbits + 8 <= 32) {
+                    accum |= static_cast<uint32_t>(static_cast<uint8_t>(src[in++])) << accum_nbits;
+                    accum_nbits += 8;
+                }
+                auto [value, nbits] = read_v2_freq(accum);
+                kcmod_decode_verify(nbits <= accum_nbits);
+                tables[t][i] = value;
+                accum >>= nbits;
+                accum_nbits -= nbits;
+            }
+        }
+        kcmod_decode_verify(accum_nbits < 8 && in == src.size());
+    }
+    return {header, header_size};
+}
+
+// Bit stream read backwards from the end of a payload, 64 bits at a time
+class BitReader {
+public:
+    // Starts reading the payload ending at end. Refills may read up to 8 bytes
+    // before the payload, but never before begin.
+    BitReader(const char *begin, const char *end, int nbits)
+        : begin_{begin}, cursor_{end} {
+        // nbits in [-7, 0] is the number of bits in the last, partial byte
+        // minus 8, or 0 when the last byte is complete
+        kcmod_decode_verify(nbits <= 0 && nbits > -8);
+        if (nbits != 0) {
+            kcmod_decode_verify(cursor_ - begin_ >= 8);
+            cursor_ -= 8;
+            accum_ = load<uint64_t>(cursor_);
+            accum_nbits_ = nbits + 64;
+        } else {
+            kcmod_decode_verify(cursor_ - begin_ >= 7);
+            cursor_ -= 7;
+            accum_ = 0;
+            memcpy(&accum_, cursor_, 7);
+            accum_nbits_ = 56;
+        }
+        kcmod_decode_verify(accum_nbits_ >= 56 && accum_nbits_ < 64 && (accum_ >> accum_nbits_) == 0);
+    }
+
+    // Refills the accumulator to at least 56 bits
+    void refill() {
+        int nbits = (63 - accum_nbits_) & -8;
+        const char *next = cursor_ - (nbits >> 3);
+        kcmod_decode_verify(next >= begin_);
+        cursor_ = next;
+        uint64_t incoming = load<uint64_t>(cursor_);
+        accum_ = (accum_ << nbits) | mask(incoming, nbits);
+        accum_nbits_ += nbits;
+    }
+
+    uint64_t pull(int nbits) {
+        accum_nbits_ -= nbits;
+        uint64_t result = accum_ >> accum_nbits_;
+        accum_ = mask(accum_, accum_nbits_);
+        return result;
+    }
+
+private:
+    static uint64_t mask(uint64_t value, int nbits) {
+        return nbits == 0 ? 0 : value & (~uint64_t{0} >> (64 - nbits));
+    }
+
+    const char *begin_;
+    const char *cursor_;
+    uint64_t accum_;
+    int accum_nbits_;
+};
+
+struct DecoderEntry {
+    int8_t k;
+    uint8_t symbol;
+    int16_t delta;
+};
+
+struct ValueDecoderEntry {
+    uint8_t total_bits;
+    uint8_t value_bits;
+    int16_t delta;
+    uint32_t vbase;
+};
+
+// Visits the decoder state of every state of the FSE table described by freq.
+// Symbol i owns freq[i] consecutive states.
+template <class F>
+void build_table(uint32_t nstates, std::span<const uint16_t> freq, F &&fn) {
+    int n_clz = std::countl_zero(nstates);
+    uint32_t total = 0;
+    for (size_t i = 0; i < freq.size(); ++i) {
+        int f = freq[i];
+        if (f == 0) {
+            continue;
+        }
+        total += f;
+        kcmod_decode_verify(total <= nstates);
+        int k = std::countl_zero(static_cast<uint32_t>(f)) - n_clz;
+        int j0 = static_cast<int>((2 * nstates) >> k) - f;
+        for (int j = 0; j < f; ++j) {
+            if (j < j0) {
+                fn(i, k, static_cast<int16_t>(((f + j) << k) - static_cast<int>(nstates)));
+            } else {
+                fn(i, k - 1, static_cast<int16_t>((j - j0) << (k - 1)));
+            }
+        }
+    }
+}
+
+std::vector<DecoderEntry> literal_decoder(std::span<const uint16_t> freq) {
+    std::vector<DecoderEntry> table;
+    table.reserve(k_literal_states);
+    build_table(k_literal_states, freq, [&](size_t symbol, int k, int16_t delta) {
+        table.push_back({static_cast<int8_t>(k), static_cast<uint8_t>(symbol), delta});
+    });
+    table.resize(k_literal_states);
+    return table;
+}
+
+std::vector<ValueDecoderEntry> value_decoder(uint32_t nstates, std::span<const uint16_t> freq,
+                                             std::span<const uint8_t> extra_bits,
+                                             std::span<const uint32_t> base_values) {
+    std::vector<ValueDecoderEntry> table;
+    table.reserve(nstates);
+    build_table(nstates, freq, [&](size_t symbol, int k, int16_t delta) {
+        table.push_back({static_cast<uint8_t>(k + extra_bits[symbol]), extra_bits[symbol], delta,
+                         base_values[symbol]});
+    });
+    table.resize(nstates);
+    return table;
+}
+
+uint8_t decode_literal(uint16_t &state, const std::vector<DecoderEntry> &table, BitReader &reader) {
+    const auto &entry = table[state];
+    state = static_cast<uint16_t>(entry.delta + reader.pull(entry.k));
+    return entry.symbol;
+}
+
+uint32_t decode_value(uint16_t &state, const std::vector<ValueDecoderEntry> &table, BitReader &reader) {
+    const auto &entry = table[state];
+    auto bits = reader.pull(entry.total_bits);
+    state = static_cast<uint16_t>(entry.delta + (bits >> entry.value_bits));
+    return entry.vbase + static_cast<uint32_t>(bits & ((uint64_t{1} << entry.value_bits) - 1));
+}
+
+// Copies size bytes from distance bytes back, byte by byte since the ranges
+// may overlap
+void copy_match(std::span<char> output, size_t offset, size_t distance, size_t size) {
+    kcmod_decode_verify(distance != 0 && distance <= offset);
+    kcmod_decode_verify(size <= output.size() - offset);
+    char *dst = output.data() + offset;
+    const char *src = dst - distance;
+    if (distance >= size) {
+        memcpy(dst, src, size);
+        return;
+    }
+    for (size_t i = 0; i < size; ++i) {
+        dst[i] = src[i];
+    }
+}
+
+// Decodes the FSE compressed block with the given header whose payload starts
+// at payload. stream is the whole input, which bounds reads before the payload.
+// Returns the offset after the decoded bytes.
+size_t decode_fse_block(const BlockHeader &header, std::span<const char> stream, size_t payload,
+                        std::span<char> output, size_t offset, std::vector<uint8_t> &literals) {
+    kcmod_decode_verify(header.n_raw_bytes <= output.size() - offset);
+    kcmod_decode_verify(header.n_literals <= k_max_literals);
+    kcmod_decode_verify(payload + header.n_literal_payload_bytes + header.n_lmd_payload_bytes <= stream.size());
+    for (auto state: header.literal_state) {
+        kcmod_decode_verify(state < k_literal_states);
+    }
+    kcmod_decode_verify(header.l_state < k_l_states && header.m_state < k_m_states && header.d_state < k_d_states);
+
+    auto literal_table = literal_decoder(header.literal_freq);
+    auto l_table = value_decoder(k_l_states, header.l_freq, k_l_extra_bits, k_l_base_values);
+    auto m_table = value_decoder(k_m_states, header.m_freq, k_m_extra_bits, k_m_base_values);
+    auto d_table = value_decoder(k_d_states, header.d_freq, k_d_extra_bits, k_d_base_values);
+
+    // Literals are decoded from four interleaved states, four at a time
+    const char *literal_payload = stream.data() + payload;
+    const char *lmd_payload = literal_payload + header.n_literal_payload_bytes;
+    {
+        BitReader reader{stream.data(), lmd_payload, header.literal_bits};
+        auto states = header.literal_state;
+        for (uint32_t i = 0; i < header.n_literals; i += 4) {
+            reader.refill();
+            for (size_t j = 0; j < 4; ++j) {
+                literals[i + j] = decode_literal(states[j], literal_table, reader);
+            }
+        }
+    }
+
+    BitReader reader{stream.data(), lmd_payload + header.n_lmd_payload_bytes, header.lmd_bits};
+    uint16_t l_state = header.l_state;
+    uint16_t m_state = header.m_state;
+    uint16_t d_state = header.d_state;
+    size_t literal = 0;
+    size_t end = offset + header.n_raw_bytes;
+    uint32_t distance = 0;
+    for (uint32_t i = 0; i < header.n_matches; ++i) {
+        reader.refill();
+        uint32_t l = decode_value(l_state, l_table, reader);
+        uint32_t m = decode_value(m_state, m_table, reader);
+        uint32_t d = decode_value(d_state, d_table, reader);
+        // A zero distance repeats the previous one
+        if (d != 0) {
+            distance = d;
+        }
+        kcmod_decode_verify(l <= header.n_literals - literal && l <= end - offset);
+        memcpy(output.data() + offset, literals.data() + literal, l);
+        literal += l;
+        offset += l;
+        if (m != 0) {
+            kcmod_decode_verify(m <= end - offset);
+            copy_match(output, offset, distance, m);
+            offset += m;
+        }
+    }
+    kcmod_decode_verify(offset == end);
+    return offset;
+}
+
+// Bit stream written forwards, read backwards by BitReader
+class BitWriter {
+public:
+    explicit BitWriter(std::vector<char> &out) : out_{out} {}
+
+    void push(int nbits, uint64_t bits) {
+        accum_ |= bits << accum_nbits_;
+        accum_nbits_ += nbits;
+    }
+
+    // Writes out all complete bytes of the accumulator
+    void flush() {
+        int nbits = accum_nbits_ & -8;
+        for (int i = 0; i < nbits; i += 8) {
+            out_.push_back(static_cast<char>(accum_ >> i));
+        }
+        accum_ = nbits == 64 ? 0 : accum_ >> nbits;
+        accum_nbits_ -= nbits;
+    }
+
+    // Writes out the remaining bits. Returns the number of bits used in the
+    // last byte minus 8, or 0 when it is complete, as stored in block headers.
+    int finish() {
+        int nbits = (accum_nbits_ + 7) & -8;
+        for (int i = 0; i < nbits; i += 8) {
+            out_.push_back(static_cast<char>(accum_ >> i));
+        }
+        accum_ = 0;
+        accum_nbits_ -= nbits;
+        return accum_nbits_;
+    }
+
+private:
+    std::vector<char> &out_;
+    uint64_t accum_ = 0;
+    int accum_nbits_ = 0;
+};
+
+struct EncoderEntry {
+    int16_t s0;
+    int16_t k;
+    int16_t delta0;
+    int16_t delta1;
+};
+
+// Inverse of build_table, symbol i owns the states following those of the
+// symbols before it
+std::vector<EncoderEntry> encoder_table(uint32_t nstates, std::span<const uint16_t> freq) {
+    std::vector<EncoderEntry> table(freq.size());
+    int n_clz = std::countl_zero(nstates);
+    int offset = 0;
+    for (size_t i = 0; i < freq.size(); ++i) {
+        int f = freq[i];
+        if (f == 0) {
+            continue;
+        }
+        int k = std::countl_zero(static_cast<uint32_t>(f)) - n_clz;
+        int n = static_cast<int>(nstates);
+        // With k == 0 the symbol owns every state and delta1 is never used
+        int delta1 = k == 0 ? 0 : offset - f + (n >> (k - 1));
+        table[i] = {static_cast<int16_t>((f << k) - n), static_cast<int16_t>(k),
+                    static_cast<int16_t>(offset - f + (n >> k)), static_cast<int16_t>(delta1)};
+        offset += f;
+    }
+    return table;
+}
+
+// Pushes the state bits for symbol and moves to the previous state
+void encode_symbol(uint16_t &state, const EncoderEntry &entry, BitWriter &writer) {
+    bool high = state >= entry.s0;
+    int nbits = high ? entry.k : entry.k - 1;
+    writer.push(nbits, state & ((1u << nbits) - 1));
+    state = static_cast<uint16_t>((high ? entry.delta0 : entry.delta1) + (state >> nbits));
+}
+
+// Scales counts to frequencies summing to nstates, keeping every used symbol
+std::vector<uint16_t> normalize_freq(std::span<const uint32_t> counts, uint32_t nstates) {
+    std::vector<uint16_t> freq(counts.size());
+    uint64_t total = 0;
+    for (auto count: counts) {
+        total += count;
+    }
+    if (total == 0) {
+        return freq;
+    }
+    int64_t remaining = nstates;
+    size_t largest = 0;
+    for (size_t i = 0; i < counts.size(); ++i) {
+        if (counts[i] == 0) {
+            continue;
+        }
+        freq[i] = static_cast<uint16_t>(std::max<uint64_t>(1, counts[i] * nstates / total));
+        remaining -= freq[i];
+        if (counts[i] > counts[largest]) {
+            largest = i;
+        }
+    }
+    if (remaining >= 0) {
+        freq[largest] += remaining;
+        return freq;
+    }
+    // Rounding up rare symbols overshot, take states from the most frequent
+    while (remaining < 0) {
+        auto it = std::max_element(freq.begin(), freq.end());
+        uint16_t excess = static_cast<uint16_t>(std::min<int64_t>(-remaining, std::max(1, *it / 4)));
+        *it -= excess;
+        remaining += excess;
+    }
+    return freq;
+}
+
+// Index of the symbol whose value range contains value
+template <size_t N>
+size_t value_symbol(uint32_t value, const std::array<uint32_t, N> &base_values) {
+    size_t symbol = std::upper_bound(base_values.begin(), base_values.end(), value) - base_values.begin();
+    return symbol - 1;
+}
+
+// Appends the frequency tables in the variable length encoding of v2 headers
+void write_v2_freq(std::vector<char> &out, std::span<const std::span<const uint16_t>> tables) {
+    uint64_t accum = 0;
+    int accum_nbits = 0;
+    for (auto table: tables) {
+        for (uint16_t value: table) {
+            static constexpr uint8_t k_codes[8] = {0, 2, 1, 5, 3, 11, 19, 27};
+            static constexpr uint8_t k_nbits[8] = {2, 2, 3, 3, 5, 5, 5, 5};
+            uint32_t code;
+            int nbits;
+            if (value < 8) {
+                code = k_codes[value];
+                nbits = k_nbits[value];
+            } else if (value < 24) {
+                code = 7 + ((value - 8) << 4);
+                nbits = 8;
+            } else {
+                code = 15 + ((value - 24) << 4);
+                nbits = 14;
+            }
+            accum |= uint64_t{code} << accum_nbits;
+            accum_nbits += nbits;
+            while (accum_nbits >= 8) {
+                out.push_back(static_cast<char>(accum));
+                accum >>= 8;
+                accum_nbits -= 8;
+            }
+        }
+    }
+    if (accum_nbits > 0) {
+        out.push_back(static_cast<char>(accum));
+    }
+}
+
+template <class T>
+void store(std::vector<char> &out, size_t offset, T value) {
+    memcpy(out.data() + offset, &value, sizeof(value));
+}
+
+struct Lmd {
+    uint32_t l;
+    uint32_t m;
+    uint32_t d;
+};
+
+// Collects literals and matches of one chunk and writes them as bvx2 blocks
+class BlockEncoder {
+public:
+    explicit BlockEncoder(std::vector<char> &out) : out_{out} {}
+
+    // Emits literal bytes followed by a match of length m at distance d
+    void push(std::span<const char> literal_bytes, uint32_t m, uint32_t d) {
+        while (literal_bytes.size() > k_max_l_value) {
+            push_lmd(literal_bytes.first(k_max_l_value), 0, 1);
+            literal_bytes = literal_bytes.subspan(k_max_l_value);
+        }
+        uint32_t first = std::min(m, k_max_m_value);
+        push_lmd(literal_bytes, first, d);
+        for (m -= first; m != 0; m -= first) {
+            first = std::min(m, k_max_m_value);
+            push_lmd({}, first, d);
+        }
+    }
+
+    void finish() {
+        if (!lmds_.empty()) {
+            write_block();
+        }
+    }
+
+private:
+    void push_lmd(std::span<const char> literal_bytes, uint32_t m, uint32_t d) {
+        if (literal_bytes.empty() && m == 0) {
+            return;
+        }
+        if (literals_.size() + literal_bytes.size() > k_literals_per_block || lmds_.size() == k_matches_per_block) {
+            write_block();
+        }
+        literals_.insert(literals_.end(), literal_bytes.begin(), literal_bytes.end());
+        // A zero distance repeats the previous match distance of the block
+        lmds_.push_back({static_cast<uint32_t>(literal_bytes.size()), m, d == previous_d_ ? 0 : d});
+        previous_d_ = d;
+        n_raw_bytes_ += literal_bytes.size() + m;
+    }
+
+    void write_block() {
+        // Literals are decoded four at a time
+        while (literals_.size() % 4 != 0) {
+            literals_.push_back(0);
+        }
+        std::vector<uint32_t> literal_counts(k_literal_symbols), l_counts(k_l_symbols), m_counts(k_m_symbols),
+            d_counts(k_d_symbols);
+        for (uint8_t literal: literals_) {
+            ++literal_counts[literal];
+        }
+        for (const auto &lmd: lmds_) {
+            ++l_counts[value_symbol(lmd.l, k_l_base_values)];
+            ++m_counts[value_symbol(lmd.m, k_m_base_values)];
+            ++d_counts[value_symbol(lmd.d, k_d_base_values)];
+        }
+        auto literal_freq = normalize_freq(literal_counts, k_literal_states);
+        auto l_freq = normalize_freq(l_counts, k_l_states);
+        auto m_freq = normalize_freq(m_counts, k_m_states);
+        auto d_freq = normalize_freq(d_counts, k_d_states);
+
+        size_t header_offset = out_.size();
+        out_.resize(out_.size() + k_v2_fixed_header_size);
+        const std::span<const uint16_t> tables[] = {l_freq, m_freq, d_freq, literal_freq};
+        write_v2_freq(out_, tables);
+        size_t header_size = out_.size() - header_offset;
+
+        // Both streams are written in reverse so they decode front to back
+        auto literal_table = encoder_table(k_literal_states, literal_freq);
+        std::array<uint16_t, 4> literal_state{};
+        BitWriter literal_writer{out_};
+        for (size_t i = literals_.size(); i > 0;) {
+            i -= 4;
+            for (size_t j = 4; j > 0; --j) {
+                encode_symbol(literal_state[j - 1], literal_table[literals_[i + j - 1]], literal_writer);
+            }
+            literal_writer.flush();
+        }
+        int literal_bits = literal_writer.finish();
+        size_t literal_payload_size = out_.size() - header_offset - header_size;
+
+        auto l_table = encoder_table(k_l_states, l_freq);
+        auto m_table = encoder_table(k_m_states, m_freq);
+        auto d_table = encoder_table(k_d_states, d_freq);
+        uint16_t l_state = 0;
+        uint16_t m_state = 0;
+        uint16_t d_state = 0;
+        BitWriter lmd_writer{out_};
+        auto encode_value = [&](uint16_t &state, const std::vector<EncoderEntry> &table, uint32_t value,
+                                const auto &extra_bits, const auto &base_values) {
+            size_t symbol = value_symbol(value, base_values);
+            lmd_writer.push(extra_bits[symbol], value - base_values[symbol]);
+            encode_symbol(state, table[symbol], lmd_writer);
+        };
+        for (size_t i = lmds_.size(); i > 0; --i) {
+            const auto &lmd = lmds_[i - 1];
+            encode_value(d_state, d_table, lmd.d, k_d_extra_bits, k_d_base_values);
+            encode_value(m_state, m_table, lmd.m, k_m_extra_bits, k_m_base_values);
+            encode_value(l_state, l_table, lmd.l, k_l_extra_bits, k_l_base_values);
+            lmd_writer.flush();
+        }
+        int lmd_bits = lmd_writer.finish();
+        size_t lmd_payload_size = out_.size() - header_offset - header_size - literal_payload_size;
+
+        uint64_t v0 = literals_.size() | (uint64_t{literal_payload_size} << 20) | (uint64_t{lmds_.size()} << 40) |
+                      (uint64_t(literal_bits + 7) << 60);
+        uint64_t v1 = literal_state[0] | (uint64_t{literal_state[1]} << 10) | (uint64_t{literal_state[2]} << 20) |
+                      (uint64_t{literal_state[3]} << 30) | (uint64_t{lmd_payload_size} << 40) |
+                      (uint64_t(lmd_bits + 7) << 60);
+        uint64_t v2 = header_size | (uint64_t{l_state} << 32) | (uint64_t{m_state} << 42) | (uint64_t{d_state} << 52);
+        store(out_, header_offset, k_lzfse_compressed_v2_block_magic);
+        store(out_, header_offset + 4, n_raw_bytes_);
+        store(out_, header_offset + 8, v0);
+        store(out_, header_offset + 16, v1);
+        store(out_, header_offset + 24, v2);
+
+        literals_.clear();
+        lmds_.clear();
+        previous_d_ = 0;
+        n_raw_bytes_ = 0;
+    }
+
+private:
+    std::vector<char> &out_;
+    std::vector<uint8_t> literals_;
+    std::vector<Lmd> lmds_;
+    uint32_t previous_d_ = 0;
+    uint32_t n_raw_bytes_ = 0;
+};
+
+// Encodes chunk as a sequence of blocks, without the end of stream block
+std::vector<char> encode_chunk(std::span<const char> chunk) {
+    std::vector<char> out;
+    MatchFinder finder{chunk, k_max_d_value, k_min_match, chunk.size()};
+    BlockEncoder encoder{out};
+    size_t literal_start = 0;
+    size_t pos = 0;
+    while (pos < chunk.size()) {
+        Match match = finder.find(pos);
+        if (match.length == 0) {
+            ++pos;
+            continue;
+        }
+        encoder.push(chunk.subspan(literal_start, pos - literal_start), match.length, match.distance);
+        for (size_t i = pos + 1; i < pos + match.length; ++i) {
+            finder.insert(i);
+        }
+        pos += match.length;
+        literal_start = pos;
+    }
+    encoder.push(chunk.subspan(literal_start), 0, 1);
+    encoder.finish();
+
+    // Incompressible chunks are stored
+    if (out.size() >= chunk.size() + 8) {
+        out.resize(8);
+        store(out, 0, k_lzfse_uncompressed_block_magic);
+        store(out, 4, static_cast<uint32_t>(chunk.size()));
+        out.insert(out.end(), chunk.begin(), chunk.end());
+    }
+    return out;
+}
+
+// Calls fn(magic, block, header_size, encoded_size) for each block of the
+// stream, up to the end of stream block
+template <class F>
+void for_each_block(std::span<const char> data, F &&fn) {
+    size_t cursor = 0;
+    while (true) {
+        kcmod_decode_verify(data.size() - cursor >= sizeof(uint32_t));
+        auto magic = load<uint32_t>(data.data() + cursor);
+        if (magic == k_lzfse_end_of_stream_magic) {
+            return;
+        }
+        auto block = data.subspan(cursor);
+        size_t header_size;
+        uint64_t payload_size;
+        switch (magic) {
+            case k_lzfse_uncompressed_block_magic:
+                kcmod_decode_verify(block.size() >= 8);
+                header_size = 8;
+                payload_size = load<uint32_t>(block.data() + 4);
+                break;
+            case k_lzfse_compressed_lzvn_block_magic:
+                kcmod_decode_verify(block.size() >= 12);
+                header_size = 12;
+                payload_size = load<uint32_t>(block.data() + 8);
+                break;
+            case k_lzfse_compressed_v1_block_magic:
+                kcmod_decode_verify(block.size() >= k_v1_header_size);
+                header_size = k_v1_header_size;
+                payload_size = uint64_t{load<uint32_t>(block.data() + 20)} + load<uint32_t>(block.data() + 24);
+                break;
+            case k_lzfse_compressed_v2_block_magic: {
+                kcmod_decode_verify(block.size() >= k_v2_fixed_header_size);
+                auto v0 = load<uint64_t>(block.data() + 8);
+                auto v1 = load<uint64_t>(block.data() + 16);
+                auto v2 = load<uint64_t>(block.data() + 24);
+                header_size = get_field(v2, 0, 32);
+                payload_size = uint64_t{get_field(v0, 20, 20)} + get_field(v1, 40, 20);
+                break;
+            }
+            default:
+                throw DecodeError{"invalid LZFSE block magic {:#x} at {:#x}", magic, cursor};
+        }
+        kcmod_decode_verify(header_size + payload_size <= block.size());
+        fn(magic, block, header_size, header_size + payload_size);
+        cursor += header_size + payload_size;
+    }
+}
+
+}// namespace
+
+
+bool kcmod::is_lzfse(std::span<const char> data) {
+    if (data.size() < sizeof(uint32_t)) {
+        return false;
+    }
+    switch (load<uint32_t>(data.data())) {
+        case k_lzfse_end_of_stream_magic:
+        case k_lzfse_uncompressed_block_magic:
+        case k_lzfse_compressed_v1_block_magic:
+        case k_lzfse_compressed_v2_block_magic:
+        case k_lzfse_compressed_lzvn_block_magic:
+            return true;
+        default:
+            return false;
+    }
+}
+
+size_t kcmod::lzfse_decoded_size(std::span<const char> data) {
+    size_t size = 0;
+    for_each_block(data, [&](uint32_t, std::span<const char> block, size_t, size_t) {
+        size += load<uint32_t>(block.data() + 4);
+    });
+    return size;
+}
+
+void kcmod::lzfse_decode(std::span<const char> data, std::span<char> output,
+                         const std::function<void(size_t)> &progress) {
+    std::vector<uint8_t> literals(k_max_literals + 4);
+    size_t offset = 0;
+    for_each_block(data, [&](uint32_t magic, std::span<const char> block, size_t header_size, size_t block_size) {
+        uint32_t n_raw_bytes = load<uint32_t>(block.data() + 4);
+        kcmod_decode_verify(n_raw_bytes <= output.size() - offset);
+        size_t payload = block.data() + header_size - data.data();
+        switch (magic) {
+            case k_lzfse_uncompressed_block_magic:
+                memcpy(output.data() + offset, data.data() + payload, n_raw_bytes);
+                offset += n_raw_bytes;
+                break;
+            case k_lzfse_compressed_lzvn_block_magic: {
+                size_t end = lzvn_decode(block.subspan(header_size, block_size - header_size),
+                                         output.first(offset + n_raw_bytes), offset);
+                kcmod_decode_verify(end == offset + n_raw_bytes);
+                offset = end;
+                break;
+            }
+            case k_lzfse_compressed_v1_block_magic:
+            case k_lzfse_compressed_v2_block_magic: {
+                auto [header, size] = magic == k_lzfse_compressed_v1_block_magic ? read_v1_header(block)
+                                                                                 : read_v2_header(block);
+                offset = decode_fse_block(header, data, payload, output, offset, literals);
+                break;
+            }
+            default:
+                kcmod_not_reachable();
+        }
+        if (progress) {
+            progress(offset);
+        }
+    });
+    kcmod_decode_verify(offset == output.size());
+}
+
+std::vector<char> kcmod::lzfse_encode(std::span<const char> data, ThreadPool &pool, size_t chunk_size) {
+    std::vector<std::future<std::vector<char>>> futures;
+    for (size_t offset = 0; offset < data.size(); offset += chunk_size) {
+        auto chunk = data.subspan(offset, std::min(chunk_size, data.size() - offset));
+        futures.push_back(pool.submit([chunk] { return encode_chunk(chunk); }));
+    }
+    std::vector<char> out;
+    for (auto &future: futures) {
+        auto blocks = future.get();
+        out.insert(out.end(), blocks.begin(), blocks.end());
+    }
+    size_t end = out.size();
+    out.resize(end + sizeof(uint32_t));
+    store(out, end, k_lzfse_end_of_stream_magic);
+    return out;
+}
+
+size_t kcmod::lzvn_decode(std::span<const char> data, std::span<char> output, size_t offset) {
+    size_t in = 0;
+    size_t distance = 0;
+    auto byte = [&](size_t at) -> uint32_t {
+        kcmod_decode_verify(in + at < data.size());
+        return static_cast<uint8_t>(data[in + at]);
+    };
+    while (true) {
+        uint32_t opc = byte(0);
+        size_t literal = 0;
+        size_t match = 0;
+        size_t opc_size;
+        if (opc == 0x06) {
+            // End of stream, followed by 7 bytes of padding
+            kcmod_decode_verify(data.size() - in >= 8);
+            return offset;
+        } else if (opc == 0x0e || opc == 0x16) {
+            in += 1;
+            continue;
+        } else if (opc >= 0xf0) {
+            // Match with the previous distance
+            opc_size = opc == 0xf0 ? 2 : 1;
+            match = opc == 0xf0 ? byte(1) + 16 : opc & 0xf;
+        } else if (opc >= 0xe0) {
+            // Literals only
+            opc_size = opc == 0xe0 ? 2 : 1;
+            literal = opc == 0xe0 ? byte(1) + 16 : opc & 0xf;
+        } else if (opc >= 0xa0 && opc < 0xc0) {
+            // 101LLMMM DDDDDDMM DDDDDDDD
+            uint32_t operand = byte(1) | (byte(2) << 8);
+            opc_size = 3;
+            literal = (opc >> 3) & 3;
+            match = (((opc & 7) << 2) | (operand & 3)) + 3;
+            distance = operand >> 2;
+        } else if ((opc >= 0x70 && opc < 0x80) || (opc >= 0xd0 && opc < 0xe0) ||
+                   (opc < 0x40 && (opc & 7) == 6)) {
+            throw DecodeError{"invalid LZVN opcode {:#x} at {:#x}", opc, in};
+        } else {
+            // LLMMMDDD with a small, large or the previous distance
+            literal = opc >> 6;
+            match = ((opc >> 3) & 7) + 3;
+            switch (opc & 7) {
+                case 6:
+                    opc_size = 1;
+                    break;
+                case 7:
+                    opc_size = 3;
+                    distance = byte(1) | (byte(2) << 8);
+                    break;
+                default:
+                    opc_size = 2;
+                    distance = ((opc & 7) << 8) | byte(1);
+                    break;
+            }
+        }
+        in += opc_size;
+        kcmod_decode_verify(literal <= data.size() - in && literal <= output.size() - offset);
+        memcpy(output.data() + offset, data.data() + in, literal);
+        in += literal;
+        offset += literal;
+        if (match != 0) {
+            copy_match(output, offset, distance, match);
+            offset += match;
+        }
+    }
+}
@@ -0,0 +1,215 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <cstring>
+
+#include <arpa/inet.h>
+
+#include "debug.h"
+#include "hash.h"
+#include "lzss.h"
+#include "match_finder.h"
+
+
+using namespace kcmod;
+
+namespace {
+
+// Parameters of the Okumura LZSS variant used by Apple
+constexpr size_t k_ring_size = 4096;
+constexpr size_t k_max_match = 18;
+constexpr size_t k_threshold = 2;
+
+constexpr size_t k_progress_interval = 4 * 1024 * 1024;
+
+// Matches must not reach the part of the ring being overwritten
+constexpr size_t k_window = k_ring_size - k_max_match;
+
+// The header is copied out, inside an IM4P it is not aligned
+LzssHeader read_header(std::span<const char> data) {
+    kcmod_decode_verify(data.size() >= sizeof(LzssHeader));
+    LzssHeader header;
+    memcpy(&header, data.data(), sizeof(header));
+    kcmod_decode_verify(memcmp(header.signature, "comp", 4) == 0);
+    kcmod_decode_verify(memcmp(header.compression_type, "lzss", 4) == 0);
+    kcmod_decode_verify(ntohl(header.encoded_size) <= data.size() - sizeof(LzssHeader));
+    return header;
+}
+
+// Encoded items of one chunk. Each item is a literal byte or a two byte
+// match, flags holds one bit per item which is set for literals.
+struct EncodedChunk {
+    std::vector<uint8_t> flags;
+    std::vector<char> items;
+    size_t item_count = 0;
+    uint32_t checksum;
+};
+
+EncodedChunk encode_chunk(std::span<const char> chunk, size_t offset) {
+    EncodedChunk encoded;
+    encoded.items.reserve(chunk.size() / 2);
+    auto push_flag = [&](bool literal) {
+        if (encoded.item_count % 8 == 0) {
+            encoded.flags.push_back(0);
+        }
+        encoded.flags.back() |= static_cast<uint8_t>(literal) << (encoded.item_count % 8);
+        ++encoded.item_count;
+    };
+    const size_t ring_start = k_ring_size - k_max_match;
+    MatchFinder finder{chunk, k_window, k_threshold + 1, k_max_match};
+    for (size_t pos = 0; pos < chunk.size();) {
+        Match match = finder.find(pos);
+        if (match.length == 0) {
+            push_flag(true);
+            encoded.items.push_back(chunk[pos]);
+            ++pos;
+            continue;
+        }
+        // Matches are addressed by their position in the ring
+        size_t position = (ring_start + offset + pos - match.distance) % k_ring_size;
+        push_flag(false);
+        encoded.items.push_back(static_cast<char>(position & 0xff));
+        encoded.items.push_back(static_cast<char>(((position >> 4) & 0xf0) | (match.length - k_threshold - 1)));
+        for (size_t i = pos + 1; i < pos + match.length; ++i) {
+            finder.insert(i);
+        }
+        pos += match.length;
+    }
+    encoded.checksum = adler32(chunk);
+    return encoded;
+}
+
+}// namespace
+
+
+bool kcmod::is_lzss(std::span<const char> data) {
+    return data.size() >= sizeof(LzssHeader) && memcmp(data.data(), "complzss", 8) == 0;
+}
+
+size_t kcmod::lzss_decoded_size(std::span<const char> data) {
+    return ntohl(read_header(data).decoded_size);
+}
+
+void kcmod::lzss_decode(std::span<const char> data, std::span<char> output,
+                        const std::function<void(size_t)> &progress) {
+    LzssHeader header = read_header(data);
+    kcmod_decode_verify(output.size() == ntohl(header.decoded_size));
+    auto input = data.subspan(sizeof(LzssHeader), ntohl(header.encoded_size));
+
+    // Back references address a ring buffer of the last k_ring_size bytes
+    // which starts out filled with spaces at position k_ring_size - k_max_match.
+    // The ring is mirrored by output, only references into the initial
+    // spaces need the explicit ring position.
+    const size_t ring_start = k_ring_size - k_max_match;
+    size_t in = 0;
+    size_t out = 0;
+    size_t next_progress = k_progress_interval;
+    uint32_t flags = 0;
+    while (out < output.size()) {
+        flags >>= 1;
+        if ((flags & 0x100) == 0) {
+            if (in == input.size()) {
+                break;
+            }
+            flags = static_cast<uint8_t>(input[in++]) | 0xff00;
+        }
+        if (flags & 1) {
+            if (in == input.size()) {
+                break;
+            }
+            output[out++] = input[in++];
+        } else {
+            if (in + 2 > input.size()) {
+                break;
+            }
+            auto lo = static_cast<uint8_t>(input[in]);
+            auto hi = static_cast<uint8_t>(input[in + 1]);
+            in += 2;
+            size_t position = lo | ((hi & 0xf0) << 4);
+            size_t length = (hi & 0x0f) + k_threshold + 1;
+            // Distance from the ring write position to the referenced byte
+            size_t distance = (ring_start + out - position) % k_ring_size;
+            if (distance == 0) {
+                distance = k_ring_size;
+            }
+            for (size_t i = 0; i < length && out < output.size(); ++i) {
+                output[out] = distance > out ? ' ' : output[out - distance];
+                ++out;
+            }
+        }
+        if (progress && out >= next_progress) {
+            progress(out);
+            next_progress = out + k_progress_interval;
+        }
+    }
+    kcmod_decode_verify(out == output.size());
+    uint32_t checksum = adler32(output);
+    if (checksum != ntohl(header.checksum)) {
+        throw DecodeError{"LZSS checksum mismatch, expected {:#x} found {:#x}", ntohl(header.checksum), checksum};
+    }
+    if (progress) {
+        progress(out);
+    }
+}
+
+std::vector<char> kcmod::lzss_encode(std::span<const char> data, ThreadPool &pool, size_t chunk_size) {
+    kcmod_verify(data.size() <= UINT32_MAX);
+    std::vector<std::future<EncodedChunk>> futures;
+    for (size_t offset = 0; offset < data.size(); offset += chunk_size) {
+        auto chunk = data.subspan(offset, std::min(chunk_size, data.size() - offset));
+        futures.push_back(pool.submit([chunk, offset] { return encode_chunk(chunk, offset); }));
+    }
+
+    // Flag bytes group eight items, chunks are joined by regrouping their
+    // items into a single stream
+    std::vector<char> out(sizeof(LzssHeader));
+    size_t flag_offset = 0;
+    size_t item_count = 0;
+    uint32_t checksum = adler32({});
+    size_t decoded = 0;
+    for (auto &future: futures) {
+        EncodedChunk chunk = future.get();
+        size_t in = 0;
+        for (size_t i = 0; i < chunk.item_count; ++i) {
+            if (item_count % 8 == 0) {
+                flag_offset = out.size();
+                out.push_back(0);
+            }
+            bool literal = (chunk.flags[i / 8] >> (i % 8)) & 1;
+            out[flag_offset] = static_cast<char>(out[flag_offset] | (literal << (item_count % 8)));
+            size_t item_size = literal ? 1 : 2;
+            out.insert(out.end(), chunk.items.begin() + in, chunk.items.begin() + in + item_size);
+            in += item_size;
+            ++item_count;
+        }
+        size_t size = std::min(chunk_size, data.size() - decoded);
+        checksum = adler32_combine(checksum, chunk.checksum, size);
+        decoded += size;
+    }
+
+    LzssHeader header{};
+    memcpy(header.signature, "comp", 4);
+    memcpy(header.compression_type, "lzss", 4);
+    header.checksum = htonl(checksum);
+    header.decoded_size = htonl(data.size());
+    header.encoded_size = htonl(out.size() - sizeof(LzssHeader));
+    memcpy(out.data(), &header, sizeof(header));
+    return out;
+}
@@ -18,52 +18,336 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <exception>
+#include <limits>
 #include <map>
+#include <set>
 #include <span>
 
 #include <docopt.h>
-#include <mio/mmap.hpp>
 
 #include "debug.h"
 
-#include "kernelcache.h"
-#include "temp.h"
+#include "extract.h"
+#include "kext.h"
+#include "kextobj.h"
+#include "log.h"
+#include "memory.h"
+#include "profile.h"
+#include "replace.h"
+#include "server.h"
+#include "symbolicate.h"
+#include "thread_pool.h"
+#include "version.h"
+#include "watch.h"
+#include "zip.h"
 
 using namespace kcmod;
 
+namespace fs = std::filesystem;
+
 static const char k_usage[] =
     R"(kcmod.
 
     Usage:
-      kcmod replace <fileset_id> --kernelcache=<kc> --kext=<kext> --output=<output> [--symbols=<symbols>]
+      kcmod replace (<fileset_id> | --auto-victim) --kernelcache=<kc> --kext=<kext> --output=<output> [--scatter] [--symbols=<symbols>] [--kext-cache=<dir>] [--result-cache=<dir>] [--output-format=<format>] [--trace] [--profile=<file>] [--low-memory] [--connect=<socket>] [-v...]
+      kcmod replace (<fileset_id> | --auto-victim) --kext=<kext> --output-dir=<dir> [--scatter] [--symbols=<symbols>] [--jobs=<jobs>] [--kext-cache=<dir>] [--result-cache=<dir>] [--output-format=<format>] [--trace] [--profile=<file>] [--low-memory] [-v...] <kernelcache>...
+      kcmod compile-kext --kext=<kext> (--output=<output> | --kext-cache=<dir>)
+      kcmod watch <fileset_id> --kernelcache=<kc> --kext=<kext> --output=<output> [--symbols=<symbols>] [--interval=<ms>] [-v...]
+      kcmod lookup <symbol> --kernelcache=<kc> [--connect=<socket>]
+      kcmod verify --kernelcache=<kc> [--connect=<socket>]
+      kcmod victims --kernelcache=<kc> --kext=<kext> [--kext-cache=<dir>] [--connect=<socket>]
+      kcmod extract (<fileset_id> | --all) --kernelcache=<kc> --output-dir=<dir> [--jobs=<jobs>]
+      kcmod symbolicate --kernelcache=<kc> [--injected-kext=<kext>...] [--index=<file>] [--slide=<slide>] [-v...] [<input>...]
+      kcmod serve --socket=<socket> [--memory-limit=<mb>] [-v...]
 
     Options:
-      -k --kernelcache <kc>       Input kernelcache (Mach-O fileset)
+      -k --kernelcache <kc>       Input kernelcache (Mach-O fileset, may be LZSS/LZFSE compressed or IM4P wrapped,
+                                  or an entry of a zip archive written archive.zip:entry)
       -x --kext <kext>            Kext to replace fileset
+      --auto-victim               Replace the fileset the kext fits best, listed first by kcmod victims
+      --scatter                   Place kext segments the victim can not hold in other filesets, which are dropped
       -s --symbols <symbols>      Additional symbol information in json format
-      -o --output <output>        Output kernelcache
+      -o --output <output>        Output kernelcache, or archive when the input is an archive entry
+      -d --output-dir <dir>       Output directory when linking multiple kernelcaches or extracting filesets
+      -j --jobs <jobs>            Number of kernelcaches to link or filesets to extract concurrently
+      --all                       Extract every fileset
+      --injected-kext <kext>      Kext kcmod replaced a fileset of the kernelcache with, whose symbols are indexed
+      --index <file>              Symbol index to load, written when missing or built from other inputs
+      --slide <slide>             KASLR slide of the addresses, taken from "Kernel slide:" lines of the input by default
+      --kext-cache <dir>          Directory of precompiled kext objects keyed by kext content
+      --result-cache <dir>        Directory of replace results keyed by the content of all inputs
+      --output-format <format>    Output kernelcache format, macho or im4p [default: macho]
+      --trace                     Print a timeline of the replace pipeline stages
+      --profile <file>            Write timings and counters of every replace stage as a Chrome trace
+      --low-memory                Edit the output in place with bounded memory use and report the peak
+      --interval <ms>             Interval between checks for a rebuilt kext in milliseconds [default: 50]
+      --socket <socket>           Unix domain socket the daemon listens on
+      --memory-limit <mb>         Memory used by kernelcaches kept loaded by the daemon [default: 4096]
+      --connect <socket>          Forward the command to the daemon listening on socket
+      -v --verbose                Print debug messages, repeated also print trace messages
       --version                   Show version.
 )";
 
+static std::optional<fs::path> optional_path(const docopt::value &value) {
+    return value ? std::optional{fs::path{value.asString()}} : std::nullopt;
+}
+
+// Parses the value of a numeric option, at least min. base 0 also accepts
+// hexadecimal and octal prefixes.
+static uint64_t parse_number(const docopt::value &value, const char *option, uint64_t min = 0, int base = 10) {
+    const std::string &text = value.asString();
+    size_t end = 0;
+    uint64_t result = 0;
+    try {
+        result = std::stoull(text, &end, base);
+    } catch (const std::logic_error &) {
+        end = 0;
+    }
+    if (text.empty() || text[0] == '-' || end != text.size() || result < min) {
+        throw FatalError{"Invalid value {} for {}", text, option};
+    }
+    return result;
+}
+
+static size_t parse_jobs(const docopt::value &value) {
+    return value ? parse_number(value, "--jobs", 1) : ThreadPool::default_thread_count();
+}
+
+static nlohmann::json absolute_path(const docopt::value &value) {
+    return value ? nlohmann::json(fs::absolute(value.asString()).string()) : nlohmann::json(nullptr);
+}
+
+// Runs request on the daemon when connect is set, otherwise in process
+static nlohmann::json run_request(const docopt::value &connect, const nlohmann::json &request) {
+    nlohmann::json response;
+    if (connect) {
+        response = send_request(connect.asString(), request);
+    } else {
+        KernelCacheStore store{std::numeric_limits<size_t>::max()};
+        response = handle_request(store, request);
+    }
+    if (!response.at("ok").get<bool>()) {
+        throw FatalError{"{}", response.at("error").get<std::string>()};
+    }
+    return response;
+}
+
+static void report_peak_memory(const ReplaceOptions &options) {
+    if (options.low_memory) {
+        fmt::print("Peak resident memory: {:.1f} MiB\n", static_cast<double>(peak_resident_size()) / (1024 * 1024));
+    }
+}
+
+static void report_profile(const std::optional<Profiler> &profiler, const docopt::value &path) {
+    if (profiler) {
+        profiler->write_trace(path.asString());
+        fmt::print("[PROFILE] {} -> {}\n", profiler->format_summary(), path.asString());
+    }
+}
+
 int main(int argc, const char *argv[]) {
     std::map<std::string, docopt::value> args =
         docopt::docopt(k_usage,
                        {argv + 1, argv + argc},
                        true,
-                       "kcmod v1.0.0");
+                       fmt::format("kcmod v{}", k_kcmod_version));
+
+    // Log messages are written asynchronously, write out the queued ones
+    // before an uncaught error ends the process
+    static std::terminate_handler default_terminate = std::set_terminate([] {
+        Logger::flush();
+        default_terminate();
+    });
+    long verbosity = args["--verbose"] ? args["--verbose"].asLong() : 0;
+    Logger::set_level(verbosity >= 2 ? LogLevel::TRACE : verbosity == 1 ? LogLevel::DEBUG : LogLevel::INFO);
+
+    std::optional<fs::path> kext_cache = optional_path(args["--kext-cache"]);
 
     if (args["replace"]) {
-        TemporaryFile output{args["--kernelcache"].asString()};
-        mio::mmap_sink kc_mmap{output.path().string()};
-        std::span<char> kc_data{kc_mmap.data(), kc_mmap.size()};
-        KernelCache kc {kc_data};
+        ReplaceOptions options{
+            .fileset_id = args["<fileset_id>"] ? args["<fileset_id>"].asString() : std::string{},
+            .auto_victim = args["--auto-victim"].asBool(),
+            .scatter = args["--scatter"].asBool(),
+            .kext = args["--kext"].asString(),
+            .symbols = optional_path(args["--symbols"]),
+            .kext_cache = kext_cache,
+            .result_cache = optional_path(args["--result-cache"]),
+            .output_format = parse_output_format(args["--output-format"].asString()),
+            .trace = args["--trace"].asBool(),
+            .low_memory = args["--low-memory"].asBool(),
+        };
+        if (args["--connect"]) {
+            if (options.trace || options.low_memory || args["--profile"]) {
+                throw FatalError{"--trace, --profile and --low-memory are not supported with --connect"};
+            }
+            // Paths are resolved by the daemon, which may run in another directory
+            auto response = run_request(args["--connect"], {
+                {"command", "replace"},
+                {"fileset_id", options.fileset_id},
+                {"auto_victim", options.auto_victim},
+                {"scatter", options.scatter},
+                {"kernelcache", absolute_path(args["--kernelcache"])},
+                {"kext", absolute_path(args["--kext"])},
+                {"output", absolute_path(args["--output"])},
+                {"symbols", absolute_path(args["--symbols"])},
+                {"kext_cache", absolute_path(args["--kext-cache"])},
+                {"result_cache", absolute_path(args["--result-cache"])},
+                {"output_format", args["--output-format"].asString()},
+            });
+            if (options.auto_victim && response.contains("fileset_id")) {
+                fmt::print("Replaced {}\n", response["fileset_id"].get<std::string>());
+            }
+            return 0;
+        }
+        std::optional<Profiler> profiler;
+        if (args["--profile"]) {
+            profiler.emplace();
+        }
+        if (!args["--output-dir"]) {
+            auto errors = replace_kernelcaches(options, {ReplaceTarget{
+                .input = args["--kernelcache"].asString(),
+                .output = args["--output"].asString(),
+            }});
+            // The profile of a failed replace shows how far it got
+            report_profile(profiler, args["--profile"]);
+            if (errors[0]) {
+                std::rethrow_exception(errors[0]);
+            }
+            report_peak_memory(options);
+            return 0;
+        }
+
+        fs::path output_dir = args["--output-dir"].asString();
+        kcmod_verify(fs::is_directory(output_dir));
+        std::vector<std::string> inputs = args["<kernelcache>"].asStringList();
+        std::vector<ReplaceTarget> targets;
+        std::set<fs::path> outputs;
+        for (const auto &input: inputs) {
+            // Archive entries are written as a copy of the whole archive
+            auto archive_path = parse_archive_path(input);
+            fs::path output = output_dir / (archive_path ? archive_path->archive : fs::path{input}).filename();
+            if (!outputs.insert(output).second) {
+                throw FatalError{"Multiple input kernelcaches named {}", output.filename().string()};
+            }
+            targets.push_back(ReplaceTarget{.input = input, .output = output});
+        }
+        options.jobs = parse_jobs(args["--jobs"]);
+
+        auto errors = replace_kernelcaches(options, targets);
+        size_t failed = 0;
+        for (size_t i = 0; i < targets.size(); ++i) {
+            try {
+                if (errors[i]) {
+                    std::rethrow_exception(errors[i]);
+                }
+                fmt::print("[OK] {}\n", inputs[i]);
+            } catch (const std::exception &e) {
+                fmt::print(stderr, "[FAILED] {}: {}\n", inputs[i], e.what());
+                failed++;
+            }
+        }
+        report_peak_memory(options);
+        report_profile(profiler, args["--profile"]);
+        return failed == 0 ? 0 : 1;
+    } else if (args["compile-kext"]) {
         KernelExtension kext{args["--kext"].asString()};
-        std::optional<std::filesystem::path> symbols =
-            args["--symbols"] ? std::optional{std::filesystem::path{args["--symbols"].asString()}}
-                              : std::nullopt;
-        kc.replace_fileset(args["<fileset_id>"].asString(), kext, symbols);
-        std::filesystem::copy_file(output.path(), args["--output"].asString(),
-                                   std::filesystem::copy_options::overwrite_existing);
+        fs::path output = kext_cache ? kext_object_cache_path(*kext_cache, kext.path())
+                                     : fs::path{args["--output"].asString()};
+        if (kext_cache) {
+            fs::create_directories(*kext_cache);
+        }
+        write_kext_object(kext, output);
+        fmt::print("{}\n", output.string());
+    } else if (args["watch"]) {
+        watch_kext(WatchOptions{
+            .fileset_id = args["<fileset_id>"].asString(),
+            .kernelcache = args["--kernelcache"].asString(),
+            .kext = args["--kext"].asString(),
+            .output = args["--output"].asString(),
+            .symbols = optional_path(args["--symbols"]),
+            .interval = std::chrono::milliseconds{parse_number(args["--interval"], "--interval", 1)},
+        });
+    } else if (args["lookup"]) {
+        auto response = run_request(args["--connect"], {
+            {"command", "lookup"},
+            {"kernelcache", absolute_path(args["--kernelcache"])},
+            {"symbol", args["<symbol>"].asString()},
+        });
+        for (const auto &symbol: response["symbols"]) {
+            fmt::print("{:#x} type: {:#x} external: {}\n", symbol["vmaddr"].get<uint64_t>(),
+                       symbol["type"].get<int>(), symbol["external"].get<bool>());
+        }
+        return response["symbols"].empty() ? 1 : 0;
+    } else if (args["verify"]) {
+        auto response = run_request(args["--connect"], {
+            {"command", "verify"},
+            {"kernelcache", absolute_path(args["--kernelcache"])},
+        });
+        for (const auto &problem: response["problems"]) {
+            fmt::print(stderr, "{}\n", problem.get<std::string>());
+        }
+        return response["problems"].empty() ? 0 : 1;
+    } else if (args["victims"]) {
+        auto response = run_request(args["--connect"], {
+            {"command", "victims"},
+            {"kernelcache", absolute_path(args["--kernelcache"])},
+            {"kext", absolute_path(args["--kext"])},
+            {"kext_cache", absolute_path(args["--kext-cache"])},
+        });
+        bool fits = false;
+        for (const auto &victim: response["victims"]) {
+            if (victim["fits"].get<bool>()) {
+                fits = true;
+                fmt::print("[FITS] {} ({:#x} bytes unused)\n", victim["fileset_id"].get<std::string>(),
+                           victim["slack"].get<uint64_t>());
+            } else {
+                fmt::print("[REJECTED] {}: {}\n", victim["fileset_id"].get<std::string>(),
+                           victim["rejection"].get<std::string>());
+            }
+        }
+        return fits ? 0 : 1;
+    } else if (args["extract"]) {
+        fs::path output_dir = args["--output-dir"].asString();
+        fs::create_directories(output_dir);
+        std::vector<std::string> fileset_ids;
+        if (!args["--all"].asBool()) {
+            fileset_ids.push_back(args["<fileset_id>"].asString());
+        }
+        size_t jobs = parse_jobs(args["--jobs"]);
+        size_t failed = 0;
+        for (const auto &result: extract_filesets(args["--kernelcache"].asString(), fileset_ids, output_dir, jobs)) {
+            try {
+                if (result.error) {
+                    std::rethrow_exception(result.error);
+                }
+                fmt::print("[OK] {}\n", result.output.string());
+            } catch (const std::exception &e) {
+                fmt::print(stderr, "[FAILED] {}: {}\n", result.fileset_id, e.what());
+                failed++;
+            }
+        }
+        return failed == 0 ? 0 : 1;
+    } else if (args["symbolicate"]) {
+        SymbolicateOptions options{
+            .kernelcache = args["--kernelcache"].asString(),
+            .index = optional_path(args["--index"]),
+        };
+        for (const auto &kext: args["--injected-kext"].asStringList()) {
+            options.kexts.emplace_back(kext);
+        }
+        if (args["--slide"]) {
+            options.slide = parse_number(args["--slide"], "--slide", 0, 0);
+        }
+        for (const auto &input: args["<input>"].asStringList()) {
+            options.inputs.emplace_back(input);
+        }
+        symbolicate(options);
+    } else if (args["serve"]) {
+        serve(ServerOptions{
+            .socket = args["--socket"].asString(),
+            .memory_limit = parse_number(args["--memory-limit"], "--memory-limit") << 20,
+        });
     } else {
         kcmod_not_reachable();
     }
@@ -0,0 +1,93 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <cstring>
+
+#include "debug.h"
+#include "match_finder.h"
+
+
+using namespace kcmod;
+
+namespace {
+
+constexpr int k_hash_bits = 16;
+
+}// namespace
+
+
+MatchFinder::MatchFinder(std::span<const char> data, size_t window, size_t min_length, size_t max_length,
+                         size_t max_chain)
+    : data_{data}, window_{window}, min_length_{min_length}, max_length_{max_length}, max_chain_{max_chain},
+      head_(size_t{1} << k_hash_bits, -1), prev_(data.size(), -1) {
+    kcmod_verify(min_length >= 3 && min_length <= 4);
+    kcmod_verify(data.size() <= INT32_MAX);
+}
+
+uint32_t MatchFinder::hash(size_t pos) const {
+    uint32_t value = 0;
+    memcpy(&value, data_.data() + pos, min_length_);
+    return (value * 2654435761u) >> (32 - k_hash_bits);
+}
+
+void MatchFinder::insert(size_t pos) {
+    if (pos + min_length_ > data_.size()) {
+        return;
+    }
+    uint32_t h = hash(pos);
+    prev_[pos] = head_[h];
+    head_[h] = static_cast<int32_t>(pos);
+}
+
+Match MatchFinder::find(size_t pos) {
+    Match best{0, 0};
+    if (pos + min_length_ > data_.size()) {
+        return best;
+    }
+    size_t limit = std::min(max_length_, data_.size() - pos);
+    const char *current = data_.data() + pos;
+    int32_t candidate = head_[hash(pos)];
+    for (size_t chain = 0; candidate >= 0 && chain < max_chain_; ++chain) {
+        size_t distance = pos - candidate;
+        if (distance > window_) {
+            break;
+        }
+        const char *previous = data_.data() + candidate;
+        // Only candidates that improve on the best match are worth comparing
+        if (previous[best.length] == current[best.length] || best.length == 0) {
+            size_t length = 0;
+            while (length < limit && previous[length] == current[length]) {
+                ++length;
+            }
+            if (length > best.length) {
+                best = {length, distance};
+                if (length == limit) {
+                    break;
+                }
+            }
+        }
+        candidate = prev_[candidate];
+    }
+    insert(pos);
+    if (best.length < min_length_) {
+        return {0, 0};
+    }
+    return best;
+}
@@ -0,0 +1,67 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <cstdint>
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "memory.h"
+
+
+using namespace kcmod;
+
+namespace {
+
+size_t page_size() {
+    static const size_t size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    return size;
+}
+
+}// namespace
+
+
+void kcmod::advise_sequential(std::span<const char> data) {
+    uintptr_t begin = reinterpret_cast<uintptr_t>(data.data()) & ~(page_size() - 1);
+    uintptr_t end = reinterpret_cast<uintptr_t>(data.data() + data.size());
+    if (end > begin) {
+        madvise(reinterpret_cast<void *>(begin), end - begin, MADV_SEQUENTIAL);
+    }
+}
+
+void kcmod::release_pages(std::span<const char> data) {
+    uintptr_t begin = (reinterpret_cast<uintptr_t>(data.data()) + page_size() - 1) & ~(page_size() - 1);
+    uintptr_t end = reinterpret_cast<uintptr_t>(data.data() + data.size()) & ~(page_size() - 1);
+    if (end > begin) {
+        madvise(reinterpret_cast<void *>(begin), end - begin, MADV_DONTNEED);
+    }
+}
+
+size_t kcmod::peak_resident_size() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return static_cast<size_t>(usage.ru_maxrss);
+#else
+    // Linux reports kilobytes
+    return static_cast<size_t>(usage.ru_maxrss) * 1024;
+#endif
+}
@@ -0,0 +1,154 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+
+#include <fmt/format.h>
+
+#include "debug.h"
+#include "pipeline.h"
+#include "profile.h"
+#include "thread_pool.h"
+
+
+using namespace kcmod;
+
+namespace {
+
+// Width of the timeline bars in format_trace()
+constexpr size_t k_trace_width = 48;
+
+double milliseconds(Pipeline::Clock::duration duration) {
+    return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+}// namespace
+
+
+Pipeline::Stage Pipeline::add(std::string name, std::vector<Stage> dependencies, std::function<void()> fn) {
+    Stage stage = stages_.size();
+    for (Stage dependency: dependencies) {
+        kcmod_verify(dependency < stage);
+        stages_[dependency].dependents.push_back(stage);
+    }
+    stages_.push_back(StageInfo{.fn = std::move(fn), .dependencies = std::move(dependencies)});
+    trace_.push_back(StageTrace{.name = std::move(name)});
+    return stage;
+}
+
+void Pipeline::run() {
+    std::mutex mutex;
+    std::condition_variable done_cv;
+    size_t remaining = stages_.size();
+    std::vector<size_t> waiting_for(stages_.size());
+    std::vector<bool> failed(stages_.size());
+    std::exception_ptr error;
+    Clock::time_point begin = Clock::now();
+
+    // Stages may block waiting for work done elsewhere, every stage gets a
+    // thread so that never delays an independent stage. Declared last so the
+    // workers are joined before the state they use is destroyed.
+    std::function<void(Stage)> launch;
+    ThreadPool pool{stages_.size()};
+    launch = [&](Stage stage) {
+        pool.submit([&, stage] {
+            bool skip;
+            {
+                std::lock_guard lock{mutex};
+                skip = failed[stage];
+            }
+            if (!skip) {
+                trace_[stage].start = Clock::now() - begin;
+                try {
+                    ProfileScope scope{trace_[stage].name};
+                    stages_[stage].fn();
+                } catch (...) {
+                    std::lock_guard lock{mutex};
+                    failed[stage] = true;
+                    if (!error) {
+                        error = std::current_exception();
+                    }
+                }
+                trace_[stage].end = Clock::now() - begin;
+            }
+
+            std::lock_guard lock{mutex};
+            for (Stage dependent: stages_[stage].dependents) {
+                if (failed[stage]) {
+                    failed[dependent] = true;
+                }
+                if (--waiting_for[dependent] == 0) {
+                    launch(dependent);
+                }
+            }
+            if (--remaining == 0) {
+                done_cv.notify_all();
+            }
+        });
+    };
+
+    std::unique_lock lock{mutex};
+    for (Stage stage = 0; stage < stages_.size(); ++stage) {
+        trace_[stage].start.reset();
+        trace_[stage].end.reset();
+        waiting_for[stage] = stages_[stage].dependencies.size();
+    }
+    for (Stage stage = 0; stage < stages_.size(); ++stage) {
+        if (waiting_for[stage] == 0) {
+            launch(stage);
+        }
+    }
+    done_cv.wait(lock, [&] { return remaining == 0; });
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+std::string Pipeline::format_trace() const {
+    Clock::duration total{};
+    size_t name_width = 0;
+    for (const auto &stage: trace_) {
+        if (stage.end) {
+            total = std::max(total, *stage.end);
+        }
+        name_width = std::max(name_width, stage.name.size());
+    }
+    auto column = [&](Clock::duration time) {
+        return total.count() == 0 ? 0 : static_cast<size_t>(time * k_trace_width / total);
+    };
+
+    std::string result;
+    for (const auto &stage: trace_) {
+        if (!stage.start || !stage.end) {
+            result += fmt::format("{:<{}}  skipped\n", stage.name, name_width);
+            continue;
+        }
+        size_t from = column(*stage.start);
+        size_t to = std::max(column(*stage.end), from + 1);
+        std::string bar(k_trace_width + 1, ' ');
+        std::fill(bar.begin() + static_cast<ptrdiff_t>(from),
+                  bar.begin() + static_cast<ptrdiff_t>(std::min(to, bar.size())), '#');
+        result += fmt::format("{:<{}}  |{}| {:9.2f} .. {:9.2f} ms\n", stage.name, name_width, bar,
+                              milliseconds(*stage.start), milliseconds(*stage.end));
+    }
+    return result;
+}
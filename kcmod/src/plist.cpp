@@ -18,36 +18,701 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
-#include <span>
+#include <charconv>
+#include <fstream>
+#include <unordered_set>
 
-#include <CoreFoundation/CFURL.h>
-#include <mio/mmap.hpp>
+#include <fmt/format.h>
 
+#include "debug.h"
 #include "plist.h"
-#include "common.h"
+#include "profile.h"
 
 
 using namespace kcmod;
 
+namespace {
 
-PropertyList::PropertyList(const std::filesystem::path &path)
-    : PropertyList{std::span<const char>{mio::mmap_source {path.string()}}} {}
+constexpr std::string_view k_default_header =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+    "<!DOCTYPE plist PUBLIC \"-//Apple//DTD PLIST 1.0//EN\" \"http://www.apple.com/DTDs/PropertyList-1.0.dtd\">\n"
+    "<plist version=\"1.0\">\n";
+constexpr std::string_view k_default_trailer = "\n</plist>\n";
 
-PropertyList::PropertyList(const std::span<const char> data) {
-    CFDataRef cf_data = CFDataCreateWithBytesNoCopy(kCFAllocatorDefault, reinterpret_cast<const UInt8 *>(data.data()), data.size(), kCFAllocatorNull);
-    plist_ = CFPropertyListCreateFromXMLData(
-        kCFAllocatorDefault,
-        cf_data,
-        kCFPropertyListMutableContainers,
-        nullptr);
-    CFRelease(cf_data);
-    if (plist_ == nullptr) {
-        throw DecodeError {"Failed to decode property list"};
+constexpr std::string_view k_base64_alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+const char *type_name(PlistNode::Type type, bool boolean) {
+    switch (type) {
+        case PlistNode::Type::DICT:
+            return "dict";
+        case PlistNode::Type::ARRAY:
+            return "array";
+        case PlistNode::Type::STRING:
+            return "string";
+        case PlistNode::Type::INTEGER:
+            return "integer";
+        case PlistNode::Type::REAL:
+            return "real";
+        case PlistNode::Type::BOOLEAN:
+            return boolean ? "true" : "false";
+        case PlistNode::Type::DATA:
+            return "data";
+        case PlistNode::Type::DATE:
+            return "date";
+    }
+    kcmod_not_reachable();
+}
+
+void link_child(PlistNode *parent, PlistNode *child) {
+    child->parent = parent;
+    child->prev = parent->last;
+    child->next = nullptr;
+    if (parent->last) {
+        parent->last->next = child;
+    } else {
+        parent->first = child;
+    }
+    parent->last = child;
+    parent->count++;
+}
+
+void append_utf8(std::string &out, uint32_t cp) {
+    if (cp < 0x80) {
+        out += static_cast<char>(cp);
+    } else if (cp < 0x800) {
+        out += static_cast<char>(0xc0 | (cp >> 6));
+        out += static_cast<char>(0x80 | (cp & 0x3f));
+    } else if (cp < 0x10000) {
+        out += static_cast<char>(0xe0 | (cp >> 12));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+        out += static_cast<char>(0x80 | (cp & 0x3f));
+    } else {
+        out += static_cast<char>(0xf0 | (cp >> 18));
+        out += static_cast<char>(0x80 | ((cp >> 12) & 0x3f));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+        out += static_cast<char>(0x80 | (cp & 0x3f));
+    }
+}
+
+void append_escaped(std::string &out, std::string_view text) {
+    for (char c: text) {
+        switch (c) {
+            case '&':
+                out += "&amp;";
+                break;
+            case '<':
+                out += "&lt;";
+                break;
+            case '>':
+                out += "&gt;";
+                break;
+            default:
+                out += c;
+        }
+    }
+}
+
+}// namespace
+
+
+uint64_t kcmod::parse_plist_integer(std::string_view text) {
+    while (!text.empty() && (text.front() == ' ' || text.front() == '\t' || text.front() == '\n')) {
+        text.remove_prefix(1);
+    }
+    bool negative = text.starts_with('-');
+    if (negative) {
+        text.remove_prefix(1);
+    }
+    int base = 10;
+    if (text.starts_with("0x") || text.starts_with("0X")) {
+        text.remove_prefix(2);
+        base = 16;
+    }
+    uint64_t value = 0;
+    auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), value, base);
+    if (ec != std::errc{}) {
+        throw DecodeError{"Invalid property list integer {}", text};
+    }
+    return negative ? -value : value;
+}
+
+std::string kcmod::escape_xml(std::string_view text) {
+    std::string result;
+    result.reserve(text.size());
+    append_escaped(result, text);
+    return result;
+}
+
+std::string kcmod::unescape_xml(std::string_view text) {
+    std::string result;
+    result.reserve(text.size());
+    for (size_t i = 0; i < text.size(); ++i) {
+        if (text[i] != '&') {
+            result += text[i];
+            continue;
+        }
+        size_t end = text.find(';', i);
+        kcmod_decode_verify(end != std::string_view::npos);
+        std::string_view entity = text.substr(i + 1, end - i - 1);
+        if (entity == "lt") {
+            result += '<';
+        } else if (entity == "gt") {
+            result += '>';
+        } else if (entity == "amp") {
+            result += '&';
+        } else if (entity == "quot") {
+            result += '"';
+        } else if (entity == "apos") {
+            result += '\'';
+        } else if (entity.starts_with("#")) {
+            bool hex = entity.starts_with("#x");
+            uint32_t cp = 0;
+            auto [ptr, ec] = std::from_chars(entity.data() + (hex ? 2 : 1), entity.data() + entity.size(), cp, hex ? 16 : 10);
+            kcmod_decode_verify(ec == std::errc{} && ptr == entity.data() + entity.size());
+            append_utf8(result, cp);
+        } else {
+            throw DecodeError{"Unknown entity &{};", entity};
+        }
+        i = end;
+    }
+    return result;
+}
+
+
+namespace kcmod {
+
+class PlistParser {
+public:
+    PlistParser(PropertyList &plist, std::string_view source) : plist_{plist}, src_{source} {}
+
+    void parse() {
+        // __PRELINK_INFO is zero padded after the document
+        src_ = src_.substr(0, src_.find('\0'));
+        skip_misc();
+        if (src_.substr(pos_).starts_with("<plist")) {
+            Tag tag = read_tag();
+            kcmod_decode_verify(!tag.closing && !tag.empty && tag.name == "plist");
+            skip_misc();
+        }
+        plist_.header_ = src_.substr(0, pos_);
+        plist_.root_ = parse_value(nullptr);
+        plist_.trailer_ = src_.substr(pos_);
+        plist_.pretty_ = plist_.root_->close.find('\n') != std::string_view::npos;
+    }
+
+private:
+    struct Tag {
+        std::string_view name;
+        std::string_view id;
+        std::string_view idref;
+        bool closing = false;
+        bool empty = false;
+    };
+
+    char peek() const {
+        kcmod_decode_verify(pos_ < src_.size());
+        return src_[pos_];
+    }
+
+    void skip_space() {
+        while (pos_ < src_.size() && (src_[pos_] == ' ' || src_[pos_] == '\t' || src_[pos_] == '\n' || src_[pos_] == '\r')) {
+            pos_++;
+        }
+    }
+
+    void skip_past(std::string_view token) {
+        size_t end = src_.find(token, pos_);
+        kcmod_decode_verify(end != std::string_view::npos);
+        pos_ = end + token.size();
+    }
+
+    // Skips whitespace, processing instructions, comments and DOCTYPE
+    void skip_misc() {
+        while (true) {
+            skip_space();
+            std::string_view rest = src_.substr(pos_);
+            if (rest.starts_with("<?")) {
+                skip_past("?>");
+            } else if (rest.starts_with("<!--")) {
+                skip_past("-->");
+            } else if (rest.starts_with("<!")) {
+                skip_past(">");
+            } else {
+                return;
+            }
+        }
+    }
+
+    Tag read_tag() {
+        kcmod_decode_verify(peek() == '<');
+        pos_++;
+        Tag tag;
+        if (peek() == '/') {
+            tag.closing = true;
+            pos_++;
+        }
+        size_t name_begin = pos_;
+        while (peek() != '>' && peek() != '/' && peek() != ' ' && peek() != '\t' && peek() != '\n' && peek() != '\r') {
+            pos_++;
+        }
+        tag.name = src_.substr(name_begin, pos_ - name_begin);
+        while (true) {
+            skip_space();
+            if (peek() == '/') {
+                pos_++;
+                kcmod_decode_verify(peek() == '>');
+                pos_++;
+                tag.empty = true;
+                return tag;
+            }
+            if (peek() == '>') {
+                pos_++;
+                return tag;
+            }
+            size_t attr_begin = pos_;
+            while (peek() != '=' && peek() != ' ') {
+                pos_++;
+            }
+            std::string_view attr = src_.substr(attr_begin, pos_ - attr_begin);
+            skip_space();
+            kcmod_decode_verify(peek() == '=');
+            pos_++;
+            skip_space();
+            char quote = peek();
+            kcmod_decode_verify(quote == '"' || quote == '\'');
+            size_t value_begin = ++pos_;
+            skip_past(std::string_view{&quote, 1});
+            std::string_view value = src_.substr(value_begin, pos_ - 1 - value_begin);
+            if (attr == "ID") {
+                tag.id = value;
+            } else if (attr == "IDREF") {
+                tag.idref = value;
+            }
+        }
+    }
+
+    // Reads the text of an element up to and including its closing tag
+    std::string_view read_text(std::string_view name) {
+        size_t text_end = src_.find('<', pos_);
+        kcmod_decode_verify(text_end != std::string_view::npos);
+        std::string_view text = src_.substr(pos_, text_end - pos_);
+        pos_ = text_end;
+        Tag close = read_tag();
+        kcmod_decode_verify(close.closing && close.name == name);
+        return text;
+    }
+
+    std::string_view decode(std::string_view text) {
+        if (text.find('&') == std::string_view::npos) {
+            return text;
+        }
+        return plist_.arena_.copy(unescape_xml(text));
+    }
+
+    PlistNode::Type parse_type(std::string_view name) {
+        if (name == "dict") {
+            return PlistNode::Type::DICT;
+        } else if (name == "array") {
+            return PlistNode::Type::ARRAY;
+        } else if (name == "string") {
+            return PlistNode::Type::STRING;
+        } else if (name == "integer") {
+            return PlistNode::Type::INTEGER;
+        } else if (name == "real") {
+            return PlistNode::Type::REAL;
+        } else if (name == "true" || name == "false") {
+            return PlistNode::Type::BOOLEAN;
+        } else if (name == "data") {
+            return PlistNode::Type::DATA;
+        } else if (name == "date") {
+            return PlistNode::Type::DATE;
+        }
+        throw DecodeError{"Unexpected property list element {}", name};
+    }
+
+    PlistNode *parse_value(PlistNode *parent) {
+        size_t begin = pos_;
+        Tag tag = read_tag();
+        kcmod_decode_verify(!tag.closing);
+        PlistNode *node = plist_.new_node(parse_type(tag.name));
+        node->parent = parent;
+        if (!tag.idref.empty()) {
+            kcmod_decode_verify(tag.empty);
+            auto it = plist_.ids_.find(tag.idref);
+            if (it == plist_.ids_.end()) {
+                throw DecodeError{"Undefined IDREF {}", tag.idref};
+            }
+            node->ref = it->second;
+            node->source = src_.substr(begin, pos_ - begin);
+            return node;
+        }
+        switch (node->type) {
+            case PlistNode::Type::DICT:
+            case PlistNode::Type::ARRAY:
+                node->open = src_.substr(begin, pos_ - begin);
+                if (!tag.empty) {
+                    parse_children(node, tag.name);
+                }
+                break;
+            case PlistNode::Type::BOOLEAN:
+                kcmod_decode_verify(tag.empty);
+                node->boolean = tag.name == "true";
+                break;
+            case PlistNode::Type::STRING:
+                node->text = tag.empty ? std::string_view{} : decode(read_text(tag.name));
+                break;
+            default:
+                node->text = tag.empty ? std::string_view{} : read_text(tag.name);
+                break;
+        }
+        node->source = src_.substr(begin, pos_ - begin);
+        node->id = tag.id;
+        if (!tag.id.empty()) {
+            plist_.ids_[tag.id] = node;
+        }
+        return node;
+    }
+
+    void parse_children(PlistNode *node, std::string_view name) {
+        while (true) {
+            size_t prefix_begin = pos_;
+            skip_misc();
+            if (src_.substr(pos_).starts_with("</")) {
+                Tag close = read_tag();
+                kcmod_decode_verify(close.name == name);
+                node->close = src_.substr(prefix_begin, pos_ - prefix_begin);
+                return;
+            }
+            std::string_view key;
+            if (node->type == PlistNode::Type::DICT) {
+                Tag key_tag = read_tag();
+                kcmod_decode_verify(!key_tag.closing && key_tag.name == "key");
+                if (!key_tag.empty) {
+                    key = decode(read_text("key"));
+                }
+                skip_misc();
+            }
+            size_t value_begin = pos_;
+            PlistNode *child = parse_value(node);
+            child->key = key;
+            child->prefix = src_.substr(prefix_begin, value_begin - prefix_begin);
+            link_child(node, child);
+            node->has_ids |= child->has_ids || child->ref || !child->id.empty();
+        }
+    }
+
+private:
+    PropertyList &plist_;
+    std::string_view src_;
+    size_t pos_ = 0;
+};
+
+class PlistWriter {
+public:
+    PlistWriter(const PropertyList &plist, std::string &out) : plist_{plist}, out_{out}, pretty_{plist.pretty_} {}
+
+    void write() {
+        bool parsed = plist_.header_.data() != nullptr;
+        out_ += parsed ? plist_.header_ : k_default_header;
+        write(plist_.root_, 0);
+        out_ += parsed ? plist_.trailer_ : k_default_trailer;
+    }
+
+    void write_fragment(const PlistNode *node) {
+        pretty_ = false;
+        write(node, 0);
+    }
+
+private:
+    bool is_clean(const PlistNode *node) const {
+        return !node->dirty && !node->source.empty();
+    }
+
+    void indent(size_t depth) {
+        if (pretty_) {
+            out_ += '\n';
+            out_.append(depth, '\t');
+        }
+    }
+
+    void write_idref(const PlistNode *node, std::string_view id) {
+        out_ += fmt::format("<{} IDREF=\"{}\"/>", type_name(node->type, node->resolve()->boolean), id);
+    }
+
+    void write(const PlistNode *node, size_t depth) {
+        if (node->ref) {
+            if (emitted_.contains(node->ref->id)) {
+                if (is_clean(node)) {
+                    out_ += node->source;
+                } else {
+                    write_idref(node, node->ref->id);
+                }
+            } else {
+                // The element defining the ID was removed, define it here
+                write(node->ref, depth);
+            }
+            return;
+        }
+        if (!node->id.empty() && !emitted_.insert(node->id).second) {
+            write_idref(node, node->id);
+            return;
+        }
+        if (is_clean(node) && !node->has_ids) {
+            out_ += node->source;
+            return;
+        }
+
+        const char *name = type_name(node->type, node->boolean);
+        std::string id_attribute = node->id.empty() ? "" : fmt::format(" ID=\"{}\"", node->id);
+        switch (node->type) {
+            case PlistNode::Type::DICT:
+            case PlistNode::Type::ARRAY:
+                break;
+            case PlistNode::Type::BOOLEAN:
+                out_ += fmt::format("<{}{}/>", name, id_attribute);
+                return;
+            case PlistNode::Type::INTEGER:
+                out_ += fmt::format("<integer{} size=\"64\">{}</integer>", id_attribute, node->text);
+                return;
+            default:
+                out_ += fmt::format("<{}{}>", name, id_attribute);
+                append_escaped(out_, node->text);
+                out_ += fmt::format("</{}>", name);
+                return;
+        }
+
+        // Parsed containers keep their tags and the text between children
+        bool parsed_tags = !node->close.empty();
+        if (!parsed_tags && node->count == 0) {
+            out_ += fmt::format("<{}{}/>", name, id_attribute);
+            return;
+        }
+        out_ += parsed_tags ? node->open : fmt::format("<{}{}>", name, id_attribute);
+        for (const PlistNode *child: node->children()) {
+            if (child->prefix.data() != nullptr) {
+                out_ += child->prefix;
+            } else {
+                indent(depth + 1);
+                if (node->is_dict()) {
+                    out_ += "<key>";
+                    append_escaped(out_, child->key);
+                    out_ += "</key>";
+                    indent(depth + 1);
+                }
+            }
+            write(child, depth + 1);
+        }
+        if (parsed_tags) {
+            out_ += node->close;
+        } else {
+            indent(depth);
+            out_ += fmt::format("</{}>", name);
+        }
+    }
+
+private:
+    const PropertyList &plist_;
+    std::string &out_;
+    bool pretty_;
+    std::unordered_set<std::string_view> emitted_;
+};
+
+}// namespace kcmod
+
+
+void *Arena::allocate(size_t size, size_t alignment) {
+    size_t padding = (alignment - reinterpret_cast<uintptr_t>(next_) % alignment) % alignment;
+    if (next_ == nullptr || padding + size > available_) {
+        size_t block_size = std::max(block_size_, size + alignment);
+        blocks_.push_back(std::make_unique<char[]>(block_size));
+        next_ = blocks_.back().get();
+        available_ = block_size;
+        padding = (alignment - reinterpret_cast<uintptr_t>(next_) % alignment) % alignment;
     }
+    char *result = next_ + padding;
+    next_ += padding + size;
+    available_ -= padding + size;
+    return result;
 }
 
-PropertyList::~PropertyList() {
-    CFRelease(plist_);
+std::string_view Arena::copy(std::string_view value) {
+    if (value.empty()) {
+        return {};
+    }
+    char *data = static_cast<char *>(allocate(value.size(), 1));
+    std::copy(value.begin(), value.end(), data);
+    return {data, value.size()};
 }
 
 
+PlistNode *PlistNode::find(std::string_view name) const {
+    const PlistNode *node = resolve();
+    if (!node->is_dict()) {
+        return nullptr;
+    }
+    for (PlistNode *child: node->children()) {
+        if (child->key == name) {
+            return child;
+        }
+    }
+    return nullptr;
+}
+
+std::string_view PlistNode::string() const {
+    const PlistNode *node = resolve();
+    if (node->type != Type::STRING) {
+        throw DecodeError{"Expected property list string, found {}", type_name(node->type, node->boolean)};
+    }
+    return node->text;
+}
+
+uint64_t PlistNode::integer() const {
+    const PlistNode *node = resolve();
+    if (node->type != Type::INTEGER) {
+        throw DecodeError{"Expected property list integer, found {}", type_name(node->type, node->boolean)};
+    }
+    return parse_plist_integer(node->text);
+}
+
+
+PropertyList::PropertyList() = default;
+
+PropertyList::PropertyList(const std::filesystem::path &path) {
+    std::ifstream file{path, std::ios::binary};
+    if (!file) {
+        throw DecodeError{"Failed to open property list {}", path.string()};
+    }
+    std::vector<char> data{std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{}};
+    *this = PropertyList{std::span<const char>{data}};
+}
+
+PropertyList::PropertyList(const std::span<const char> data) : source_{std::make_unique<char[]>(data.size())} {
+    std::copy(data.begin(), data.end(), source_.get());
+    PlistParser{*this, std::string_view{source_.get(), data.size()}}.parse();
+    profile_count(ProfileCounter::PLIST_BYTES_PARSED, data.size());
+}
+
+void PropertyList::set_root(PlistNode *root) {
+    root_ = root;
+}
+
+PlistNode *PropertyList::new_node(PlistNode::Type type) {
+    PlistNode *node = arena_.create<PlistNode>();
+    node->type = type;
+    return node;
+}
+
+PlistNode *PropertyList::new_dict() {
+    return new_node(PlistNode::Type::DICT);
+}
+
+PlistNode *PropertyList::new_array() {
+    return new_node(PlistNode::Type::ARRAY);
+}
+
+PlistNode *PropertyList::new_string(std::string_view value) {
+    PlistNode *node = new_node(PlistNode::Type::STRING);
+    node->text = arena_.copy(value);
+    return node;
+}
+
+PlistNode *PropertyList::new_integer(uint64_t value) {
+    PlistNode *node = new_node(PlistNode::Type::INTEGER);
+    node->text = arena_.copy(fmt::format("{:#x}", value));
+    return node;
+}
+
+PlistNode *PropertyList::new_boolean(bool value) {
+    PlistNode *node = new_node(PlistNode::Type::BOOLEAN);
+    node->boolean = value;
+    return node;
+}
+
+PlistNode *PropertyList::new_data(std::span<const uint8_t> value) {
+    std::string text;
+    text.reserve((value.size() + 2) / 3 * 4);
+    for (size_t i = 0; i < value.size(); i += 3) {
+        uint32_t group = value[i] << 16;
+        if (i + 1 < value.size()) {
+            group |= value[i + 1] << 8;
+        }
+        if (i + 2 < value.size()) {
+            group |= value[i + 2];
+        }
+        text += k_base64_alphabet[(group >> 18) & 0x3f];
+        text += k_base64_alphabet[(group >> 12) & 0x3f];
+        text += i + 1 < value.size() ? k_base64_alphabet[(group >> 6) & 0x3f] : '=';
+        text += i + 2 < value.size() ? k_base64_alphabet[group & 0x3f] : '=';
+    }
+    PlistNode *node = new_node(PlistNode::Type::DATA);
+    node->text = arena_.copy(text);
+    return node;
+}
+
+PlistNode *PropertyList::copy(const PlistNode *node) {
+    node = node->resolve();
+    PlistNode *result = new_node(node->type);
+    result->text = arena_.copy(node->text);
+    result->boolean = node->boolean;
+    for (const PlistNode *child: node->children()) {
+        PlistNode *child_copy = copy(child);
+        child_copy->key = arena_.copy(child->key);
+        link_child(result, child_copy);
+    }
+    return result;
+}
+
+void PropertyList::set(PlistNode *dict, std::string_view key, PlistNode *value) {
+    kcmod_verify(dict->is_dict() && dict->ref == nullptr);
+    value->key = arena_.copy(key);
+    if (PlistNode *existing = dict->find(key)) {
+        // Keep the <key> element and whitespace of the replaced value
+        value->prefix = existing->prefix;
+        value->parent = dict;
+        value->prev = existing->prev;
+        value->next = existing->next;
+        (value->prev ? value->prev->next : dict->first) = value;
+        (value->next ? value->next->prev : dict->last) = value;
+    } else {
+        link_child(dict, value);
+    }
+    mark_dirty(dict);
+}
+
+void PropertyList::append(PlistNode *array, PlistNode *value) {
+    kcmod_verify(array->is_array() && array->ref == nullptr);
+    link_child(array, value);
+    mark_dirty(array);
+}
+
+void PropertyList::remove(PlistNode *node) {
+    PlistNode *parent = node->parent;
+    kcmod_verify(parent != nullptr);
+    (node->prev ? node->prev->next : parent->first) = node->next;
+    (node->next ? node->next->prev : parent->last) = node->prev;
+    parent->count--;
+    node->parent = node->prev = node->next = nullptr;
+    mark_dirty(parent);
+}
+
+void PropertyList::mark_dirty(PlistNode *node) {
+    for (; node && !node->dirty; node = node->parent) {
+        node->dirty = true;
+    }
+}
+
+std::string PropertyList::serialize() const {
+    kcmod_verify(root_ != nullptr);
+    std::string result;
+    result.reserve(header_.size() + (root_->source.size() + trailer_.size()) * 9 / 8 + 4096);
+    PlistWriter{*this, result}.write();
+    profile_count(ProfileCounter::PLIST_BYTES_SERIALIZED, result.size());
+    return result;
+}
+
+std::string PropertyList::serialize(const PlistNode *node) const {
+    std::string result;
+    PlistWriter{*this, result}.write_fragment(node);
+    profile_count(ProfileCounter::PLIST_BYTES_SERIALIZED, result.size());
+    return result;
+}
@@ -0,0 +1,117 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <cstring>
+#include <future>
+
+#include <mach-o/fixup-chains.h>
+
+#include "pointer_index.h"
+#include "thread_pool.h"
+
+using namespace kcmod;
+
+namespace {
+
+// Pages of chains walked by one task
+constexpr uint64_t k_pages_per_task = 256;
+
+}// namespace
+
+PointerIndex::PointerIndex(std::span<const char> kernelcache) {
+    MachOBinary<const char> kc{kernelcache};
+    uint64_t vm_base = kc.vm_base();
+
+    struct Task {
+        const dyld_chained_starts_in_segment* starts;
+        uint64_t first_page;
+        uint64_t end_page;
+    };
+    std::vector<Task> tasks;
+    for (const auto* starts: read_chained_starts(kc)) {
+        for (uint64_t page = 0; page < starts->page_count; page += k_pages_per_task) {
+            tasks.push_back({starts, page, std::min<uint64_t>(page + k_pages_per_task, starts->page_count)});
+        }
+    }
+
+    auto walk = [&](const Task& task) {
+        std::vector<Entry> entries;
+        for (uint64_t page_idx = task.first_page; page_idx < task.end_page; ++page_idx) {
+            uint16_t page_start = task.starts->page_start[page_idx];
+            if (page_start == DYLD_CHAINED_PTR_START_NONE) {
+                continue;
+            }
+            kcmod_decode_verify(!(page_start & DYLD_CHAINED_PTR_START_MULTI));
+            uint64_t page_begin = task.starts->segment_offset + page_idx * task.starts->page_size;
+            uint64_t position = page_begin + page_start;
+            while (true) {
+                kcmod_decode_verify(position + sizeof(DyldFixupPointer) <= page_begin + task.starts->page_size);
+                kcmod_decode_verify(position + sizeof(DyldFixupPointer) <= kernelcache.size());
+                DyldFixupPointer pointer;
+                memcpy(&pointer, kernelcache.data() + position, sizeof(pointer));
+                if (!pointer.bind) {
+                    uint64_t target = pointer.auth ? pointer.ptr_auth_rebase.target : pointer.ptr_rebase.target;
+                    entries.push_back({vm_base + target, position});
+                }
+                if (pointer.next == 0) {
+                    break;
+                }
+                position += pointer.next * 4;
+            }
+        }
+        return entries;
+    };
+
+    std::vector<std::vector<Entry>> results(tasks.size());
+    if (tasks.size() < 2) {
+        for (size_t i = 0; i < tasks.size(); ++i) {
+            results[i] = walk(tasks[i]);
+        }
+    } else {
+        ThreadPool pool{std::min(tasks.size(), ThreadPool::default_thread_count())};
+        std::vector<std::future<std::vector<Entry>>> futures;
+        for (const auto& task: tasks) {
+            futures.push_back(pool.submit([&walk, &task] { return walk(task); }));
+        }
+        for (size_t i = 0; i < futures.size(); ++i) {
+            results[i] = futures[i].get();
+        }
+    }
+
+    size_t count = 0;
+    for (const auto& entries: results) {
+        count += entries.size();
+    }
+    entries_.reserve(count);
+    for (const auto& entries: results) {
+        entries_.insert(entries_.end(), entries.begin(), entries.end());
+    }
+    std::ranges::sort(entries_);
+}
+
+std::vector<uint64_t> PointerIndex::find(uint64_t vmaddr) const {
+    auto begin = std::ranges::lower_bound(entries_, Entry{vmaddr, 0});
+    std::vector<uint64_t> result;
+    for (auto it = begin; it != entries_.end() && it->target == vmaddr; ++it) {
+        result.push_back(it->fileoff);
+    }
+    return result;
+}
@@ -0,0 +1,555 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <charconv>
+#include <functional>
+#include <optional>
+
+#include <fmt/format.h>
+
+#include "debug.h"
+#include "prelink.h"
+#include "profile.h"
+
+
+using namespace kcmod;
+
+namespace {
+
+struct Tag {
+    std::string_view name;
+    std::string_view id;
+    std::string_view idref;
+    std::string_view size;
+    bool empty = false;
+};
+
+// Reads the opening tag at pos and advances pos past it
+Tag read_tag(std::string_view xml, size_t &pos) {
+    size_t end = xml.find('>', pos);
+    kcmod_decode_verify(end != std::string_view::npos);
+    std::string_view tag_text = xml.substr(pos + 1, end - pos - 1);
+    pos = end + 1;
+
+    Tag tag;
+    if (tag_text.ends_with('/')) {
+        tag.empty = true;
+        tag_text.remove_suffix(1);
+    }
+    size_t name_end = tag_text.find_first_of(" \t\r\n");
+    tag.name = tag_text.substr(0, name_end);
+    if (name_end == std::string_view::npos) {
+        return tag;
+    }
+    auto attribute = [&](std::string_view name) -> std::string_view {
+        for (size_t at = tag_text.find(name, name_end); at != std::string_view::npos; at = tag_text.find(name, at + 1)) {
+            char before = tag_text[at - 1];
+            size_t quote = at + name.size() + 1;
+            if ((before == ' ' || before == '\t' || before == '\n') && quote < tag_text.size() &&
+                tag_text[at + name.size()] == '=') {
+                size_t value_end = tag_text.find(tag_text[quote], quote + 1);
+                kcmod_decode_verify(value_end != std::string_view::npos);
+                return tag_text.substr(quote + 1, value_end - quote - 1);
+            }
+        }
+        return {};
+    };
+    tag.id = attribute("ID");
+    tag.idref = attribute("IDREF");
+    tag.size = attribute("size");
+    return tag;
+}
+
+std::string_view trim(std::string_view text) {
+    size_t begin = text.find_first_not_of(" \t\r\n");
+    if (begin == std::string_view::npos) {
+        return {};
+    }
+    return text.substr(begin, text.find_last_not_of(" \t\r\n") - begin + 1);
+}
+
+// Key identifying a scalar value independent of how it is formatted
+std::string scalar_key(std::string_view name, std::string_view size, std::string_view text) {
+    if (name == "integer") {
+        return fmt::format("integer:{}:{:#x}", size.empty() ? "64" : size, parse_plist_integer(text));
+    } else if (name == "string") {
+        return fmt::format("string:{}", unescape_xml(text));
+    }
+    return fmt::format("{}:{}", name, trim(text));
+}
+
+// Writes an info dictionary without whitespace, sharing repeated values
+class InfoWriter {
+public:
+    // existing returns the ID of a value already defined in the document
+    using Lookup = std::function<std::optional<std::string_view>(const std::string &)>;
+
+    InfoWriter(Lookup existing, uint64_t &next_id) : existing_{std::move(existing)}, next_id_{next_id} {}
+
+    std::string write(const PlistNode *root) {
+        count(root);
+        std::string out;
+        write(root, out);
+        return out;
+    }
+
+private:
+    static const char *name(const PlistNode *node) {
+        switch (node->type) {
+            case PlistNode::Type::DICT:
+                return "dict";
+            case PlistNode::Type::ARRAY:
+                return "array";
+            case PlistNode::Type::STRING:
+                return "string";
+            case PlistNode::Type::INTEGER:
+                return "integer";
+            case PlistNode::Type::REAL:
+                return "real";
+            case PlistNode::Type::BOOLEAN:
+                return node->boolean ? "true" : "false";
+            case PlistNode::Type::DATA:
+                return "data";
+            case PlistNode::Type::DATE:
+                return "date";
+        }
+        kcmod_not_reachable();
+    }
+
+    const std::string &key(const PlistNode *node) {
+        auto it = keys_.find(node);
+        if (it != keys_.end()) {
+            return it->second;
+        }
+        std::string result;
+        if (node->is_dict() || node->is_array()) {
+            result = fmt::format("{}{{", name(node));
+            for (const PlistNode *child: node->children()) {
+                if (node->is_dict()) {
+                    result += fmt::format("key:{}", child->key);
+                    result += '\0';
+                }
+                result += key(child);
+                result += '\0';
+            }
+            result += '}';
+        } else if (node->type == PlistNode::Type::BOOLEAN) {
+            result = name(node);
+        } else {
+            result = scalar_key(name(node), "", node->text);
+        }
+        return keys_.emplace(node, std::move(result)).first->second;
+    }
+
+    // Counts the occurrences of every value, values nested in a repeated
+    // container are only counted in its first occurrence
+    void count(const PlistNode *node) {
+        if (counts_[key(node)]++ > 0) {
+            return;
+        }
+        for (const PlistNode *child: node->children()) {
+            count(child);
+        }
+    }
+
+    static std::string idref(const PlistNode *node, std::string_view id) {
+        return fmt::format("<{} IDREF=\"{}\"/>", name(node), id);
+    }
+
+    std::string definition(const PlistNode *node, std::string_view id) {
+        std::string id_attribute = id.empty() ? "" : fmt::format(" ID=\"{}\"", id);
+        switch (node->type) {
+            case PlistNode::Type::BOOLEAN:
+                return fmt::format("<{}/>", name(node));
+            case PlistNode::Type::INTEGER:
+                return fmt::format("<integer size=\"64\"{}>{:#x}</integer>", id_attribute, node->integer());
+            default:
+                return fmt::format("<{0}{1}>{2}</{0}>", name(node), id_attribute, escape_xml(node->text));
+        }
+    }
+
+    void write(const PlistNode *node, std::string &out) {
+        const std::string &node_key = key(node);
+        if (auto it = ids_.find(node_key); it != ids_.end()) {
+            out += idref(node, it->second);
+            return;
+        }
+        bool container = node->is_dict() || node->is_array();
+        if (!container && node->type != PlistNode::Type::BOOLEAN) {
+            if (auto id = existing_(node_key)) {
+                std::string ref = idref(node, *id);
+                if (ref.size() <= definition(node, "").size()) {
+                    out += ref;
+                    return;
+                }
+            }
+        }
+
+        std::string id;
+        if (counts_[node_key] > 1 && node->type != PlistNode::Type::BOOLEAN) {
+            id = std::to_string(next_id_++);
+            ids_.emplace(node_key, id);
+        }
+        if (!container) {
+            out += definition(node, id);
+            return;
+        }
+        std::string id_attribute = id.empty() ? "" : fmt::format(" ID=\"{}\"", id);
+        if (node->size() == 0) {
+            out += fmt::format("<{}{}/>", name(node), id_attribute);
+            return;
+        }
+        out += fmt::format("<{}{}>", name(node), id_attribute);
+        for (const PlistNode *child: node->children()) {
+            if (node->is_dict()) {
+                out += fmt::format("<key>{}</key>", escape_xml(child->key));
+            }
+            write(child, out);
+        }
+        out += fmt::format("</{}>", name(node));
+    }
+
+private:
+    Lookup existing_;
+    uint64_t &next_id_;
+    std::unordered_map<const PlistNode *, std::string> keys_;
+    std::unordered_map<std::string, size_t> counts_;
+    std::unordered_map<std::string, std::string> ids_;
+};
+
+bool contains(std::span<const std::pair<size_t, size_t>> ranges, size_t begin, size_t end) {
+    return std::ranges::any_of(ranges, [&](const auto &range) {
+        return range.first <= begin && end <= range.second;
+    });
+}
+
+}// namespace
+
+
+PrelinkInfoEditor::PrelinkInfoEditor(std::span<char> segment) : segment_{segment} {
+    xml_ = std::string_view{segment.data(), segment.size()};
+    // The document is zero padded to the end of the segment
+    xml_ = xml_.substr(0, xml_.find('\0'));
+    scan();
+    profile_count(ProfileCounter::PLIST_BYTES_PARSED, xml_.size());
+}
+
+void PrelinkInfoEditor::scan() {
+    enum class Role {
+        OTHER,
+        ROOT,
+        ARRAY,
+        INFO,
+    };
+    struct Open {
+        size_t begin;
+        std::string_view id;
+        Role role;
+    };
+    std::vector<Open> stack;
+    bool root_seen = false;
+    std::string key;
+    size_t key_depth = SIZE_MAX;
+
+    size_t pos = 0;
+    while ((pos = xml_.find('<', pos)) != std::string_view::npos) {
+        size_t begin = pos;
+        std::string_view rest = xml_.substr(pos);
+        if (rest.starts_with("<?") || rest.starts_with("<!")) {
+            std::string_view terminator = rest.starts_with("<?") ? "?>" : rest.starts_with("<!--") ? "-->" : ">";
+            pos = xml_.find(terminator, pos);
+            kcmod_decode_verify(pos != std::string_view::npos);
+            pos += terminator.size();
+            continue;
+        }
+        if (rest.starts_with("</")) {
+            pos = xml_.find('>', pos);
+            kcmod_decode_verify(pos != std::string_view::npos && !stack.empty());
+            pos++;
+            Open open = stack.back();
+            stack.pop_back();
+            if (!open.id.empty()) {
+                define(open.id, {open.begin, pos});
+            }
+            if (open.role == Role::ARRAY) {
+                array_end_ = begin;
+            } else if (open.role == Role::INFO) {
+                info_dicts_.back().range.end = pos;
+            }
+            continue;
+        }
+
+        Tag tag = read_tag(xml_, pos);
+        Role parent = stack.empty() ? Role::OTHER : stack.back().role;
+        std::string_view value_key;
+        if (key_depth == stack.size()) {
+            value_key = key;
+            key_depth = SIZE_MAX;
+        }
+
+        if (tag.name == "key") {
+            kcmod_decode_verify(!tag.empty);
+            size_t text_end = xml_.find('<', pos);
+            kcmod_decode_verify(text_end != std::string_view::npos);
+            key = unescape_xml(xml_.substr(pos, text_end - pos));
+            key_depth = stack.size();
+            pos = xml_.find('>', text_end);
+            kcmod_decode_verify(pos != std::string_view::npos);
+            pos++;
+            continue;
+        }
+
+        bool is_bundle_id = parent == Role::INFO && value_key == "CFBundleIdentifier";
+        if (!tag.idref.empty()) {
+            kcmod_decode_verify(tag.empty);
+            refs_.push_back({{begin, pos}, tag.idref});
+            if (is_bundle_id) {
+                auto it = definitions_.find(tag.idref);
+                if (it == definitions_.end()) {
+                    throw DecodeError{"Undefined IDREF {}", tag.idref};
+                }
+                info_dicts_.back().bundle_id = unescape_xml(element_text(it->second));
+            }
+            continue;
+        }
+
+        if (tag.name == "dict" || tag.name == "array" || tag.name == "plist") {
+            Role role = Role::OTHER;
+            if (tag.name == "dict" && !root_seen) {
+                root_seen = true;
+                role = Role::ROOT;
+            } else if (tag.name == "array" && parent == Role::ROOT && value_key == "_PrelinkInfoDictionary") {
+                role = Role::ARRAY;
+            } else if (tag.name == "dict" && parent == Role::ARRAY) {
+                role = Role::INFO;
+                info_dicts_.push_back(InfoDict{.range = {begin, 0}});
+            }
+            if (tag.empty) {
+                kcmod_decode_verify(role != Role::ARRAY);
+                if (role == Role::INFO) {
+                    info_dicts_.back().range.end = pos;
+                }
+                if (!tag.id.empty()) {
+                    define(tag.id, {begin, pos});
+                }
+            } else {
+                stack.push_back({begin, tag.id, role});
+            }
+            continue;
+        }
+
+        if (!tag.empty) {
+            size_t text_end = xml_.find('<', pos);
+            kcmod_decode_verify(text_end != std::string_view::npos);
+            pos = xml_.find('>', text_end);
+            kcmod_decode_verify(pos != std::string_view::npos);
+            pos++;
+        }
+        if (!tag.id.empty()) {
+            define(tag.id, {begin, pos});
+            if (tag.name != "true" && tag.name != "false") {
+                values_.try_emplace(scalar_key(tag.name, tag.size, element_text({begin, pos})), tag.id, Range{begin, pos});
+            }
+        }
+        if (is_bundle_id) {
+            info_dicts_.back().bundle_id = unescape_xml(element_text({begin, pos}));
+        }
+    }
+    kcmod_decode_verify(stack.empty());
+    if (array_end_ == 0) {
+        throw DecodeError{"_PrelinkInfoDictionary not found in prelink info"};
+    }
+}
+
+void PrelinkInfoEditor::define(std::string_view id, Range range) {
+    definitions_[id] = range;
+    uint64_t value = 0;
+    auto [ptr, ec] = std::from_chars(id.data(), id.data() + id.size(), value);
+    if (ec == std::errc{} && ptr == id.data() + id.size()) {
+        next_id_ = std::max(next_id_, value + 1);
+    }
+}
+
+std::string_view PrelinkInfoEditor::element_name(Range range) const {
+    std::string_view element = xml_.substr(range.begin + 1, range.end - range.begin - 1);
+    return element.substr(0, element.find_first_of(" \t\r\n/>"));
+}
+
+std::string_view PrelinkInfoEditor::element_text(Range range) const {
+    std::string_view element = xml_.substr(range.begin, range.end - range.begin);
+    if (element.ends_with("/>")) {
+        return {};
+    }
+    size_t begin = element.find('>') + 1;
+    return element.substr(begin, element.find('<', begin) - begin);
+}
+
+void PrelinkInfoEditor::remove(const std::string &bundle_id) {
+    kcmod_verify(!committed_);
+    for (auto &info: info_dicts_) {
+        if (!info.removed && info.bundle_id == bundle_id) {
+            info.removed = true;
+            return;
+        }
+    }
+    throw FatalError{"Fileset {} not found in prelink info", bundle_id};
+}
+
+void PrelinkInfoEditor::append(const PlistNode *info) {
+    kcmod_verify(!committed_);
+    // The copy resolves IDREFs, the IDs of the info dictionary could collide
+    // with the ones of the prelink info
+    PropertyList fragment;
+    fragment.set_root(fragment.copy(info));
+    appended_.push_back(std::move(fragment));
+}
+
+std::string PrelinkInfoEditor::materialize(std::string_view id) {
+    Range range = definitions_.at(id);
+    std::vector<Splice> splices;
+    auto spliced = [&](Range inner) {
+        return std::ranges::any_of(splices, [&](const Splice &splice) {
+            return splice.range.begin <= inner.begin && inner.end <= splice.range.end;
+        });
+    };
+
+    // IDs defined inside the element are defined again along with it, unless
+    // they already were
+    std::vector<bool *> defined_here;
+    for (auto &[other_id, defined]: materialized_) {
+        const Range &other = definitions_.at(other_id);
+        if (range.begin > other.begin || other.end > range.end) {
+            continue;
+        }
+        if (defined) {
+            splices.push_back({other, fmt::format("<{} IDREF=\"{}\"/>", element_name(other), other_id)});
+        } else {
+            defined_here.push_back(&defined);
+        }
+    }
+    for (bool *defined: defined_here) {
+        *defined = true;
+    }
+
+    auto ref = std::ranges::lower_bound(refs_, range.begin, {}, [](const IdRef &ref) { return ref.range.begin; });
+    for (; ref != refs_.end() && ref->range.end <= range.end; ++ref) {
+        auto it = materialized_.find(ref->id);
+        if (it == materialized_.end() || it->second || spliced(ref->range)) {
+            continue;
+        }
+        splices.push_back({ref->range, materialize(ref->id)});
+    }
+
+    std::ranges::sort(splices, {}, [](const Splice &splice) { return splice.range.begin; });
+    std::string result;
+    size_t cursor = range.begin;
+    for (const auto &splice: splices) {
+        if (splice.range.begin < cursor) {
+            // Nested in a splice that was already applied
+            continue;
+        }
+        result.append(xml_.substr(cursor, splice.range.begin - cursor));
+        result += splice.replacement;
+        cursor = splice.range.end;
+    }
+    result.append(xml_.substr(cursor, range.end - cursor));
+    return result;
+}
+
+size_t PrelinkInfoEditor::commit() {
+    kcmod_verify(!committed_);
+    committed_ = true;
+
+    std::vector<Splice> splices;
+    std::vector<std::pair<size_t, size_t>> removed;
+    for (const auto &info: info_dicts_) {
+        if (info.removed) {
+            removed.emplace_back(info.range.begin, info.range.end);
+            splices.push_back({info.range, ""});
+        }
+    }
+
+    // IDs defined in removed dictionaries are defined again at their first
+    // reference that is kept
+    for (const auto &[id, range]: definitions_) {
+        if (contains(removed, range.begin, range.end)) {
+            materialized_[id] = false;
+        }
+    }
+    for (const auto &ref: refs_) {
+        auto it = materialized_.find(ref.id);
+        if (it == materialized_.end() || it->second || contains(removed, ref.range.begin, ref.range.end)) {
+            continue;
+        }
+        splices.push_back({ref.range, materialize(ref.id)});
+    }
+
+    // Values defined before the end of _PrelinkInfoDictionary can be
+    // referenced by the appended dictionaries
+    auto existing = [&](const std::string &key) -> std::optional<std::string_view> {
+        auto it = values_.find(key);
+        if (it == values_.end()) {
+            return std::nullopt;
+        }
+        const auto &[id, range] = it->second;
+        if (range.end > array_end_ || contains(removed, range.begin, range.end)) {
+            return std::nullopt;
+        }
+        return id;
+    };
+    std::string appended;
+    for (const auto &info: appended_) {
+        appended += InfoWriter{existing, next_id_}.write(info.root());
+    }
+    if (!appended.empty()) {
+        splices.push_back({{array_end_, array_end_}, std::move(appended)});
+    }
+    if (splices.empty()) {
+        return segment_.size() - xml_.size();
+    }
+
+    std::ranges::stable_sort(splices, {}, [](const Splice &splice) { return splice.range.begin; });
+    size_t first = splices.front().range.begin;
+    std::string tail;
+    size_t cursor = first;
+    for (const auto &splice: splices) {
+        tail.append(xml_.substr(cursor, splice.range.begin - cursor));
+        tail += splice.replacement;
+        cursor = splice.range.end;
+    }
+    tail.append(xml_.substr(cursor));
+
+    size_t size = first + tail.size();
+    if (size > segment_.size()) {
+        throw FatalError{
+            "Prelink info of size {} does not fit in __PRELINK_INFO segment of size {} ({} bytes over)",
+            size,
+            segment_.size(),
+            size - segment_.size(),
+        };
+    }
+    std::copy(tail.begin(), tail.end(), segment_.begin() + first);
+    profile_count(ProfileCounter::PLIST_BYTES_SERIALIZED, tail.size());
+    if (size < xml_.size()) {
+        std::fill(segment_.begin() + size, segment_.begin() + xml_.size(), 0);
+    }
+    return segment_.size() - size;
+}
@@ -0,0 +1,169 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <fstream>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <fmt/format.h>
+#include <nlohmann/json.hpp>
+
+#include "debug.h"
+#include "profile.h"
+
+
+using namespace kcmod;
+
+namespace {
+
+constexpr std::array<const char *, k_profile_counter_count> k_counter_names = {
+    "bytes copied",
+    "fixups added",
+    "fixups removed",
+    "symbols indexed",
+    "plist bytes parsed",
+    "plist bytes serialized",
+    "minor page faults",
+    "major page faults",
+};
+
+// Small ids instead of std::thread::id, which has no portable integer value
+uint32_t current_thread() {
+    static std::atomic<uint32_t> next_thread{1};
+    thread_local uint32_t thread = next_thread.fetch_add(1, std::memory_order_relaxed);
+    return thread;
+}
+
+Profiler::Counters page_faults() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    Profiler::Counters counters{};
+    counters[static_cast<size_t>(ProfileCounter::MINOR_PAGE_FAULTS)] = static_cast<uint64_t>(usage.ru_minflt);
+    counters[static_cast<size_t>(ProfileCounter::MAJOR_PAGE_FAULTS)] = static_cast<uint64_t>(usage.ru_majflt);
+    return counters;
+}
+
+double microseconds(Profiler::Clock::duration duration) {
+    return std::chrono::duration<double, std::micro>(duration).count();
+}
+
+std::string format_bytes(uint64_t bytes) {
+    if (bytes < 1024 * 1024) {
+        return fmt::format("{:.1f} KiB", static_cast<double>(bytes) / 1024);
+    }
+    return fmt::format("{:.1f} MiB", static_cast<double>(bytes) / (1024 * 1024));
+}
+
+}// namespace
+
+
+std::atomic<Profiler *> Profiler::active_{nullptr};
+
+Profiler::Profiler() : start_{Clock::now()}, start_faults_{page_faults()} {
+    Profiler *expected = nullptr;
+    kcmod_verify(active_.compare_exchange_strong(expected, this));
+}
+
+Profiler::~Profiler() {
+    active_.store(nullptr);
+}
+
+Profiler::Counters Profiler::counters() const {
+    Counters result = page_faults();
+    for (size_t i = 0; i < k_profile_counter_count; ++i) {
+        result[i] -= start_faults_[i];
+        result[i] += counters_[i].load(std::memory_order_relaxed);
+    }
+    return result;
+}
+
+void Profiler::record(std::string name, Clock::time_point begin, const Counters &begin_counters) {
+    Event event{
+        .name = std::move(name),
+        .thread = current_thread(),
+        .begin = begin,
+        .end = Clock::now(),
+        .begin_counters = begin_counters,
+        .end_counters = counters(),
+    };
+    std::lock_guard lock{mutex_};
+    events_.push_back(std::move(event));
+}
+
+void Profiler::write_trace(const std::filesystem::path &path) const {
+    int pid = static_cast<int>(getpid());
+    nlohmann::json events = nlohmann::json::array();
+    std::lock_guard lock{mutex_};
+    for (const auto &event: events_) {
+        nlohmann::json args = nlohmann::json::object();
+        for (size_t i = 0; i < k_profile_counter_count; ++i) {
+            if (uint64_t delta = event.end_counters[i] - event.begin_counters[i]) {
+                args[k_counter_names[i]] = delta;
+            }
+        }
+        events.push_back({
+            {"name", event.name},
+            {"cat", "kcmod"},
+            {"ph", "X"},
+            {"ts", microseconds(event.begin - start_)},
+            {"dur", microseconds(event.end - event.begin)},
+            {"pid", pid},
+            {"tid", event.thread},
+            {"args", std::move(args)},
+        });
+        // Counter tracks with the process totals at the end of every scope
+        for (size_t i = 0; i < k_profile_counter_count; ++i) {
+            events.push_back({
+                {"name", k_counter_names[i]},
+                {"ph", "C"},
+                {"ts", microseconds(event.end - start_)},
+                {"pid", pid},
+                {"args", {{"value", event.end_counters[i]}}},
+            });
+        }
+    }
+
+    std::ofstream out{path};
+    if (!out) {
+        throw FatalError{"Failed to open profile {}", path.string()};
+    }
+    out << nlohmann::json{{"traceEvents", std::move(events)}, {"displayTimeUnit", "ms"}}.dump();
+    if (!out) {
+        throw FatalError{"Failed to write profile {}", path.string()};
+    }
+}
+
+std::string Profiler::format_summary() const {
+    Counters totals = counters();
+    auto total = [&](ProfileCounter counter) { return totals[static_cast<size_t>(counter)]; };
+    return fmt::format(
+        "{:.2f} ms, {} copied, {} fixups added, {} fixups removed, {} symbols indexed, "
+        "plist {} parsed / {} serialized, {} page faults ({} major)",
+        microseconds(Clock::now() - start_) / 1000,
+        format_bytes(total(ProfileCounter::BYTES_COPIED)),
+        total(ProfileCounter::FIXUPS_ADDED),
+        total(ProfileCounter::FIXUPS_REMOVED),
+        total(ProfileCounter::SYMBOLS_INDEXED),
+        format_bytes(total(ProfileCounter::PLIST_BYTES_PARSED)),
+        format_bytes(total(ProfileCounter::PLIST_BYTES_SERIALIZED)),
+        total(ProfileCounter::MINOR_PAGE_FAULTS) + total(ProfileCounter::MAJOR_PAGE_FAULTS),
+        total(ProfileCounter::MAJOR_PAGE_FAULTS));
+}
@@ -0,0 +1,288 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <mutex>
+#include <numeric>
+#include <sstream>
+
+#include "debug.h"
+#include "image.h"
+#include "kernelcache.h"
+#include "kextobj.h"
+#include "log.h"
+#include "pipeline.h"
+#include "profile.h"
+#include "replace.h"
+#include "result_cache.h"
+#include "temp.h"
+#include "thread_pool.h"
+#include "version.h"
+#include "victim.h"
+#include "zip.h"
+
+
+using namespace kcmod;
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Parses the kext once, on the pipeline of whichever target needs it first
+class SharedKext {
+public:
+    SharedKext(const ReplaceOptions &options) : options_{options} {}
+
+    const KernelExtension &get() {
+        std::call_once(loaded_, [this] { kext_.emplace(load_kext(options_.kext, options_.kext_cache)); });
+        return *kext_;
+    }
+
+private:
+    const ReplaceOptions &options_;
+    std::once_flag loaded_;
+    std::optional<KernelExtension> kext_;
+};
+
+void write_output(const ReplaceOptions &options, const ReplaceTarget &target, KernelCacheImage &image,
+                  const fs::path &working_copy, ThreadPool &worker_pool) {
+    if (auto archive_path = parse_archive_path(target.input)) {
+        // The output is a copy of the archive, the kernelcache entry keeps
+        // the encoding it was shipped with
+        KernelCacheContainer container = image.container();
+        OutputFormat format = container.encoding == KernelCacheEncoding::NONE && container.im4p_type.empty()
+                                  ? options.output_format
+                                  : OutputFormat::IM4P;
+        std::ostringstream entry;
+        write_kernelcache(entry, image.data(), format, container, worker_pool);
+        std::string entry_data = std::move(entry).str();
+        ZipArchive{archive_path->archive}.write_replacing(target.output, archive_path->entry, entry_data,
+                                                          worker_pool);
+    } else if (options.output_format != OutputFormat::MACHO) {
+        write_kernelcache(target.output, image.data(), options.output_format, image.container(), worker_pool);
+    } else {
+        fs::copy_file(working_copy, target.output, fs::copy_options::overwrite_existing);
+    }
+}
+
+// Replaces the fileset in one kernelcache as a pipeline. The kernelcache is
+// decoded on the image's thread while the kext is parsed, and the victim
+// fileset is overwritten while the dependency filesets are indexed:
+//
+//   load commands --+-- check filesets -- payload --+-- copy fileset --+-- link -- write
+//   parse kext -----+                               +-- index ---------+
+//
+// With auto_victim the victim is selected from the payload before copying,
+// with scatter the kext segments are placed when copying.
+void replace_kernelcache(const ReplaceOptions &options, const ReplaceTarget &target, SharedKext &shared_kext,
+                         ThreadPool &worker_pool) {
+    // In low memory mode the kernelcache is decoded straight into the output
+    // and edited in place, only the pages that are edited or read for linking
+    // stay resident
+    if (options.low_memory &&
+        (options.output_format != OutputFormat::MACHO || parse_archive_path(target.input))) {
+        throw FatalError{"Low memory mode only writes Mach-O kernelcaches"};
+    }
+    TemporaryFile working_copy;
+    KernelCacheImage image{target.input};
+    image.start(options.low_memory ? target.output : working_copy.path(), options.low_memory);
+    std::set<std::string> fileset_ids;
+    const KernelExtension *kext = nullptr;
+    std::optional<KernelCache> kc;
+    std::optional<SymbolRegistry> registry;
+
+    Pipeline pipeline;
+    auto load_commands = pipeline.add("decode load commands", {}, [&] {
+        fileset_ids = image.wait_for_fileset_ids();
+    });
+    auto kext_parsed = pipeline.add("parse kext", {}, [&] {
+        kext = &shared_kext.get();
+    });
+    // Missing filesets are reported without waiting for the payload
+    auto checked = pipeline.add("check filesets", {load_commands, kext_parsed}, [&] {
+        if (!options.auto_victim && !fileset_ids.contains(options.fileset_id)) {
+            throw FatalError{"Fileset {} not present in kernelcache", options.fileset_id};
+        }
+        for (const auto &dependency: kext->dependencies()) {
+            if (!fileset_ids.contains(dependency)) {
+                throw FatalError{"Dependency {} for kext {} not present in kernelcache", dependency,
+                                 kext->bundle_id()};
+            }
+        }
+    });
+    auto payload = pipeline.add("decode payload", {checked}, [&] {
+        image.finish();
+        kc.emplace(image.data());
+        kc->set_thread_pool(&worker_pool);
+    });
+    auto indexed = pipeline.add("index dependencies", {payload}, [&] {
+        registry.emplace(kc->construct_symbol_registry(*kext, options.symbols));
+    });
+    std::string victim = options.fileset_id;
+    auto selected = payload;
+    if (options.auto_victim) {
+        selected = pipeline.add("select victim", {payload}, [&] {
+            victim = select_victim(image.data(), *kext, options.scatter);
+            kcmod_log_info("{}: replacing {}", target.input.string(), victim);
+        });
+    }
+    KextPlacement placement;
+    auto copied = pipeline.add("copy fileset", {selected}, [&] {
+        if (options.scatter) {
+            placement = place_segments(image.data(), *kext, victim);
+            for (const auto &[segname, target_segment]: placement) {
+                kcmod_log_info("{}: placing {} in {} {} at {:#x}", target.input.string(), segname,
+                               target_segment.fileset, target_segment.segment, target_segment.offset);
+            }
+        }
+        kc->copy_fileset(victim, *kext, placement);
+    });
+    auto linked = pipeline.add("link fileset", {copied, indexed}, [&] {
+        kc->link_fileset(victim, *kext, *registry, placement);
+    });
+    if (!options.low_memory) {
+        pipeline.add("write output", {linked}, [&] {
+            write_output(options, target, image, working_copy.path(), worker_pool);
+        });
+    }
+
+    std::exception_ptr error;
+    try {
+        ProfileScope scope{target.input.string()};
+        pipeline.run();
+    } catch (...) {
+        error = std::current_exception();
+    }
+    if (options.trace) {
+        fmt::print("[TRACE] {}\n{}", target.input.string(), pipeline.format_trace());
+    }
+    if (error) {
+        if (options.low_memory) {
+            fs::remove(target.output);
+        }
+        std::rethrow_exception(error);
+    }
+}
+
+template <class F>
+std::vector<std::exception_ptr> run_parallel(ThreadPool &pool, const std::vector<size_t> &indices, F &&fn) {
+    std::vector<std::future<void>> futures;
+    for (size_t index: indices) {
+        futures.push_back(pool.submit([&fn, index] { fn(index); }));
+    }
+    std::vector<std::exception_ptr> errors;
+    for (auto &future: futures) {
+        try {
+            future.get();
+            errors.push_back(nullptr);
+        } catch (...) {
+            errors.push_back(std::current_exception());
+        }
+    }
+    return errors;
+}
+
+}// namespace
+
+
+KernelExtension kcmod::load_kext(const fs::path &kext_path, const std::optional<fs::path> &cache_dir) {
+    if (!cache_dir) {
+        return KernelExtension{kext_path};
+    }
+    fs::create_directories(*cache_dir);
+    fs::path object_path = kext_object_cache_path(*cache_dir, kext_path);
+    if (fs::exists(object_path)) {
+        return KernelExtension{object_path};
+    }
+    KernelExtension kext{kext_path};
+    write_kext_object(kext, object_path);
+    return kext;
+}
+
+
+std::vector<std::exception_ptr> kcmod::replace_kernelcaches(const ReplaceOptions &options,
+                                                            const std::vector<ReplaceTarget> &targets) {
+    std::vector<std::exception_ptr> errors(targets.size());
+    std::vector<size_t> pending(targets.size());
+    std::iota(pending.begin(), pending.end(), 0);
+    ThreadPool pool{std::min(options.jobs, targets.size())};
+
+    // Compression of IM4P and archive outputs and the instruction fixups of
+    // large kexts are split into tasks running on all cores, shared by all
+    // targets. Its tasks never wait on other tasks.
+    ThreadPool worker_pool;
+
+    // Cached results are patches against the input, which only apply when
+    // both the input and the output are plain Mach-O files
+    auto cacheable = [&](size_t i) {
+        return options.output_format == OutputFormat::MACHO && !is_encoded_kernelcache(targets[i].input);
+    };
+    std::optional<ResultCache> cache;
+    std::vector<std::string> cache_keys(targets.size());
+    if (options.result_cache) {
+        cache.emplace(*options.result_cache);
+        // The bundle name and executable path are linked into __PRELINK_INFO,
+        // kext objects store them
+        std::string kext_key = options.kext.extension() == k_kext_object_extension
+                                   ? cache->key_builder().add_file(options.kext).finish()
+                                   : KernelExtension::content_key(options.kext) + ":" +
+                                         KernelExtension::bundle_key(options.kext);
+        std::vector<char> restored(targets.size());
+        auto lookup_errors = run_parallel(pool, pending, [&](size_t i) {
+            if (!cacheable(i)) {
+                return;
+            }
+            auto key = cache->key_builder()
+                           .add_string(k_kcmod_version)
+                           .add_string(options.auto_victim ? "<auto-victim>" : options.fileset_id)
+                           .add_string(options.scatter ? "<scatter>" : "")
+                           .add_string(kext_key)
+                           .add_file(targets[i].input);
+            if (options.symbols) {
+                key.add_file(*options.symbols);
+            }
+            cache_keys[i] = key.finish();
+            restored[i] = cache->restore(cache_keys[i], targets[i].input, targets[i].output);
+        });
+        std::vector<size_t> misses;
+        for (size_t i = 0; i < pending.size(); ++i) {
+            errors[pending[i]] = lookup_errors[i];
+            if (!lookup_errors[i] && !restored[pending[i]]) {
+                misses.push_back(pending[i]);
+            }
+        }
+        pending = std::move(misses);
+    }
+    if (pending.empty()) {
+        return errors;
+    }
+
+    SharedKext kext{options};
+    auto replace_errors = run_parallel(pool, pending, [&](size_t i) {
+        replace_kernelcache(options, targets[i], kext, worker_pool);
+        if (cache && cacheable(i)) {
+            cache->store(cache_keys[i], targets[i].input, targets[i].output);
+        }
+    });
+    for (size_t i = 0; i < pending.size(); ++i) {
+        errors[pending[i]] = replace_errors[i];
+    }
+    return errors;
+}
@@ -0,0 +1,189 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <fstream>
+
+#include <mio/mmap.hpp>
+
+#include "debug.h"
+#include "hash.h"
+#include "log.h"
+#include "memio.h"
+#include "result_cache.h"
+#include "temp.h"
+
+
+using namespace kcmod;
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Patch file layout:
+//
+//     PatchHeader
+//     PatchEntry, data[PatchEntry::size] ... (PatchHeader::entry_count times)
+
+constexpr char k_patch_magic[8] = {'K', 'C', 'M', 'O', 'D', 'P', 'A', 'T'};
+
+struct PatchHeader {
+    char magic[8];
+    uint64_t file_size;
+    uint64_t entry_count;
+};
+
+struct PatchEntry {
+    uint64_t offset;
+    uint64_t size;
+};
+
+// Differences closer than this are merged into one entry
+constexpr size_t k_patch_merge_gap = 64;
+constexpr size_t k_diff_chunk_size = 16 * 1024 * 1024;
+
+std::vector<PatchEntry> diff_chunk(std::span<const char> from, std::span<const char> to, uint64_t base) {
+    std::vector<PatchEntry> result;
+    size_t i = 0;
+    while (i < to.size()) {
+        if (from[i] == to[i]) {
+            i++;
+            continue;
+        }
+        size_t start = i;
+        size_t end = i + 1;
+        for (size_t j = end; j < to.size() && j < end + k_patch_merge_gap; ++j) {
+            if (from[j] != to[j]) {
+                end = j + 1;
+            }
+        }
+        result.push_back(PatchEntry{.offset = base + start, .size = end - start});
+        i = end;
+    }
+    return result;
+}
+
+}// namespace
+
+
+ResultCache::ResultCache(const fs::path &dir) : dir_{dir} {
+    fs::create_directories(dir_);
+}
+
+ResultCache::KeyBuilder &ResultCache::KeyBuilder::add_file(const fs::path &path) {
+    if (fs::file_size(path) == 0) {
+        hashes_.push_back(xxh64({}));
+        return *this;
+    }
+    mio::mmap_source file{path.string()};
+    hashes_.push_back(parallel_xxh64({file.data(), file.size()}, pool_));
+    return *this;
+}
+
+ResultCache::KeyBuilder &ResultCache::KeyBuilder::add_string(const std::string &value) {
+    hashes_.push_back(xxh64(value));
+    return *this;
+}
+
+std::string ResultCache::KeyBuilder::finish() const {
+    std::span<const char> data{reinterpret_cast<const char *>(hashes_.data()), hashes_.size() * sizeof(uint64_t)};
+    return to_hex(xxh64(data, 0)) + to_hex(xxh64(data, 1));
+}
+
+fs::path ResultCache::entry_path(const std::string &key) const {
+    return dir_ / (key + ".kcmodpatch");
+}
+
+bool ResultCache::restore(const std::string &key, const fs::path &input, const fs::path &output) {
+    fs::path path = entry_path(key);
+    if (!fs::exists(path)) {
+        return false;
+    }
+    // The whole patch is validated before output is touched, a truncated or
+    // corrupt entry is removed and counts as a miss
+    mio::mmap_source patch{path.string()};
+    std::vector<std::pair<const PatchEntry *, std::span<const char>>> entries;
+    try {
+        SpanReader reader{std::span<const char>{patch.data(), patch.size()}, 0};
+        const auto *header = reader.read<PatchHeader>();
+        kcmod_decode_verify(memcmp(header->magic, k_patch_magic, sizeof(k_patch_magic)) == 0);
+        kcmod_decode_verify(header->file_size == fs::file_size(input));
+        for (uint64_t i = 0; i < header->entry_count; ++i) {
+            const auto *entry = reader.read<PatchEntry>();
+            kcmod_decode_verify(entry->offset <= header->file_size);
+            kcmod_decode_verify(entry->size <= header->file_size - entry->offset);
+            entries.emplace_back(entry, reader.read_data(entry->size));
+        }
+        kcmod_decode_verify(reader.cursor() == patch.size());
+    } catch (const std::exception &e) {
+        kcmod_log_warn("discarding result cache entry {}: {}", path.string(), e.what());
+        patch.unmap();
+        std::error_code ec;
+        fs::remove(path, ec);
+        return false;
+    }
+
+    fs::copy_file(input, output, fs::copy_options::overwrite_existing);
+    std::fstream file{output, std::ios::binary | std::ios::in | std::ios::out};
+    for (const auto &[entry, data]: entries) {
+        file.seekp(entry->offset);
+        file.write(data.data(), data.size());
+    }
+    kcmod_verify(file.good());
+    kcmod_log_debug("restored {} from result cache", output.string());
+    return true;
+}
+
+void ResultCache::store(const std::string &key, const fs::path &input, const fs::path &output) {
+    mio::mmap_source from{input.string()};
+    mio::mmap_source to{output.string()};
+    kcmod_verify(from.size() == to.size());
+
+    std::vector<std::future<std::vector<PatchEntry>>> futures;
+    for (size_t offset = 0; offset < to.size(); offset += k_diff_chunk_size) {
+        size_t size = std::min(k_diff_chunk_size, to.size() - offset);
+        std::span<const char> from_chunk{from.data() + offset, size};
+        std::span<const char> to_chunk{to.data() + offset, size};
+        futures.push_back(pool_.submit([=] { return diff_chunk(from_chunk, to_chunk, offset); }));
+    }
+    std::vector<PatchEntry> entries;
+    for (auto &future: futures) {
+        auto chunk_entries = future.get();
+        entries.insert(entries.end(), chunk_entries.begin(), chunk_entries.end());
+    }
+
+    fs::path path = entry_path(key);
+    // Stores of the same key may run concurrently, each one writes its own
+    // file and the last rename wins
+    TemporaryFile temp{dir_, fmt::format(".{}.", path.filename().string())};
+    {
+        std::ofstream file{temp.path(), std::ios::binary | std::ios::trunc};
+        PatchHeader header{};
+        memcpy(header.magic, k_patch_magic, sizeof(k_patch_magic));
+        header.file_size = to.size();
+        header.entry_count = entries.size();
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        for (const auto &entry: entries) {
+            file.write(reinterpret_cast<const char *>(&entry), sizeof(entry));
+            file.write(to.data() + entry.offset, entry.size);
+        }
+        kcmod_verify(file.good());
+    }
+    fs::rename(temp.path(), path);
+}
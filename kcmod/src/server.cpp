@@ -0,0 +1,389 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <csignal>
+#include <fstream>
+#include <thread>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <fmt/format.h>
+#include <mio/mmap.hpp>
+
+#include "debug.h"
+#include "image.h"
+#include "kernelcache.h"
+#include "log.h"
+#include "replace.h"
+#include "server.h"
+#include "temp.h"
+#include "verify.h"
+#include "victim.h"
+#include "zip.h"
+
+
+using namespace kcmod;
+
+namespace fs = std::filesystem;
+using json = nlohmann::json;
+
+namespace {
+
+// Pause after accept fails for reasons other than an interruption
+constexpr auto k_accept_backoff = std::chrono::milliseconds{100};
+
+std::optional<fs::path> optional_path(const json &request, const char *key) {
+    if (!request.contains(key) || request[key].is_null()) {
+        return std::nullopt;
+    }
+    return fs::path{request[key].get<std::string>()};
+}
+
+json handle_replace(KernelCacheStore &store, const json &request) {
+    ReplaceOptions options{
+        .fileset_id = request.value("fileset_id", ""),
+        .auto_victim = request.value("auto_victim", false),
+        .scatter = request.value("scatter", false),
+        .kext = request.at("kext").get<std::string>(),
+        .symbols = optional_path(request, "symbols"),
+        .kext_cache = optional_path(request, "kext_cache"),
+        .result_cache = optional_path(request, "result_cache"),
+        .output_format = parse_output_format(request.value("output_format", "macho")),
+    };
+    ReplaceTarget target{
+        .input = request.at("kernelcache").get<std::string>(),
+        .output = request.at("output").get<std::string>(),
+    };
+    if (options.result_cache || parse_archive_path(target.input)) {
+        // Cached results are patches against the kernelcache on disk and
+        // archive outputs copy the rest of the archive, there is nothing to
+        // gain from the resident copy
+        auto errors = replace_kernelcaches(options, {target});
+        if (errors[0]) {
+            std::rethrow_exception(errors[0]);
+        }
+        return {{"ok", true}};
+    }
+
+    std::shared_ptr<LoadedKernelCache> loaded = store.load(target.input);
+    KernelExtension kext = load_kext(options.kext, options.kext_cache);
+    std::shared_ptr<const SymbolRegistry> registry = loaded->kext_registry(kext, options.symbols);
+    if (options.auto_victim) {
+        options.fileset_id = select_victim(loaded->data(), kext, options.scatter);
+    }
+    KextPlacement placement;
+    if (options.scatter) {
+        placement = place_segments(loaded->data(), kext, options.fileset_id);
+    }
+
+    TemporaryFile working_copy;
+    {
+        std::span<const char> data = loaded->data();
+        std::ofstream file{working_copy.path(), std::ios::binary};
+        file.write(data.data(), static_cast<std::streamsize>(data.size()));
+        kcmod_verify(file.good());
+    }
+    {
+        mio::mmap_sink kc_mmap{working_copy.path().string()};
+        KernelCache kc{std::span<char>{kc_mmap.data(), kc_mmap.size()}};
+        kc.set_thread_pool(&store.worker_pool());
+        kc.replace_fileset(options.fileset_id, kext, *registry, placement);
+        if (options.output_format != OutputFormat::MACHO) {
+            write_kernelcache(target.output, {kc_mmap.data(), kc_mmap.size()}, options.output_format,
+                              loaded->container(), store.worker_pool());
+            return {{"ok", true}, {"fileset_id", options.fileset_id}};
+        }
+    }
+    fs::copy_file(working_copy.path(), target.output, fs::copy_options::overwrite_existing);
+    return {{"ok", true}, {"fileset_id", options.fileset_id}};
+}
+
+json handle_lookup(KernelCacheStore &store, const json &request) {
+    std::shared_ptr<LoadedKernelCache> loaded = store.load(request.at("kernelcache").get<std::string>());
+    std::shared_ptr<const SymbolRegistry> registry = loaded->full_registry();
+    json symbols = json::array();
+    if (const auto *found = registry->find_registered_symbols(request.at("symbol").get<std::string>())) {
+        for (const auto &symbol: *found) {
+            symbols.push_back({
+                {"vmaddr", symbol.vmaddr},
+                {"type", static_cast<int>(symbol.type)},
+                {"external", symbol.is_external},
+                {"private_ext", symbol.is_private_ext},
+            });
+        }
+    }
+    return {{"ok", true}, {"symbols", symbols}};
+}
+
+json handle_verify(KernelCacheStore &store, const json &request) {
+    std::shared_ptr<LoadedKernelCache> loaded = store.load(request.at("kernelcache").get<std::string>());
+    return {{"ok", true}, {"problems", verify_kernelcache(loaded->data())}};
+}
+
+json handle_victims(KernelCacheStore &store, const json &request) {
+    std::shared_ptr<LoadedKernelCache> loaded = store.load(request.at("kernelcache").get<std::string>());
+    KernelExtension kext = load_kext(request.at("kext").get<std::string>(), optional_path(request, "kext_cache"));
+    json victims = json::array();
+    for (const auto &fit: rank_victims(loaded->data(), kext)) {
+        victims.push_back({
+            {"fileset_id", fit.fileset_id},
+            {"fits", fit.fits()},
+            {"slack", fit.slack},
+            {"shortfall", fit.shortfall},
+            {"rejection", fit.rejection},
+        });
+    }
+    return {{"ok", true}, {"victims", victims}};
+}
+
+void write_all(int fd, std::string_view data) {
+    while (!data.empty()) {
+        ssize_t written = write(fd, data.data(), data.size());
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            throw FatalError{"socket write failed, errno: {}", errno};
+        }
+        data.remove_prefix(written);
+    }
+}
+
+// Reads the next newline terminated line from fd into line, buffer holds
+// data read past the previous line. Returns false at end of stream.
+bool read_line(int fd, std::string &buffer, std::string &line) {
+    while (true) {
+        if (size_t pos = buffer.find('\n'); pos != std::string::npos) {
+            line = buffer.substr(0, pos);
+            buffer.erase(0, pos + 1);
+            return true;
+        }
+        char chunk[4096];
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        buffer.append(chunk, n);
+    }
+}
+
+sockaddr_un socket_address(const fs::path &socket) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    std::string path = socket.string();
+    if (path.size() >= sizeof(address.sun_path)) {
+        throw FatalError{"socket path {} is too long", path};
+    }
+    std::copy(path.begin(), path.end(), address.sun_path);
+    return address;
+}
+
+void serve_connection(KernelCacheStore &store, int fd) {
+    std::string buffer;
+    std::string line;
+    try {
+        while (read_line(fd, buffer, line)) {
+            json response;
+            try {
+                response = handle_request(store, json::parse(line));
+            } catch (const json::exception &e) {
+                response = {{"ok", false}, {"error", e.what()}};
+            }
+            write_all(fd, response.dump() + "\n");
+        }
+    } catch (const std::exception &e) {
+        kcmod_log_warn("connection closed: {}", e.what());
+    }
+    close(fd);
+}
+
+}// namespace
+
+
+LoadedKernelCache::LoadedKernelCache(const fs::path &path, fs::file_time_type mtime)
+    : path_{path}, mtime_{mtime} {}
+
+std::span<const char> LoadedKernelCache::data() {
+    std::call_once(load_flag_, [this] {
+        data_ = read_kernelcache(path_, &container_);
+        memory_size_ += data_.size();
+    });
+    return data_;
+}
+
+std::shared_ptr<const SymbolRegistry> LoadedKernelCache::kext_registry(const KernelExtension &kext,
+                                                                       const std::optional<fs::path> &symbols) {
+    std::string key = fmt::format("{}", fmt::join(kext.dependencies(), ","));
+    if (symbols) {
+        key += fmt::format("|{}|{}", fs::absolute(*symbols).string(),
+                           fs::last_write_time(*symbols).time_since_epoch().count());
+    }
+    data();
+    std::lock_guard lock{registries_mutex_};
+    if (auto it = registries_.find(key); it != registries_.end()) {
+        return it->second;
+    }
+    KernelCache kc{data_};
+    auto registry = std::make_shared<const SymbolRegistry>(kc.construct_symbol_registry(kext, symbols));
+    memory_size_ += registry->memory_size();
+    registries_.emplace(key, registry);
+    return registry;
+}
+
+std::shared_ptr<const SymbolRegistry> LoadedKernelCache::full_registry() {
+    std::span<const char> kc_data = data();
+    std::lock_guard lock{registries_mutex_};
+    // '*' is not a valid bundle id and never collides with a dependency list
+    if (auto it = registries_.find("*"); it != registries_.end()) {
+        return it->second;
+    }
+    auto registry = std::make_shared<SymbolRegistry>();
+    for (const auto &[_, fileset]: MachOBinary{kc_data}.read_filesets()) {
+        registry->index_binary(kc_data, fileset->fileoff);
+    }
+    memory_size_ += registry->memory_size();
+    registries_.emplace("*", registry);
+    return registry;
+}
+
+
+std::shared_ptr<LoadedKernelCache> KernelCacheStore::load(const fs::path &path) {
+    fs::path canonical;
+    fs::file_time_type mtime;
+    if (auto archive_path = parse_archive_path(path)) {
+        canonical = fs::canonical(archive_path->archive).string() + ":" + archive_path->entry;
+        mtime = fs::last_write_time(archive_path->archive);
+    } else {
+        canonical = fs::canonical(path);
+        mtime = fs::last_write_time(canonical);
+    }
+    std::shared_ptr<LoadedKernelCache> entry;
+    {
+        std::lock_guard lock{mutex_};
+        auto it = std::ranges::find(entries_, canonical, &LoadedKernelCache::path);
+        if (it != entries_.end() && (*it)->mtime() == mtime) {
+            entry = *it;
+            entries_.erase(it);
+        } else {
+            if (it != entries_.end()) {
+                // Kernelcache changed on disk
+                entries_.erase(it);
+            }
+            entry = std::make_shared<LoadedKernelCache>(canonical, mtime);
+        }
+        entries_.push_front(entry);
+    }
+    entry->data();
+    evict();
+    return entry;
+}
+
+void KernelCacheStore::evict() {
+    std::lock_guard lock{mutex_};
+    size_t total = 0;
+    for (const auto &entry: entries_) {
+        total += entry->memory_size();
+    }
+    while (total > memory_limit_ && entries_.size() > 1) {
+        kcmod_log_debug("evicting {}", entries_.back()->path().string());
+        total -= entries_.back()->memory_size();
+        entries_.pop_back();
+    }
+}
+
+
+json kcmod::handle_request(KernelCacheStore &store, const json &request) {
+    try {
+        std::string command = request.at("command").get<std::string>();
+        if (command == "replace") {
+            return handle_replace(store, request);
+        } else if (command == "lookup") {
+            return handle_lookup(store, request);
+        } else if (command == "verify") {
+            return handle_verify(store, request);
+        } else if (command == "victims") {
+            return handle_victims(store, request);
+        }
+        throw FatalError{"unknown command {}", command};
+    } catch (const std::exception &e) {
+        return {{"ok", false}, {"error", e.what()}};
+    }
+}
+
+void kcmod::serve(const ServerOptions &options) {
+    // Clients going away mid response must not terminate the daemon
+    signal(SIGPIPE, SIG_IGN);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    kcmod_verify(fd >= 0);
+    sockaddr_un address = socket_address(options.socket);
+    // Only a socket left by a previous daemon is replaced
+    if (fs::is_socket(options.socket)) {
+        fs::remove(options.socket);
+    } else if (fs::exists(options.socket)) {
+        throw FatalError{"{} exists and is not a socket", options.socket.string()};
+    }
+    if (bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+        throw FatalError{"failed to bind {}, errno: {}", options.socket.string(), errno};
+    }
+    kcmod_verify(listen(fd, SOMAXCONN) == 0);
+
+    KernelCacheStore store{options.memory_limit};
+    while (true) {
+        int client = accept(fd, nullptr, nullptr);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            // Running out of file descriptors clears up as connections close,
+            // keep serving the ones that are open
+            kcmod_log_warn("accept failed, errno: {}", errno);
+            std::this_thread::sleep_for(k_accept_backoff);
+            continue;
+        }
+        std::thread{serve_connection, std::ref(store), client}.detach();
+    }
+}
+
+json kcmod::send_request(const fs::path &socket_path, const json &request) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    kcmod_verify(fd >= 0);
+    sockaddr_un address = socket_address(socket_path);
+    if (connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+        close(fd);
+        throw FatalError{"failed to connect to kcmod daemon at {}, errno: {}", socket_path.string(), errno};
+    }
+    std::string buffer;
+    std::string line;
+    try {
+        write_all(fd, request.dump() + "\n");
+        kcmod_verify(read_line(fd, buffer, line));
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+    return json::parse(line);
+}
@@ -18,61 +18,97 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
-#include "split_seg.h"
 #include "macho.h"
+#include "split_seg.h"
 
 
 using namespace kcmod;
 
 namespace {
 
-class SplitSegmentInfoParser {
-public:
-    SplitSegmentInfoParser(std::span<const char> data) : data_{data} {}
+// Offset after the next count ULEB128 values starting at offset, found by
+// counting their final bytes
+uint64_t skip_uleb128s(std::span<const char> data, uint64_t offset, uint64_t count) {
+    while (count > 0) {
+        kcmod_decode_verify(offset < data.size());
+        if ((data[offset++] & 0x80) == 0) {
+            --count;
+        }
+    }
+    return offset;
+}
+
+}// namespace
+
+
+SplitSegInfo::Iterator::Iterator(std::span<const char> data, uint64_t position, uint64_t section_count)
+    : data_{data}, position_{position}, sections_left_{section_count}, done_{false} {
+    advance();
+}
 
-    std::vector<DyldCacheAdjV2Entry> parse() {
-        std::vector<DyldCacheAdjV2Entry> result;
-        MachOBinary binary{data_};
-        const auto *cmd = binary.read_command<linkedit_data_command>(LC_SEGMENT_SPLIT_INFO);
-        SpanReader reader{data_, cmd->dataoff};
-        uint8_t version = *reader.read<uint8_t>();
-        kcmod_verify(version == DYLD_CACHE_ADJ_V2_FORMAT);
-        uint64_t section_count = reader.read_uleb128();
-        for (uint64_t section_idx = 0; section_idx < section_count; ++section_idx) {
-            uint64_t from_section_idx = reader.read_uleb128();
-            uint64_t to_section_idx = reader.read_uleb128();
-            uint64_t to_offset_count = reader.read_uleb128();
-            uint64_t to_section_offset = 0;
-            for (uint64_t to_offset_idx = 0; to_offset_idx < to_offset_count; ++to_offset_idx) {
-                to_section_offset += reader.read_uleb128();
-                uint64_t from_offset_count = reader.read_uleb128();
-                for (uint64_t from_offset_idx = 0; from_offset_idx < from_offset_count; ++from_offset_idx) {
-                    uint64_t kind = reader.read_uleb128();
-                    kcmod_verify(kind < (uint64_t) DyldCacheAdjV2Kind::Invalid);
-                    uint64_t from_section_delta_count = reader.read_uleb128();
-                    uint64_t from_section_offset = 0;
-                    for (uint64_t from_section_delta_idx = 0; from_section_delta_idx < from_section_delta_count; ++from_section_delta_idx) {
-                        from_section_offset += reader.read_uleb128();
-                        result.push_back(DyldCacheAdjV2Entry{
-                            .from_section_idx = from_section_idx,
-                            .to_section_idx = to_section_idx,
-                            .from_section_offset = from_section_offset,
-                            .to_section_offset = to_section_offset,
-                            .kind = static_cast<DyldCacheAdjV2Kind>(kind)});
-                    }
-                }
+void SplitSegInfo::Iterator::advance() {
+    while (true) {
+        if (kinds_left_ > 0) {
+            --kinds_left_;
+            uint64_t kind = decode_uleb128(data_, position_);
+            kcmod_decode_verify(kind < (uint64_t) DyldCacheAdjV2Kind::Invalid);
+            uint64_t count = decode_uleb128(data_, position_);
+            run_.kind = static_cast<DyldCacheAdjV2Kind>(kind);
+            run_.from_section_offsets = SplitSegOffsets{data_, position_, count};
+            position_ = skip_uleb128s(data_, position_, count);
+            if (count > 0) {
+                return;
             }
+        } else if (to_offsets_left_ > 0) {
+            --to_offsets_left_;
+            run_.to_section_offset += decode_uleb128(data_, position_);
+            kinds_left_ = decode_uleb128(data_, position_);
+        } else if (sections_left_ > 0) {
+            --sections_left_;
+            run_.from_section_idx = decode_uleb128(data_, position_);
+            run_.to_section_idx = decode_uleb128(data_, position_);
+            run_.to_section_offset = 0;
+            to_offsets_left_ = decode_uleb128(data_, position_);
+        } else {
+            done_ = true;
+            return;
         }
-        return result;
     }
+}
 
-private:
-    std::span<const char> data_;
-};
+SplitSegInfo::SplitSegInfo(std::span<const char> encoded)
+    : encoded_{encoded} {
+    kcmod_decode_verify(!encoded_.empty());
+    kcmod_decode_verify(static_cast<uint8_t>(encoded_[0]) == DYLD_CACHE_ADJ_V2_FORMAT);
+    runs_offset_ = 1;
+    section_count_ = decode_uleb128(encoded_, runs_offset_);
+}
 
-}// namespace
+SplitSegInfo SplitSegInfo::read(std::span<const char> data) {
+    MachOBinary binary{data};
+    const auto *cmd = binary.read_command<linkedit_data_command>(LC_SEGMENT_SPLIT_INFO);
+    kcmod_decode_verify(cmd && cmd->dataoff + cmd->datasize <= data.size());
+    return SplitSegInfo{data.subspan(cmd->dataoff, cmd->datasize)};
+}
 
+SplitSegInfo::Iterator SplitSegInfo::begin() const {
+    if (encoded_.empty()) {
+        return {};
+    }
+    return {encoded_, runs_offset_, section_count_};
+}
 
-std::vector<DyldCacheAdjV2Entry> kcmod::parse_split_seg_info(std::span<const char> data) {
-    return SplitSegmentInfoParser{data}.parse();
+std::vector<DyldCacheAdjV2Entry> SplitSegInfo::entries() const {
+    std::vector<DyldCacheAdjV2Entry> result;
+    for (const SplitSegRun &run: *this) {
+        for (uint64_t from_section_offset: run.from_section_offsets) {
+            result.push_back(DyldCacheAdjV2Entry{
+                .from_section_idx = run.from_section_idx,
+                .to_section_idx = run.to_section_idx,
+                .from_section_offset = from_section_offset,
+                .to_section_offset = run.to_section_offset,
+                .kind = run.kind});
+        }
+    }
+    return result;
 }
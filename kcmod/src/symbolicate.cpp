@@ -0,0 +1,557 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <limits>
+#include <map>
+#include <memory>
+
+#include "address_index.h"
+#include "debug.h"
+#include "image.h"
+#include "log.h"
+#include "result_cache.h"
+#include "symbolicate.h"
+#include "symidx.h"
+#include "temp.h"
+#include "thread_pool.h"
+
+using namespace kcmod;
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr char k_symbol_index_magic[8] = {'K', 'C', 'S', 'Y', 'M', 'I', 'D', 'X'};
+constexpr uint32_t k_symbol_index_version = 1;
+
+// Name of entries ending a section, addresses after them have no symbol
+constexpr uint32_t k_no_symbol = std::numeric_limits<uint32_t>::max();
+
+struct SymbolIndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t key_size;
+    uint64_t count;
+    uint64_t strings_size;
+};
+
+// Of the candidates at one address the one with the highest kind is indexed
+enum class CandidateKind : uint8_t {
+    SECTION_END,
+    SECTION_START,
+    FUNCTION_START,
+    LOCAL_SYMBOL,
+    EXTERNAL_SYMBOL,
+};
+
+struct Candidate {
+    uint64_t vmaddr;
+    CandidateKind kind;
+    uint32_t fileset;
+    std::string name;
+};
+
+// Maps an address of the binary symbols are read from to the kernelcache
+using TranslateFn = std::function<std::optional<uint64_t>(uint64_t)>;
+
+void collect_symbols(MachOBinary<const char> binary, uint32_t fileset, const TranslateFn &translate,
+                     std::vector<Candidate> &result) {
+    if (binary.read_command<symtab_command>(LC_SYMTAB) == nullptr) {
+        return;
+    }
+    for (const auto &[name, nlist]: binary.read_symbols()) {
+        Symbol symbol{*nlist};
+        if (symbol.is_debug || symbol.type != Symbol::SECT) {
+            continue;
+        }
+        if (auto vmaddr = translate(symbol.vmaddr)) {
+            auto kind = symbol.is_external ? CandidateKind::EXTERNAL_SYMBOL : CandidateKind::LOCAL_SYMBOL;
+            result.push_back({*vmaddr, kind, fileset, name});
+        }
+    }
+}
+
+void collect_function_starts(MachOBinary<const char> binary, uint32_t fileset, const TranslateFn &translate,
+                             std::vector<Candidate> &result) {
+    const auto *cmd = binary.read_command<linkedit_data_command>(LC_FUNCTION_STARTS);
+    const auto *text = binary.read_segment("__TEXT");
+    if (cmd == nullptr || text == nullptr) {
+        return;
+    }
+    // ULEB128 deltas starting from __TEXT, terminated by a zero delta
+    std::span<const char> starts = binary.data().subspan(cmd->dataoff, cmd->datasize);
+    uint64_t position = 0;
+    uint64_t address = text->vmaddr;
+    while (position < starts.size()) {
+        uint64_t delta = decode_uleb128(starts, position);
+        if (delta == 0) {
+            break;
+        }
+        address += delta;
+        if (auto vmaddr = translate(address)) {
+            result.push_back({*vmaddr, CandidateKind::FUNCTION_START, fileset, fmt::format("sub_{:x}", *vmaddr)});
+        }
+    }
+}
+
+void collect_sections(MachOBinary<const char> binary, uint32_t fileset, std::vector<Candidate> &result) {
+    for (const auto *segment: binary.read_segments()) {
+        if (std::string_view{segment->segname} == "__LINKEDIT") {
+            continue;
+        }
+        for (const auto *section: binary.read_sections(segment->segname)) {
+            if (section->size == 0) {
+                continue;
+            }
+            std::string name = fmt::format("{},{}", std::string_view{section->segname, strnlen(section->segname, 16)},
+                                           std::string_view{section->sectname, strnlen(section->sectname, 16)});
+            result.push_back({section->addr, CandidateKind::SECTION_START, fileset, std::move(name)});
+            result.push_back({section->addr + section->size, CandidateKind::SECTION_END, fileset, {}});
+        }
+    }
+}
+
+std::vector<Candidate> collect_fileset(std::span<const char> kernelcache, const fileset_entry_command *entry,
+                                       uint32_t fileset, const KernelExtension *kext) {
+    std::vector<Candidate> result;
+    MachOBinary<const char> binary{kernelcache, entry->fileoff};
+    collect_sections(binary, fileset, result);
+    if (kext == nullptr) {
+        auto identity = [](uint64_t vmaddr) { return std::optional{vmaddr}; };
+        collect_symbols(binary, fileset, identity, result);
+        collect_function_starts(binary, fileset, identity, result);
+        return result;
+    }
+
+    // Segments of the kext were copied over the segments of the fileset with
+    // the same name
+    MachOBinary<const char> kext_binary = kext->binary();
+    const auto *symtab = kext_binary.read_command<symtab_command>(LC_SYMTAB);
+    if (symtab == nullptr || symtab->stroff + symtab->strsize > kext->binary_data().size()) {
+        throw FatalError{"Kext {} has no symbol table", kext->path().string()};
+    }
+    std::map<std::string, const segment_command_64 *> fileset_segments;
+    for (const auto *segment: binary.read_segments()) {
+        fileset_segments[segment->segname] = segment;
+    }
+    AddressIndex kext_index{kext->binary_data()};
+    auto translate = [&](uint64_t vmaddr) -> std::optional<uint64_t> {
+        auto location = kext_index.find_vmaddr(vmaddr);
+        if (!location) {
+            return std::nullopt;
+        }
+        auto it = fileset_segments.find(location->segment->segname);
+        if (it == fileset_segments.end()) {
+            return std::nullopt;
+        }
+        return it->second->vmaddr + (vmaddr - location->segment->vmaddr);
+    };
+    collect_symbols(kext_binary, fileset, translate, result);
+    collect_function_starts(kext_binary, fileset, translate, result);
+    return result;
+}
+
+template <class T>
+std::span<const T> read_array(SpanReader<const char> &reader, uint64_t count) {
+    reader.seek((alignof(T) - reader.cursor() % alignof(T)) % alignof(T));
+    auto bytes = reader.read_data(count * sizeof(T));
+    kcmod_decode_verify(reinterpret_cast<uintptr_t>(bytes.data()) % alignof(T) == 0);
+    return {reinterpret_cast<const T *>(bytes.data()), count};
+}
+
+template <class T>
+void write_array(std::ofstream &file, std::span<const T> values) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    static const char k_padding[alignof(T)] = {};
+    file.write(k_padding, (alignof(T) - file.tellp() % alignof(T)) % alignof(T));
+    file.write(reinterpret_cast<const char *>(values.data()), static_cast<std::streamsize>(values.size_bytes()));
+}
+
+// Parses the hex number at the start of text, which must be at most 64 bits
+std::optional<uint64_t> parse_hex(std::string_view text, size_t &length) {
+    uint64_t value = 0;
+    length = 0;
+    while (length < text.size()) {
+        char c = text[length];
+        uint64_t digit;
+        if (c >= '0' && c <= '9') {
+            digit = c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            digit = c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            digit = c - 'A' + 10;
+        } else {
+            break;
+        }
+        value = (value << 4) | digit;
+        length++;
+    }
+    if (length == 0 || length > 16) {
+        return std::nullopt;
+    }
+    return value;
+}
+
+constexpr std::string_view k_slide_marker = "Kernel slide:";
+
+std::optional<uint64_t> find_slide(std::string_view text) {
+    size_t position = text.find(k_slide_marker);
+    if (position == std::string_view::npos) {
+        return std::nullopt;
+    }
+    position = text.find("0x", position + k_slide_marker.size());
+    if (position == std::string_view::npos) {
+        return std::nullopt;
+    }
+    size_t length;
+    return parse_hex(text.substr(position + 2), length);
+}
+
+class Annotator {
+public:
+    Annotator(const SymbolicationIndex &index, std::optional<uint64_t> slide)
+        : index_{index}, fixed_slide_{slide} {}
+
+    // Starts a new input, whose slide is found in text when not fixed
+    void begin_input(std::string_view text) {
+        slide_ = fixed_slide_.value_or(find_slide(text).value_or(0));
+    }
+
+    void annotate_line(std::string_view line) {
+        if (!fixed_slide_) {
+            if (auto slide = find_slide(line)) {
+                slide_ = *slide;
+            }
+        }
+        size_t copied = 0;
+        size_t position = 0;
+        while ((position = line.find("0x", position)) != std::string_view::npos) {
+            size_t length;
+            auto value = parse_hex(line.substr(position + 2), length);
+            position += 2 + length;
+            if (!value) {
+                continue;
+            }
+            addresses_++;
+            auto location = index_.resolve(*value - slide_);
+            if (!location) {
+                continue;
+            }
+            resolved_++;
+            out_.append(line.substr(copied, position - copied));
+            copied = position;
+            if (location->offset == 0) {
+                fmt::format_to(std::back_inserter(out_), " ({}`{})", location->fileset, location->symbol);
+            } else {
+                fmt::format_to(std::back_inserter(out_), " ({}`{} + {:#x})", location->fileset, location->symbol,
+                               location->offset);
+            }
+        }
+        out_.append(line.substr(copied));
+    }
+
+    // Annotates the complete lines of text and returns the size consumed
+    size_t annotate_lines(std::string_view text) {
+        size_t consumed = 0;
+        size_t end;
+        while ((end = text.find('\n', consumed)) != std::string_view::npos) {
+            annotate_line(text.substr(consumed, end + 1 - consumed));
+            consumed = end + 1;
+            if (out_.size() >= k_flush_size) {
+                flush();
+            }
+        }
+        return consumed;
+    }
+
+    void flush() {
+        kcmod_verify(fwrite(out_.data(), 1, out_.size(), stdout) == out_.size());
+        fflush(stdout);
+        out_.clear();
+    }
+
+    size_t addresses() const { return addresses_; }
+    size_t resolved() const { return resolved_; }
+
+private:
+    static constexpr size_t k_flush_size = 1024 * 1024;
+
+    const SymbolicationIndex &index_;
+    std::optional<uint64_t> fixed_slide_;
+    uint64_t slide_ = 0;
+    fmt::memory_buffer out_;
+    size_t addresses_ = 0;
+    size_t resolved_ = 0;
+};
+
+void annotate_file(Annotator &annotator, const fs::path &path) {
+    if (fs::file_size(path) == 0) {
+        return;
+    }
+    mio::mmap_source mapping{path.string()};
+    std::string_view text{mapping.data(), mapping.size()};
+    annotator.begin_input(text);
+    size_t consumed = annotator.annotate_lines(text);
+    if (consumed < text.size()) {
+        annotator.annotate_line(text.substr(consumed));
+    }
+    annotator.flush();
+}
+
+// Annotates lines as they arrive so that symbolicate can follow a log
+void annotate_stdin(Annotator &annotator) {
+    annotator.begin_input({});
+    std::string pending;
+    std::vector<char> buffer(1024 * 1024);
+    while (true) {
+        ssize_t size = read(STDIN_FILENO, buffer.data(), buffer.size());
+        if (size < 0 && errno == EINTR) {
+            continue;
+        }
+        if (size < 0) {
+            throw FatalError{"Failed to read stdin: {}", strerror(errno)};
+        }
+        if (size == 0) {
+            break;
+        }
+        pending.append(buffer.data(), size);
+        pending.erase(0, annotator.annotate_lines(pending));
+        annotator.flush();
+    }
+    annotator.annotate_line(pending);
+    annotator.flush();
+}
+
+SymbolicationIndex build_index(const SymbolicateOptions &options, std::string key) {
+    std::vector<std::unique_ptr<KernelExtension>> kexts;
+    std::vector<const KernelExtension *> kext_ptrs;
+    for (const auto &path: options.kexts) {
+        kexts.push_back(std::make_unique<KernelExtension>(path));
+        kext_ptrs.push_back(kexts.back().get());
+    }
+
+    // Plain kernelcaches are mapped, encoded ones decoded into memory
+    mio::mmap_source mapping;
+    std::vector<char> decoded;
+    std::span<const char> data;
+    if (is_encoded_kernelcache(options.kernelcache)) {
+        decoded = read_kernelcache(options.kernelcache);
+        data = decoded;
+    } else {
+        mapping = mio::mmap_source{options.kernelcache.string()};
+        data = {mapping.data(), mapping.size()};
+    }
+    return SymbolicationIndex{data, kext_ptrs, std::move(key)};
+}
+
+}// namespace
+
+
+SymbolicationIndex::SymbolicationIndex(std::span<const char> kernelcache,
+                                       const std::vector<const KernelExtension *> &kexts, std::string key)
+    : key_{std::move(key)} {
+    std::map<std::string, const KernelExtension *> kext_filesets;
+    for (const auto *kext: kexts) {
+        kext_filesets[kext->bundle_id()] = kext;
+    }
+    auto filesets = MachOBinary<const char>{kernelcache}.read_filesets();
+    for (const auto &[bundle_id, kext]: kext_filesets) {
+        if (!filesets.contains(bundle_id)) {
+            throw FatalError{"Kext {} not present in kernelcache", bundle_id};
+        }
+    }
+
+    // Fileset ids are the first strings, at the offsets of their index
+    std::vector<uint32_t> fileset_names;
+    for (const auto &[id, entry]: filesets) {
+        fileset_names.push_back(string_storage_.size());
+        string_storage_.insert(string_storage_.end(), id.begin(), id.end());
+        string_storage_.push_back('\0');
+    }
+
+    std::vector<Candidate> candidates;
+    {
+        ThreadPool pool{std::min(filesets.size(), ThreadPool::default_thread_count())};
+        std::vector<std::future<std::vector<Candidate>>> futures;
+        uint32_t fileset = 0;
+        for (const auto &[id, entry]: filesets) {
+            auto kext = kext_filesets.find(id);
+            const KernelExtension *fileset_kext = kext != kext_filesets.end() ? kext->second : nullptr;
+            futures.push_back(pool.submit([kernelcache, entry, fileset, fileset_kext] {
+                return collect_fileset(kernelcache, entry, fileset, fileset_kext);
+            }));
+            fileset++;
+        }
+        for (auto &future: futures) {
+            auto fileset_candidates = future.get();
+            candidates.insert(candidates.end(), std::make_move_iterator(fileset_candidates.begin()),
+                              std::make_move_iterator(fileset_candidates.end()));
+        }
+    }
+
+    std::sort(candidates.begin(), candidates.end(), [](const Candidate &a, const Candidate &b) {
+        if (a.vmaddr != b.vmaddr) {
+            return a.vmaddr < b.vmaddr;
+        }
+        if (a.kind != b.kind) {
+            return a.kind > b.kind;
+        }
+        return a.name < b.name;
+    });
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        const Candidate &candidate = candidates[i];
+        if (i > 0 && candidates[i - 1].vmaddr == candidate.vmaddr) {
+            continue;
+        }
+        uint32_t name = k_no_symbol;
+        if (candidate.kind != CandidateKind::SECTION_END) {
+            name = string_storage_.size();
+            string_storage_.insert(string_storage_.end(), candidate.name.begin(), candidate.name.end());
+            string_storage_.push_back('\0');
+        }
+        address_storage_.push_back(candidate.vmaddr);
+        entry_storage_.push_back(Entry{.name = name, .fileset = fileset_names[candidate.fileset]});
+    }
+    kcmod_verify(string_storage_.size() < k_no_symbol);
+
+    addresses_ = address_storage_;
+    entries_ = entry_storage_;
+    strings_ = string_storage_;
+}
+
+SymbolicationIndex::SymbolicationIndex(const fs::path &path)
+    : mapping_{path.string()} {
+    std::span<const char> data{mapping_.data(), mapping_.size()};
+    SpanReader reader{data, 0};
+    const auto *header = reader.read<SymbolIndexHeader>();
+    if (memcmp(header->magic, k_symbol_index_magic, sizeof(header->magic)) != 0) {
+        throw DecodeError{"{} is not a symbol index", path.string()};
+    }
+    if (header->version != k_symbol_index_version) {
+        throw DecodeError{"Unsupported symbol index version {} in {}", header->version, path.string()};
+    }
+    key_ = reader.read_string();
+    kcmod_decode_verify(key_.size() == header->key_size);
+    reader.seek(key_.size() + 1);
+    addresses_ = read_array<uint64_t>(reader, header->count);
+    entries_ = read_array<Entry>(reader, header->count);
+    strings_ = read_array<char>(reader, header->strings_size);
+
+    // Names are read up to their NUL, make sure every one has it
+    kcmod_decode_verify(!strings_.empty() && strings_.back() == '\0');
+    kcmod_decode_verify(std::is_sorted(addresses_.begin(), addresses_.end()));
+    for (const auto &entry: entries_) {
+        kcmod_decode_verify(entry.fileset < strings_.size());
+        kcmod_decode_verify(entry.name == k_no_symbol || entry.name < strings_.size());
+    }
+}
+
+void SymbolicationIndex::save(const fs::path &path) const {
+    SymbolIndexHeader header{};
+    memcpy(header.magic, k_symbol_index_magic, sizeof(header.magic));
+    header.version = k_symbol_index_version;
+    header.key_size = key_.size();
+    header.count = addresses_.size();
+    header.strings_size = strings_.size();
+
+    // Write to a temporary file next to path and rename so that concurrent
+    // runs never map a partial index
+    TemporaryFile temp{path.parent_path(), fmt::format(".{}.", path.filename().string())};
+    {
+        std::ofstream file{temp.path(), std::ios::binary | std::ios::trunc};
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        file.write(key_.c_str(), static_cast<std::streamsize>(key_.size() + 1));
+        write_array(file, addresses_);
+        write_array(file, entries_);
+        write_array(file, strings_);
+        kcmod_verify(file.good());
+    }
+    fs::rename(temp.path(), path);
+}
+
+std::optional<SymbolLocation> SymbolicationIndex::resolve(uint64_t vmaddr) const {
+    auto it = std::upper_bound(addresses_.begin(), addresses_.end(), vmaddr);
+    if (it == addresses_.begin()) {
+        return std::nullopt;
+    }
+    size_t index = std::prev(it) - addresses_.begin();
+    const Entry &entry = entries_[index];
+    if (entry.name == k_no_symbol) {
+        return std::nullopt;
+    }
+    return SymbolLocation{
+        .fileset = strings_.data() + entry.fileset,
+        .symbol = strings_.data() + entry.name,
+        .offset = vmaddr - addresses_[index],
+    };
+}
+
+void kcmod::symbolicate(const SymbolicateOptions &options) {
+    auto start = std::chrono::steady_clock::now();
+    std::optional<SymbolicationIndex> index;
+    std::string key;
+    if (options.index) {
+        ThreadPool pool;
+        auto key_builder = ResultCache::KeyBuilder{pool};
+        key_builder.add_file(options.kernelcache);
+        for (const auto &kext: options.kexts) {
+            key_builder.add_string(KernelExtension::content_key(kext));
+        }
+        key = key_builder.finish();
+
+        if (fs::exists(*options.index)) {
+            try {
+                index.emplace(*options.index);
+                if (index->key() != key) {
+                    kcmod_log_info("Rebuilding symbol index {} of other inputs", options.index->string());
+                    index.reset();
+                }
+            } catch (const std::exception &e) {
+                kcmod_log_warn("Rebuilding symbol index {}: {}", options.index->string(), e.what());
+                index.reset();
+            }
+        }
+    }
+    if (!index) {
+        index.emplace(build_index(options, key));
+        if (options.index) {
+            index->save(*options.index);
+        }
+    }
+    auto indexed = std::chrono::steady_clock::now();
+    kcmod_log_debug("symbol index of {} addresses ready in {} ms", index->size(),
+                    std::chrono::duration_cast<std::chrono::milliseconds>(indexed - start).count());
+
+    Annotator annotator{*index, options.slide};
+    if (options.inputs.empty()) {
+        annotate_stdin(annotator);
+    }
+    for (const auto &input: options.inputs) {
+        annotate_file(annotator, input);
+    }
+    kcmod_log_debug("resolved {} of {} addresses in {} ms", annotator.resolved(), annotator.addresses(),
+                    std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - indexed).count());
+}
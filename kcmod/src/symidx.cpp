@@ -20,6 +20,8 @@
 
 #include "symidx.h"
 #include "common.h"
+#include "log.h"
+#include "profile.h"
 
 
 using namespace kcmod;
@@ -34,10 +36,12 @@ Symbol::Symbol(const nlist_64 &nlist)
 
 void SymbolRegistry::index_binary(std::span<const char> data, uint64_t offset) {
     MachOBinary binary{data, offset};
+    size_t indexed = 0;
     for (auto [name, nlist]: binary.read_symbols()) {
         if (name.size() == 0) {
             continue;
         }
+        indexed++;
         Symbol symbol{*nlist};
         if (auto it = symbols_.find(name); it != symbols_.end()) {
             it->second.push_back(symbol);
@@ -45,6 +49,8 @@ void SymbolRegistry::index_binary(std::span<const char> data, uint64_t offset) {
             symbols_[name] = std::vector<Symbol>{symbol};
         }
     }
+    kcmod_log_trace("indexed {} symbols of binary at {:#x}", indexed, offset);
+    profile_count(ProfileCounter::SYMBOLS_INDEXED, indexed);
 }
 
 const std::vector<Symbol> *SymbolRegistry::find_registered_symbols(const std::string &name) const {
@@ -98,3 +104,16 @@ void SymbolRegistry::add_override(const std::string &name, uint64_t address) {
         };
     }
 }
+
+size_t SymbolRegistry::memory_size() const {
+    // Approximate, accounts for map nodes and vector storage
+    constexpr size_t k_node_size = 64;
+    size_t size = 0;
+    for (const auto& [name, symbols]: symbols_) {
+        size += k_node_size + name.capacity() + symbols.capacity() * sizeof(Symbol);
+    }
+    for (const auto& [name, _]: override_symbols_) {
+        size += k_node_size + name.capacity() + sizeof(Symbol);
+    }
+    return size;
+}
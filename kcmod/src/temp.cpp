@@ -18,20 +18,31 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
-#include "debug.h"
+#include <cstring>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include "debug.h"
 #include "temp.h"
 
 
 using namespace kcmod;
 
 
-TemporaryFile::TemporaryFile()
-    : path_{std::filesystem::temp_directory_path() / "kcmod.XXXXXXXXXX"} {
-    int fd = mkstemp(path_.string().data());
-    kcmod_verify(fd >= 0);
+TemporaryFile::TemporaryFile() : TemporaryFile(std::filesystem::temp_directory_path(), "kcmod.") {}
+
+TemporaryFile::TemporaryFile(const std::filesystem::path &directory, std::string_view prefix) {
+    std::filesystem::path parent = directory.empty() ? std::filesystem::path{"."} : directory;
+    std::string path = (parent / fmt::format("{}XXXXXXXXXX", prefix)).string();
+    int fd = mkstemp(path.data());
+    if (fd < 0) {
+        throw FatalError{"Can not create a temporary file in {}: {}", parent.string(), strerror(errno)};
+    }
+    // mkstemp creates the file private to the user, files renamed into place
+    // get the usual permissions
+    fchmod(fd, 0644);
     close(fd);
+    path_ = path;
 }
 
 TemporaryFile::TemporaryFile(const std::filesystem::path &path): TemporaryFile() {
@@ -0,0 +1,428 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <set>
+
+#include <mach-o/fixup-chains.h>
+
+#include <fmt/format.h>
+
+#include "aarch64.h"
+#include "fixup_chain.h"
+#include "macho.h"
+#include "plist.h"
+#include "thread_pool.h"
+#include "verify.h"
+
+
+using namespace kcmod;
+
+namespace {
+
+constexpr size_t k_max_problems_per_check = 64;
+constexpr uint64_t k_chain_pages_per_check = 256;
+constexpr uint64_t k_instructions_per_check = 256 * 1024;
+// Listed in LC_FILESET_ENTRY without an info dictionary in __PRELINK_INFO
+constexpr const char *k_kernel_id = "com.apple.kernel";
+
+// Problems found by one check, at most k_max_problems_per_check are kept
+class Problems {
+public:
+    template <typename... T>
+    void add(fmt::format_string<T...> format, T &&...args) {
+        if (messages_.size() < k_max_problems_per_check) {
+            messages_.push_back(fmt::format(format, std::forward<T>(args)...));
+        } else {
+            dropped_++;
+        }
+    }
+
+    void append_to(std::vector<std::string> &problems) const {
+        problems.insert(problems.end(), messages_.begin(), messages_.end());
+        if (dropped_ > 0) {
+            problems.push_back(fmt::format("{} more problems like the above", dropped_));
+        }
+    }
+
+private:
+    std::vector<std::string> messages_;
+    size_t dropped_ = 0;
+};
+
+// Address ranges of non-overlapping segments
+class RangeSet {
+public:
+    void add(uint64_t begin, uint64_t end) {
+        if (begin < end) {
+            ranges_.emplace_back(begin, end);
+        }
+    }
+
+    void sort() {
+        std::ranges::sort(ranges_);
+    }
+
+    bool contains(uint64_t address) const {
+        auto it = std::ranges::upper_bound(ranges_, address, {}, &std::pair<uint64_t, uint64_t>::first);
+        return it != ranges_.begin() && address < std::prev(it)->second;
+    }
+
+private:
+    std::vector<std::pair<uint64_t, uint64_t>> ranges_;
+};
+
+// Top level segments of the kernelcache, which every fileset segment lies in
+struct Layout {
+    uint64_t vm_base = 0;
+    std::vector<const segment_command_64 *> segments;
+    RangeSet vm;
+    RangeSet executable;
+    std::map<std::string, const fileset_entry_command *> filesets;
+};
+
+const segment_command_64 *find_segment(const Layout &layout, uint64_t vmaddr) {
+    for (const auto *segment: layout.segments) {
+        if (segment->vmaddr <= vmaddr && vmaddr - segment->vmaddr < segment->vmsize) {
+            return segment;
+        }
+    }
+    return nullptr;
+}
+
+void verify_segments(MachOBinary<const char> &binary, size_t file_size, const std::string &name,
+                     Problems &problems) {
+    for (const auto *segment: binary.read_segments()) {
+        if (segment->filesize == 0) {
+            continue;
+        }
+        if (segment->fileoff > file_size || segment->filesize > file_size - segment->fileoff) {
+            problems.add("{}: segment {} [{:#x}, {:#x}) outside kernelcache", name, std::string{segment->segname},
+                         segment->fileoff, segment->fileoff + segment->filesize);
+        }
+    }
+}
+
+// The load commands of a fileset describe segments and sections inside the
+// top level segments at the same file offset relative to the VM address
+void verify_fileset(std::span<const char> data, const Layout &layout, const std::string &name,
+                    const fileset_entry_command *fileset, Problems &problems) {
+    if (fileset->fileoff >= data.size()) {
+        problems.add("{}: fileoff {:#x} outside kernelcache", name, fileset->fileoff);
+        return;
+    }
+    MachOBinary<const char> binary{data, fileset->fileoff};
+    const auto *header = reinterpret_cast<const mach_header_64 *>(data.data() + fileset->fileoff);
+    uint64_t commands_size = 0;
+    SpanReader reader{data, fileset->fileoff + sizeof(mach_header_64)};
+    for (uint32_t i = 0; i < header->ncmds; ++i) {
+        const auto *cmd = reader.peek<load_command>();
+        if (cmd->cmdsize < sizeof(load_command)) {
+            problems.add("{}: load command {} has size {}", name, i, cmd->cmdsize);
+            return;
+        }
+        commands_size += cmd->cmdsize;
+        reader.seek(cmd->cmdsize);
+    }
+    if (commands_size != header->sizeofcmds) {
+        problems.add("{}: load commands take {} bytes, header says {}", name, commands_size, header->sizeofcmds);
+    }
+    verify_segments(binary, data.size(), name, problems);
+
+    for (const auto *segment: binary.read_segments()) {
+        std::string segname{segment->segname};
+        if (segname == "__TEXT" && (segment->fileoff != fileset->fileoff || segment->vmaddr != fileset->vmaddr)) {
+            problems.add("{}: __TEXT at {:#x} ({:#x}) but fileset entry at {:#x} ({:#x})", name, segment->vmaddr,
+                         segment->fileoff, fileset->vmaddr, fileset->fileoff);
+        }
+        if (segment->vmsize == 0) {
+            continue;
+        }
+        const auto *container = find_segment(layout, segment->vmaddr);
+        if (container == nullptr ||
+            segment->vmsize > container->vmaddr + container->vmsize - segment->vmaddr) {
+            problems.add("{}: segment {} [{:#x}, {:#x}) not inside a kernelcache segment", name, segname,
+                         segment->vmaddr, segment->vmaddr + segment->vmsize);
+            continue;
+        }
+        if (segment->filesize > 0 && segment->fileoff - container->fileoff != segment->vmaddr - container->vmaddr) {
+            problems.add("{}: segment {} at {:#x} has fileoff {:#x}, {} maps it to {:#x}", name, segname,
+                         segment->vmaddr, segment->fileoff, std::string{container->segname},
+                         container->fileoff + (segment->vmaddr - container->vmaddr));
+        }
+        for (const auto *section: binary.read_sections(segname)) {
+            std::string sectname{section->sectname, strnlen(section->sectname, sizeof(section->sectname))};
+            if (section->addr < segment->vmaddr ||
+                section->size > segment->vmaddr + segment->vmsize - section->addr) {
+                problems.add("{}: section {},{} [{:#x}, {:#x}) outside its segment", name, segname, sectname,
+                             section->addr, section->addr + section->size);
+                continue;
+            }
+            uint32_t type = section->flags & SECTION_TYPE;
+            if (type != S_ZEROFILL && type != S_GB_ZEROFILL && type != S_THREAD_LOCAL_ZEROFILL &&
+                section->offset - segment->fileoff != section->addr - segment->vmaddr) {
+                problems.add("{}: section {},{} at {:#x} has offset {:#x}, its segment maps it to {:#x}", name,
+                             segname, sectname, section->addr, section->offset,
+                             segment->fileoff + (section->addr - segment->vmaddr));
+            }
+        }
+    }
+
+    if (const auto *symtab = binary.read_command<symtab_command>(LC_SYMTAB); symtab && symtab->nsyms > 0) {
+        if (symtab->symoff > data.size() || symtab->nsyms * sizeof(nlist_64) > data.size() - symtab->symoff ||
+            symtab->stroff > data.size() || symtab->strsize > data.size() - symtab->stroff) {
+            problems.add("{}: symbol table outside kernelcache", name);
+        }
+    }
+}
+
+// Walks the chains of pages [first_page, end_page) of one segment
+void verify_fixup_chains(std::span<const char> data, const Layout &layout,
+                         const dyld_chained_starts_in_segment *starts, uint64_t first_page, uint64_t end_page,
+                         Problems &problems) {
+    for (uint64_t page_idx = first_page; page_idx < end_page; ++page_idx) {
+        uint16_t page_start = starts->page_start[page_idx];
+        if (page_start == DYLD_CHAINED_PTR_START_NONE) {
+            continue;
+        }
+        uint64_t page_begin = starts->segment_offset + page_idx * starts->page_size;
+        uint64_t page_end = std::min<uint64_t>(page_begin + starts->page_size, data.size());
+        if (page_start & DYLD_CHAINED_PTR_START_MULTI) {
+            problems.add("page at {:#x} has multiple chain starts, which kernelcaches do not use", page_begin);
+            continue;
+        }
+        uint64_t position = page_begin + page_start;
+        while (true) {
+            if (position + sizeof(DyldFixupPointer) > page_end) {
+                problems.add("fixup chain of page at {:#x} leaves the page at {:#x}", page_begin, position);
+                break;
+            }
+            DyldFixupPointer pointer;
+            memcpy(&pointer, data.data() + position, sizeof(pointer));
+            if (pointer.bind) {
+                problems.add("bind left at {:#x}", position);
+            } else {
+                uint64_t target = layout.vm_base + (pointer.auth ? pointer.ptr_auth_rebase.target
+                                                                 : pointer.ptr_rebase.target);
+                if (!layout.vm.contains(target)) {
+                    problems.add("rebase at {:#x} targets {:#x} outside kernelcache segments", position, target);
+                }
+            }
+            if (pointer.next == 0) {
+                break;
+            }
+            position += pointer.next * 4;
+        }
+    }
+}
+
+// Branches and ADRP pages, including the ones written for hooks and split
+// segment info, must point into the kernelcache
+void verify_instructions(std::span<const char> data, const Layout &layout, const std::string &name,
+                         const section_64 *section, uint64_t first, uint64_t end, Problems &problems) {
+    for (uint64_t offset = first; offset < end; offset += sizeof(uint32_t)) {
+        uint32_t instr;
+        memcpy(&instr, data.data() + section->offset + offset, sizeof(instr));
+        uint64_t pc = section->addr + offset;
+        if ((instr & 0x7c000000) == 0x14000000) {
+            uint64_t target = pc + aarch64::Branch{instr}.imm();
+            if (!layout.executable.contains(target)) {
+                problems.add("{}: branch at {:#x} to {:#x} outside executable segments", name, pc, target);
+            }
+        } else if ((instr & 0x9f000000) == 0x90000000) {
+            uint64_t target = (pc & ~0xfffULL) + aarch64::Adrp{instr}.imm();
+            if (!layout.vm.contains(target) && !layout.vm.contains(target + 0xfff)) {
+                problems.add("{}: adrp at {:#x} to page {:#x} outside kernelcache segments", name, pc, target);
+            }
+        }
+    }
+}
+
+// Every fileset except the kernel has an info dictionary loading it at its
+// __TEXT address, and every info dictionary with an executable has a fileset
+void verify_prelink_info(std::span<const char> data, const Layout &layout, Problems &problems) {
+    const segment_command_64 *segment = nullptr;
+    for (const auto *candidate: layout.segments) {
+        if (std::string{candidate->segname} == "__PRELINK_INFO") {
+            segment = candidate;
+        }
+    }
+    if (segment == nullptr) {
+        problems.add("no __PRELINK_INFO segment");
+        return;
+    }
+    if (segment->fileoff > data.size() || segment->filesize > data.size() - segment->fileoff) {
+        return;
+    }
+    std::string_view xml{data.data() + segment->fileoff, segment->filesize};
+    xml = xml.substr(0, xml.find('\0'));
+    PropertyList info{std::span<const char>{xml.data(), xml.size()}};
+    const PlistNode *dicts = info.root() && info.root()->is_dict() ? info.root()->find("_PrelinkInfoDictionary") : nullptr;
+    if (dicts == nullptr || !dicts->resolve()->is_array()) {
+        problems.add("__PRELINK_INFO has no _PrelinkInfoDictionary array");
+        return;
+    }
+
+    std::set<std::string> prelinked;
+    for (const PlistNode *dict: dicts->children()) {
+        const PlistNode *id_node = dict->resolve()->is_dict() ? dict->find("CFBundleIdentifier") : nullptr;
+        if (id_node == nullptr) {
+            problems.add("__PRELINK_INFO has an info dictionary without CFBundleIdentifier");
+            continue;
+        }
+        std::string id{id_node->string()};
+        const PlistNode *load_addr = dict->find("_PrelinkExecutableLoadAddr");
+        if (load_addr == nullptr) {
+            continue;
+        }
+        if (!prelinked.insert(id).second) {
+            problems.add("{}: multiple info dictionaries in __PRELINK_INFO", id);
+        }
+        auto it = layout.filesets.find(id);
+        if (it == layout.filesets.end()) {
+            problems.add("{}: in __PRELINK_INFO but not a fileset", id);
+        } else if (load_addr->integer() != it->second->vmaddr) {
+            problems.add("{}: _PrelinkExecutableLoadAddr {:#x} but fileset at {:#x}", id, load_addr->integer(),
+                         it->second->vmaddr);
+        }
+    }
+    for (const auto &[id, fileset]: layout.filesets) {
+        if (id != k_kernel_id && !prelinked.contains(id)) {
+            problems.add("{}: fileset without an info dictionary in __PRELINK_INFO", id);
+        }
+    }
+}
+
+// Runs every check on its own task and collects the problems in the order
+// the checks were added
+class Checks {
+public:
+    void add(std::string name, std::function<void(Problems &)> check) {
+        checks_.push_back({std::move(name), std::move(check)});
+    }
+
+    std::vector<std::string> run() {
+        std::vector<Problems> results(checks_.size());
+        ThreadPool pool{std::min(checks_.size(), ThreadPool::default_thread_count())};
+        std::vector<std::future<void>> futures;
+        for (size_t i = 0; i < checks_.size(); ++i) {
+            futures.push_back(pool.submit([this, &results, i] {
+                try {
+                    checks_[i].second(results[i]);
+                } catch (const std::exception &e) {
+                    results[i].add("{}: {}", checks_[i].first, e.what());
+                }
+            }));
+        }
+        std::vector<std::string> problems;
+        for (size_t i = 0; i < checks_.size(); ++i) {
+            futures[i].get();
+            results[i].append_to(problems);
+        }
+        return problems;
+    }
+
+private:
+    std::vector<std::pair<std::string, std::function<void(Problems &)>>> checks_;
+};
+
+}// namespace
+
+
+std::vector<std::string> kcmod::verify_kernelcache(std::span<const char> data) {
+    std::vector<std::string> problems;
+    Checks checks;
+    Layout layout;
+    try {
+        MachOBinary<const char> kc{data};
+        const auto *header = reinterpret_cast<const mach_header_64 *>(data.data());
+        if (header->filetype != MH_FILESET) {
+            problems.push_back(fmt::format("unexpected file type {:#x}", header->filetype));
+            return problems;
+        }
+        Problems segment_problems;
+        verify_segments(kc, data.size(), "kernelcache", segment_problems);
+        segment_problems.append_to(problems);
+
+        layout.vm_base = kc.vm_base();
+        layout.segments = kc.read_segments();
+        for (const auto *segment: layout.segments) {
+            layout.vm.add(segment->vmaddr, segment->vmaddr + segment->vmsize);
+            if (segment->initprot & VM_PROT_EXECUTE) {
+                layout.executable.add(segment->vmaddr, segment->vmaddr + segment->vmsize);
+            }
+        }
+        layout.vm.sort();
+        layout.executable.sort();
+        layout.filesets = kc.read_filesets();
+
+        for (const auto &[name, fileset]: layout.filesets) {
+            checks.add(name, [&, name = name, fileset = fileset](Problems &problems) {
+                verify_fileset(data, layout, name, fileset, problems);
+            });
+        }
+        checks.add("__PRELINK_INFO", [&](Problems &problems) { verify_prelink_info(data, layout, problems); });
+
+        // Chains and instructions are split into chunks, one check each
+        if (kc.read_command<linkedit_data_command>(LC_DYLD_CHAINED_FIXUPS) == nullptr) {
+            problems.push_back("no LC_DYLD_CHAINED_FIXUPS");
+        } else {
+            for (const auto *starts: read_chained_starts(kc)) {
+                for (uint64_t page = 0; page < starts->page_count; page += k_chain_pages_per_check) {
+                    uint64_t end = std::min<uint64_t>(page + k_chain_pages_per_check, starts->page_count);
+                    checks.add(fmt::format("fixup chains at {:#x}", starts->segment_offset),
+                               [&, starts, page, end](Problems &problems) {
+                                   verify_fixup_chains(data, layout, starts, page, end, problems);
+                               });
+                }
+            }
+        }
+        for (const auto &[name, fileset]: layout.filesets) {
+            if (fileset->fileoff >= data.size()) {
+                continue;
+            }
+            MachOBinary<const char> binary{data, fileset->fileoff};
+            for (const auto *segment: binary.read_segments()) {
+                for (const auto *section: binary.read_sections(segment->segname)) {
+                    if (!(section->flags & (S_ATTR_PURE_INSTRUCTIONS | S_ATTR_SOME_INSTRUCTIONS)) ||
+                        section->offset > data.size() || section->size > data.size() - section->offset) {
+                        continue;
+                    }
+                    uint64_t size = section->size & ~3ULL;
+                    for (uint64_t offset = 0; offset < size; offset += k_instructions_per_check * 4) {
+                        uint64_t end = std::min(offset + k_instructions_per_check * 4, size);
+                        checks.add(name, [&, name = name, section, offset, end](Problems &problems) {
+                            verify_instructions(data, layout, name, section, offset, end, problems);
+                        });
+                    }
+                }
+            }
+        }
+    } catch (const std::exception &e) {
+        problems.push_back(e.what());
+        return problems;
+    }
+    std::vector<std::string> check_problems = checks.run();
+    problems.insert(problems.end(), check_problems.begin(), check_problems.end());
+    return problems;
+}
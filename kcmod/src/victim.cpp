@@ -0,0 +1,314 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <tuple>
+
+#include "debug.h"
+#include "plist.h"
+#include "victim.h"
+
+using namespace kcmod;
+
+namespace {
+
+// Filesets the kernel does not boot without
+const std::set<std::string> k_essential_filesets = {
+    "com.apple.kernel",
+    "com.apple.kec.corecrypto",
+    "com.apple.kec.Libm",
+    "com.apple.kec.pthread",
+    "com.apple.driver.AppleARMPlatform",
+    "com.apple.driver.AppleMobileFileIntegrity",
+    "com.apple.driver.AppleSEPManager",
+    "com.apple.filesystems.apfs",
+    "com.apple.iokit.IOStorageFamily",
+    "com.apple.security.AppleImage4",
+    "com.apple.security.sandbox",
+};
+
+// Segments copied from the kext into the victim, __LINKEDIT is shared by all
+// filesets and only has to be present
+const std::vector<std::string> k_copied_segments = {"__TEXT", "__TEXT_EXEC", "__DATA_CONST", "__DATA"};
+
+// Segments place_segments may move out of the victim
+const std::vector<std::string> k_placed_segments = {"__TEXT_EXEC", "__DATA_CONST", "__DATA"};
+
+constexpr uint64_t k_page_size = 16384;
+
+struct KextRequirements {
+    std::map<std::string, uint64_t> segment_sizes;
+    std::vector<std::string> present_segments;
+};
+
+KextRequirements kext_requirements(const KernelExtension &kext, bool scatter) {
+    KextRequirements result;
+    MachOBinary<const char> binary = kext.binary();
+    for (const auto *segment: kext.read_segments()) {
+        std::string name{segment->segname};
+        if (scatter && std::ranges::find(k_placed_segments, name) != k_placed_segments.end()) {
+            continue;
+        }
+        if (std::ranges::find(k_copied_segments, name) != k_copied_segments.end()) {
+            result.segment_sizes[name] = binary.read_used_segment_size(name);
+        } else {
+            result.present_segments.push_back(name);
+        }
+    }
+    return result;
+}
+
+// Filesets listed in the OSBundleLibraries of a prelinked fileset, mapped to
+// the first fileset depending on them. KPIs are provided by the kernel.
+std::map<std::string, std::string> prelinked_dependencies(MachOBinary<const char> kc) {
+    std::map<std::string, std::string> result;
+    const auto *segment = kc.read_segment("__PRELINK_INFO");
+    if (segment == nullptr) {
+        return result;
+    }
+    kcmod_decode_verify(segment->fileoff + segment->filesize <= kc.data().size());
+    std::string_view xml{kc.data().data() + segment->fileoff, segment->filesize};
+    xml = xml.substr(0, xml.find('\0'));
+    PropertyList info{std::span<const char>{xml.data(), xml.size()}};
+    const PlistNode *dicts = info.root() && info.root()->is_dict() ? info.root()->find("_PrelinkInfoDictionary") : nullptr;
+    if (dicts == nullptr) {
+        return result;
+    }
+    for (const PlistNode *dict: dicts->children()) {
+        if (!dict->resolve()->is_dict()) {
+            continue;
+        }
+        const PlistNode *id = dict->find("CFBundleIdentifier");
+        const PlistNode *libraries = dict->find("OSBundleLibraries");
+        if (id == nullptr || libraries == nullptr) {
+            continue;
+        }
+        for (const PlistNode *library: libraries->children()) {
+            std::string dependency = library->key.starts_with("com.apple.kpi.") ? "com.apple.kernel"
+                                                                                : std::string{library->key};
+            result.emplace(dependency, std::string{id->string()});
+        }
+    }
+    return result;
+}
+
+// Why fileset_id may not be overwritten by kext, empty when it may.
+// dependencies is the result of prelinked_dependencies.
+std::string protected_fileset(const std::string &fileset_id, const KernelExtension &kext,
+                              const std::map<std::string, std::string> &dependencies) {
+    if (k_essential_filesets.contains(fileset_id)) {
+        return "required to boot";
+    }
+    if (std::ranges::find(kext.dependencies(), fileset_id) != kext.dependencies().end()) {
+        return "dependency of the kext";
+    }
+    // An earlier build of the kext may be replaced, its dependents link to
+    // the new one
+    if (auto it = dependencies.find(fileset_id); it != dependencies.end() && fileset_id != kext.bundle_id()) {
+        return fmt::format("dependency of {}", it->second);
+    }
+    return {};
+}
+
+VictimFit check_victim(MachOBinary<const char> kc, const std::string &fileset_id,
+                       const fileset_entry_command *entry, const KernelExtension &kext,
+                       const KextRequirements &requirements, bool kext_present,
+                       const std::map<std::string, std::string> &dependencies) {
+    VictimFit fit{.fileset_id = fileset_id};
+    fit.rejection = protected_fileset(fileset_id, kext, dependencies);
+    if (!fit.fits()) {
+        return fit;
+    }
+    // Replacing another fileset would leave two with the id of the kext
+    if (kext_present && fileset_id != kext.bundle_id()) {
+        fit.rejection = fmt::format("kernelcache already contains {}", kext.bundle_id());
+        return fit;
+    }
+    if (entry->cmdsize - entry->entry_id.offset - 1 < kext.bundle_id().size()) {
+        fit.rejection = "fileset id shorter than the kext bundle id";
+        return fit;
+    }
+
+    MachOBinary<const char> binary{kc.data(), entry->fileoff};
+    std::map<std::string, const segment_command_64 *> segments;
+    for (const auto *segment: binary.read_segments()) {
+        segments[segment->segname] = segment;
+    }
+    std::vector<std::string> too_small;
+    for (const auto &[name, size]: requirements.segment_sizes) {
+        auto it = segments.find(name);
+        if (it == segments.end()) {
+            fit.rejection = fmt::format("missing segment {}", name);
+            return fit;
+        }
+        if (size > it->second->filesize) {
+            fit.shortfall += size - it->second->filesize;
+            too_small.push_back(fmt::format("{} needs {:#x} of {:#x}", name, size, it->second->filesize));
+        } else {
+            fit.slack += it->second->filesize - size;
+        }
+    }
+    for (const auto &name: requirements.present_segments) {
+        if (!segments.contains(name)) {
+            fit.rejection = fmt::format("missing segment {}", name);
+            return fit;
+        }
+    }
+    if (!too_small.empty()) {
+        fit.rejection = fmt::format("{}", fmt::join(too_small, ", "));
+    }
+    return fit;
+}
+
+// Bytes a placed kext segment takes, including the zero fill past its file
+// contents
+uint64_t placed_segment_size(const KernelExtension &kext, const std::string &name) {
+    uint64_t size = kext.binary().read_used_segment_size(name);
+    const auto *segment = kext.read_segment(name);
+    for (const auto *section: kext.read_sections(name)) {
+        size = std::max(size, section->addr + section->size - segment->vmaddr);
+    }
+    return (size + k_page_size - 1) & ~(k_page_size - 1);
+}
+
+// Unused range of a segment kext segments can be placed in
+struct PlacementBin {
+    std::string fileset;
+    std::string segment;
+    uint64_t used = 0;
+    uint64_t capacity = 0;
+};
+
+bool accepts(const PlacementBin &bin, const std::string &segment) {
+    return bin.segment == segment || (segment == "__DATA_CONST" && bin.segment == "__DATA");
+}
+
+}// namespace
+
+
+std::vector<VictimFit> kcmod::rank_victims(std::span<const char> kernelcache, const KernelExtension &kext,
+                                           bool scatter) {
+    KextRequirements requirements = kext_requirements(kext, scatter);
+    MachOBinary<const char> kc{kernelcache};
+    auto filesets = kc.read_filesets();
+    bool kext_present = filesets.contains(kext.bundle_id());
+    std::map<std::string, std::string> dependencies = prelinked_dependencies(kc);
+
+    std::vector<VictimFit> result;
+    for (const auto &[fileset_id, entry]: filesets) {
+        result.push_back(check_victim(kc, fileset_id, entry, kext, requirements, kext_present, dependencies));
+    }
+
+    // Rejections other than size come last
+    auto rank = [](const VictimFit &fit) {
+        return std::tuple{!fit.fits(), fit.shortfall == 0 && !fit.fits(), fit.fits() ? fit.slack : fit.shortfall};
+    };
+    std::stable_sort(result.begin(), result.end(), [&](const VictimFit &a, const VictimFit &b) {
+        return rank(a) < rank(b);
+    });
+    return result;
+}
+
+std::string kcmod::select_victim(std::span<const char> kernelcache, const KernelExtension &kext, bool scatter) {
+    std::vector<VictimFit> fits = rank_victims(kernelcache, kext, scatter);
+    if (fits.empty() || !fits[0].fits()) {
+        std::vector<std::string> closest;
+        for (size_t i = 0; i < std::min<size_t>(fits.size(), 3); ++i) {
+            closest.push_back(fmt::format("{} ({})", fits[i].fileset_id, fits[i].rejection));
+        }
+        throw FatalError{"No fileset of the kernelcache fits kext {}, closest: {}", kext.bundle_id(),
+                         fmt::join(closest, "; ")};
+    }
+    return fits[0].fileset_id;
+}
+
+KextPlacement kcmod::place_segments(std::span<const char> kernelcache, const KernelExtension &kext,
+                                    const std::string &victim) {
+    MachOBinary<const char> kc{kernelcache};
+    auto filesets = kc.read_filesets();
+    kcmod_verify(filesets.contains(victim));
+
+    // Segments to place, largest first
+    std::vector<std::pair<uint64_t, std::string>> items;
+    bool fits_victim = true;
+    MachOBinary<const char> victim_binary{kernelcache, filesets[victim]->fileoff};
+    for (const auto &name: k_placed_segments) {
+        if (!kext.read_segment(name)) {
+            continue;
+        }
+        const auto *segment = victim_binary.read_segment(name);
+        if (!segment || kext.binary().read_used_segment_size(name) > segment->filesize) {
+            fits_victim = false;
+        }
+        items.emplace_back(placed_segment_size(kext, name), name);
+    }
+    if (fits_victim) {
+        return {};
+    }
+    std::ranges::sort(items, std::greater{});
+
+    // Donors are dropped, nothing prelinked may depend on them
+    std::map<std::string, std::string> dependencies = prelinked_dependencies(kc);
+    std::vector<PlacementBin> bins;
+    for (const auto &[fileset_id, entry]: filesets) {
+        if (fileset_id != victim && (!protected_fileset(fileset_id, kext, dependencies).empty() || fileset_id == kext.bundle_id())) {
+            continue;
+        }
+        MachOBinary<const char> binary{kernelcache, entry->fileoff};
+        for (const auto *segment: binary.read_segments()) {
+            std::string name{segment->segname};
+            if (std::ranges::find(k_placed_segments, name) != k_placed_segments.end()) {
+                bins.push_back(PlacementBin{fileset_id, name, 0, segment->filesize & ~(k_page_size - 1)});
+            }
+        }
+    }
+
+    // Filesets already overwritten cost nothing more to use
+    std::set<std::string> opened = {victim};
+    KextPlacement placement;
+    for (const auto &[size, name]: items) {
+        PlacementBin *best = nullptr;
+        auto better = [&](const PlacementBin &bin) {
+            if (!best) {
+                return true;
+            }
+            bool bin_opened = opened.contains(bin.fileset);
+            bool best_opened = opened.contains(best->fileset);
+            if (bin_opened != best_opened) {
+                return bin_opened;
+            }
+            return bin.capacity - bin.used < best->capacity - best->used;
+        };
+        for (auto &bin: bins) {
+            if (accepts(bin, name) && bin.capacity - bin.used >= size && better(bin)) {
+                best = &bin;
+            }
+        }
+        if (!best) {
+            throw FatalError{"No segment of the kernelcache fits {:#x} bytes of kext segment {}", size, name};
+        }
+        placement[name] = SegmentPlacement{best->fileset, best->segment, best->used, size};
+        best->used += size;
+        opened.insert(best->fileset);
+    }
+    return placement;
+}
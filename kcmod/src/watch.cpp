@@ -0,0 +1,246 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <fstream>
+#include <thread>
+
+#include <mio/mmap.hpp>
+
+#include "address_index.h"
+#include "debug.h"
+#include "image.h"
+#include "kernelcache.h"
+#include "log.h"
+#include "thread_pool.h"
+#include "watch.h"
+
+
+using namespace kcmod;
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+bool same_segment_layout(const KernelExtension &a, const KernelExtension &b) {
+    auto a_segments = a.read_segments();
+    auto b_segments = b.read_segments();
+    if (a_segments.size() != b_segments.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a_segments.size(); ++i) {
+        const auto *sa = a_segments[i];
+        const auto *sb = b_segments[i];
+        if (std::string{sa->segname} != std::string{sb->segname}) {
+            return false;
+        }
+        if (sa->segname == std::string{"__LINKEDIT"}) {
+            continue;
+        }
+        if (sa->vmaddr != sb->vmaddr || sa->vmsize != sb->vmsize || sa->fileoff != sb->fileoff ||
+            sa->filesize != sb->filesize || sa->nsects != sb->nsects) {
+            return false;
+        }
+        auto a_sections = a.read_sections(sa->segname);
+        auto b_sections = b.read_sections(sb->segname);
+        for (size_t j = 0; j < a_sections.size(); ++j) {
+            if (std::string{a_sections[j]->sectname} != std::string{b_sections[j]->sectname} ||
+                a_sections[j]->addr != b_sections[j]->addr || a_sections[j]->size != b_sections[j]->size ||
+                a_sections[j]->offset != b_sections[j]->offset) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+std::span<const char> segment_data(const KernelExtension &kext, const segment_command_64 *segment) {
+    return kext.binary_data().subspan(segment->fileoff, kext.binary().read_used_segment_size(segment->segname));
+}
+
+// Returns the segments of kext which have to be linked again after previous,
+// or nullopt if kext can not be linked incrementally
+std::optional<std::set<std::string>> changed_segments(const KernelExtension &previous, const KernelExtension &kext) {
+    if (previous.bundle_id() != kext.bundle_id() || previous.dependencies() != kext.dependencies() ||
+        !std::ranges::equal(previous.info_plist_data(), kext.info_plist_data()) ||
+        !same_segment_layout(previous, kext)) {
+        return std::nullopt;
+    }
+
+    std::set<std::string> result;
+    for (const auto *segment: kext.read_segments()) {
+        std::string segname{segment->segname};
+        if (segname == "__TEXT" || segname == "__LINKEDIT") {
+            continue;
+        }
+        if (!std::ranges::equal(segment_data(previous, previous.read_segment(segname)), segment_data(kext, segment))) {
+            result.insert(segname);
+        }
+    }
+
+    // Split segment entries and binds are patched into the segment they are
+    // located in, relink that segment when they change
+    auto section_segments = [](const KernelExtension &kext) {
+        std::vector<std::string> result;
+        for (const auto *segment: kext.read_segments()) {
+            for (const auto *section: kext.read_sections(segment->segname)) {
+                result.emplace_back(section->segname);
+            }
+        }
+        return result;
+    };
+    std::vector<std::string> sections = section_segments(kext);
+    auto split_seg_key = [](const DyldCacheAdjV2Entry &e) {
+        return std::tie(e.from_section_idx, e.from_section_offset, e.to_section_idx, e.to_section_offset, e.kind);
+    };
+    auto group_entries = [&](const KernelExtension &kext) {
+        std::map<std::string, std::vector<DyldCacheAdjV2Entry>> result;
+        for (const auto &entry: kext.split_seg_info().entries()) {
+            kcmod_decode_verify(entry.from_section_idx >= 1 && entry.from_section_idx <= sections.size());
+            result[sections[entry.from_section_idx - 1]].push_back(entry);
+        }
+        for (auto &[_, entries]: result) {
+            std::ranges::sort(entries, {}, split_seg_key);
+        }
+        return result;
+    };
+    auto previous_entries = group_entries(previous);
+    auto entries = group_entries(kext);
+    for (const auto &segname: sections) {
+        auto &a = previous_entries[segname];
+        auto &b = entries[segname];
+        if (!std::ranges::equal(a, b, {}, split_seg_key, split_seg_key)) {
+            result.insert(segname);
+        }
+    }
+
+    auto group_binds = [](const KernelExtension &kext) {
+        std::map<std::string, std::vector<std::tuple<uint64_t, uint64_t, std::string>>> result;
+        AddressIndex index {kext.binary_data()};
+        for (const auto &bind: kext.binds()) {
+            auto location = index.find_fileoff(bind.fileoff);
+            kcmod_decode_verify(location.has_value());
+            result[location->segment->segname].emplace_back(bind.fileoff, bind.pointer.raw, bind.symbol_name);
+        }
+        return result;
+    };
+    auto previous_binds = group_binds(previous);
+    auto binds = group_binds(kext);
+    for (const auto &segname: sections) {
+        if (previous_binds[segname] != binds[segname]) {
+            result.insert(segname);
+        }
+    }
+
+    auto hook_key = [](const KCModHook &hook) {
+        return std::tie(hook.fn_name, hook.hook_fn.vmaddr, hook.super_fn.vmaddr);
+    };
+    // Redirected pointers are restored and retargeted with __TEXT_EXEC
+    auto redirect_key = [](const KCModRedirect &redirect) {
+        return std::tie(redirect.fn_name, redirect.redirect_fn.vmaddr);
+    };
+    if (!std::ranges::equal(previous.hooks(), kext.hooks(), {}, hook_key, hook_key) ||
+        !std::ranges::equal(previous.redirects(), kext.redirects(), {}, redirect_key, redirect_key)) {
+        result.insert("__TEXT_EXEC");
+    }
+    return result;
+}
+
+std::optional<fs::file_time_type> kext_mtime(const fs::path &path) {
+    std::error_code ec;
+    std::optional<fs::file_time_type> result;
+    for (const auto &entry: fs::recursive_directory_iterator{path, ec}) {
+        if (!entry.is_regular_file(ec)) {
+            continue;
+        }
+        auto mtime = entry.last_write_time(ec);
+        if (ec) {
+            return std::nullopt;
+        }
+        result = result ? std::max(*result, mtime) : mtime;
+    }
+    return ec ? std::nullopt : result;
+}
+
+}// namespace
+
+
+void kcmod::watch_kext(const WatchOptions &options) {
+    // Compressed kernelcaches are decoded once, the output is a plain Mach-O
+    std::vector<char> pristine = read_kernelcache(options.kernelcache);
+    {
+        std::ofstream file{options.output, std::ios::binary | std::ios::trunc};
+        file.write(pristine.data(), static_cast<std::streamsize>(pristine.size()));
+        kcmod_verify(file.good());
+    }
+    mio::mmap_sink output_mmap{options.output.string()};
+    std::span<char> output{output_mmap.data(), output_mmap.size()};
+    ThreadPool worker_pool;
+    KernelCache kc{output};
+    kc.set_thread_pool(&worker_pool);
+
+    std::optional<KernelExtension> kext;
+    std::optional<SymbolRegistry> registry;
+    std::optional<fs::file_time_type> linked_mtime;
+
+    while (true) {
+        std::optional<fs::file_time_type> mtime = kext_mtime(options.kext);
+        if (!mtime || mtime == linked_mtime) {
+            std::this_thread::sleep_for(options.interval);
+            continue;
+        }
+        // Wait for the build to finish writing the kext
+        std::this_thread::sleep_for(options.interval);
+        if (kext_mtime(options.kext) != mtime) {
+            continue;
+        }
+        linked_mtime = mtime;
+
+        auto start = Clock::now();
+        try {
+            KernelExtension updated{options.kext};
+            std::optional<std::set<std::string>> segments;
+            if (kext) {
+                segments = changed_segments(*kext, updated);
+            }
+            if (segments) {
+                kc.relink_segments(*kext, updated, *segments, *registry, pristine);
+                kcmod_log_debug("relinked segments [{}]", fmt::join(*segments, ", "));
+            } else {
+                std::copy(pristine.begin(), pristine.end(), output.begin());
+                if (!kext || kext->dependencies() != updated.dependencies()) {
+                    registry = kc.construct_symbol_registry(updated, options.symbols);
+                }
+                kc.replace_fileset(options.fileset_id, updated, *registry);
+            }
+            std::error_code ec;
+            output_mmap.sync(ec);
+            kcmod_verify(!ec);
+            kext.emplace(std::move(updated));
+            auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start);
+            fmt::print("linked {} into {} in {} ms\n", options.kext.string(), options.output.string(), elapsed.count());
+        } catch (const std::exception &e) {
+            // Keep watching, the next build may fix the problem. The output
+            // is relinked from scratch once a kext links successfully.
+            fmt::print(stderr, "failed to link {}: {}\n", options.kext.string(), e.what());
+            kext.reset();
+        }
+    }
+}
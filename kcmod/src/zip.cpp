@@ -0,0 +1,478 @@
+// Copyright (c) skr0x1c0 2023.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <concepts>
+#include <cstring>
+#include <fstream>
+#include <numeric>
+
+#include <zlib.h>
+
+#include "debug.h"
+#include "temp.h"
+#include "zip.h"
+
+
+using namespace kcmod;
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr uint32_t k_local_header_signature = 0x04034b50;
+constexpr uint32_t k_central_header_signature = 0x02014b50;
+constexpr uint32_t k_end_of_central_directory_signature = 0x06054b50;
+constexpr uint32_t k_zip64_end_of_central_directory_signature = 0x06064b50;
+constexpr uint32_t k_zip64_locator_signature = 0x07064b50;
+
+constexpr size_t k_local_header_size = 30;
+constexpr size_t k_central_header_size = 46;
+constexpr size_t k_end_of_central_directory_size = 22;
+constexpr size_t k_zip64_end_of_central_directory_size = 56;
+constexpr size_t k_zip64_locator_size = 20;
+
+constexpr uint16_t k_zip64_extra_id = 0x0001;
+constexpr uint16_t k_zip64_version = 45;
+constexpr uint16_t k_deflate_version = 20;
+
+constexpr uint16_t k_method_stored = 0;
+constexpr uint16_t k_method_deflated = 8;
+// General purpose flag bit of names encoded in UTF-8
+constexpr uint16_t k_flag_utf8 = 0x800;
+
+// Size of the chunks deflated concurrently, each is primed with the window
+// preceding it
+constexpr size_t k_deflate_chunk_size = 1024 * 1024;
+constexpr size_t k_deflate_window_size = 32 * 1024;
+
+template <class T>
+T load(std::span<const char> data, size_t offset) {
+    kcmod_decode_verify(offset + sizeof(T) <= data.size());
+    T value;
+    memcpy(&value, data.data() + offset, sizeof(value));
+    return value;
+}
+
+class ByteWriter {
+public:
+    template <std::integral T>
+    void put(T value) {
+        const char *bytes = reinterpret_cast<const char *>(&value);
+        data.insert(data.end(), bytes, bytes + sizeof(value));
+    }
+
+    void put(std::span<const char> bytes) {
+        data.insert(data.end(), bytes.begin(), bytes.end());
+    }
+
+    std::vector<char> data;
+};
+
+// Zip64 extended information of entry, empty when it is not needed
+std::vector<char> zip64_extra(uint64_t compressed_size, uint64_t uncompressed_size,
+                              std::optional<uint64_t> local_header_offset) {
+    ByteWriter fields;
+    if (compressed_size >= UINT32_MAX || uncompressed_size >= UINT32_MAX) {
+        fields.put(uncompressed_size);
+        fields.put(compressed_size);
+    }
+    if (local_header_offset && *local_header_offset >= UINT32_MAX) {
+        fields.put(*local_header_offset);
+    }
+    if (fields.data.empty()) {
+        return {};
+    }
+    ByteWriter extra;
+    extra.put(k_zip64_extra_id);
+    extra.put(static_cast<uint16_t>(fields.data.size()));
+    extra.put(fields.data);
+    return extra.data;
+}
+
+uint32_t clamp32(uint64_t value) {
+    return value >= UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(value);
+}
+
+std::vector<char> central_header(const ZipEntry &entry) {
+    auto zip64 = zip64_extra(entry.compressed_size, entry.uncompressed_size, entry.local_header_offset);
+    bool large_sizes = entry.compressed_size >= UINT32_MAX || entry.uncompressed_size >= UINT32_MAX;
+    ByteWriter header;
+    header.put(k_central_header_signature);
+    header.put(entry.version_made_by);
+    header.put(zip64.empty() ? entry.version_needed : std::max(entry.version_needed, k_zip64_version));
+    header.put(entry.flags);
+    header.put(entry.method);
+    header.put(entry.time);
+    header.put(entry.date);
+    header.put(entry.crc32);
+    header.put(large_sizes ? UINT32_MAX : static_cast<uint32_t>(entry.compressed_size));
+    header.put(large_sizes ? UINT32_MAX : static_cast<uint32_t>(entry.uncompressed_size));
+    header.put(static_cast<uint16_t>(entry.name.size()));
+    header.put(static_cast<uint16_t>(zip64.size() + entry.extra.size()));
+    header.put(static_cast<uint16_t>(entry.comment.size()));
+    header.put(uint16_t{0});
+    header.put(entry.internal_attributes);
+    header.put(entry.external_attributes);
+    header.put(clamp32(entry.local_header_offset));
+    header.put(entry.name);
+    header.put(zip64);
+    header.put(entry.extra);
+    header.put(entry.comment);
+    return header.data;
+}
+
+std::vector<char> local_header(const ZipEntry &entry) {
+    auto zip64 = zip64_extra(entry.compressed_size, entry.uncompressed_size, std::nullopt);
+    ByteWriter header;
+    header.put(k_local_header_signature);
+    header.put(zip64.empty() ? entry.version_needed : std::max(entry.version_needed, k_zip64_version));
+    header.put(entry.flags);
+    header.put(entry.method);
+    header.put(entry.time);
+    header.put(entry.date);
+    header.put(entry.crc32);
+    header.put(zip64.empty() ? static_cast<uint32_t>(entry.compressed_size) : UINT32_MAX);
+    header.put(zip64.empty() ? static_cast<uint32_t>(entry.uncompressed_size) : UINT32_MAX);
+    header.put(static_cast<uint16_t>(entry.name.size()));
+    header.put(static_cast<uint16_t>(zip64.size()));
+    header.put(entry.name);
+    header.put(zip64);
+    return header.data;
+}
+
+std::vector<char> end_of_central_directory(uint64_t entry_count, uint64_t directory_offset, uint64_t directory_size,
+                                           std::span<const char> comment) {
+    ByteWriter end;
+    bool zip64 = entry_count >= UINT16_MAX || directory_offset >= UINT32_MAX || directory_size >= UINT32_MAX;
+    if (zip64) {
+        uint64_t record_offset = directory_offset + directory_size;
+        end.put(k_zip64_end_of_central_directory_signature);
+        end.put(uint64_t{k_zip64_end_of_central_directory_size - 12});
+        end.put(k_zip64_version);
+        end.put(k_zip64_version);
+        end.put(uint32_t{0});
+        end.put(uint32_t{0});
+        end.put(entry_count);
+        end.put(entry_count);
+        end.put(directory_size);
+        end.put(directory_offset);
+        end.put(k_zip64_locator_signature);
+        end.put(uint32_t{0});
+        end.put(record_offset);
+        end.put(uint32_t{1});
+    }
+    uint16_t count16 = entry_count >= UINT16_MAX ? UINT16_MAX : static_cast<uint16_t>(entry_count);
+    end.put(k_end_of_central_directory_signature);
+    end.put(uint16_t{0});
+    end.put(uint16_t{0});
+    end.put(count16);
+    end.put(count16);
+    end.put(clamp32(directory_size));
+    end.put(clamp32(directory_offset));
+    end.put(static_cast<uint16_t>(comment.size()));
+    end.put(comment);
+    return end.data;
+}
+
+struct DeflatedChunk {
+    std::vector<char> data;
+    uint32_t crc32;
+};
+
+// Raw deflates chunk. Chunks other than the last end with a sync flush so
+// their concatenation is a single deflate stream. dictionary is the data
+// preceding chunk, which back references may use.
+DeflatedChunk deflate_chunk(std::span<const char> chunk, std::span<const char> dictionary, bool last) {
+    z_stream stream{};
+    kcmod_verify(deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+    if (!dictionary.empty()) {
+        deflateSetDictionary(&stream, reinterpret_cast<const Bytef *>(dictionary.data()),
+                             static_cast<uInt>(dictionary.size()));
+    }
+    DeflatedChunk result;
+    // A sync flush adds an empty stored block after the deflateBound output
+    result.data.resize(deflateBound(&stream, chunk.size()) + 16);
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(chunk.data()));
+    stream.avail_in = static_cast<uInt>(chunk.size());
+    stream.next_out = reinterpret_cast<Bytef *>(result.data.data());
+    stream.avail_out = static_cast<uInt>(result.data.size());
+    int status = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+    bool complete = last ? status == Z_STREAM_END : status == Z_OK && stream.avail_in == 0;
+    result.data.resize(stream.total_out);
+    deflateEnd(&stream);
+    kcmod_verify(complete);
+    result.crc32 = crc32(0, reinterpret_cast<const Bytef *>(chunk.data()), static_cast<uInt>(chunk.size()));
+    return result;
+}
+
+}// namespace
+
+
+std::optional<ArchivePath> kcmod::parse_archive_path(const fs::path &path) {
+    std::string string = path.string();
+    size_t separator = string.rfind(':');
+    if (separator == std::string::npos || fs::exists(path)) {
+        return std::nullopt;
+    }
+    fs::path archive = string.substr(0, separator);
+    if (!fs::is_regular_file(archive)) {
+        return std::nullopt;
+    }
+    return ArchivePath{archive, string.substr(separator + 1)};
+}
+
+ZipArchive::ZipArchive(const fs::path &path)
+    : file_{path.string()} {
+    std::span<const char> data{file_.data(), file_.size()};
+    kcmod_decode_verify(data.size() >= k_end_of_central_directory_size);
+
+    // The end of central directory record is followed by a comment of at
+    // most 64 KiB
+    size_t end = data.size() - k_end_of_central_directory_size;
+    size_t search_limit = end > UINT16_MAX ? end - UINT16_MAX : 0;
+    while (true) {
+        if (load<uint32_t>(data, end) == k_end_of_central_directory_signature &&
+            end + k_end_of_central_directory_size + load<uint16_t>(data, end + 20) == data.size()) {
+            break;
+        }
+        if (end == search_limit) {
+            throw DecodeError{"{} is not a zip archive", path.string()};
+        }
+        --end;
+    }
+    uint64_t entry_count = load<uint16_t>(data, end + 10);
+    uint64_t directory_size = load<uint32_t>(data, end + 12);
+    uint64_t directory_offset = load<uint32_t>(data, end + 16);
+    comment_ = data.subspan(end + k_end_of_central_directory_size, load<uint16_t>(data, end + 20));
+    if (end >= k_zip64_locator_size && load<uint32_t>(data, end - k_zip64_locator_size) == k_zip64_locator_signature) {
+        uint64_t record = load<uint64_t>(data, end - k_zip64_locator_size + 8);
+        kcmod_decode_verify(load<uint32_t>(data, record) == k_zip64_end_of_central_directory_signature);
+        entry_count = load<uint64_t>(data, record + 32);
+        directory_size = load<uint64_t>(data, record + 40);
+        directory_offset = load<uint64_t>(data, record + 48);
+    }
+    kcmod_decode_verify(directory_offset + directory_size <= data.size());
+    directory_offset_ = directory_offset;
+
+    size_t cursor = directory_offset;
+    for (uint64_t i = 0; i < entry_count; ++i) {
+        kcmod_decode_verify(load<uint32_t>(data, cursor) == k_central_header_signature);
+        ZipEntry entry{};
+        entry.version_made_by = load<uint16_t>(data, cursor + 4);
+        entry.version_needed = load<uint16_t>(data, cursor + 6);
+        entry.flags = load<uint16_t>(data, cursor + 8);
+        entry.method = load<uint16_t>(data, cursor + 10);
+        entry.time = load<uint16_t>(data, cursor + 12);
+        entry.date = load<uint16_t>(data, cursor + 14);
+        entry.crc32 = load<uint32_t>(data, cursor + 16);
+        entry.compressed_size = load<uint32_t>(data, cursor + 20);
+        entry.uncompressed_size = load<uint32_t>(data, cursor + 24);
+        size_t name_size = load<uint16_t>(data, cursor + 28);
+        size_t extra_size = load<uint16_t>(data, cursor + 30);
+        size_t comment_size = load<uint16_t>(data, cursor + 32);
+        entry.internal_attributes = load<uint16_t>(data, cursor + 36);
+        entry.external_attributes = load<uint32_t>(data, cursor + 38);
+        entry.local_header_offset = load<uint32_t>(data, cursor + 42);
+        size_t name_offset = cursor + k_central_header_size;
+        kcmod_decode_verify(name_offset + name_size + extra_size + comment_size <= data.size());
+        auto name = data.subspan(name_offset, name_size);
+        entry.name.assign(name.begin(), name.end());
+        entry.comment = data.subspan(name_offset + name_size + extra_size, comment_size);
+
+        // Fields saturated at 0xffffffff are found in the zip64 extra field,
+        // which is dropped here and written again when needed
+        auto extra = data.subspan(name_offset + name_size, extra_size);
+        size_t extra_cursor = 0;
+        while (extra_cursor + 4 <= extra.size()) {
+            auto id = load<uint16_t>(extra, extra_cursor);
+            size_t size = load<uint16_t>(extra, extra_cursor + 2);
+            kcmod_decode_verify(extra_cursor + 4 + size <= extra.size());
+            auto field = extra.subspan(extra_cursor, 4 + size);
+            if (id == k_zip64_extra_id) {
+                size_t offset = 4;
+                for (uint64_t *value: {&entry.uncompressed_size, &entry.compressed_size, &entry.local_header_offset}) {
+                    if (*value == UINT32_MAX) {
+                        *value = load<uint64_t>(field, offset);
+                        offset += sizeof(uint64_t);
+                    }
+                }
+            } else {
+                entry.extra.insert(entry.extra.end(), field.begin(), field.end());
+            }
+            extra_cursor += field.size();
+        }
+        kcmod_decode_verify(entry.local_header_offset < directory_offset_);
+        entries_.push_back(std::move(entry));
+        cursor = name_offset + name_size + extra_size + comment_size;
+    }
+
+    // write_replacing copies the bytes between consecutive local headers,
+    // entries sharing one would wrap the copied range around
+    std::vector<uint64_t> local_header_offsets;
+    for (const auto &entry: entries_) {
+        local_header_offsets.push_back(entry.local_header_offset);
+    }
+    std::ranges::sort(local_header_offsets);
+    kcmod_decode_verify(std::ranges::adjacent_find(local_header_offsets) == local_header_offsets.end());
+}
+
+const ZipEntry &ZipArchive::find(const std::string &name) const {
+    auto it = std::ranges::find(entries_, name, &ZipEntry::name);
+    if (it == entries_.end()) {
+        throw FatalError{"Entry {} not found in archive", name};
+    }
+    return *it;
+}
+
+std::span<const char> ZipArchive::entry_data(const ZipEntry &entry) const {
+    std::span<const char> data{file_.data(), file_.size()};
+    size_t offset = entry.local_header_offset;
+    kcmod_decode_verify(load<uint32_t>(data, offset) == k_local_header_signature);
+    size_t data_offset = offset + k_local_header_size + load<uint16_t>(data, offset + 26) +
+                         load<uint16_t>(data, offset + 28);
+    kcmod_decode_verify(data_offset <= data.size() && entry.compressed_size <= data.size() - data_offset);
+    return data.subspan(data_offset, entry.compressed_size);
+}
+
+std::vector<char> ZipArchive::read(const ZipEntry &entry) const {
+    auto compressed = entry_data(entry);
+    std::vector<char> result(entry.uncompressed_size);
+    if (entry.method == k_method_stored) {
+        kcmod_decode_verify(compressed.size() == result.size());
+        std::copy(compressed.begin(), compressed.end(), result.begin());
+    } else if (entry.method == k_method_deflated) {
+        z_stream stream{};
+        kcmod_verify(inflateInit2(&stream, -MAX_WBITS) == Z_OK);
+        stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(compressed.data()));
+        stream.next_out = reinterpret_cast<Bytef *>(result.data());
+        // avail_in and avail_out are 32 bits wide, entries are fed in pieces
+        size_t in = 0;
+        size_t out = 0;
+        int status = Z_OK;
+        while (status == Z_OK) {
+            if (stream.avail_in == 0) {
+                stream.avail_in = static_cast<uInt>(std::min<size_t>(compressed.size() - in, UINT32_MAX));
+                in += stream.avail_in;
+            }
+            if (stream.avail_out == 0) {
+                stream.avail_out = static_cast<uInt>(std::min<size_t>(result.size() - out, UINT32_MAX));
+                out += stream.avail_out;
+            }
+            status = inflate(&stream, Z_NO_FLUSH);
+            if (status == Z_BUF_ERROR && stream.avail_in == 0 && in == compressed.size()) {
+                break;
+            }
+        }
+        inflateEnd(&stream);
+        if (status != Z_STREAM_END || stream.total_out != result.size()) {
+            throw DecodeError{"Failed to inflate {}, zlib status {}", entry.name, status};
+        }
+    } else {
+        throw DecodeError{"Unsupported compression method {} for {}", entry.method, entry.name};
+    }
+
+    uLong crc = crc32(0, nullptr, 0);
+    for (size_t offset = 0; offset < result.size(); offset += UINT32_MAX) {
+        size_t size = std::min<size_t>(result.size() - offset, UINT32_MAX);
+        crc = crc32(crc, reinterpret_cast<const Bytef *>(result.data() + offset), static_cast<uInt>(size));
+    }
+    if (crc != entry.crc32) {
+        throw DecodeError{"CRC mismatch for {}", entry.name};
+    }
+    return result;
+}
+
+void ZipArchive::write_replacing(const fs::path &path, const std::string &name, std::span<const char> data,
+                                 ThreadPool &pool) const {
+    const ZipEntry &replaced = find(name);
+
+    std::vector<std::future<DeflatedChunk>> futures;
+    size_t offset = 0;
+    do {
+        auto chunk = data.subspan(offset, std::min(k_deflate_chunk_size, data.size() - offset));
+        size_t window = std::min(offset, k_deflate_window_size);
+        auto dictionary = data.subspan(offset - window, window);
+        bool last = offset + chunk.size() == data.size();
+        futures.push_back(pool.submit([=] { return deflate_chunk(chunk, dictionary, last); }));
+        offset += chunk.size();
+    } while (offset < data.size());
+
+    ZipEntry updated = replaced;
+    updated.version_needed = std::max(replaced.version_needed, k_deflate_version);
+    // Sizes are known up front, the new entry has no data descriptor
+    updated.flags = replaced.flags & k_flag_utf8;
+    updated.method = k_method_deflated;
+    updated.uncompressed_size = data.size();
+    std::vector<DeflatedChunk> chunks;
+    updated.compressed_size = 0;
+    updated.crc32 = crc32(0, nullptr, 0);
+    offset = 0;
+    for (auto &future: futures) {
+        chunks.push_back(future.get());
+        size_t chunk_size = std::min(k_deflate_chunk_size, data.size() - offset);
+        updated.crc32 = crc32_combine(updated.crc32, chunks.back().crc32, static_cast<z_off_t>(chunk_size));
+        updated.compressed_size += chunks.back().data.size();
+        offset += chunk_size;
+    }
+
+    // Entries are written in their original order, each one spans the bytes
+    // up to the next local header
+    std::vector<ZipEntry> entries = entries_;
+    std::vector<size_t> order(entries.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::ranges::sort(order, {}, [&](size_t i) { return entries_[i].local_header_offset; });
+
+    // path may be the archive itself, which file_ still maps. The copy is
+    // written next to it and renamed over it when complete.
+    TemporaryFile temp{path.parent_path(), fmt::format(".{}.", path.filename().string())};
+    std::ofstream out{temp.path(), std::ios::binary | std::ios::trunc};
+    kcmod_verify(out.good());
+    uint64_t position = 0;
+    auto write = [&](std::span<const char> bytes) {
+        out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+        position += bytes.size();
+    };
+    for (size_t k = 0; k < order.size(); ++k) {
+        size_t i = order[k];
+        uint64_t begin = entries_[i].local_header_offset;
+        uint64_t end = k + 1 < order.size() ? entries_[order[k + 1]].local_header_offset : directory_offset_;
+        if (&entries_[i] == &replaced) {
+            updated.local_header_offset = position;
+            entries[i] = updated;
+            write(local_header(updated));
+            for (const auto &chunk: chunks) {
+                write(chunk.data);
+            }
+        } else {
+            entries[i].local_header_offset = position;
+            write({file_.data() + begin, end - begin});
+        }
+    }
+
+    uint64_t new_directory_offset = position;
+    for (const auto &entry: entries) {
+        write(central_header(entry));
+    }
+    write(end_of_central_directory(entries.size(), new_directory_offset, position - new_directory_offset, comment_));
+    out.close();
+    kcmod_verify(out.good());
+    fs::rename(temp.path(), path);
+}
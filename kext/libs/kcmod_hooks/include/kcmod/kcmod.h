@@ -34,3 +34,11 @@
 
 
 #define KCMOD_SUPER(fn, ...) __kcmod_hook_super_##fn(__VA_ARGS__)
+
+
+// Replaces fn in every function pointer of the kernelcache, like the entries
+// of MAC policy ops, sysent or vtables, without patching fn itself. Calling
+// fn directly still reaches the original.
+#define KCMOD_REDIRECT(return_type, fn, ...) \
+    extern return_type fn(__VA_ARGS__);       \
+    return_type __kcmod_redirect_##fn(__VA_ARGS__)